@@ -0,0 +1,152 @@
+/*
+ * Coroutine vs callback API benchmark.
+ *
+ * Consumes the same burst of MESSAGE frames once through stomp_run() 
+ * with a SCB_MESSAGE callback and once through co_await subscription::next(),
+ * reporting throughput and operator new calls per message.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <new>
+
+#include <stomp_coro.hpp>
+
+#include "burst.h"
+
+static unsigned long allocs;
+
+void *operator new(std::size_t n)
+{
+	allocs++;
+	void *p = malloc(n ? n : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	free(p);
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *api, unsigned long received, double secs, unsigned long a)
+{
+	fprintf(stdout, "api=%s messages=%lu secs=%.3f msgs/s=%.0f allocs/msg=%.3f\n", 
+			api, received, secs, received / secs, received ? (double)a / received : 0);
+}
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	(*(unsigned long *)session_ctx)++;
+}
+
+static void bench_callback(struct burst *b)
+{
+	unsigned long received = 0;
+	unsigned long a;
+	double start;
+	stomp_session_t *s;
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct stomp_hdr sub[] = {
+		{"destination", "/queue/bench"},
+	};
+
+	s = stomp_session_new(&received);
+	if (!s) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+	stomp_callback_set(s, SCB_MESSAGE, _message);
+
+	start = now();
+	a = allocs;
+	if (stomp_connect(s, "127.0.0.1", b->port, 1, hdrs) || stomp_subscribe(s, 1, sub) < 0) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+	(void)stomp_run(s);
+
+	report("callback", received, now() - start, allocs - a);
+	stomp_session_free(s);
+}
+
+static stomp::coro::task<> consume(stomp::coro::session &s, const char *port, unsigned long &received)
+{
+	co_await s.connect("127.0.0.1", port, stomp::headers(stomp::hdr("accept-version", "1.2")));
+	auto sub = s.subscribe(stomp::headers(stomp::hdr("destination", "/queue/bench")));
+
+	try {
+		for (;;) {
+			co_await sub.next();
+			received++;
+		}
+	} catch (const std::system_error &) {
+		/* the broker closes the connection after the burst */
+	}
+}
+
+static void bench_coro(struct burst *b)
+{
+	unsigned long received = 0;
+	unsigned long a;
+	double start;
+	stomp::coro::executor ex;
+	stomp::coro::session s(ex);
+
+	start = now();
+	a = allocs;
+	ex.spawn(consume(s, b->port, received));
+	ex.run();
+
+	report("coroutine", received, now() - start, allocs - a);
+}
+
+int main(int argc, char *argv[])
+{
+	struct burst b;
+	unsigned long messages = 100000;
+	size_t body_len = 64;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:b:")) != -1) {
+		switch (opt) {
+			case 'm':
+				messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				body_len = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-m messages] [-b body size]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (burst_start(&b, messages, body_len)) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_callback(&b);
+	bench_coro(&b);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,398 @@
+/*
+ * Frame parser and encoder microbenchmarks.
+ *
+ * Runs frame_read(), frame_read() + frame_hdrs_get(), frame_write() and
+ * building a frame with frame_hdr_add() over a corpus of typical frames
+ * and reports ns/frame, bytes/s, allocations/frame and syscalls/frame.
+ * Every case starts with one frame outside the measurement, so the buffers
+ * have grown to the frame size and allocations/frame is the steady state.
+ * read() and write() are wrapped at link time to count the syscalls.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "frame.h"
+
+/* bytes each case is run over by default, at least one frame */
+#define BENCHBYTES (8 * 1024 * 1024)
+
+/* frames per case at most */
+#define BENCHFRAMES 200000
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+static unsigned long syscalls;
+static unsigned long allocs;
+static size_t bench_bytes = BENCHBYTES;
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	syscalls++;
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	syscalls++;
+	return __real_write(fd, buf, count);
+}
+
+static void *count_malloc(void *ctx, size_t size)
+{
+	allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size)
+{
+	allocs++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const struct stomp_allocator counting = {count_malloc, count_realloc, count_free, NULL, 0};
+
+struct corpus {
+	const char *name;
+	size_t hdrs; /* number of generated headers */
+	int escaped; /* headers need escaping */
+	size_t body_len;
+
+	frame_t *frame; /* encoded MESSAGE */
+	const void *data;
+	size_t len;
+};
+
+static struct corpus corpus[] = {
+	{"heartbeat", 0, 0, 0},
+	{"message-20hdrs", 20, 0, 64},
+	{"message-escaped", 20, 1, 64},
+	{"body-1k", 8, 0, 1024},
+	{"body-64k", 8, 0, 64 * 1024},
+	{"body-16m", 8, 0, 16 * 1024 * 1024},
+};
+
+struct result {
+	unsigned long frames;
+	size_t bytes;
+	double secs;
+	unsigned long allocs;
+	unsigned long syscalls;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build(frame_t *f, struct corpus *c, const char *body)
+{
+	char key[32];
+	char val[64];
+	size_t i;
+
+	frame_reset(f);
+	if (frame_cmd_set(f, "MESSAGE")) {
+		die("frame_cmd_set");
+	}
+
+	for (i = 0; i < c->hdrs; i++) {
+		snprintf(key, sizeof(key), c->escaped ? "x-key:%zu" : "x-key-%zu", i);
+		snprintf(val, sizeof(val), c->escaped ? "line\nvalue\\%zu" : "/queue/value-%zu", i);
+		if (frame_hdr_add(f, key, val)) {
+			die("frame_hdr_add");
+		}
+	}
+
+	if (c->body_len) {
+		snprintf(val, sizeof(val), "%zu", c->body_len);
+		if (frame_hdr_add(f, "content-length", val) || frame_body_set(f, body, c->body_len)) {
+			die("frame_body_set");
+		}
+	}
+}
+
+static void corpus_init(void)
+{
+	char *body;
+	size_t i;
+
+	body = malloc(corpus[sizeof(corpus)/sizeof(*corpus) - 1].body_len);
+	if (!body) {
+		die("malloc");
+	}
+	memset(body, 'x', corpus[sizeof(corpus)/sizeof(*corpus) - 1].body_len);
+
+	for (i = 0; i < sizeof(corpus)/sizeof(*corpus); i++) {
+		struct corpus *c = &corpus[i];
+
+		if (!c->hdrs && !c->body_len) {
+			c->data = "\n";
+			c->len = 1;
+			continue;
+		}
+
+		c->frame = frame_new();
+		if (!c->frame) {
+			die("frame_new");
+		}
+
+		build(c->frame, c, body);
+		c->len = frame_data(c->frame, &c->data);
+	}
+
+	free(body);
+}
+
+static unsigned long frames_for(const struct corpus *c)
+{
+	unsigned long n = bench_bytes / c->len;
+
+	if (n < 1) {
+		return 1;
+	}
+
+	return n > BENCHFRAMES ? BENCHFRAMES : n;
+}
+
+/* an in-memory fd holding n copies of the frame */
+static int corpus_fd(const struct corpus *c, unsigned long n)
+{
+	unsigned long i;
+	int fd;
+
+	fd = memfd_create("bench", MFD_CLOEXEC);
+	if (fd == -1) {
+		die("memfd_create");
+	}
+
+	for (i = 0; i < n; i++) {
+		if (__real_write(fd, c->data, c->len) != (ssize_t)c->len) {
+			die("write");
+		}
+	}
+
+	if (lseek(fd, 0, SEEK_SET)) {
+		die("lseek");
+	}
+
+	return fd;
+}
+
+static void bench_read(const struct corpus *c, int hdrs, struct result *r)
+{
+	const struct stomp_hdr *h;
+	unsigned long n = frames_for(c);
+	unsigned long i;
+	double start;
+	frame_t *f;
+	int fd;
+
+	fd = corpus_fd(c, n + 1);
+	f = frame_new_with(&counting);
+	if (!f) {
+		die("frame_new");
+	}
+
+	if (frame_read(fd, f)) {
+		die("frame_read");
+	}
+	(void)frame_hdrs_get(f, &h);
+
+	allocs = 0;
+	syscalls = 0;
+	start = now();
+
+	for (i = 0; i < n; i++) {
+		frame_reset(f);
+		if (frame_read(fd, f)) {
+			die("frame_read");
+		}
+
+		if (hdrs) {
+			(void)frame_hdrs_get(f, &h);
+		}
+	}
+
+	r->secs = now() - start;
+	r->frames = n;
+	r->bytes = n * c->len;
+	r->allocs = allocs;
+	r->syscalls = syscalls;
+
+	frame_free(f);
+	close(fd);
+}
+
+static void bench_write(const struct corpus *c, struct result *r)
+{
+	unsigned long n = frames_for(c);
+	unsigned long i;
+	double start;
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		die("/dev/null");
+	}
+
+	allocs = 0;
+	syscalls = 0;
+	start = now();
+
+	for (i = 0; i < n; i++) {
+		if (c->frame ? frame_write(fd, c->frame) < 0 : write(fd, c->data, c->len) < 0) {
+			die("frame_write");
+		}
+	}
+
+	r->secs = now() - start;
+	r->frames = n;
+	r->bytes = n * c->len;
+	r->allocs = allocs;
+	r->syscalls = syscalls;
+
+	close(fd);
+}
+
+static void bench_encode(struct corpus *c, struct result *r)
+{
+	unsigned long n = frames_for(c);
+	unsigned long i;
+	double start;
+	char *body;
+	frame_t *f;
+
+	body = calloc(1, c->body_len + 1);
+	f = frame_new_with(&counting);
+	if (!body || !f) {
+		die("frame_new");
+	}
+	build(f, c, body);
+
+	allocs = 0;
+	syscalls = 0;
+	start = now();
+
+	for (i = 0; i < n; i++) {
+		build(f, c, body);
+	}
+
+	r->secs = now() - start;
+	r->frames = n;
+	r->bytes = n * c->len;
+	r->allocs = allocs;
+	r->syscalls = syscalls;
+
+	frame_free(f);
+	free(body);
+}
+
+static void report(FILE *json, int *first, const char *bench, const struct corpus *c, const struct result *r)
+{
+	double ns = r->secs * 1e9 / r->frames;
+	double bps = r->secs > 0 ? r->bytes / r->secs : 0;
+	double apf = (double)r->allocs / r->frames;
+	double spf = (double)r->syscalls / r->frames;
+
+	fprintf(stdout, "%-12s %-16s frames=%-8lu ns/frame=%-12.1f MB/s=%-10.1f allocs/frame=%-8.3f syscalls/frame=%.1f\n",
+			bench, c->name, r->frames, ns, bps / 1e6, apf, spf);
+
+	if (!json) {
+		return;
+	}
+
+	fprintf(json, "%s\n    {\"bench\": \"%s\", \"corpus\": \"%s\", \"frames\": %lu, \"frame_bytes\": %zu, "
+			"\"ns_per_frame\": %.1f, \"bytes_per_sec\": %.0f, \"allocs_per_frame\": %.3f, \"syscalls_per_frame\": %.1f}",
+			*first ? "" : ",", bench, c->name, r->frames, c->len, ns, bps, apf, spf);
+	*first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	FILE *json = NULL;
+	struct result r;
+	int first = 1;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:c:b:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+				if (!json) {
+					die(optarg);
+				}
+				break;
+			case 'c':
+				only = optarg;
+				break;
+			case 'b':
+				bench_bytes = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-j results.json|-] [-c corpus] [-b bytes per case]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	corpus_init();
+
+	if (json) {
+		fprintf(json, "{\n  \"results\": [");
+	}
+
+	for (i = 0; i < sizeof(corpus)/sizeof(*corpus); i++) {
+		struct corpus *c = &corpus[i];
+
+		if (only && strcmp(only, c->name)) {
+			continue;
+		}
+
+		bench_read(c, 0, &r);
+		report(json, &first, "read", c, &r);
+
+		bench_read(c, 1, &r);
+		report(json, &first, "read+hdrs", c, &r);
+
+		bench_write(c, &r);
+		report(json, &first, "write", c, &r);
+
+		if (c->frame) {
+			bench_encode(c, &r);
+			report(json, &first, "encode", c, &r);
+		}
+	}
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		if (json != stdout) {
+			fclose(json);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
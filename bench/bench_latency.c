@@ -0,0 +1,246 @@
+/*
+ * Round trip latency over TCP loopback and a Unix socket.
+ *
+ * One session subscribes to a queue of the mock broker of the tests and
+ * sends a message to it each time the previous one comes back, so only
+ * one message is ever in flight. The same workload runs over 127.0.0.1
+ * and over a Unix socket, and the round trip percentiles of both are
+ * reported side by side.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <stomp.h>
+
+#include "broker.h"
+
+/* round trips made before the latencies are recorded */
+#define WARMUP 100
+
+struct ping {
+	unsigned long rounds; /* recorded after the warm up */
+	unsigned long n; /* round trips made so far */
+	unsigned long long sent; /* ns, when the message in flight was sent */
+	unsigned long long *rtt; /* ns */
+	void *body;
+	size_t body_len;
+	int failed;
+};
+
+static struct stomp_hdr dest[] = {
+	{"destination", "/queue/ping"},
+};
+
+static struct stomp_hdr bye[] = {
+	{"receipt", "bye"},
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ping(stomp_session_t *s, struct ping *p)
+{
+	p->sent = now_ns();
+	if (stomp_send(s, 1, dest, p->body, p->body_len)) {
+		p->failed = 1;
+	}
+}
+
+/* the subscription is in place, start */
+static void _receipt(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct ping *p = session_ctx;
+
+	if (!p->n) {
+		ping(s, p);
+	}
+}
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct ping *p = session_ctx;
+	unsigned long long rtt = now_ns() - p->sent;
+
+	if (p->n >= WARMUP) {
+		p->rtt[p->n - WARMUP] = rtt;
+	}
+
+	if (++p->n < p->rounds + WARMUP) {
+		ping(s, p);
+	} else if (stomp_disconnect(s, 1, bye)) {
+		p->failed = 1;
+	}
+}
+
+static int cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(const char *host, const char *service, struct ping *p)
+{
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct stomp_hdr sub[] = {
+		{"destination", "/queue/ping"},
+		{"ack", "auto"},
+		{"receipt", "subscribed"},
+	};
+	stomp_session_t *s;
+
+	p->n = 0;
+	s = stomp_session_new(p);
+	if (!s) {
+		die("stomp_session_new");
+	}
+	stomp_callback_set(s, SCB_RECEIPT, _receipt);
+	stomp_callback_set(s, SCB_MESSAGE, _message);
+
+	if (stomp_subscribe(s, 3, sub) < 0 || stomp_connect(s, host, service, 1, hdrs)) {
+		die(host);
+	}
+
+	/* the broker closes the connection after the bye receipt */
+	(void)stomp_run(s);
+	stomp_session_free(s);
+
+	if (p->failed || p->n != p->rounds + WARMUP) {
+		fprintf(stderr, "%s: %lu of %lu round trips\n", host, p->n, p->rounds + WARMUP);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void report(FILE *json, int *first, const char *bench, struct ping *p)
+{
+	unsigned long long sum = 0;
+	unsigned long i;
+	double mean;
+
+	qsort(p->rtt, p->rounds, sizeof(*p->rtt), cmp);
+	for (i = 0; i < p->rounds; i++) {
+		sum += p->rtt[i];
+	}
+	mean = (double)sum / p->rounds;
+
+	fprintf(stdout, "%-14s body=%-8zu rounds=%-8lu us: mean=%-9.1f p50=%-9.1f p99=%-9.1f p99.9=%-9.1f max=%.1f\n",
+			bench, p->body_len, p->rounds, mean / 1e3,
+			p->rtt[p->rounds / 2] / 1e3,
+			p->rtt[p->rounds * 99 / 100] / 1e3,
+			p->rtt[p->rounds * 999 / 1000] / 1e3,
+			p->rtt[p->rounds - 1] / 1e3);
+
+	if (!json) {
+		return;
+	}
+
+	/* same keys as bench_frame, a "frame" being a round trip */
+	fprintf(json, "%s\n    {\"bench\": \"%s\", \"corpus\": \"body-%zu\", \"frames\": %lu, "
+			"\"ns_per_frame\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu}",
+			*first ? "" : ",", bench, p->body_len, p->rounds, mean,
+			p->rtt[p->rounds / 2], p->rtt[p->rounds * 99 / 100]);
+	*first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct broker_opts o = {0};
+	struct ping p = {0};
+	char path[64];
+	char host[80];
+	FILE *json = NULL;
+	broker_t *b;
+	char *body;
+	int first = 1;
+	int opt;
+
+	p.rounds = 10000;
+	p.body_len = 64;
+
+	while ((opt = getopt(argc, argv, "j:m:b:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+				if (!json) {
+					die(optarg);
+				}
+				break;
+			case 'm':
+				p.rounds = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				p.body_len = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-j results.json|-] [-m round trips] [-b body size]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!p.rounds) {
+		fprintf(stderr, "%s: -m must be at least 1\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	body = malloc(p.body_len + 1);
+	p.rtt = calloc(p.rounds, sizeof(*p.rtt));
+	if (!body || !p.rtt) {
+		die("malloc");
+	}
+	memset(body, 'x', p.body_len);
+	p.body = body;
+
+	if (json) {
+		fprintf(json, "{\n  \"results\": [");
+	}
+
+	b = broker_start(NULL);
+	if (!b) {
+		die("broker_start");
+	}
+	run("127.0.0.1", broker_service(b), &p);
+	broker_stop(b);
+	report(json, &first, "latency-tcp", &p);
+
+	snprintf(path, sizeof(path), "/tmp/bench_latency-%d.sock", (int)getpid());
+	snprintf(host, sizeof(host), "unix:%s", path);
+	o.path = path;
+	b = broker_start(&o);
+	if (!b) {
+		die("broker_start");
+	}
+	run(host, NULL, &p);
+	broker_stop(b);
+	report(json, &first, "latency-unix", &p);
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		if (json != stdout) {
+			fclose(json);
+		}
+	}
+
+	free(p.rtt);
+	free(body);
+
+	exit(EXIT_SUCCESS);
+}
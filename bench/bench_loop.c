@@ -0,0 +1,299 @@
+/*
+ * Loopback session throughput benchmark.
+ *
+ * Receives a burst of MESSAGE frames and sends a stream of SEND frames
+ * through a single session over a loopback connection and reports
+ * ns/message and heap allocations/message. Allocations are counted by
+ * interposing malloc(), calloc() and realloc() over glibc, so nothing the
+ * library or libc does on its behalf is missed, and only the steady
+ * state after WARMUP messages is counted: once the session has grown its
+ * buffers the hot path must not allocate.
+ *
+ * mem-recv receives the same burst through the in-memory transport, which
+ * leaves the parser and the dispatcher without the kernel underneath.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <stomp.h>
+
+#include "burst.h"
+
+/* messages run before the allocations are counted */
+#define WARMUP 1000
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+struct result {
+	unsigned long messages;
+	double secs;
+	unsigned long allocs; /* after the warm up */
+};
+
+struct recv_ctx {
+	unsigned long messages;
+	unsigned long allocs; /* allocations at the end of the warm up */
+	struct timespec start; /* time of the end of the warm up */
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static double since(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct recv_ctx *c = session_ctx;
+
+	if (++c->messages == WARMUP) {
+		c->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &c->start);
+	}
+}
+
+static void bench_recv(unsigned long messages, size_t body_len, struct result *r)
+{
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct recv_ctx c = {0};
+	stomp_session_t *s;
+	struct burst b;
+
+	if (burst_start(&b, messages + WARMUP, body_len)) {
+		die("burst_start");
+	}
+
+	s = stomp_session_new(&c);
+	if (!s) {
+		die("stomp_session_new");
+	}
+	stomp_callback_set(s, SCB_MESSAGE, _message);
+
+	if (stomp_connect(s, "127.0.0.1", b.port, sizeof(hdrs)/sizeof(*hdrs), hdrs)) {
+		die("stomp_connect");
+	}
+
+	/* the burst ends with the connection closed */
+	(void)stomp_run(s);
+
+	r->secs = since(&c.start);
+	r->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - c.allocs;
+	r->messages = c.messages - WARMUP;
+	if (c.messages != messages + WARMUP) {
+		fprintf(stderr, "received %lu of %lu messages\n", c.messages, messages + WARMUP);
+		exit(EXIT_FAILURE);
+	}
+
+	stomp_session_free(s);
+}
+
+static void bench_mem_recv(unsigned long messages, size_t body_len, struct result *r)
+{
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct recv_ctx c = {0};
+	stomp_mem_t *ends[2];
+	stomp_session_t *s;
+	struct burst b;
+
+	if (burst_frames(&b, messages + WARMUP, body_len) || stomp_mem_pair(ends)) {
+		die("burst_frames");
+	}
+
+	/* the whole burst is queued up front so the run never waits */
+	if (stomp_mem_write(ends[1], b.buf, b.buf_len) != (ssize_t)b.buf_len) {
+		die("stomp_mem_write");
+	}
+
+	s = stomp_session_new(&c);
+	if (!s) {
+		die("stomp_session_new");
+	}
+	stomp_callback_set(s, SCB_MESSAGE, _message);
+
+	if (stomp_transport_set(s, stomp_mem_transport(), ends[0]) ||
+	    stomp_connect(s, "mem", NULL, sizeof(hdrs)/sizeof(*hdrs), hdrs)) {
+		die("stomp_connect");
+	}
+
+	/* the session reads EOF once it is through the burst */
+	stomp_mem_close(ends[1]);
+	(void)stomp_run(s);
+
+	r->secs = since(&c.start);
+	r->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - c.allocs;
+	r->messages = c.messages - WARMUP;
+	if (c.messages != messages + WARMUP) {
+		fprintf(stderr, "received %lu of %lu messages\n", c.messages, messages + WARMUP);
+		exit(EXIT_FAILURE);
+	}
+
+	stomp_session_free(s);
+	stomp_mem_free(ends[0]);
+	stomp_mem_free(ends[1]);
+	free((void *)b.buf);
+}
+
+static void bench_send(unsigned long messages, size_t body_len, struct result *r)
+{
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct stomp_hdr send_hdrs[] = {
+		{"destination", "/queue/bench"},
+	};
+	struct timespec start;
+	unsigned long start_allocs = 0;
+	stomp_session_t *s;
+	struct burst b;
+	unsigned long i;
+	char *body;
+
+	/* an empty burst swallows whatever is sent to it */
+	if (burst_start(&b, 0, 0)) {
+		die("burst_start");
+	}
+
+	body = calloc(1, body_len + 1);
+	s = stomp_session_new(NULL);
+	if (!body || !s) {
+		die("stomp_session_new");
+	}
+	memset(body, 'x', body_len);
+
+	if (stomp_connect(s, "127.0.0.1", b.port, sizeof(hdrs)/sizeof(*hdrs), hdrs)) {
+		die("stomp_connect");
+	}
+
+	for (i = 0; i < messages + WARMUP; i++) {
+		if (i == WARMUP) {
+			start_allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		}
+
+		if (stomp_send(s, sizeof(send_hdrs)/sizeof(*send_hdrs), send_hdrs, body, body_len)) {
+			die("stomp_send");
+		}
+	}
+
+	r->secs = since(&start);
+	r->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - start_allocs;
+	r->messages = messages;
+
+	stomp_session_free(s);
+	free(body);
+}
+
+static void report(FILE *json, int *first, const char *bench, size_t body_len, const struct result *r)
+{
+	double ns = r->secs * 1e9 / r->messages;
+	double apm = (double)r->allocs / r->messages;
+
+	fprintf(stdout, "%-12s body=%-8zu messages=%-8lu ns/message=%-10.1f msgs/s=%-10.0f allocs/message=%.3f\n",
+			bench, body_len, r->messages, ns, r->secs > 0 ? r->messages / r->secs : 0, apm);
+
+	if (!json) {
+		return;
+	}
+
+	/* same keys as bench_frame so both can be compared by check-perf.sh */
+	fprintf(json, "%s\n    {\"bench\": \"%s\", \"corpus\": \"body-%zu\", \"frames\": %lu, "
+			"\"ns_per_frame\": %.1f, \"allocs_per_frame\": %.3f}",
+			*first ? "" : ",", bench, body_len, r->messages, ns, apm);
+	*first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long messages = 100000;
+	size_t body_len = 64;
+	FILE *json = NULL;
+	struct result r;
+	int first = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:m:b:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+				if (!json) {
+					die(optarg);
+				}
+				break;
+			case 'm':
+				messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				body_len = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-j results.json|-] [-m messages] [-b body size]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!messages) {
+		fprintf(stderr, "%s: -m must be at least 1\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (json) {
+		fprintf(json, "{\n  \"results\": [");
+	}
+
+	bench_recv(messages, body_len, &r);
+	report(json, &first, "loop-recv", body_len, &r);
+
+	bench_mem_recv(messages, body_len, &r);
+	report(json, &first, "mem-recv", body_len, &r);
+
+	bench_send(messages, body_len, &r);
+	report(json, &first, "loop-send", body_len, &r);
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		if (json != stdout) {
+			fclose(json);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,137 @@
+/*
+ * Reactor scaling benchmark.
+ *
+ * Measures how fast many loopback sessions consume a burst of 
+ * MESSAGE frames while being spread over 1..N reactor shards.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <stomp.h>
+
+#include "burst.h"
+
+struct counter {
+	unsigned long messages;
+};
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct counter *c = session_ctx;
+	c->messages++;
+}
+
+static double run(struct burst *b, size_t shards, size_t sessions, unsigned long *received)
+{
+	stomp_reactor_t *r;
+	stomp_session_t **ss;
+	struct counter *counters;
+	struct timespec start, end;
+	size_t i;
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+
+	ss = calloc(sessions, sizeof(*ss));
+	counters = calloc(sessions, sizeof(*counters));
+	r = stomp_reactor_new(shards, NULL);
+	if (!ss || !counters || !r) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < sessions; i++) {
+		ss[i] = stomp_session_new(&counters[i]);
+		if (!ss[i]) {
+			perror("bench");
+			exit(EXIT_FAILURE);
+		}
+		stomp_callback_set(ss[i], SCB_MESSAGE, _message);
+
+		if (stomp_connect(ss[i], "127.0.0.1", b->port, sizeof(hdrs)/sizeof(struct stomp_hdr), hdrs)) {
+			perror("bench");
+			exit(EXIT_FAILURE);
+		}
+
+		if (stomp_reactor_add(r, ss[i], -1) < 0) {
+			perror("bench");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	stomp_reactor_join(r);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*received = 0;
+	for (i = 0; i < sessions; i++) {
+		*received += counters[i].messages;
+		stomp_session_free(ss[i]);
+	}
+
+	stomp_reactor_free(r);
+	free(counters);
+	free(ss);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct burst b;
+	size_t sessions = 64;
+	unsigned long messages = 5000;
+	size_t body_len = 64;
+	long max_shards = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long received;
+	double secs;
+	double base = 0;
+	long shards;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:m:b:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				sessions = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				body_len = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				max_shards = strtol(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s sessions] [-m messages per session] [-b body size] [-c max shards]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (burst_start(&b, messages, body_len)) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+
+	for (shards = 1; shards <= max_shards; shards *= 2) {
+		secs = run(&b, shards, sessions, &received);
+		if (shards == 1) {
+			base = received / secs;
+		}
+
+		fprintf(stdout, "shards=%ld sessions=%lu messages=%lu secs=%.3f msgs/s=%.0f speedup=%.2f\n", 
+				shards, (unsigned long)sessions, received, secs, received / secs, 
+				base ? (received / secs) / base : 0);
+
+		if (shards < max_shards && shards * 2 > max_shards) {
+			shards = max_shards / 2;
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
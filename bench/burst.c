@@ -0,0 +1,142 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "burst.h"
+
+struct conn {
+	struct burst *b;
+	int fd;
+};
+
+static void *conn_run(void *arg)
+{
+	struct conn *c = arg;
+	char buf[4096];
+	char ch;
+	size_t off = 0;
+	ssize_t n;
+
+	/* swallow the CONNECT frame */
+	while (read(c->fd, &ch, 1) == 1 && ch != '\0') {
+	}
+
+	while (off < c->b->buf_len) {
+		n = write(c->fd, c->b->buf + off, c->b->buf_len - off);
+		if (n <= 0) {
+			break;
+		}
+		off += n;
+	}
+
+	/* closing with unread data (e.g. SUBSCRIBE) would reset the
+	 * connection and discard the frames not read by the client yet */
+	shutdown(c->fd, SHUT_WR);
+	while (read(c->fd, buf, sizeof(buf)) > 0) {
+	}
+
+	close(c->fd);
+	free(c);
+
+	return NULL;
+}
+
+static void *burst_run(void *arg)
+{
+	struct burst *b = arg;
+	struct conn *c;
+	pthread_t t;
+	int fd;
+
+	while ((fd = accept(b->fd, NULL, NULL)) != -1) {
+		c = malloc(sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->b = b;
+		c->fd = fd;
+		if (pthread_create(&t, NULL, conn_run, c)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(t);
+	}
+
+	return NULL;
+}
+
+int burst_frames(struct burst *b, unsigned long messages, size_t body_len)
+{
+	char *buf;
+	char *body;
+	size_t frame_len;
+	size_t off;
+	unsigned long i;
+	const char *connected = "CONNECTED\nversion:1.2\n\n";
+
+	body = malloc(body_len + 1);
+	if (!body) {
+		return -1;
+	}
+	memset(body, 'x', body_len);
+	body[body_len] = '\0';
+
+	frame_len = 256 + body_len;
+	buf = malloc(strlen(connected) + 1 + messages * frame_len);
+	if (!buf) {
+		free(body);
+		return -1;
+	}
+
+	off = sprintf(buf, "%s", connected) + 1;
+	for (i = 0; i < messages; i++) {
+		off += sprintf(buf + off, "MESSAGE\nsubscription:1\nmessage-id:%lu\n"
+				"destination:/queue/bench\ncontent-length:%lu\n\n%s", 
+				i, (unsigned long)body_len, body) + 1;
+	}
+	free(body);
+
+	b->buf = buf;
+	b->buf_len = off;
+	b->fd = -1;
+
+	return 0;
+}
+
+int burst_start(struct burst *b, unsigned long messages, size_t body_len)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t t;
+
+	if (burst_frames(b, messages, body_len)) {
+		return -1;
+	}
+
+	b->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (b->fd == -1) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(b->fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(b->fd, 1024)) {
+		return -1;
+	}
+
+	if (getsockname(b->fd, (struct sockaddr *)&addr, &len)) {
+		return -1;
+	}
+	snprintf(b->port, sizeof(b->port), "%d", ntohs(addr.sin_port));
+
+	return pthread_create(&t, NULL, burst_run, b);
+}
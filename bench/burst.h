@@ -0,0 +1,33 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal loopback broker for the benchmarks.
+ *
+ * Every accepted connection gets its CONNECT frame swallowed and is then 
+ * sent CONNECTED followed by a burst of MESSAGE frames for subscription "1",
+ * after which the connection is closed. Whatever the client sends
+ * meanwhile is read and discarded.
+ */
+struct burst {
+	int fd;
+	char port[16];
+	const char *buf; /* CONNECTED + all MESSAGE frames */
+	size_t buf_len;
+};
+
+/* only build buf, for feeding it to a session some other way */
+int burst_frames(struct burst *b, unsigned long messages, size_t body_len);
+int burst_start(struct burst *b, unsigned long messages, size_t body_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BURST_H */
@@ -0,0 +1,173 @@
+#!/bin/sh
+#
+# Compare benchmark results with a baseline, or write a new baseline.
+#
+# Every run.json is one run of bench_frame or bench_loop. The runs of a
+# bench and corpus written to a baseline are reduced to their median
+# ns_per_frame; the runs checked against it are reduced to their fastest.
+# A run is only ever slowed down by the scheduler and other load, never
+# sped up, so a regression in the code shows in every run, while the
+# median of a few runs of bench_loop on a busy machine moves by a third
+# from one make check-perf to the next. The median absolute deviation
+# from the median, relative to the median, is taken as the noise.
+# A result regresses if its fastest run is slower than the baseline by
+# more than the threshold plus the noise of both the baseline and the
+# current runs, or if it allocates more per frame than the baseline did.
+# The steady state benches, which measure after one warm-up frame, must
+# not allocate at all, whatever the baseline says; a baseline is not
+# written while one of them does.
+# Results missing from the baseline are reported but do not fail.
+#
+# usage: check-perf.sh [-t percent] [-u] baseline.json run.json...
+#   -t  allowed slowdown in percent on top of the noise (10)
+#   -u  write the runs to baseline.json instead of comparing
+#
+threshold=10
+update=0
+# benches which reuse their buffers from the second frame on
+steady="read read+hdrs write encode loop-recv loop-send mem-recv"
+
+while getopts t:u opt; do
+	case $opt in
+		t) threshold=$OPTARG ;;
+		u) update=1 ;;
+		*) echo "usage: $0 [-t percent] [-u] baseline.json run.json..." >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 2 ]; then
+	echo "usage: $0 [-t percent] [-u] baseline.json run.json..." >&2
+	exit 2
+fi
+
+baseline=$1
+shift
+
+if [ $update = 0 ] && [ ! -r "$baseline" ]; then
+	echo "$0: no baseline $baseline, run make perf-baseline first" >&2
+	exit 2
+fi
+
+out=/dev/null
+if [ $update = 1 ]; then
+	out=$baseline
+else
+	set -- "$baseline" "$@"
+fi
+
+awk -v threshold="$threshold" -v update="$update" -v baseline="$baseline" -v out="$out" -v steady="$steady" '
+function field(line, name,    i, s) {
+	i = index(line, "\"" name "\": ")
+	if (!i) {
+		return ""
+	}
+	s = substr(line, i + length(name) + 4)
+	sub(/^"/, "", s)
+	sub(/["},].*$/, "", s)
+	return s
+}
+
+function median(v, n,    i, j, t) {
+	for (i = 2; i <= n; i++) {
+		for (j = i; j > 1 && v[j - 1] > v[j]; j--) {
+			t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+		}
+	}
+	return n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+}
+
+BEGIN {
+	n = split(steady, s, " ")
+	for (i = 1; i <= n; i++) {
+		zero[s[i]] = 1
+	}
+}
+
+FILENAME == baseline {
+	if (!index($0, "\"bench\"")) {
+		next
+	}
+	key = field($0, "bench") "/" field($0, "corpus")
+	base_ns[key] = field($0, "ns_per_frame") + 0
+	base_noise[key] = field($0, "noise") + 0
+	base_allocs[key] = field($0, "allocs_per_frame") + 0
+	next
+}
+
+index($0, "\"bench\"") {
+	key = field($0, "bench") "/" field($0, "corpus")
+	if (!(key in runs)) {
+		order[++keys] = key
+		bench[key] = field($0, "bench")
+		corpus[key] = field($0, "corpus")
+	}
+	ns[key, ++runs[key]] = field($0, "ns_per_frame") + 0
+	a = field($0, "allocs_per_frame") + 0
+	if (!(key in allocs) || a > allocs[key]) {
+		allocs[key] = a
+	}
+}
+
+END {
+	failed = 0
+
+	for (k = 1; k <= keys; k++) {
+		key = order[k]
+		n = runs[key]
+		for (i = 1; i <= n; i++) {
+			v[i] = ns[key, i]
+		}
+		mid = median(v, n)
+		# median() sorted v
+		cur = update ? mid : v[1]
+		for (i = 1; i <= n; i++) {
+			v[i] = ns[key, i] > mid ? ns[key, i] - mid : mid - ns[key, i]
+		}
+		noise = mid > 0 ? median(v, n) / mid : 0
+
+		if (bench[key] in zero && allocs[key] > 0) {
+			printf "%-28s %12.1f ns  allocs %.3f, expected none  ALLOCS\n", key, cur, allocs[key]
+			failed = 1
+			continue
+		}
+
+		if (update) {
+			line[k] = sprintf("%s\n    {\"bench\": \"%s\", \"corpus\": \"%s\", \"ns_per_frame\": %.1f, \"noise\": %.3f, \"allocs_per_frame\": %.3f}", \
+				(k > 1 ? "," : ""), bench[key], corpus[key], cur, noise, allocs[key])
+			continue
+		}
+
+		if (!(key in base_ns)) {
+			printf "%-28s %12.1f ns  (not in the baseline)\n", key, cur
+			continue
+		}
+
+		change = base_ns[key] > 0 ? (cur - base_ns[key]) * 100 / base_ns[key] : 0
+		allowed = threshold + (base_noise[key] + noise) * 100
+		status = "ok"
+		if (change > allowed) {
+			status = "SLOWER"
+			failed = 1
+		}
+		if (allocs[key] > base_allocs[key] + 0.0005) {
+			status = status == "ok" ? "ALLOCS" : status "+ALLOCS"
+			failed = 1
+		}
+
+		printf "%-28s %12.1f ns %+8.1f%% (allowed %+.1f%%)  allocs %.3f/%.3f  %s\n", \
+			key, cur, change, allowed, allocs[key], base_allocs[key], status
+	}
+
+	if (update && !failed) {
+		printf "{\n  \"results\": [" > out
+		for (k = 1; k <= keys; k++) {
+			printf "%s", line[k] > out
+		}
+		printf "\n  ]\n}\n" > out
+		printf "wrote %s\n", baseline
+	}
+
+	exit failed
+}
+' "$@"
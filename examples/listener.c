@@ -18,15 +18,9 @@ static void dump_hdrs(int hdrc, const struct stomp_hdr *hdrs)
 
 static void _connected(stomp_session_t *s, void *ctx, void *session_ctx)
 {
-	struct ctx *c = session_ctx;
-	struct stomp_hdr hdrs[] = {
-		{"destination", c->destination},
-	};
-
-	int err = stomp_subscribe(s, sizeof(hdrs)/sizeof(struct stomp_hdr), hdrs);
-	if (err<0) {
-		perror("stomp");
-	}
+	struct stomp_ctx_connected *e = ctx;
+	dump_hdrs(e->hdrc, e->hdrs);
+	fprintf(stdout, "connected\n");
 }
 
 static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
@@ -65,6 +59,9 @@ int main(int argc, char *argv[])
 		{"accept-version", "1.2"},
 		{"heart-beat", "1000,1000"},
 	};
+	struct stomp_hdr sub_hdrs[] = {
+		{"destination", NULL},
+	};
 
 	if (argc != 2) {
 		fprintf(stderr, "usage: %s <destination>\n", argv[0]);
@@ -72,6 +69,7 @@ int main(int argc, char *argv[])
 	}
 
 	c.destination = argv[1];
+	sub_hdrs[0].val = c.destination;
 
 	s = stomp_session_new(&c);
 	if (!s) {
@@ -85,6 +83,14 @@ int main(int argc, char *argv[])
 	stomp_callback_set(s, SCB_RECEIPT, _receipt);
 	stomp_callback_set(s, SCB_USER, _user);
 
+	/* sent together with CONNECT, no need to wait for the broker to answer first */
+	err = stomp_subscribe(s, sizeof(sub_hdrs)/sizeof(struct stomp_hdr), sub_hdrs);
+	if (err < 0) {
+		perror("stomp");
+		stomp_session_free(s);
+		exit(EXIT_FAILURE);
+	}
+
 	err = stomp_connect(s, "127.0.0.1", "61613", sizeof(hdrs)/sizeof(struct stomp_hdr), hdrs);
 	if (err) {
 		perror("stomp");
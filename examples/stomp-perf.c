@@ -0,0 +1,628 @@
+/*
+ * stomp-perf: load generator and latency meter for libstomp.
+ *
+ * Runs producer and consumer sessions against a broker, or against the
+ * in-process mock broker of the tests with -L, each session on a thread
+ * of its own. Producers put their CLOCK_MONOTONIC send time in the first
+ * 8 bytes of every body, consumers turn it into end-to-end latency.
+ * CPU time is taken per session thread, so with -L the broker's own work
+ * is not counted against the library.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stomp.h>
+
+#include "broker.h"
+
+/* log-linear buckets, 8 per power of two, enough for any 64 bit value */
+#define HISTSUB 8
+#define HISTBUCKETS (64 * HISTSUB)
+
+/* max messages a producer sends between two steps of its session */
+#define BURST 64
+
+/* ms to wait for the consumers to subscribe */
+#define READYTIMEOUT 10000
+
+struct opts {
+	const char *host;
+	const char *service;
+	const char *login;
+	const char *passcode;
+	const char *prefix;
+	int local;
+	int tls;
+	struct stomp_tls tls_conf;
+	int producers;
+	int consumers;
+	size_t size;
+	unsigned long messages; /* per producer */
+	unsigned long seconds;
+	unsigned long rate; /* per producer, msg/s; 0 as fast as possible */
+	int destinations;
+	const char *ack;
+	size_t batch;
+	unsigned long linger; /* ms a consumer waits for more once the producers are done */
+};
+
+static struct opts o = {
+	.host = "127.0.0.1",
+	.service = "61613",
+	.login = "admin",
+	.passcode = "password",
+	.prefix = "/queue/perf-",
+	.producers = 1,
+	.consumers = 1,
+	.size = 128,
+	.messages = 100000,
+	.destinations = 1,
+	.ack = "auto",
+	.linger = 1000,
+};
+
+struct worker {
+	pthread_t thread;
+	stomp_session_t *s;
+	int producer;
+	int id;
+	int disconnecting;
+	int failed;
+
+	unsigned long sent;
+	unsigned long received;
+	unsigned long errors;
+	unsigned long long first; /* time of the first message sent or received, ns */
+	unsigned long long last; /* time of the last one */
+	unsigned long long next; /* time the next message is due, ns */
+	unsigned long long deadline; /* time to stop sending, ns; 0 none */
+	double cpu; /* seconds of CPU used by the thread */
+	char *body;
+	unsigned long long hist[HISTBUCKETS];
+};
+
+static char **dests;
+static int ready; /* consumers subscribed */
+static int gone; /* consumers that gave up */
+static unsigned long long produced; /* time the producers were done, ns */
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hist_index(unsigned long long v)
+{
+	int e;
+
+	if (v < HISTSUB) {
+		return v;
+	}
+
+	e = 63 - __builtin_clzll(v);
+	return (e - 2) * HISTSUB + ((v >> (e - 3)) & (HISTSUB - 1));
+}
+
+/* lowest value of a bucket */
+static unsigned long long hist_value(unsigned int i)
+{
+	if (i < HISTSUB) {
+		return i;
+	}
+
+	return (unsigned long long)(HISTSUB + i % HISTSUB) << (i / HISTSUB - 1);
+}
+
+static unsigned long long hist_quantile(const unsigned long long *h, unsigned long long count, double q)
+{
+	unsigned long long rank = count * q;
+	unsigned long long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HISTBUCKETS; i++) {
+		seen += h[i];
+		if (seen > rank) {
+			return hist_value(i);
+		}
+	}
+
+	return 0;
+}
+
+static double thread_cpu(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru)) {
+		return 0;
+	}
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_message *e = ctx;
+	struct worker *w = session_ctx;
+	unsigned long long now = now_ns();
+	unsigned long long sent;
+	struct stomp_hdr hdrs[2];
+	size_t i;
+
+	if (!w->received++) {
+		w->first = now;
+	}
+	w->last = now;
+
+	if (e->body_len >= sizeof(sent)) {
+		memcpy(&sent, e->body, sizeof(sent));
+		w->hist[hist_index(now > sent ? now - sent : 0)]++;
+	}
+
+	if (!strcmp(o.ack, "auto")) {
+		return;
+	}
+
+	/* STOMP 1.2 acks by "id", 1.1 by "message-id" and "subscription" */
+	hdrs[0].key = hdrs[1].key = NULL;
+	for (i = 0; i < e->hdrc; i++) {
+		if (!strcmp(e->hdrs[i].key, "ack")) {
+			hdrs[0].key = "id";
+			hdrs[0].val = e->hdrs[i].val;
+			break;
+		} else if (!strcmp(e->hdrs[i].key, "message-id")) {
+			hdrs[0].key = "message-id";
+			hdrs[0].val = e->hdrs[i].val;
+		} else if (!strcmp(e->hdrs[i].key, "subscription")) {
+			hdrs[1].key = "subscription";
+			hdrs[1].val = e->hdrs[i].val;
+		}
+	}
+
+	if (!hdrs[0].key || stomp_ack(s, hdrs[1].key && strcmp(hdrs[0].key, "id") ? 2 : 1, hdrs)) {
+		w->errors++;
+	}
+}
+
+static void _receipt(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_receipt *e = ctx;
+	size_t i;
+
+	/* the last SUBSCRIBE asked for it, the consumer is all set */
+	for (i = 0; i < e->hdrc; i++) {
+		if (!strcmp(e->hdrs[i].key, "receipt-id") && !strcmp(e->hdrs[i].val, "ready")) {
+			__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static void _error(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_error *e = ctx;
+	struct worker *w = session_ctx;
+
+	w->errors++;
+	fprintf(stderr, "%s %d: ERROR %.*s\n", w->producer ? "producer" : "consumer", w->id,
+			(int)e->body_len, (const char *)e->body);
+}
+
+static void _batch(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_batch *e = ctx;
+	struct worker *w = session_ctx;
+
+	if (e->status) {
+		w->errors += e->messages;
+	}
+}
+
+static int disconnect(struct worker *w)
+{
+	struct stomp_hdr hdrs[] = {
+		{"receipt", "bye"},
+	};
+
+	w->disconnecting = 1;
+	return stomp_disconnect(w->s, sizeof(hdrs)/sizeof(*hdrs), hdrs);
+}
+
+/* send the messages that are due, returns the ms to wait for the next one */
+static int produce(struct worker *w, unsigned long timeout)
+{
+	struct stomp_hdr hdrs[] = {
+		{"destination", NULL},
+	};
+	unsigned long long now = now_ns();
+	unsigned long long next;
+	int n;
+
+	for (n = 0; n < BURST; n++) {
+		if ((o.messages && w->sent == o.messages) || (w->deadline && now >= w->deadline)) {
+			return disconnect(w) ? -1 : 0;
+		}
+
+		if (o.rate) {
+			if (now < w->next) {
+				next = (w->next - now + 999999) / 1000000;
+				return next < timeout ? next : timeout;
+			}
+			w->next += 1000000000ULL / o.rate;
+		}
+
+		hdrs[0].val = dests[w->sent % o.destinations];
+		memcpy(w->body, &now, sizeof(now));
+		if (stomp_send(w->s, sizeof(hdrs)/sizeof(*hdrs), hdrs, w->body, o.size)) {
+			return -1;
+		}
+
+		if (!w->sent++) {
+			w->first = now;
+		}
+		w->last = now;
+		now = now_ns();
+	}
+
+	return 0;
+}
+
+static int loop(struct worker *w)
+{
+	unsigned long long done;
+	struct pollfd pfd;
+	unsigned long t;
+	int r;
+
+	for (;;) {
+		t = stomp_session_timeout(w->s);
+
+		if (w->producer && !w->disconnecting) {
+			r = produce(w, t);
+			if (r < 0) {
+				return -1;
+			}
+			t = r;
+		} else if (!w->producer && !w->disconnecting && (done = __atomic_load_n(&produced, __ATOMIC_ACQUIRE))) {
+			/* idle since the last message, or since the producers were done */
+			if (done < w->last) {
+				done = w->last;
+			}
+			if (now_ns() - done >= o.linger * 1000000ULL && disconnect(w)) {
+				return -1;
+			}
+			if (t > o.linger) {
+				t = o.linger;
+			}
+		}
+
+		pfd.fd = stomp_session_fd(w->s);
+		pfd.events = stomp_session_throttled(w->s) ? 0 : POLLIN;
+		pfd.revents = 0;
+
+		r = poll(&pfd, 1, t);
+		if (r < 0 && errno != EINTR) {
+			return -1;
+		}
+
+		r = stomp_session_step(w->s, r > 0 && pfd.revents);
+		if (r <= 0) {
+			return r;
+		}
+	}
+}
+
+static int subscribe(struct worker *w)
+{
+	struct stomp_hdr hdrs[] = {
+		{"destination", NULL},
+		{"ack", o.ack},
+		{"receipt", "ready"},
+	};
+	int i;
+
+	for (i = 0; i < o.destinations; i++) {
+		hdrs[0].val = dests[i];
+		/* only the last one asks for a receipt */
+		if (stomp_subscribe(w->s, i == o.destinations - 1 ? 3 : 2, hdrs) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	struct stomp_hdr hdrs[] = {
+		{"login", o.login},
+		{"passcode", o.passcode},
+		{"accept-version", "1.1,1.2"},
+		{"heart-beat", "0,0"},
+	};
+
+	w->s = stomp_session_new(w);
+	if (!w->s) {
+		w->failed = errno;
+		return NULL;
+	}
+
+	stomp_callback_set(w->s, SCB_MESSAGE, _message);
+	stomp_callback_set(w->s, SCB_RECEIPT, _receipt);
+	stomp_callback_set(w->s, SCB_ERROR, _error);
+	stomp_callback_set(w->s, SCB_BATCH, _batch);
+
+	if ((!w->producer && subscribe(w)) ||
+	    (w->producer && o.batch && stomp_batch_set(w->s, o.batch, 0, 100)) ||
+	    (o.tls && stomp_tls_set(w->s, &o.tls_conf)) ||
+	    stomp_connect(w->s, o.host, o.service, sizeof(hdrs)/sizeof(*hdrs), hdrs) ||
+	    loop(w)) {
+		w->failed = errno;
+		if (!w->producer) {
+			__atomic_add_fetch(&gone, 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	w->cpu = thread_cpu();
+	stomp_session_free(w->s);
+	w->s = NULL;
+
+	return NULL;
+}
+
+static void start(struct worker *w, int producer, int id)
+{
+	w->producer = producer;
+	w->id = id;
+	if (producer) {
+		w->next = now_ns();
+		if (o.seconds) {
+			w->deadline = w->next + o.seconds * 1000000000ULL;
+		}
+
+		w->body = calloc(1, o.size);
+		if (!w->body) {
+			die("calloc");
+		}
+		memset(w->body + sizeof(unsigned long long), 'x', o.size - sizeof(unsigned long long));
+	}
+
+	errno = pthread_create(&w->thread, NULL, run, w);
+	if (errno) {
+		die("pthread_create");
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+			"  -H host          broker host, or unix:/path for a Unix socket (%s)\n"
+			"  -P port          broker port (%s)\n"
+			"  -L               run against an in-process mock broker\n"
+			"  -S               connect over TLS\n"
+			"  -C ca.pem        CAs to verify the broker against, implies -S\n"
+			"  -K               no kernel TLS offload, implies -S\n"
+			"  -u login:passcode\n"
+			"  -p producers     number of producer sessions (%d)\n"
+			"  -c consumers     number of consumer sessions (%d)\n"
+			"  -s size          message body size in bytes, at least 8 (%zu)\n"
+			"  -n messages      messages per producer, 0 for no limit (%lu)\n"
+			"  -t seconds       stop producing after this long, 0 for no limit\n"
+			"  -r rate          messages per second per producer, 0 for no limit\n"
+			"  -d destinations  number of destinations (%d)\n"
+			"  -q prefix        destination name prefix (%s)\n"
+			"  -a ack           auto, client or client-individual (%s)\n"
+			"  -b messages      send in transactions of this many messages\n"
+			"  -l ms            consumer linger once the producers are done (%lu)\n",
+			prog, o.host, o.service, o.producers, o.consumers, o.size, o.messages,
+			o.destinations, o.prefix, o.ack, o.linger);
+	exit(EXIT_FAILURE);
+}
+
+static void report(struct worker *w, int n, const char *what)
+{
+	unsigned long long first = 0, last = 0;
+	unsigned long msgs = 0, errors = 0;
+	double cpu = 0, secs;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		msgs += w[i].producer ? w[i].sent : w[i].received;
+		errors += w[i].errors;
+		cpu += w[i].cpu;
+		if (w[i].first && (!first || w[i].first < first)) {
+			first = w[i].first;
+		}
+		if (w[i].last > last) {
+			last = w[i].last;
+		}
+		if (w[i].failed) {
+			fprintf(stderr, "%s %d: %s\n", what, i, strerror(w[i].failed));
+		}
+	}
+
+	secs = last > first ? (last - first) / 1e9 : 0;
+	fprintf(stdout, "%-9s msgs=%-10lu secs=%-8.3f msg/s=%-12.0f MB/s=%-10.1f cpu us/msg=%-8.2f errors=%lu\n",
+			what, msgs, secs, secs ? msgs / secs : 0, secs ? msgs * o.size / secs / 1e6 : 0,
+			msgs ? cpu * 1e6 / msgs : 0, errors);
+}
+
+static void report_latency(struct worker *w, int n)
+{
+	unsigned long long h[HISTBUCKETS] = {0};
+	unsigned long long count = 0;
+	unsigned long long max = 0;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < HISTBUCKETS; j++) {
+			h[j] += w[i].hist[j];
+			count += w[i].hist[j];
+			if (w[i].hist[j]) {
+				max = hist_value(j) > max ? hist_value(j) : max;
+			}
+		}
+	}
+
+	if (!count) {
+		return;
+	}
+
+	fprintf(stdout, "latency   us p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+			hist_quantile(h, count, 0.5) / 1e3, hist_quantile(h, count, 0.9) / 1e3,
+			hist_quantile(h, count, 0.99) / 1e3, hist_quantile(h, count, 0.999) / 1e3, max / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *producers, *consumers;
+	struct broker_opts bo = {0};
+	broker_t *b = NULL;
+	unsigned long waited;
+	char *colon;
+	int failed = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "H:P:LSC:Ku:p:c:s:n:t:r:d:q:a:b:l:")) != -1) {
+		switch (opt) {
+			case 'H': o.host = optarg; break;
+			case 'P': o.service = optarg; break;
+			case 'L': o.local = 1; break;
+			case 'S': o.tls = 1; break;
+			case 'C': o.tls = 1; o.tls_conf.ca_file = optarg; break;
+			case 'K': o.tls = 1; o.tls_conf.no_ktls = 1; break;
+			case 'u':
+				colon = strchr(optarg, ':');
+				if (!colon) {
+					usage(argv[0]);
+				}
+				*colon = '\0';
+				o.login = optarg;
+				o.passcode = colon + 1;
+				break;
+			case 'p': o.producers = atoi(optarg); break;
+			case 'c': o.consumers = atoi(optarg); break;
+			case 's': o.size = strtoul(optarg, NULL, 10); break;
+			case 'n': o.messages = strtoul(optarg, NULL, 10); break;
+			case 't': o.seconds = strtoul(optarg, NULL, 10); break;
+			case 'r': o.rate = strtoul(optarg, NULL, 10); break;
+			case 'd': o.destinations = atoi(optarg); break;
+			case 'q': o.prefix = optarg; break;
+			case 'a': o.ack = optarg; break;
+			case 'b': o.batch = strtoul(optarg, NULL, 10); break;
+			case 'l': o.linger = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (o.producers < 0 || o.consumers < 0 || o.destinations < 1 ||
+	    o.size < sizeof(unsigned long long) || (!o.messages && !o.seconds)) {
+		usage(argv[0]);
+	}
+
+	if (o.local) {
+		bo.tls = o.tls;
+		b = broker_start(&bo);
+		if (!b) {
+			die("broker_start");
+		}
+		o.host = "127.0.0.1";
+		o.service = broker_service(b);
+		if (o.tls) {
+			o.tls_conf.ca_file = broker_tls_ca(b);
+		}
+	}
+
+	dests = calloc(o.destinations, sizeof(*dests));
+	producers = calloc(o.producers + 1, sizeof(*producers));
+	consumers = calloc(o.consumers + 1, sizeof(*consumers));
+	if (!dests || !producers || !consumers) {
+		die("calloc");
+	}
+
+	for (i = 0; i < o.destinations; i++) {
+		if (asprintf(&dests[i], "%s%d", o.prefix, i) < 0) {
+			die("asprintf");
+		}
+	}
+
+	/* messages sent before a consumer subscribes would not be measured */
+	for (i = 0; i < o.consumers; i++) {
+		start(&consumers[i], 0, i);
+	}
+
+	for (waited = 0; __atomic_load_n(&ready, __ATOMIC_ACQUIRE) < o.consumers; waited++) {
+		if (__atomic_load_n(&gone, __ATOMIC_ACQUIRE)) {
+			for (i = 0; i < o.consumers; i++) {
+				pthread_join(consumers[i].thread, NULL);
+			}
+			report(consumers, o.consumers, "received");
+			exit(EXIT_FAILURE);
+		}
+
+		if (waited == READYTIMEOUT) {
+			fprintf(stderr, "consumers did not subscribe in time\n");
+			exit(EXIT_FAILURE);
+		}
+		usleep(1000);
+	}
+
+	for (i = 0; i < o.producers; i++) {
+		start(&producers[i], 1, i);
+	}
+
+	for (i = 0; i < o.producers; i++) {
+		pthread_join(producers[i].thread, NULL);
+		failed |= producers[i].failed;
+	}
+
+	__atomic_store_n(&produced, now_ns(), __ATOMIC_RELEASE);
+
+	for (i = 0; i < o.consumers; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		failed |= consumers[i].failed;
+	}
+
+	fprintf(stdout, "producers=%d consumers=%d size=%zu destinations=%d ack=%s batch=%zu rate=%lu\n",
+			o.producers, o.consumers, o.size, o.destinations, o.ack, o.batch, o.rate);
+	report(producers, o.producers, "sent");
+	report(consumers, o.consumers, "received");
+	report_latency(consumers, o.consumers);
+
+	if (b) {
+		broker_stop(b);
+	}
+
+	for (i = 0; i < o.producers; i++) {
+		free(producers[i].body);
+	}
+	for (i = 0; i < o.destinations; i++) {
+		free(dests[i]);
+	}
+	free(dests);
+	free(producers);
+	free(consumers);
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "alloc.h"
+
+/* arena allocations are aligned to this many bytes */
+#define ARENAALIGN (sizeof(max_align_t))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size; /* usable bytes in data */
+	size_t used; /* bytes handed out from data */
+	max_align_t data[];
+};
+
+static void *libc_malloc(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+static void *libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void libc_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static struct stomp_allocator global = {
+	.malloc_fn = libc_malloc,
+	.realloc_fn = libc_realloc,
+	.free_fn = libc_free,
+};
+
+/* set once the library wide allocator handed out memory */
+static int global_used;
+
+static const struct stomp_allocator *alloc_get(const struct stomp_allocator *a)
+{
+	if (a) {
+		return a;
+	}
+
+	if (!__atomic_load_n(&global_used, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&global_used, 1, __ATOMIC_RELAXED);
+	}
+
+	return &global;
+}
+
+void *alloc_malloc(const struct stomp_allocator *a, size_t size)
+{
+	void *ptr;
+
+	a = alloc_get(a);
+	ptr = a->malloc_fn(a->ctx, size);
+	if (!ptr) {
+		errno = ENOMEM;
+	}
+
+	return ptr;
+}
+
+void *alloc_calloc(const struct stomp_allocator *a, size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = alloc_malloc(a, nmemb * size);
+	if (ptr) {
+		memset(ptr, 0, nmemb * size);
+	}
+
+	return ptr;
+}
+
+void *alloc_realloc(const struct stomp_allocator *a, void *ptr, size_t size)
+{
+	a = alloc_get(a);
+
+	if (!ptr) {
+		return alloc_malloc(a, size);
+	}
+
+	ptr = a->realloc_fn(a->ctx, ptr, size);
+	if (!ptr) {
+		errno = ENOMEM;
+	}
+
+	return ptr;
+}
+
+void alloc_free(const struct stomp_allocator *a, void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+
+	a = alloc_get(a);
+	a->free_fn(a->ctx, ptr);
+}
+
+char *alloc_strdup(const struct stomp_allocator *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *dup;
+
+	dup = alloc_malloc(a, len);
+	if (dup) {
+		memcpy(dup, s, len);
+	}
+
+	return dup;
+}
+
+void alloc_global_get(struct stomp_allocator *a)
+{
+	*a = *alloc_get(NULL);
+}
+
+int alloc_global_set(const struct stomp_allocator *a)
+{
+	/* memory handed out so far has to go back to the same allocator */
+	if (__atomic_load_n(&global_used, __ATOMIC_RELAXED)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!a) {
+		global.malloc_fn = libc_malloc;
+		global.realloc_fn = libc_realloc;
+		global.free_fn = libc_free;
+		global.ctx = NULL;
+		global.arena = 0;
+		return 0;
+	}
+
+	if (!a->malloc_fn || !a->realloc_fn || !a->free_fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	global = *a;
+
+	return 0;
+}
+
+static size_t align(size_t size)
+{
+	return (size + ARENAALIGN - 1) & ~(ARENAALIGN - 1);
+}
+
+void *arena_alloc(struct arena *ar, const struct stomp_allocator *a, size_t size)
+{
+	struct arena_chunk *c = ar->cur;
+	size_t len;
+
+	size = align(size);
+
+	if (c && c->size - c->used >= size) {
+		ar->last = (char *)c->data + c->used;
+		c->used += size;
+		return ar->last;
+	}
+
+	/* chunks past cur are left over from a previous frame and empty */
+	while (c && c->next) {
+		c = c->next;
+		c->used = 0;
+		ar->cur = c;
+		if (c->size >= size) {
+			ar->last = c->data;
+			c->used = size;
+			return ar->last;
+		}
+	}
+
+	len = size > ar->chunk ? size : ar->chunk;
+	c = alloc_malloc(a, sizeof(*c) + len);
+	if (!c) {
+		return NULL;
+	}
+
+	c->next = NULL;
+	c->size = len;
+	c->used = size;
+	ar->size += len;
+
+	if (ar->cur) {
+		ar->cur->next = c;
+	} else {
+		ar->head = c;
+	}
+	ar->cur = c;
+	ar->last = c->data;
+
+	return ar->last;
+}
+
+void *arena_realloc(struct arena *ar, const struct stomp_allocator *a, void *ptr, size_t old_size, size_t size)
+{
+	struct arena_chunk *c = ar->cur;
+	size_t offset;
+	void *dest;
+
+	/* the most recent allocation grows in place while the chunk has room */
+	if (ptr && ptr == ar->last) {
+		offset = (char *)ptr - (char *)c->data;
+		if (c->size - offset >= align(size)) {
+			c->used = offset + align(size);
+			return ptr;
+		}
+	}
+
+	dest = arena_alloc(ar, a, size);
+	if (dest && ptr) {
+		memcpy(dest, ptr, old_size < size ? old_size : size);
+	}
+
+	return dest;
+}
+
+void arena_reset(struct arena *ar)
+{
+	ar->cur = ar->head;
+	ar->last = NULL;
+	if (ar->cur) {
+		ar->cur->used = 0;
+	}
+}
+
+void arena_free(struct arena *ar, const struct stomp_allocator *a)
+{
+	struct arena_chunk *c;
+
+	while (ar->head) {
+		c = ar->head;
+		ar->head = c->next;
+		alloc_free(a, c);
+	}
+
+	ar->cur = NULL;
+	ar->last = NULL;
+	ar->size = 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+#include "stomp.h"
+
+/* 
+ * Allocation helpers. A NULL allocator stands for the library wide 
+ * one set with stomp_set_allocator(), libc unless replaced.
+ */
+void *alloc_malloc(const struct stomp_allocator *a, size_t size);
+void *alloc_calloc(const struct stomp_allocator *a, size_t nmemb, size_t size);
+void *alloc_realloc(const struct stomp_allocator *a, void *ptr, size_t size);
+void alloc_free(const struct stomp_allocator *a, void *ptr);
+char *alloc_strdup(const struct stomp_allocator *a, const char *s);
+
+/* copy of the library wide allocator for objects which outlive a change of it */
+void alloc_global_get(struct stomp_allocator *a);
+int alloc_global_set(const struct stomp_allocator *a);
+
+/* 
+ * Bump allocator for data which lives as long as a frame. 
+ * Chunks are kept for reuse, arena_reset() rewinds in O(1).
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *head; /* first chunk */
+	struct arena_chunk *cur; /* chunk allocations are carved from */
+	void *last; /* most recent allocation, may grow in place */
+	size_t chunk; /* min size of a chunk in bytes */
+	size_t size; /* bytes held by all chunks */
+};
+
+void *arena_alloc(struct arena *ar, const struct stomp_allocator *a, size_t size);
+void *arena_realloc(struct arena *ar, const struct stomp_allocator *a, void *ptr, size_t old_size, size_t size);
+void arena_reset(struct arena *ar);
+void arena_free(struct arena *ar, const struct stomp_allocator *a);
+
+#endif /* ALLOC_H */
@@ -14,14 +14,25 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "frame.h"
 #include "hdr.h"
+#include "alloc.h"
+#include "stats.h"
+#include "io.h"
 
 enum read_state {
 	RS_INIT,
@@ -33,11 +44,13 @@ enum read_state {
 	RS_ERR
 };
 
+/* offsets into buf, whose headers are capped at HDRSMAX bytes. 
+ * 16 bytes so four headers share a cache line */
 struct frame_hdr {
-	ptrdiff_t key_offset;
-	size_t key_len;
-	ptrdiff_t val_offset;
-	size_t val_len;
+	uint32_t key_offset;
+	uint32_t key_len;
+	uint32_t val_offset;
+	uint32_t val_len;
 };
 
 struct _frame {
@@ -62,6 +75,20 @@ struct _frame {
 	enum read_state read_state; /* current state of the frame reading state mashine */
 	ptrdiff_t tmp_offset; /* current position within buf while reading an incomming frame */
 	size_t tmp_len; /* amount of bytes read while reading an incomming frame */
+
+	struct stomp_allocator alloc; /* hooks the frame was allocated with */
+	struct arena arena; /* buffers are carved from here if alloc.arena is set */
+
+	void *spill; /* mapping the body is received into, NULL unless spilled */
+	size_t spill_capacity; /* bytes mapped */
+	size_t spill_expect; /* body bytes announced by content-length, 0 if unknown */
+	int spill_fd; /* file behind the mapping */
+
+	struct stomp_limits limits; /* enforced while reading */
+	struct stomp_stats *stats; /* session counters, may be NULL */
+	const struct io *io; /* stream the frame is read from and written to, NULL for the fd itself */
+	size_t trim_hwm; /* most bytes used by a frame in the current trim window */
+	unsigned int trim_frames; /* frames seen in the current trim window */
 };
 
 /* number of bytes to increase session->buf by
@@ -72,6 +99,17 @@ struct _frame {
  * when adding more data to the frame */
 #define HDRINCLEN 4
 
+/* max bytes in a frame buffer, so doubling its capacity cannot overflow */
+#define BUFMAX (SIZE_MAX / 2 - BUFINCLEN)
+
+/* max bytes up to the end of the headers so struct frame_hdr offsets 
+ * fit in 32 bits; the body after them is only capped at BUFMAX */
+#define HDRSMAX (UINT32_MAX < BUFMAX ? UINT32_MAX : BUFMAX)
+
+/* number of frames over which the buffer usage is 
+ * watched before oversized buffers are trimmed */
+#define TRIMFRAMES 64
+
 static int parse_content_length(const char *s, size_t *len)
 {
 	size_t tmp_len;
@@ -103,17 +141,66 @@ static int parse_content_length(const char *s, size_t *len)
 
 frame_t *frame_new()
 {
-	frame_t *f = calloc(1, sizeof(*f));
+	struct stomp_allocator a;
+
+	alloc_global_get(&a);
+
+	return frame_new_with(&a);
+}
+
+frame_t *frame_new_with(const struct stomp_allocator *a)
+{
+	frame_t *f = alloc_calloc(a, 1, sizeof(*f));
+	if (!f) {
+		return NULL;
+	}
+
+	f->alloc = *a;
+	f->arena.chunk = a->arena;
 	
 	return f;
 }
 
+static void frame_spill_free(frame_t *f)
+{
+	if (!f->spill) {
+		return;
+	}
+
+	munmap(f->spill, f->spill_capacity);
+	close(f->spill_fd);
+	f->spill = NULL;
+	f->spill_capacity = 0;
+}
+
 void frame_free(frame_t *f)
 {
-	free(f->stomp_hdrs);
-	free(f->hdrs);
-	free(f->buf);
-	free(f);
+	struct stomp_allocator a = f->alloc;
+
+	frame_spill_free(f);
+
+	if (a.arena) {
+		arena_free(&f->arena, &a);
+	} else {
+		alloc_free(&a, f->stomp_hdrs);
+		alloc_free(&a, f->hdrs);
+		alloc_free(&a, f->buf);
+	}
+	alloc_free(&a, f);
+}
+
+/* grow one of the frame buffers */
+static void *frame_realloc(frame_t *f, void *ptr, size_t old_size, size_t size)
+{
+	if (f->stats) {
+		STATS_ADD(f->stats->reallocs, 1);
+	}
+
+	if (f->alloc.arena) {
+		return arena_realloc(&f->arena, &f->alloc, ptr, old_size, size);
+	}
+
+	return alloc_realloc(&f->alloc, ptr, size);
 }
 
 void frame_reset(frame_t *f)
@@ -124,10 +211,33 @@ void frame_reset(frame_t *f)
 	size_t hdrs_capacity = f->hdrs_capacity;
 	struct stomp_hdr *stomp_hdrs = f->stomp_hdrs;
 	size_t stomp_hdrs_capacity = f->stomp_hdrs_capacity;
+	struct stomp_allocator alloc = f->alloc;
+	struct arena arena = f->arena;
+	struct stomp_limits limits = f->limits;
+	struct stomp_stats *stats = f->stats;
+	const struct io *io = f->io;
+	size_t trim_hwm = f->trim_hwm;
+	unsigned int trim_frames = f->trim_frames;
+
+	frame_spill_free(f);
+
+	/* rewinding the arena gives back all the buffers at once */
+	if (alloc.arena) {
+		arena_reset(&arena);
+		memset(f, 0, sizeof(*f));
+		f->alloc = alloc;
+		f->arena = arena;
+		f->limits = limits;
+		f->stats = stats;
+		f->io = io;
+		f->trim_hwm = trim_hwm;
+		f->trim_frames = trim_frames;
+		f->read_state = RS_INIT;
+		return;
+	}
 
+	/* only the lengths are reset, header slots are cleared as they are used */
 	memset(f, 0, sizeof(*f));
-	memset(hdrs, 0, sizeof(*hdrs)*hdrs_capacity);
-	memset(stomp_hdrs, 0, sizeof(*stomp_hdrs)*stomp_hdrs_capacity);
 
 	f->buf = buf;
 	f->buf_capacity = capacity;
@@ -135,9 +245,97 @@ void frame_reset(frame_t *f)
 	f->hdrs_capacity = hdrs_capacity;
 	f->stomp_hdrs = stomp_hdrs;
 	f->stomp_hdrs_capacity = stomp_hdrs_capacity;
+	f->alloc = alloc;
+	f->arena = arena;
+	f->limits = limits;
+	f->stats = stats;
+	f->io = io;
+	f->trim_hwm = trim_hwm;
+	f->trim_frames = trim_frames;
 	f->read_state = RS_INIT;
 }
 
+void frame_limits_set(frame_t *f, const struct stomp_limits *l)
+{
+	f->limits = *l;
+}
+
+void frame_stats_set(frame_t *f, struct stomp_stats *st)
+{
+	f->stats = st;
+}
+
+void frame_io_set(frame_t *f, const struct io *io)
+{
+	f->io = io;
+}
+
+size_t frame_len(frame_t *f)
+{
+	return f->buf_len + (f->spill ? f->tmp_len : 0);
+}
+
+size_t frame_held(frame_t *f)
+{
+	if (f->alloc.arena) {
+		return f->arena.size;
+	}
+
+	return f->buf_capacity + 
+		f->hdrs_capacity * sizeof(*f->hdrs) + 
+		f->stomp_hdrs_capacity * sizeof(*f->stomp_hdrs);
+}
+
+int frame_trim(frame_t *f, size_t keep)
+{
+	size_t used;
+	size_t held;
+	size_t hwm;
+
+	used = f->buf_len + 
+		f->hdrs_len * sizeof(*f->hdrs) + 
+		f->stomp_hdrs_len * sizeof(*f->stomp_hdrs);
+	if (used > f->trim_hwm) {
+		f->trim_hwm = used;
+	}
+
+	if (++f->trim_frames < TRIMFRAMES) {
+		return 0;
+	}
+
+	hwm = f->trim_hwm;
+	f->trim_hwm = 0;
+	f->trim_frames = 0;
+
+	/* only shrink if the whole window got by with less than half */
+	held = frame_held(f);
+	if (held <= keep || held / 2 <= hwm) {
+		return 0;
+	}
+
+	/* the buffers grow back to the working size within one frame */
+	if (f->alloc.arena) {
+		arena_free(&f->arena, &f->alloc);
+	} else {
+		alloc_free(&f->alloc, f->stomp_hdrs);
+		alloc_free(&f->alloc, f->hdrs);
+		alloc_free(&f->alloc, f->buf);
+	}
+
+	f->buf = NULL;
+	f->buf_len = 0;
+	f->buf_capacity = 0;
+	f->hdrs = NULL;
+	f->hdrs_len = 0;
+	f->hdrs_capacity = 0;
+	f->stomp_hdrs = NULL;
+	f->stomp_hdrs_len = 0;
+	f->stomp_hdrs_capacity = 0;
+	frame_reset(f);
+
+	return 1;
+}
+
 static size_t buflene(const void *data, size_t len)
 {
 	char c;
@@ -157,17 +355,29 @@ static size_t buflene(const void *data, size_t len)
 	return lene;
 }
 
-static void *frame_alloc(frame_t *f, size_t len)
+static void *frame_alloc(frame_t *f, size_t len, size_t max)
 {
 	size_t capacity;
 	void *buf;
 
+	if (len > max - f->buf_len || 
+	    (f->limits.frame && f->buf_len + len > f->limits.frame)) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
 	if (f->buf_capacity - f->buf_len >= len) {
 		return f->buf + f->buf_len;
 	}
 
-	capacity = f->buf_capacity + BUFINCLEN;
-	buf = realloc(f->buf, capacity);
+	/* at least doubled so appending stays linear; 
+	 * also bounds the copies left behind in an arena */
+	capacity = f->buf_capacity ? f->buf_capacity * 2 : BUFINCLEN;
+	if (capacity - f->buf_len < len) {
+		capacity = (f->buf_len + len + BUFINCLEN - 1) / BUFINCLEN * BUFINCLEN;
+	}
+
+	buf = frame_realloc(f, f->buf, f->buf_capacity, capacity);
 	if (!buf) {
 		return NULL;
 	}
@@ -180,11 +390,11 @@ static void *frame_alloc(frame_t *f, size_t len)
 	return f->buf + f->buf_len;
 }
 
-static void *frame_bufcat(frame_t *f, const void *data, size_t len)
+static void *frame_bufcatn(frame_t *f, const void *data, size_t len, size_t max)
 {
 	void *dest;
 
-	dest = frame_alloc(f, len);
+	dest = frame_alloc(f, len, max);
 	if (!dest) {
 		return NULL;
 	}
@@ -196,6 +406,18 @@ static void *frame_bufcat(frame_t *f, const void *data, size_t len)
 	return dest;
 }
 
+/* append to the command or the headers */
+static void *frame_bufcat(frame_t *f, const void *data, size_t len)
+{
+	return frame_bufcatn(f, data, len, HDRSMAX);
+}
+
+/* append to the body, which no header offset points past */
+static void *frame_bodycat(frame_t *f, const void *data, size_t len)
+{
+	return frame_bufcatn(f, data, len, BUFMAX);
+}
+
 static void *frame_bufcate(frame_t *f, const void *data, size_t len)
 {
 	size_t i;
@@ -210,7 +432,7 @@ static void *frame_bufcate(frame_t *f, const void *data, size_t len)
 		return frame_bufcat(f, data, len);
 	}
 
-	dest = frame_alloc(f, lene);
+	dest = frame_alloc(f, lene, HDRSMAX);
 	if (!dest) {
 		return NULL;
 	}
@@ -288,11 +510,19 @@ int frame_cmd_set(frame_t *f, const char *cmd)
 }
 
 int frame_hdr_add(frame_t *f, const char *key, const char *val)
+{
+	if (!key || !val) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return frame_hdr_addn(f, key, strlen(key), val, strlen(val));
+}
+
+int frame_hdr_addn(frame_t *f, const char *key, size_t key_len, const char *val, size_t val_len)
 {
 	struct frame_hdr *h;
 	void *dest;
-	size_t key_len;
-	size_t val_len;
 
 	if (!f) {
 		errno = EINVAL;
@@ -310,34 +540,19 @@ int frame_hdr_add(frame_t *f, const char *key, const char *val)
 		return -1;
 	}
 
-	if (!key) {
+	if (!key || !key_len) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	key_len = strlen(key);
-
-	if (!key_len) {
+	if (!val || !val_len) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (!val) {
-		errno = EINVAL;
-		return -1;
-	}
-	
-	val_len = strlen(val);
-
-	if (!val_len) {
-		errno = EINVAL;
-		return -1;
-	}
-
-
 	if (!(f->hdrs_capacity - f->hdrs_len)) {
 		size_t capacity = f->hdrs_capacity + HDRINCLEN;
-		h = realloc(f->hdrs, capacity * sizeof(*h));
+		h = frame_realloc(f, f->hdrs, f->hdrs_capacity * sizeof(*h), capacity * sizeof(*h));
 		if (!h) {
 			return -1;
 		}
@@ -355,6 +570,7 @@ int frame_hdr_add(frame_t *f, const char *key, const char *val)
 	}
 
 	h->key_offset = dest - f->buf; 
+	h->key_len = key_len;
 
 	if (!frame_bufcat(f, ":", 1)) {
 		return -1;
@@ -366,6 +582,7 @@ int frame_hdr_add(frame_t *f, const char *key, const char *val)
 	}
 	
 	h->val_offset = dest - f->buf;
+	h->val_len = val_len;
 
 	if (!frame_bufcat(f, "\n", 1)) {
 		return -1;
@@ -396,13 +613,36 @@ int frame_hdrs_add(frame_t *f, size_t hdrc, const struct stomp_hdr *hdrs)
 	return 0;
 }
 
+int frame_hdrs_addn(frame_t *f, size_t hdrc, const struct stomp_hdr *hdrs, const struct stomp_hdr_len *lens)
+{
+	size_t i;
+
+	if (!lens) {
+		return frame_hdrs_add(f, hdrc, hdrs);
+	}
+
+	if (!hdrs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i=0; i < hdrc; i++) {
+		if (frame_hdr_addn(f, hdrs[i].key, lens[i].key_len, hdrs[i].val, lens[i].val_len)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static size_t frame_hdr_get(frame_t *f, const char *key, const char **val)
 {
 	size_t i;
+	size_t key_len = strlen(key);
 	const struct frame_hdr *h;
 	for (i=0; i < f->hdrs_len; i++) {
 		h = &f->hdrs[i];
-		if (!strncmp(key, f->buf + h->key_offset, h->key_len)) {
+		if (h->key_len == key_len && !memcmp(key, f->buf + h->key_offset, key_len)) {
 			*val = f->buf + h->val_offset;
 			return h->val_len; 
 		}
@@ -437,7 +677,7 @@ int frame_body_set(frame_t *f, const void *data, size_t len)
 		return -1;
 	}
 
-	dest = frame_bufcat(f, data, len);
+	dest = frame_bodycat(f, data, len);
 	if (!dest) {
 		return -1;
 	}
@@ -445,7 +685,7 @@ int frame_body_set(frame_t *f, const void *data, size_t len)
 	offset = dest - f->buf;
 
 	/* end of frame */
-	if (!frame_bufcat(f, "\0", 1)) {
+	if (!frame_bodycat(f, "\0", 1)) {
 		return -1;
 	}
 
@@ -455,6 +695,164 @@ int frame_body_set(frame_t *f, const void *data, size_t len)
 	return 0;
 }
 
+static int spill_open(void)
+{
+	char path[] = P_tmpdir "/stomp-XXXXXX";
+	int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("stomp-body", MFD_CLOEXEC);
+	if (fd != -1 || errno != ENOSYS) {
+		return fd;
+	}
+#endif
+
+	fd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		return fd;
+	}
+
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd != -1) {
+		unlink(path);
+	}
+
+	return fd;
+}
+
+static size_t page_round(size_t len)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	return (len + page - 1) / page * page;
+}
+
+/* move the body read so far into a mapped temporary file of at least len bytes */
+static int frame_spill(frame_t *f, size_t len)
+{
+	size_t capacity = page_round(len > f->tmp_len ? len : f->tmp_len + 1);
+	void *map;
+	int fd;
+
+	fd = spill_open();
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (ftruncate(fd, capacity)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (f->limits.spill_huge) {
+		(void)madvise(map, capacity, MADV_HUGEPAGE);
+	}
+#endif
+
+	if (f->tmp_len) {
+		memcpy(map, f->buf + f->tmp_offset, f->tmp_len);
+		f->buf_len = f->tmp_offset;
+	}
+
+	f->spill = map;
+	f->spill_capacity = capacity;
+	f->spill_fd = fd;
+
+	return 0;
+}
+
+/* make room for len more body bytes in the mapping */
+static int frame_spill_reserve(frame_t *f, size_t len)
+{
+	size_t capacity;
+	void *map;
+
+	if (f->limits.frame && f->buf_len + f->tmp_len + len > f->limits.frame) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (f->spill_capacity - f->tmp_len >= len) {
+		return 0;
+	}
+
+	capacity = page_round(f->spill_capacity * 2 > f->tmp_len + len ? f->spill_capacity * 2 : f->tmp_len + len);
+	if (ftruncate(f->spill_fd, capacity)) {
+		return -1;
+	}
+
+	/* pages are moved, not copied */
+	map = mremap(f->spill, f->spill_capacity, capacity, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	f->spill = map;
+	f->spill_capacity = capacity;
+
+	return 0;
+}
+
+/* spill a body announced to be larger than the threshold right away */
+static int frame_spill_early(frame_t *f)
+{
+	size_t body_len;
+	const char *l;
+
+	if (!f->limits.spill || !frame_hdr_get(f, "content-length", &l) || 
+	    parse_content_length(l, &body_len) || body_len <= f->limits.spill) {
+		return 0;
+	}
+
+	if (frame_spill(f, body_len + 1)) {
+		return -1;
+	}
+
+	f->spill_expect = body_len;
+
+	return 0;
+}
+
+/* read the announced body straight into the mapping */
+static int frame_spill_read(int fd, frame_t *f)
+{
+	ssize_t n;
+
+	while (f->tmp_len < f->spill_expect) {
+		if (frame_spill_reserve(f, f->spill_expect - f->tmp_len)) {
+			return -1;
+		}
+
+		n = io_read(f->io, fd, f->spill + f->tmp_len, f->spill_expect - f->tmp_len);
+		if (f->stats) {
+			STATS_ADD(f->stats->reads, 1);
+		}
+		if (n <= 0) {
+			if (!n) {
+				errno = ECONNRESET;
+			}
+			return -1;
+		}
+
+		f->tmp_len += n;
+	}
+
+	return 0;
+}
+
+/* the file holds the body followed by a '\0', nothing more */
+static int frame_spill_done(frame_t *f)
+{
+	return ftruncate(f->spill_fd, f->tmp_len);
+}
+
 static enum read_state frame_read_body(frame_t *f, char c) 
 {
 	void *tmp;
@@ -462,13 +860,25 @@ static enum read_state frame_read_body(frame_t *f, char c)
 	size_t body_len;
 	const char *l;
 
-	tmp = frame_bufcat(f, &c, 1);
-	if (!tmp) {
+	/* a body growing past the threshold moves to a file */
+	if (!f->spill && f->limits.spill && f->tmp_len >= f->limits.spill && frame_spill(f, f->tmp_len * 2)) {
 		return RS_ERR;
 	}
 
-	if (!f->tmp_offset) {
-		f->tmp_offset = tmp - f->buf;
+	if (f->spill) {
+		if (frame_spill_reserve(f, 1)) {
+			return RS_ERR;
+		}
+		((char *)f->spill)[f->tmp_len] = c;
+	} else {
+		tmp = frame_bodycat(f, &c, 1);
+		if (!tmp) {
+			return RS_ERR;
+		}
+
+		if (!f->tmp_offset) {
+			f->tmp_offset = tmp - f->buf;
+		}
 	}
 
 	f->tmp_len += 1;
@@ -483,28 +893,53 @@ static enum read_state frame_read_body(frame_t *f, char c)
 	if (!frame_hdr_get(f, "content-length", &l) || parse_content_length(l, &body_len) || f->tmp_len >= body_len){
 		f->body_offset = f->tmp_offset;
 		f->body_len = f->tmp_len - 1; /* skip last '\0' */
+		if (f->spill && frame_spill_done(f)) {
+			return RS_ERR;
+		}
 		return RS_DONE;
 	}
 
 	return state;
 } 
 
+/* close the frame */
+static int frame_close(frame_t *f)
+{
+	if (!f->body_offset) {
+		if (!frame_bufcat(f, "\n\0", 2)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+ssize_t frame_data(frame_t *f, const void **data)
+{
+	if (frame_close(f)) {
+		return -1;
+	}
+
+	*data = f->buf;
+	return f->buf_len;
+}
+
 ssize_t frame_write(int fd, frame_t *f) 
 {
 	size_t left; 
 	ssize_t n;
 	ssize_t total = 0;
 
-	/* close the frame */
-	if (!f->body_offset) {
-		if (!frame_bufcat(f, "\n\0", 2)) {
-			return -1;
-		}
+	if (frame_close(f)) {
+		return -1;
 	}
 
 	left = f->buf_len; 
 	while(total < f->buf_len) {
-		n = write(fd, f->buf+total, left);
+		n = io_write(f->io, fd, f->buf+total, left);
+		if (f->stats) {
+			STATS_ADD(f->stats->writes, 1);
+		}
 		if (n == -1) {
 			return -1;
 		}
@@ -544,6 +979,14 @@ static enum read_state frame_read_init(frame_t *f, char c)
 	return state;
 } 
 
+/* header slots are not cleared on reset, clear the next one before it is parsed into */
+static void frame_hdr_clear(frame_t *f)
+{
+	if (f->hdrs_len < f->hdrs_capacity) {
+		memset(&f->hdrs[f->hdrs_len], 0, sizeof(*f->hdrs));
+	}
+}
+
 static enum read_state frame_read_cmd(frame_t *f, char c) 
 {
 	enum read_state state = f->read_state;
@@ -564,6 +1007,7 @@ static enum read_state frame_read_cmd(frame_t *f, char c)
 				{
 					f->cmd_offset = f->tmp_offset;
 					f->cmd_len = f->tmp_len;
+					frame_hdr_clear(f);
 					state = RS_HDR;
 					f->tmp_offset = 0;
 					f->tmp_len = 0;
@@ -581,6 +1025,25 @@ static enum read_state frame_read_cmd(frame_t *f, char c)
 	return state;
 } 
 
+/* the header being read would exceed the limit with one more byte */
+static int frame_hdr_too_long(frame_t *f, const struct frame_hdr *h)
+{
+	return f->limits.hdr && h->key_len + f->tmp_len >= f->limits.hdr;
+}
+
+/* the announced body would not fit the frame size limit */
+static int frame_body_too_long(frame_t *f)
+{
+	size_t body_len;
+	const char *l;
+
+	if (!f->limits.frame || !frame_hdr_get(f, "content-length", &l) || parse_content_length(l, &body_len)) {
+		return 0;
+	}
+
+	return body_len > f->limits.frame || f->buf_len > f->limits.frame - body_len;
+}
+
 static enum read_state frame_read_hdr(frame_t *f, char c) 
 {
 	struct frame_hdr *h;
@@ -590,7 +1053,7 @@ static enum read_state frame_read_hdr(frame_t *f, char c)
 	
 	if (!(f->hdrs_capacity - count)) {
 		size_t capacity = f->hdrs_capacity + HDRINCLEN;
-		h = realloc(f->hdrs, capacity * sizeof(*h));
+		h = frame_realloc(f, f->hdrs, f->hdrs_capacity * sizeof(*h), capacity * sizeof(*h));
 		if (!h) {
 			return RS_ERR;
 		}
@@ -620,16 +1083,25 @@ static enum read_state frame_read_hdr(frame_t *f, char c)
 			}
 			break;
 		case '\n':
-			if (h->key_len) {
+			if (h->key_len && f->limits.hdrs && f->hdrs_len == f->limits.hdrs) {
+				errno = EMSGSIZE;
+				state = RS_ERR;
+			} else if (h->key_len) {
 				if (!frame_bufcat(f, "\0", 1)) {
 					state = RS_ERR;
 				} else {
 					h->val_offset = f->tmp_offset;
 					h->val_len = f->tmp_len;
 					f->hdrs_len += 1;
+					frame_hdr_clear(f);
 					f->tmp_offset = 0;
 					f->tmp_len = 0;
 				}
+			} else if (frame_body_too_long(f)) {
+				errno = EMSGSIZE;
+				state = RS_ERR;
+			} else if (frame_spill_early(f)) {
+				state = RS_ERR;
 			} else {
 				state = RS_BODY;
 			} 
@@ -638,6 +1110,12 @@ static enum read_state frame_read_hdr(frame_t *f, char c)
 				state = RS_HDR_ESC;
 			break;
 		default:
+			if (frame_hdr_too_long(f, h)) {
+				errno = EMSGSIZE;
+				state = RS_ERR;
+				break;
+			}
+
 			tmp = frame_bufcat(f, &c, 1);
 			if (!tmp) {
 				state = RS_ERR;
@@ -657,6 +1135,11 @@ static enum read_state frame_read_hdr_esc(frame_t *f, char c)
 	char *buf;
 	void *tmp;
 	
+	if (frame_hdr_too_long(f, &f->hdrs[f->hdrs_len])) {
+		errno = EMSGSIZE;
+		return RS_ERR;
+	}
+
 	if (c == 'r') {
 		buf = "\r";
 	} else if (c == 'n') {
@@ -686,10 +1169,26 @@ static enum read_state frame_read_hdr_esc(frame_t *f, char c)
 int frame_read(int fd, frame_t *f)
 {
 	char c = 0;
+	ssize_t n;
 	
 	while (f->read_state != RS_ERR && f->read_state != RS_DONE) {
 
-		if(read(fd, &c, sizeof(char)) != sizeof(char)) {
+		if (f->read_state == RS_BODY && f->tmp_len < f->spill_expect) {
+			if (frame_spill_read(fd, f)) {
+				return -1;
+			}
+			continue;
+		}
+
+		n = io_read(f->io, fd, &c, sizeof(char));
+		if (f->stats) {
+			STATS_ADD(f->stats->reads, 1);
+		}
+		if (n != sizeof(char)) {
+			/* the peer closed the connection */
+			if (!n) {
+				errno = ECONNRESET;
+			}
 			return -1;
 		}
 
@@ -746,7 +1245,7 @@ size_t frame_hdrs_get(frame_t *f, const struct stomp_hdr **hdrs)
 	}
 
 	if (f->hdrs_len > f->stomp_hdrs_capacity) {
-		h = realloc(f->stomp_hdrs, f->hdrs_len * sizeof(*h));
+		h = frame_realloc(f, f->stomp_hdrs, f->stomp_hdrs_capacity * sizeof(*h), f->hdrs_len * sizeof(*h));
 		if (!h) {
 			return -1;
 		}
@@ -773,7 +1272,12 @@ size_t frame_body_get(frame_t *f, const void **body)
 		return 0;
 	}
 
-	*body = f->buf + f->body_offset;
+	*body = f->spill ? f->spill : f->buf + f->body_offset;
 	return f->body_len;
 }
 
+int frame_body_fd(frame_t *f)
+{
+	return f->spill ? f->spill_fd : -1;
+}
+
@@ -21,18 +21,33 @@
 
 typedef struct _frame frame_t;
 
+struct io;
+
 frame_t *frame_new();
+frame_t *frame_new_with(const struct stomp_allocator *a);
 void frame_free(frame_t *f);
 void frame_reset(frame_t *f);
 int frame_cmd_set(frame_t *f, const char *cmd);
 int frame_hdr_add(frame_t *f, const char *key, const char *val);
 int frame_hdrs_add(frame_t *f, size_t hdrc, const struct stomp_hdr *hdrs);
+/* as above with the lengths known, lens may be NULL */
+int frame_hdr_addn(frame_t *f, const char *key, size_t key_len, const char *val, size_t val_len);
+int frame_hdrs_addn(frame_t *f, size_t hdrc, const struct stomp_hdr *hdrs, const struct stomp_hdr_len *lens);
 int frame_body_set(frame_t *f, const void *body, size_t len);
 ssize_t frame_write(int fd, frame_t *f);
+ssize_t frame_data(frame_t *f, const void **data);
 
 size_t frame_cmd_get(frame_t *f, const char **cmd);
 size_t frame_hdrs_get(frame_t *f, const struct stomp_hdr **hdrs);
 size_t frame_body_get(frame_t *f, const void **body);
+int frame_body_fd(frame_t *f);
 int frame_read(int fd, frame_t *f);
 
+void frame_limits_set(frame_t *f, const struct stomp_limits *l);
+void frame_stats_set(frame_t *f, struct stomp_stats *st);
+void frame_io_set(frame_t *f, const struct io *io);
+size_t frame_len(frame_t *f);
+size_t frame_held(frame_t *f);
+int frame_trim(frame_t *f, size_t keep);
+
 #endif /* FRAME_H */
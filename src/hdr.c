@@ -15,8 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "hdr.h"
+#include "alloc.h"
 
 const char *hdr_get(size_t count, const struct stomp_hdr *hdrs, const char *key)
 {
@@ -31,3 +33,39 @@ const char *hdr_get(size_t count, const struct stomp_hdr *hdrs, const char *key)
 
 	return NULL;
 }
+
+struct stomp_hdr *hdr_dup(const struct stomp_allocator *a, size_t count, const struct stomp_hdr *hdrs)
+{
+	size_t i;
+	size_t len;
+	size_t key_len;
+	size_t val_len;
+	char *p;
+	struct stomp_hdr *dup;
+
+	/* one allocation for the array and the strings */
+	len = count * sizeof(*hdrs);
+	for (i=0; i < count; i++) {
+		len += strlen(hdrs[i].key) + strlen(hdrs[i].val) + 2;
+	}
+
+	dup = alloc_malloc(a, len ? len : 1);
+	if (!dup) {
+		return NULL;
+	}
+
+	p = (char *)&dup[count];
+	for (i=0; i < count; i++) {
+		key_len = strlen(hdrs[i].key) + 1;
+		memcpy(p, hdrs[i].key, key_len);
+		dup[i].key = p;
+		p += key_len;
+
+		val_len = strlen(hdrs[i].val) + 1;
+		memcpy(p, hdrs[i].val, val_len);
+		dup[i].val = p;
+		p += val_len;
+	}
+
+	return dup;
+}
@@ -20,6 +20,7 @@
 #include "stomp.h"
 
 const char *hdr_get(size_t count, const struct stomp_hdr *hdrs, const char *key);
+struct stomp_hdr *hdr_dup(const struct stomp_allocator *a, size_t count, const struct stomp_hdr *hdrs);
 
 
 #endif /* HDR_H */
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "hist.h"
+
+#define HISTSUB (1ULL << HISTSUBBITS)
+
+static size_t hist_bucket(unsigned long long ns)
+{
+	unsigned int e;
+
+	if (ns < HISTSUB) {
+		return ns;
+	}
+
+	e = 63 - __builtin_clzll(ns);
+	if (e > HISTMAXEXP) {
+		return HISTBUCKETS - 1;
+	}
+
+	return ((e - HISTSUBBITS + 1) << HISTSUBBITS) + ((ns >> (e - HISTSUBBITS)) & (HISTSUB - 1));
+}
+
+/* highest value falling into bucket i */
+static unsigned long long hist_value(size_t i)
+{
+	unsigned int shift;
+
+	if (i < HISTSUB) {
+		return i;
+	}
+
+	shift = (i >> HISTSUBBITS) - 1;
+
+	return ((HISTSUB + (i & (HISTSUB - 1))) << shift) + (1ULL << shift) - 1;
+}
+
+void hist_record(struct hist *h, unsigned long long ns)
+{
+	unsigned long long cur;
+
+	__atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+
+	/* min is kept plus one, so that 0 means no samples */
+	cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+	while ((!cur || ns + 1 < cur) && 
+	       !__atomic_compare_exchange_n(&h->min, &cur, ns + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (ns > cur && 
+	       !__atomic_compare_exchange_n(&h->max, &cur, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+static unsigned long long hist_percentile(const unsigned long long *buckets, unsigned long long count, 
+		unsigned long long max, double p)
+{
+	unsigned long long rank = (unsigned long long)(p / 100.0 * count + 0.5);
+	unsigned long long seen = 0;
+	unsigned long long v;
+	size_t i;
+
+	if (!rank) {
+		rank = 1;
+	}
+
+	for (i = 0; i < HISTBUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	v = hist_value(i < HISTBUCKETS ? i : HISTBUCKETS - 1);
+
+	return v < max ? v : max;
+}
+
+void hist_read(struct hist *h, struct stomp_latency *l, int reset)
+{
+	unsigned long long buckets[HISTBUCKETS];
+	unsigned long long count = 0;
+	unsigned long long sum;
+	unsigned long long min;
+	size_t i;
+
+	memset(l, 0, sizeof(*l));
+
+	for (i = 0; i < HISTBUCKETS; i++) {
+		buckets[i] = reset ? __atomic_exchange_n(&h->buckets[i], 0, __ATOMIC_RELAXED) : 
+				     __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+
+	if (reset) {
+		sum = __atomic_exchange_n(&h->sum, 0, __ATOMIC_RELAXED);
+		min = __atomic_exchange_n(&h->min, 0, __ATOMIC_RELAXED);
+		l->max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+	} else {
+		sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+		l->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	}
+
+	if (!count) {
+		memset(l, 0, sizeof(*l));
+		return;
+	}
+
+	l->count = count;
+	l->min = min ? min - 1 : 0;
+	l->mean = sum / count;
+	l->p50 = hist_percentile(buckets, count, l->max, 50);
+	l->p90 = hist_percentile(buckets, count, l->max, 90);
+	l->p99 = hist_percentile(buckets, count, l->max, 99);
+	l->p999 = hist_percentile(buckets, count, l->max, 99.9);
+}
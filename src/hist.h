@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HIST_H
+#define HIST_H
+
+#include "stomp.h"
+
+/* 
+ * Log-linear latency histogram in the manner of HdrHistogram. 
+ *
+ * Values below 2^HISTSUBBITS nanoseconds get a bucket each, above that 
+ * every power of two is split into 2^HISTSUBBITS buckets, which keeps 
+ * the error of a reported value within 1/2^HISTSUBBITS (about 6%). 
+ * Values of 2^HISTMAXEXP nanoseconds (about 18 minutes) and more share the last bucket.
+ *
+ * hist_record() is called by the thread running the session, hist_read()
+ * from any thread. Buckets are updated atomically, so reading with reset 
+ * moves every sample to exactly one interval.
+ */
+#define HISTSUBBITS 4
+#define HISTMAXEXP 40
+#define HISTBUCKETS ((HISTMAXEXP - HISTSUBBITS + 2) << HISTSUBBITS)
+
+struct hist {
+	unsigned long long buckets[HISTBUCKETS];
+	unsigned long long sum;
+	unsigned long long min; /* 0 if there are no samples */
+	unsigned long long max;
+};
+
+void hist_record(struct hist *h, unsigned long long ns);
+void hist_read(struct hist *h, struct stomp_latency *l, int reset);
+
+#endif /* HIST_H */
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IO_H
+#define IO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stomp.h"
+
+/*
+ * Byte stream of a broker connection: a transport and its ctx.
+ *
+ * Frames without one, in the tests, read and write fd directly.
+ */
+struct io {
+	const struct stomp_transport *t; /* NULL while not connected */
+	void *ctx;
+};
+
+/* read(2) and write(2) through io, or on fd if io is NULL */
+#define io_read(io, fd, buf, len) ((io) ? \
+	(io)->t->readv((io)->ctx, &(struct iovec){(buf), (len)}, 1) : read((fd), (buf), (len)))
+#define io_write(io, fd, buf, len) ((io) ? \
+	(io)->t->writev((io)->ctx, &(struct iovec){(void *)(buf), (len)}, 1) : write((fd), (buf), (len)))
+
+/* bytes io can read without the fd polling readable */
+#define io_pending(io) ((io)->t && (io)->t->pending ? (io)->t->pending((io)->ctx) : 0)
+
+#endif /* IO_H */
@@ -0,0 +1,421 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "stomp.h"
+#include "alloc.h"
+
+/* min number of bytes to grow a buffer by */
+#define MEMINCLEN 4096
+
+/* bytes sendfile() reads from the file at a time */
+#define MEMFILELEN 16384
+
+struct mem_pair;
+
+struct stomp_mem {
+	struct mem_pair *pair;
+	struct stomp_mem *peer;
+	char *buf; /* bytes written by the peer, not read yet */
+	size_t off;
+	size_t len;
+	size_t cap;
+	size_t chunk; /* max bytes per read, 0 for no limit */
+	int efd; /* readable while the end is */
+	int signalled; /* efd is readable */
+	int closed;
+};
+
+struct mem_pair {
+	pthread_mutex_t lock; /* everything of both ends */
+	pthread_cond_t cond; /* something to read at either end */
+	struct stomp_mem ends[2];
+	int refs; /* ends not freed yet */
+};
+
+/* make the eventfd of m readable if a read would not block, and not otherwise;
+ * call with the lock held */
+static void mem_signal(struct stomp_mem *m)
+{
+	int readable = m->len || m->closed || m->peer->closed;
+	eventfd_t v;
+
+	if (readable && !m->signalled) {
+		(void)eventfd_write(m->efd, 1);
+		m->signalled = 1;
+	} else if (!readable && m->signalled) {
+		(void)eventfd_read(m->efd, &v);
+		m->signalled = 0;
+	}
+}
+
+/* append to what m has to read; call with the lock held */
+static int mem_push(struct stomp_mem *m, const void *buf, size_t len)
+{
+	size_t cap;
+	char *tmp;
+
+	if (m->cap - m->off - m->len < len && m->off) {
+		memmove(m->buf, m->buf + m->off, m->len);
+		m->off = 0;
+	}
+
+	if (m->cap - m->len < len) {
+		cap = m->cap * 2;
+		if (cap < m->len + len + MEMINCLEN) {
+			cap = m->len + len + MEMINCLEN;
+		}
+
+		tmp = alloc_realloc(NULL, m->buf, cap);
+		if (!tmp) {
+			return -1;
+		}
+
+		m->buf = tmp;
+		m->cap = cap;
+	}
+
+	memcpy(m->buf + m->off + m->len, buf, len);
+	m->len += len;
+
+	return 0;
+}
+
+/* move at most max bytes into iov; call with the lock held */
+static size_t mem_pull(struct stomp_mem *m, const struct iovec *iov, int iovcnt, size_t max)
+{
+	size_t total = 0;
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && m->len && total < max; i++) {
+		n = iov[i].iov_len;
+		if (n > m->len) {
+			n = m->len;
+		}
+		if (n > max - total) {
+			n = max - total;
+		}
+
+		memcpy(iov[i].iov_base, m->buf + m->off, n);
+		m->off += n;
+		m->len -= n;
+		total += n;
+	}
+
+	if (!m->len) {
+		m->off = 0;
+	}
+
+	return total;
+}
+
+static ssize_t mem_readv_locked(struct stomp_mem *m, const struct iovec *iov, int iovcnt)
+{
+	size_t n;
+
+	if (m->closed) {
+		errno = EBADF;
+		return -1;
+	}
+
+	n = mem_pull(m, iov, iovcnt, m->chunk ? m->chunk : (size_t)-1);
+	mem_signal(m);
+
+	return n;
+}
+
+static ssize_t mem_writev_locked(struct stomp_mem *m, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+
+	if (m->closed) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (m->peer->closed) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (mem_push(m->peer, iov[i].iov_base, iov[i].iov_len)) {
+			break;
+		}
+		total += iov[i].iov_len;
+	}
+
+	if (total) {
+		mem_signal(m->peer);
+		pthread_cond_broadcast(&m->pair->cond);
+	} else if (i < iovcnt) {
+		return -1;
+	}
+
+	return total;
+}
+
+static int mem_connect(void *ctx, const char *host, const char *service, unsigned long timeout)
+{
+	struct stomp_mem *m = ctx;
+	int r = 0;
+
+	pthread_mutex_lock(&m->pair->lock);
+	if (m->closed || m->peer->closed) {
+		errno = ECONNREFUSED;
+		r = -1;
+	}
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return r;
+}
+
+/* blocks until there is something to read, like a socket */
+static ssize_t mem_readv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct stomp_mem *m = ctx;
+	ssize_t n;
+
+	pthread_mutex_lock(&m->pair->lock);
+	while (!m->len && !m->closed && !m->peer->closed) {
+		pthread_cond_wait(&m->pair->cond, &m->pair->lock);
+	}
+	n = mem_readv_locked(m, iov, iovcnt);
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return n;
+}
+
+static ssize_t mem_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct stomp_mem *m = ctx;
+	ssize_t n;
+
+	pthread_mutex_lock(&m->pair->lock);
+	n = mem_writev_locked(m, iov, iovcnt);
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return n;
+}
+
+static ssize_t mem_sendfile(void *ctx, int in_fd, off_t *offset, size_t count)
+{
+	char buf[MEMFILELEN];
+	struct iovec iov = {buf, 0};
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < count) {
+		iov.iov_len = count - total < sizeof(buf) ? count - total : sizeof(buf);
+		n = offset ? pread(in_fd, buf, iov.iov_len, *offset) : read(in_fd, buf, iov.iov_len);
+		if (n <= 0) {
+			break;
+		}
+
+		iov.iov_len = n;
+		if (mem_writev(ctx, &iov, 1) < 0) {
+			break;
+		}
+
+		if (offset) {
+			*offset += n;
+		}
+		total += n;
+	}
+
+	return total || !count ? (ssize_t)total : -1;
+}
+
+static size_t mem_pending(void *ctx)
+{
+	struct stomp_mem *m = ctx;
+	size_t n;
+
+	pthread_mutex_lock(&m->pair->lock);
+	n = m->len;
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return n;
+}
+
+static int mem_fd(void *ctx)
+{
+	struct stomp_mem *m = ctx;
+
+	return m->efd;
+}
+
+static void mem_close(void *ctx)
+{
+	stomp_mem_close(ctx);
+}
+
+static const struct stomp_transport mem_transport = {
+	.connect = mem_connect,
+	.readv = mem_readv,
+	.writev = mem_writev,
+	.sendfile = mem_sendfile,
+	.pending = mem_pending,
+	.fd = mem_fd,
+	.close = mem_close,
+};
+
+const struct stomp_transport *stomp_mem_transport(void)
+{
+	return &mem_transport;
+}
+
+int stomp_mem_pair(stomp_mem_t *ends[2])
+{
+	struct mem_pair *p;
+	int mutex = 0; /* p->lock was initialized */
+	int err;
+	int i;
+
+	p = alloc_calloc(NULL, 1, sizeof(*p));
+	if (!p) {
+		return -1;
+	}
+
+	p->ends[0].efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	p->ends[1].efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (p->ends[0].efd == -1 || p->ends[1].efd == -1) {
+		err = errno;
+		goto stomp_mem_pair_error;
+	}
+
+	/* these return the error instead of setting errno */
+	err = pthread_mutex_init(&p->lock, NULL);
+	if (err) {
+		goto stomp_mem_pair_error;
+	}
+	mutex = 1;
+
+	err = pthread_cond_init(&p->cond, NULL);
+	if (err) {
+		goto stomp_mem_pair_error;
+	}
+
+	for (i = 0; i < 2; i++) {
+		p->ends[i].pair = p;
+		p->ends[i].peer = &p->ends[!i];
+		ends[i] = &p->ends[i];
+	}
+	p->refs = 2;
+
+	return 0;
+
+stomp_mem_pair_error:
+
+	if (mutex) {
+		pthread_mutex_destroy(&p->lock);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (p->ends[i].efd != -1) {
+			(void)close(p->ends[i].efd);
+		}
+	}
+
+	alloc_free(NULL, p);
+	errno = err;
+	return -1;
+}
+
+void stomp_mem_free(stomp_mem_t *m)
+{
+	struct mem_pair *p;
+	int refs;
+
+	if (!m) {
+		return;
+	}
+
+	stomp_mem_close(m);
+
+	p = m->pair;
+	pthread_mutex_lock(&p->lock);
+	alloc_free(NULL, m->buf);
+	m->buf = NULL;
+	refs = --p->refs;
+	pthread_mutex_unlock(&p->lock);
+
+	if (refs) {
+		return;
+	}
+
+	(void)close(p->ends[0].efd);
+	(void)close(p->ends[1].efd);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	alloc_free(NULL, p);
+}
+
+ssize_t stomp_mem_write(stomp_mem_t *m, const void *buf, size_t len)
+{
+	struct iovec iov = {(void *)buf, len};
+
+	return mem_writev(m, &iov, 1);
+}
+
+ssize_t stomp_mem_read(stomp_mem_t *m, void *buf, size_t len)
+{
+	struct iovec iov = {buf, len};
+	ssize_t n;
+
+	pthread_mutex_lock(&m->pair->lock);
+	if (!m->len && !m->closed && !m->peer->closed) {
+		errno = EAGAIN;
+		n = -1;
+	} else {
+		n = mem_readv_locked(m, &iov, 1);
+	}
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return n;
+}
+
+int stomp_mem_chunk_set(stomp_mem_t *m, size_t chunk)
+{
+	pthread_mutex_lock(&m->pair->lock);
+	m->chunk = chunk;
+	pthread_mutex_unlock(&m->pair->lock);
+
+	return 0;
+}
+
+void stomp_mem_close(stomp_mem_t *m)
+{
+	pthread_mutex_lock(&m->pair->lock);
+	if (!m->closed) {
+		m->closed = 1;
+		m->off = 0;
+		m->len = 0;
+		mem_signal(m);
+		mem_signal(m->peer);
+		pthread_cond_broadcast(&m->pair->cond);
+	}
+	pthread_mutex_unlock(&m->pair->lock);
+}
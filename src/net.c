@@ -0,0 +1,349 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "net.h"
+#include "io.h"
+
+/* max number of addresses raced */
+#define MAXATTEMPTS 16
+
+static long long now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* preferred first, then alternate between the address families 
+ * starting with the family of the first address (RFC 8305, section 4) */
+static size_t order(struct addrinfo *addrs, struct addrinfo *preferred, struct addrinfo **out, size_t len)
+{
+	struct addrinfo *first[MAXATTEMPTS];
+	struct addrinfo *other[MAXATTEMPTS];
+	struct addrinfo *rp;
+	size_t first_len = 0;
+	size_t other_len = 0;
+	size_t i = 0;
+	size_t j = 0;
+	size_t n = 0;
+	int family;
+	int other_turn;
+
+	if (preferred) {
+		out[n++] = preferred;
+	}
+
+	family = preferred ? preferred->ai_family : addrs->ai_family;
+	for (rp = addrs; rp; rp = rp->ai_next) {
+		if (rp == preferred) {
+			continue;
+		}
+
+		if (rp->ai_family == family && first_len < MAXATTEMPTS) {
+			first[first_len++] = rp;
+		} else if (rp->ai_family != family && other_len < MAXATTEMPTS) {
+			other[other_len++] = rp;
+		}
+	}
+
+	/* the preferred address took the first turn of its family already */
+	other_turn = preferred != NULL;
+	while (n < len && (i < first_len || j < other_len)) {
+		if ((other_turn && j < other_len) || i == first_len) {
+			out[n++] = other[j++];
+		} else {
+			out[n++] = first[i++];
+		}
+
+		other_turn = !other_turn;
+	}
+
+	return n;
+}
+
+/* start a non-blocking connect. returns the socket or -1, *done is set if it connected already */
+static int attempt(struct addrinfo *rp, int *done)
+{
+	int fd;
+	int err;
+
+	fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+	if (fd == -1) {
+		return -1;
+	}
+
+	*done = !connect(fd, rp->ai_addr, rp->ai_addrlen);
+	if (!*done && errno != EINPROGRESS) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+int net_dial(struct addrinfo *addrs, struct addrinfo *preferred, unsigned long timeout, struct addrinfo **used)
+{
+	struct addrinfo *candidates[MAXATTEMPTS];
+	struct pollfd pfds[MAXATTEMPTS];
+	size_t len;
+	size_t started = 0;
+	size_t active = 0;
+	size_t i;
+	int winner = -1;
+	int done;
+	int err = ECONNREFUSED;
+	int fd;
+	int r;
+	int so_err;
+	int wait;
+	socklen_t err_len;
+	long long now;
+	long long deadline;
+	long long next = 0;
+
+	if (!addrs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = order(addrs, preferred, candidates, MAXATTEMPTS);
+	deadline = now_ms() + timeout;
+
+	while (winner < 0) {
+		now = now_ms();
+		if (timeout && now >= deadline) {
+			err = ETIMEDOUT;
+			break;
+		}
+
+		if (started < len && (now >= next || !active)) {
+			fd = attempt(candidates[started], &done);
+			pfds[started].fd = fd;
+			pfds[started].events = POLLOUT;
+			pfds[started].revents = 0;
+			if (fd == -1) {
+				err = errno;
+			} else if (done) {
+				winner = started;
+			} else {
+				active++;
+			}
+
+			started++;
+			next = now + NETATTEMPTDELAY;
+			continue;
+		}
+
+		if (!active) {
+			break;
+		}
+
+		wait = -1;
+		if (started < len) {
+			wait = next - now;
+		}
+
+		if (timeout && (wait < 0 || deadline - now < wait)) {
+			wait = deadline - now;
+		}
+
+		r = poll(pfds, started, wait);
+		if (r < 0 && errno != EINTR) {
+			err = errno;
+			break;
+		}
+
+		for (i = 0; r > 0 && i < started; i++) {
+			if (pfds[i].fd == -1 || !pfds[i].revents) {
+				continue;
+			}
+
+			err_len = sizeof(so_err);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &so_err, &err_len)) {
+				so_err = errno;
+			}
+
+			if (!so_err) {
+				winner = i;
+				break;
+			}
+
+			err = so_err;
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			active--;
+			/* no point in waiting for the delay to pass */
+			next = now;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		if ((int)i != winner && pfds[i].fd != -1) {
+			close(pfds[i].fd);
+		}
+	}
+
+	if (winner < 0) {
+		errno = err;
+		return -1;
+	}
+
+	fd = pfds[winner].fd;
+	/* the rest of the library does blocking io */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	*used = candidates[winner];
+
+	return fd;
+}
+
+int net_dial_unix(const char *path, unsigned long timeout, int passcred)
+{
+	struct sockaddr_un un;
+	struct timeval tv;
+	size_t len = strlen(path);
+	int on = 1;
+	int err;
+	int fd;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (len > sizeof(un.sun_path) || (len == sizeof(un.sun_path) && path[0] != '@')) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	memcpy(un.sun_path, path, len);
+	/* abstract names are not NUL terminated, their length is part of the name */
+	if (path[0] == '@') {
+		un.sun_path[0] = '\0';
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	/* connect() blocks for SO_SNDTIMEO at most while the backlog of the broker is full */
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if ((passcred && setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on))) ||
+	    (timeout && setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))) {
+		goto fail;
+	}
+
+	if (connect(fd, (struct sockaddr *)&un, offsetof(struct sockaddr_un, sun_path) + len)) {
+		if (errno == EAGAIN) {
+			errno = ETIMEDOUT;
+		}
+		goto fail;
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	if (timeout && setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+ssize_t net_write(const struct io *io, int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+	size_t total = 0;
+
+	while (total < len) {
+		n = io_write(io, fd, (const char *)buf + total, len - total);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		total += n;
+	}
+
+	return total;
+}
+
+static ssize_t sock_readv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	return readv(*(int *)ctx, iov, iovcnt);
+}
+
+static ssize_t sock_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	return writev(*(int *)ctx, iov, iovcnt);
+}
+
+static ssize_t sock_sendfile(void *ctx, int in_fd, off_t *offset, size_t count)
+{
+	return sendfile(*(int *)ctx, in_fd, offset, count);
+}
+
+static int sock_fd(void *ctx)
+{
+	return *(int *)ctx;
+}
+
+static void sock_close(void *ctx)
+{
+	(void)close(*(int *)ctx);
+}
+
+/* connected by the session itself, from net_dial() or net_dial_unix() */
+const struct stomp_transport net_sock = {
+	.readv = sock_readv,
+	.writev = sock_writev,
+	.sendfile = sock_sendfile,
+	.fd = sock_fd,
+	.close = sock_close,
+};
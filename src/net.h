@@ -0,0 +1,54 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NET_H
+#define NET_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* 
+ * Connection establishment. 
+ *
+ * Candidate addresses are raced per RFC 8305 (Happy Eyeballs v2): 
+ * address families are interleaved and a new non-blocking attempt is 
+ * started every NETATTEMPTDELAY milliseconds, or as soon as the previous 
+ * one fails, until one of them connects. 
+ */
+
+/* milliseconds to wait for an attempt before starting the next one */
+#define NETATTEMPTDELAY 250
+
+/* connect to one of addrs, preferred first. timeout is in milliseconds, 0 for none. 
+ * returns a blocking socket and stores the address used in *used. */
+int net_dial(struct addrinfo *addrs, struct addrinfo *preferred, unsigned long timeout, struct addrinfo **used);
+
+/* connect to the Unix socket at path, "@name" for the abstract namespace. 
+ * with passcred set every write carries SCM_CREDENTIALS. 
+ * timeout is in milliseconds, 0 for none. returns a blocking socket. */
+int net_dial_unix(const char *path, unsigned long timeout, int passcred);
+
+struct io;
+struct stomp_transport;
+
+/* transport of a socket of the above, ctx points to its fd */
+extern const struct stomp_transport net_sock;
+
+/* write all of buf to a blocking fd, through io unless it is NULL */
+ssize_t net_write(const struct io *io, int fd, const void *buf, size_t len);
+
+#endif /* NET_H */
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "alloc.h"
+
+struct _pool {
+	pthread_mutex_t lock;
+	stomp_message_t *free; /* list of messages ready for reuse */
+	size_t free_len; /* number of messages in the list */
+	size_t max; /* max number of messages kept for reuse */
+	unsigned long refs; /* the owner plus every message handed out */
+	int closed; /* the owner is gone, nothing to recycle for */
+	struct stomp_allocator alloc; /* hooks new frames are allocated with */
+};
+
+static void message_free(stomp_message_t *m)
+{
+	frame_free(m->frame);
+	alloc_free(NULL, m);
+}
+
+static void pool_destroy(pool_t *p)
+{
+	stomp_message_t *m;
+
+	while (p->free) {
+		m = p->free;
+		p->free = m->next;
+		message_free(m);
+	}
+
+	pthread_mutex_destroy(&p->lock);
+	alloc_free(NULL, p);
+}
+
+pool_t *pool_new(size_t max, const struct stomp_allocator *a)
+{
+	pool_t *p = alloc_calloc(NULL, 1, sizeof(*p));
+	if (!p) {
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&p->lock, NULL)) {
+		alloc_free(NULL, p);
+		return NULL;
+	}
+
+	p->max = max;
+	p->refs = 1;
+	p->alloc = *a;
+
+	return p;
+}
+
+void pool_free(pool_t *p)
+{
+	int last;
+
+	pthread_mutex_lock(&p->lock);
+	p->closed = 1;
+	last = !--p->refs;
+	pthread_mutex_unlock(&p->lock);
+
+	if (last) {
+		pool_destroy(p);
+	}
+}
+
+void pool_allocator_set(pool_t *p, const struct stomp_allocator *a)
+{
+	stomp_message_t *m;
+
+	pthread_mutex_lock(&p->lock);
+	p->alloc = *a;
+	/* recycled frames would keep the old hooks */
+	m = p->free;
+	p->free = NULL;
+	p->free_len = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	while (m) {
+		stomp_message_t *next = m->next;
+		message_free(m);
+		m = next;
+	}
+}
+
+size_t pool_held(pool_t *p)
+{
+	stomp_message_t *m;
+	size_t held = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (m = p->free; m; m = m->next) {
+		held += frame_held(m->frame);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return held;
+}
+
+stomp_message_t *pool_get(pool_t *p)
+{
+	struct stomp_allocator a;
+	stomp_message_t *m;
+
+	pthread_mutex_lock(&p->lock);
+	m = p->free;
+	if (m) {
+		p->free = m->next;
+		p->free_len--;
+	}
+	p->refs++;
+	a = p->alloc;
+	pthread_mutex_unlock(&p->lock);
+
+	if (m) {
+		m->next = NULL;
+		m->refs = 1;
+		return m;
+	}
+
+	m = alloc_calloc(NULL, 1, sizeof(*m));
+	if (!m) {
+		goto pool_get_error;
+	}
+
+	m->frame = frame_new_with(&a);
+	if (!m->frame) {
+		alloc_free(NULL, m);
+		goto pool_get_error;
+	}
+
+	m->pool = p;
+	m->refs = 1;
+
+	return m;
+
+pool_get_error:
+
+	pthread_mutex_lock(&p->lock);
+	p->refs--;
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+void pool_put(stomp_message_t *m)
+{
+	pool_t *p = m->pool;
+	int last;
+
+	if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	frame_reset(m->frame);
+
+	pthread_mutex_lock(&p->lock);
+	if (!p->closed && p->free_len < p->max) {
+		m->next = p->free;
+		p->free = m;
+		p->free_len++;
+		m = NULL;
+	}
+	last = !--p->refs;
+	pthread_mutex_unlock(&p->lock);
+
+	if (m) {
+		message_free(m);
+	}
+
+	if (last) {
+		pool_destroy(p);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+/* 
+ * Recycling pool of received frames. 
+ * Frames handed out to the client code via stomp_message_retain() 
+ * come back with stomp_message_release(), possibly from another thread. 
+ * The pool lives until the session and every handed out frame are gone.
+ */
+typedef struct _pool pool_t;
+
+struct _stomp_message {
+	frame_t *frame;
+	pool_t *pool; /* pool the message returns to */
+	struct _stomp_message *next; /* free list link */
+	unsigned long refs; /* atomic, holders of the message */
+};
+
+pool_t *pool_new(size_t max, const struct stomp_allocator *a);
+void pool_free(pool_t *p);
+stomp_message_t *pool_get(pool_t *p);
+void pool_put(stomp_message_t *m);
+void pool_allocator_set(pool_t *p, const struct stomp_allocator *a);
+size_t pool_held(pool_t *p);
+
+#endif /* POOL_H */
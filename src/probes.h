@@ -0,0 +1,57 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes, provider "stomp", built in with ./configure --enable-usdt.
+ *
+ * A probe is a single nop until a tracer attaches to it, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libstomp.so:stomp:dispatch { @[arg1] = hist(arg2); }'
+ *
+ * Without --enable-usdt the macros expand to nothing and their
+ * arguments are not evaluated. The first argument is always the session.
+ * cmd is an enum stomp_stats_cmd, durations are in nanoseconds.
+ *
+ *   frame__read__start(s)
+ *   frame__read__end(s, cmd, bytes)        a frame or heart-beat was received
+ *   frame__write(s, cmd, bytes)            a frame was written, or corked to be written
+ *   dispatch(s, cmd, ns)                   a received frame went through the callbacks
+ *   user(s, ns)                            SCB_USER was called
+ *   heartbeat__sent(s)
+ *   heartbeat__received(s)
+ *   heartbeat__missed(s, timeouts)         the broker was silent for one more period
+ *   connect(s, conn_seq)                   a connection to the broker was made
+ *   connected(s, ns)                       CONNECTED arrived ns after CONNECT was sent
+ *   disconnect(s)                          DISCONNECT was sent
+ *   lost(s, err)                           the connection dropped with errno err
+ */
+#ifdef STOMP_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(stomp, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(stomp, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(stomp, name, a, b, c)
+#else
+/* never run, but the arguments still count as used */
+#define PROBE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#endif
+
+#endif /* PROBES_H */
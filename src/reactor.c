@@ -0,0 +1,716 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "stomp.h"
+#include "session.h"
+#include "alloc.h"
+
+/* max number of events fetched by a single epoll_wait() */
+#define MAXEVENTS 64
+
+/* number of sessions to add to shard->sessions when full */
+#define SESSIONSINCLEN 16
+
+enum reactor_op {
+	ROP_ADD,
+	ROP_SEND
+};
+
+/* a request handed to the thread owning the session */
+struct reactor_msg {
+	struct reactor_msg *next;
+	enum reactor_op op;
+	stomp_session_t *session;
+	size_t hdrc;
+	struct stomp_hdr *hdrs;
+	void *body;
+	size_t body_len;
+};
+
+struct reactor_session {
+	stomp_session_t *session; /* NULL once the session is over */
+	struct timespec due; /* time of the next stomp_session_step() without input */
+	int watched; /* the fd is registered with epoll */
+	unsigned long conn; /* connection the registered fd belongs to */
+};
+
+struct shard {
+	stomp_reactor_t *reactor;
+	pthread_t thread;
+	int thread_started;
+	int cpu; /* negative if not pinned */
+	int epfd;
+	int evfd; /* wakes up the thread when msgs are queued */
+
+	pthread_mutex_t lock; /* protects msgs_head and msgs_tail */
+	struct reactor_msg *msgs_head;
+	struct reactor_msg *msgs_tail;
+
+	/* accessed by the shard thread only */
+	struct reactor_session **sessions; /* array of pointers to sessions */
+	size_t sessions_len; /* number of elements in the array */
+	size_t sessions_capacity; /* allocated number of elements */
+};
+
+struct _stomp_reactor {
+	struct shard *shards;
+	size_t shards_len;
+	unsigned int next; /* round-robin counter for stomp_reactor_add() */
+	int run; /* cleared by stomp_reactor_free() */
+	int draining; /* set by stomp_reactor_join() */
+	int joined;
+};
+
+static void timespec_add_ms(struct timespec *ts, unsigned long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static long timespec_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static int shard_wake(struct shard *sh)
+{
+	uint64_t one = 1;
+
+	if (write(sh->evfd, &one, sizeof(one)) != sizeof(one)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int shard_push(struct shard *sh, struct reactor_msg *m)
+{
+	m->next = NULL;
+
+	pthread_mutex_lock(&sh->lock);
+	if (sh->msgs_tail) {
+		sh->msgs_tail->next = m;
+	} else {
+		sh->msgs_head = m;
+	}
+	sh->msgs_tail = m;
+	pthread_mutex_unlock(&sh->lock);
+
+	return shard_wake(sh);
+}
+
+/* take m back off the queue if the shard did not pick it up yet */
+static int shard_unpush(struct shard *sh, struct reactor_msg *m)
+{
+	struct reactor_msg **pm;
+	struct reactor_msg *prev = NULL;
+	int found = 0;
+
+	pthread_mutex_lock(&sh->lock);
+	for (pm = &sh->msgs_head; *pm; prev = *pm, pm = &(*pm)->next) {
+		if (*pm != m) {
+			continue;
+		}
+
+		*pm = m->next;
+		if (sh->msgs_tail == m) {
+			sh->msgs_tail = prev;
+		}
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	return found;
+}
+
+/* free the queued messages to a session that is over. stomp_reactor_send() 
+ * may still queue some after that, shard_msgs_run() drops those */
+static void shard_msgs_drop(struct shard *sh, stomp_session_t *s)
+{
+	struct reactor_msg **pm;
+	struct reactor_msg *m;
+	struct reactor_msg *prev = NULL;
+
+	pthread_mutex_lock(&sh->lock);
+	pm = &sh->msgs_head;
+	while ((m = *pm)) {
+		if (m->op != ROP_SEND || m->session != s) {
+			prev = m;
+			pm = &m->next;
+			continue;
+		}
+
+		*pm = m->next;
+		if (sh->msgs_tail == m) {
+			sh->msgs_tail = prev;
+		}
+		alloc_free(NULL, m);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/* the entry of a session run by the shard. sessions are not freed before 
+ * the reactor is joined, but once over they are no longer owned by it */
+static struct reactor_session *shard_session_find(struct shard *sh, stomp_session_t *s)
+{
+	size_t i;
+
+	if (session_owner_get(s) != sh) {
+		return NULL;
+	}
+
+	i = session_slot_get(s);
+	if (i >= sh->sessions_len || sh->sessions[i]->session != s) {
+		return NULL;
+	}
+
+	return sh->sessions[i];
+}
+
+static int shard_idle(struct shard *sh)
+{
+	int idle;
+
+	if (sh->sessions_len) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	idle = !sh->msgs_head;
+	pthread_mutex_unlock(&sh->lock);
+
+	return idle;
+}
+
+/* keep the epoll registration in line with the session. the fd is not
+ * watched while the session is out of credit or waiting to reconnect, 
+ * which also keeps a hung up connection from waking the shard up in a loop */
+static int shard_session_watch(struct shard *sh, struct reactor_session *e)
+{
+	stomp_session_t *s = e->session;
+	struct epoll_event ev;
+	int fd = stomp_session_fd(s);
+	unsigned long conn = session_conn_seq(s);
+	int watch = fd != -1 && !stomp_session_throttled(s);
+
+	if (e->watched && (!watch || conn != e->conn)) {
+		/* the fd of a previous connection is closed and gone from epoll already */
+		if (conn == e->conn) {
+			(void)epoll_ctl(sh->epfd, EPOLL_CTL_DEL, fd, NULL);
+		}
+		e->watched = 0;
+	}
+
+	if (!watch || e->watched) {
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = e;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		return -1;
+	}
+
+	e->watched = 1;
+	e->conn = conn;
+
+	return 0;
+}
+
+static void shard_session_add(struct shard *sh, stomp_session_t *s)
+{
+	struct reactor_session *e;
+	struct reactor_session **tmp;
+
+	if (sh->sessions_len == sh->sessions_capacity) {
+		size_t capacity = sh->sessions_capacity + SESSIONSINCLEN;
+		tmp = alloc_realloc(NULL, sh->sessions, capacity * sizeof(*tmp));
+		if (!tmp) {
+			shard_msgs_drop(sh, s);
+			session_owner_set(s, NULL);
+			return;
+		}
+
+		sh->sessions = tmp;
+		sh->sessions_capacity = capacity;
+	}
+
+	e = alloc_calloc(NULL, 1, sizeof(*e));
+	if (!e) {
+		shard_msgs_drop(sh, s);
+		session_owner_set(s, NULL);
+		return;
+	}
+
+	/* failure is not fatal, the old buffers are still usable */
+	(void)session_frames_renew(s);
+
+	e->session = s;
+	if ((stomp_session_fd(s) == -1 && !stomp_session_reconnecting(s)) || shard_session_watch(sh, e)) {
+		shard_msgs_drop(sh, s);
+		session_owner_set(s, NULL);
+		alloc_free(NULL, e);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &e->due);
+	timespec_add_ms(&e->due, stomp_session_timeout(s));
+
+	session_slot_set(s, sh->sessions_len);
+	sh->sessions[sh->sessions_len++] = e;
+}
+
+static void shard_session_step(struct shard *sh, struct reactor_session *e, int readable)
+{
+	stomp_session_t *s = e->session;
+
+	if (stomp_session_step(s, readable) > 0) {
+		(void)shard_session_watch(sh, e);
+		clock_gettime(CLOCK_MONOTONIC, &e->due);
+		timespec_add_ms(&e->due, stomp_session_timeout(s));
+		return;
+	}
+	
+	/* the fd is closed by now, which also removes it from epoll */
+	shard_msgs_drop(sh, s);
+	session_owner_set(s, NULL);
+	e->session = NULL;
+}
+
+static void shard_sessions_compact(struct shard *sh)
+{
+	size_t i = 0;
+	struct reactor_session *e;
+
+	while (i < sh->sessions_len) {
+		e = sh->sessions[i];
+		if (e->session) {
+			/* it may have been moved here from the end */
+			session_slot_set(e->session, i);
+			i++;
+			continue;
+		}
+
+		alloc_free(NULL, e);
+		sh->sessions[i] = sh->sessions[--sh->sessions_len];
+	}
+}
+
+static void shard_msgs_run(struct shard *sh)
+{
+	struct reactor_msg *m;
+	struct reactor_msg *next;
+	struct reactor_session *e;
+	uint64_t cnt;
+
+	(void)read(sh->evfd, &cnt, sizeof(cnt));
+
+	pthread_mutex_lock(&sh->lock);
+	m = sh->msgs_head;
+	sh->msgs_head = NULL;
+	sh->msgs_tail = NULL;
+	pthread_mutex_unlock(&sh->lock);
+
+	for (; m; m = next) {
+		next = m->next;
+
+		switch (m->op) {
+			case ROP_ADD:
+				shard_session_add(sh, m->session);
+				break;
+			case ROP_SEND:
+				/* the session might be over in the meantime */
+				e = shard_session_find(sh, m->session);
+				if (e) {
+					(void)stomp_send(e->session, m->hdrc, m->hdrs, m->body, m->body_len);
+				}
+				break;
+			default:
+				;
+		}
+
+		alloc_free(NULL, m);
+	}
+}
+
+static int shard_timeout(struct shard *sh)
+{
+	size_t i;
+	long t = -1;
+	long d;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < sh->sessions_len; i++) {
+		d = timespec_diff_ms(&sh->sessions[i]->due, &now);
+		if (d < 0) {
+			d = 0;
+		}
+
+		if (t < 0 || d < t) {
+			t = d;
+		}
+	}
+
+	return t;
+}
+
+static void *shard_run(void *arg)
+{
+	struct shard *sh = arg;
+	stomp_reactor_t *r = sh->reactor;
+	struct epoll_event events[MAXEVENTS];
+	struct reactor_session *e;
+	struct timespec now;
+	cpu_set_t set;
+	size_t i;
+	int j;
+	int n;
+
+	if (sh->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(sh->cpu, &set);
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	while (__atomic_load_n(&r->run, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&r->draining, __ATOMIC_ACQUIRE) && shard_idle(sh)) {
+			break;
+		}
+
+		n = epoll_wait(sh->epfd, events, MAXEVENTS, shard_timeout(sh));
+		if (n < 0 && errno != EINTR) {
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			e = events[j].data.ptr;
+			if (!e) {
+				shard_msgs_run(sh);
+			} else if (e->session) {
+				shard_session_step(sh, e, 1);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < sh->sessions_len; i++) {
+			e = sh->sessions[i];
+			if (e->session && timespec_diff_ms(&e->due, &now) <= 0) {
+				shard_session_step(sh, e, 0);
+			}
+		}
+
+		shard_sessions_compact(sh);
+	}
+
+	return NULL;
+}
+
+static void shard_destroy(struct shard *sh)
+{
+	struct reactor_msg *m;
+	size_t i;
+
+	while ((m = sh->msgs_head)) {
+		sh->msgs_head = m->next;
+		if (m->op == ROP_ADD) {
+			session_owner_set(m->session, NULL);
+		}
+		alloc_free(NULL, m);
+	}
+
+	for (i = 0; i < sh->sessions_len; i++) {
+		if (sh->sessions[i]->session) {
+			session_owner_set(sh->sessions[i]->session, NULL);
+		}
+		alloc_free(NULL, sh->sessions[i]);
+	}
+	alloc_free(NULL, sh->sessions);
+
+	if (sh->evfd != -1) {
+		(void)close(sh->evfd);
+	}
+
+	if (sh->epfd != -1) {
+		(void)close(sh->epfd);
+	}
+
+	pthread_mutex_destroy(&sh->lock);
+}
+
+static int shard_init(stomp_reactor_t *r, struct shard *sh, int cpu)
+{
+	struct epoll_event ev;
+
+	sh->reactor = r;
+	sh->cpu = cpu;
+	sh->evfd = -1;
+	pthread_mutex_init(&sh->lock, NULL);
+
+	sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sh->epfd == -1) {
+		return -1;
+	}
+
+	sh->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sh->evfd == -1) {
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->evfd, &ev)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void reactor_stop(stomp_reactor_t *r)
+{
+	size_t i;
+
+	for (i = 0; i < r->shards_len; i++) {
+		(void)shard_wake(&r->shards[i]);
+	}
+
+	for (i = 0; i < r->shards_len; i++) {
+		if (r->shards[i].thread_started) {
+			pthread_join(r->shards[i].thread, NULL);
+			r->shards[i].thread_started = 0;
+		}
+	}
+
+	r->joined = 1;
+}
+
+stomp_reactor_t *stomp_reactor_new(size_t shards, const int *cpus)
+{
+	stomp_reactor_t *r;
+	size_t i;
+	long online;
+	int cpu;
+
+	if (!shards) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online < 1) {
+		online = 1;
+	}
+
+	r = alloc_calloc(NULL, 1, sizeof(*r));
+	if (!r) {
+		return NULL;
+	}
+
+	r->shards = alloc_calloc(NULL, shards, sizeof(*r->shards));
+	if (!r->shards) {
+		alloc_free(NULL, r);
+		return NULL;
+	}
+
+	r->run = 1;
+
+	for (i = 0; i < shards; i++) {
+		cpu = cpus ? cpus[i] : (int)(i % online);
+		r->shards_len++;
+		if (shard_init(r, &r->shards[i], cpu)) {
+			goto stomp_reactor_new_error;
+		}
+	}
+
+	for (i = 0; i < shards; i++) {
+		if (pthread_create(&r->shards[i].thread, NULL, shard_run, &r->shards[i])) {
+			goto stomp_reactor_new_error;
+		}
+		r->shards[i].thread_started = 1;
+	}
+
+	return r;
+
+stomp_reactor_new_error:
+
+	stomp_reactor_free(r);
+	return NULL;
+}
+
+void stomp_reactor_free(stomp_reactor_t *r)
+{
+	size_t i;
+
+	if (!r) {
+		return;
+	}
+
+	__atomic_store_n(&r->run, 0, __ATOMIC_RELEASE);
+	reactor_stop(r);
+
+	for (i = 0; i < r->shards_len; i++) {
+		shard_destroy(&r->shards[i]);
+	}
+
+	alloc_free(NULL, r->shards);
+	alloc_free(NULL, r);
+}
+
+int stomp_reactor_join(stomp_reactor_t *r)
+{
+	if (!r) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__atomic_store_n(&r->draining, 1, __ATOMIC_RELEASE);
+	reactor_stop(r);
+
+	return 0;
+}
+
+int stomp_reactor_add(stomp_reactor_t *r, stomp_session_t *s, int shard)
+{
+	struct reactor_msg *m;
+	struct shard *sh;
+
+	if (!r || !s || r->joined) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (stomp_session_fd(s) == -1 || session_owner_get(s)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (shard < 0) {
+		shard = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED) % r->shards_len;
+	}
+
+	if ((size_t)shard >= r->shards_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	m = alloc_calloc(NULL, 1, sizeof(*m));
+	if (!m) {
+		return -1;
+	}
+
+	sh = &r->shards[shard];
+	m->op = ROP_ADD;
+	m->session = s;
+	session_owner_set(s, sh);
+
+	/* once the shard picked it up the session is its own, queue or no wake up */
+	if (shard_push(sh, m) && shard_unpush(sh, m)) {
+		session_owner_set(s, NULL);
+		alloc_free(NULL, m);
+		return -1;
+	}
+
+	return shard;
+}
+
+int stomp_reactor_send(stomp_reactor_t *r, stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, const void *body, size_t body_len)
+{
+	struct reactor_msg *m;
+	struct shard *sh;
+	size_t len;
+	size_t i;
+	size_t key_len;
+	size_t val_len;
+	char *p;
+
+	if (!r || !s || (hdrc && !hdrs)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sh = session_owner_get(s);
+	if (!sh || sh->reactor != r) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the request, the headers, the strings and the body in one chunk */
+	len = sizeof(*m) + hdrc * sizeof(struct stomp_hdr) + body_len;
+	for (i = 0; i < hdrc; i++) {
+		if (!hdrs[i].key || !hdrs[i].val) {
+			errno = EINVAL;
+			return -1;
+		}
+		len += strlen(hdrs[i].key) + strlen(hdrs[i].val) + 2;
+	}
+
+	m = alloc_malloc(NULL, len);
+	if (!m) {
+		return -1;
+	}
+
+	m->op = ROP_SEND;
+	m->session = s;
+	m->hdrc = hdrc;
+	m->hdrs = (struct stomp_hdr *)(m + 1);
+	p = (char *)(m->hdrs + hdrc);
+
+	m->body = p;
+	m->body_len = body_len;
+	if (body_len) {
+		memcpy(p, body, body_len);
+		p += body_len;
+	}
+
+	for (i = 0; i < hdrc; i++) {
+		key_len = strlen(hdrs[i].key) + 1;
+		val_len = strlen(hdrs[i].val) + 1;
+
+		m->hdrs[i].key = memcpy(p, hdrs[i].key, key_len);
+		p += key_len;
+		m->hdrs[i].val = memcpy(p, hdrs[i].val, val_len);
+		p += val_len;
+	}
+
+	/* queued, the shard picks it up with the next wake up of any kind. 
+	 * failing now would have the caller send it twice */
+	(void)shard_push(sh, m);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "receipt.h"
+#include "alloc.h"
+
+/* initial number of slots, must be a power of 2 */
+#define MINSLOTS 16
+
+struct _receipts {
+	struct receipt *slots; /* open addressing, seq 0 marks a free slot */
+	size_t slots_len; /* number of slots, a power of 2 */
+	size_t len; /* number of used slots */
+	struct stomp_allocator alloc; /* hooks the table is allocated with */
+};
+
+static size_t slot(const receipts_t *r, unsigned long seq)
+{
+	/* Fibonacci hashing, consecutive ids end up spread out */
+	return (seq * 11400714819323198485llu) & (r->slots_len - 1);
+}
+
+static int receipts_resize(receipts_t *r, size_t slots_len)
+{
+	struct receipt *old = r->slots;
+	size_t old_len = r->slots_len;
+	struct receipt *e;
+	size_t i;
+
+	r->slots = alloc_calloc(&r->alloc, slots_len, sizeof(*r->slots));
+	if (!r->slots) {
+		r->slots = old;
+		return -1;
+	}
+
+	r->slots_len = slots_len;
+	r->len = 0;
+
+	for (i = 0; i < old_len; i++) {
+		if (!old[i].seq) {
+			continue;
+		}
+
+		e = receipts_add(r, old[i].seq);
+		*e = old[i];
+	}
+
+	alloc_free(&r->alloc, old);
+
+	return 0;
+}
+
+receipts_t *receipts_new(const struct stomp_allocator *a)
+{
+	receipts_t *r = alloc_calloc(a, 1, sizeof(*r));
+	if (!r) {
+		return NULL;
+	}
+
+	r->alloc = *a;
+
+	if (receipts_resize(r, MINSLOTS)) {
+		alloc_free(a, r);
+		return NULL;
+	}
+
+	return r;
+}
+
+receipts_t *receipts_copy(receipts_t *r, const struct stomp_allocator *a)
+{
+	receipts_t *copy = receipts_new(a);
+	if (!copy) {
+		return NULL;
+	}
+
+	if (r->slots_len > copy->slots_len && receipts_resize(copy, r->slots_len)) {
+		receipts_free(copy);
+		return NULL;
+	}
+
+	/* same number of slots, so every receipt hashes to the same one */
+	memcpy(copy->slots, r->slots, r->slots_len * sizeof(*r->slots));
+	copy->len = r->len;
+
+	return copy;
+}
+
+void receipts_free(receipts_t *r)
+{
+	struct stomp_allocator a = r->alloc;
+
+	alloc_free(&a, r->slots);
+	alloc_free(&a, r);
+}
+
+int receipts_reserve(receipts_t *r, size_t len)
+{
+	size_t slots_len = r->slots_len;
+
+	/* keep the load factor at or below 1/2 */
+	while (slots_len < 2 * len) {
+		slots_len *= 2;
+	}
+
+	if (slots_len == r->slots_len) {
+		return 0;
+	}
+
+	return receipts_resize(r, slots_len);
+}
+
+struct receipt *receipts_add(receipts_t *r, unsigned long seq)
+{
+	size_t i;
+
+	if (!seq) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (receipts_reserve(r, r->len + 1)) {
+		return NULL;
+	}
+
+	for (i = slot(r, seq); r->slots[i].seq; i = (i + 1) & (r->slots_len - 1)) {
+		if (r->slots[i].seq == seq) {
+			errno = EEXIST;
+			return NULL;
+		}
+	}
+
+	memset(&r->slots[i], 0, sizeof(r->slots[i]));
+	r->slots[i].seq = seq;
+	r->len++;
+
+	return &r->slots[i];
+}
+
+struct receipt *receipts_get(receipts_t *r, unsigned long seq)
+{
+	size_t i;
+
+	if (!seq) {
+		return NULL;
+	}
+
+	for (i = slot(r, seq); r->slots[i].seq; i = (i + 1) & (r->slots_len - 1)) {
+		if (r->slots[i].seq == seq) {
+			return &r->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+void receipts_del(receipts_t *r, unsigned long seq)
+{
+	size_t mask = r->slots_len - 1;
+	size_t i;
+	size_t j;
+	size_t k;
+	struct receipt *e = receipts_get(r, seq);
+
+	if (!e) {
+		return;
+	}
+
+	/* backward shift deletion, no tombstones needed */
+	i = e - r->slots;
+	for (j = (i + 1) & mask; r->slots[j].seq; j = (j + 1) & mask) {
+		k = slot(r, r->slots[j].seq);
+		/* move j to i unless its home slot k lies cyclically in (i, j] */
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			r->slots[i] = r->slots[j];
+			i = j;
+		}
+	}
+
+	memset(&r->slots[i], 0, sizeof(r->slots[i]));
+	r->len--;
+}
+
+size_t receipts_len(receipts_t *r)
+{
+	return r->len;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RECEIPT_H
+#define RECEIPT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "stomp.h"
+
+/* 
+ * Hash table of in-flight messages keyed by the numeric 
+ * part of the receipt id generated for them. 
+ */
+typedef struct _receipts receipts_t;
+
+struct receipt {
+	unsigned long seq; /* numeric receipt id, never 0 */
+	void *ctx; /* user supplied pointer */
+	struct timespec deadline; /* time after which the message is considered lost */
+	unsigned long long sent; /* time the message was sent in nanoseconds, for SLT_RECEIPT */
+};
+
+receipts_t *receipts_new(const struct stomp_allocator *a);
+/* copy of r allocated with a, r is left as it is */
+receipts_t *receipts_copy(receipts_t *r, const struct stomp_allocator *a);
+void receipts_free(receipts_t *r);
+int receipts_reserve(receipts_t *r, size_t len);
+struct receipt *receipts_add(receipts_t *r, unsigned long seq);
+struct receipt *receipts_get(receipts_t *r, unsigned long seq);
+void receipts_del(receipts_t *r, unsigned long seq);
+size_t receipts_len(receipts_t *r);
+
+#endif /* RECEIPT_H */
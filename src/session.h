@@ -0,0 +1,46 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "stomp.h"
+
+/* 
+ * Library internal session helpers. 
+ * Not part of the public API.
+ */
+
+/* replace the session frames with freshly allocated ones. 
+ * Called from the thread which is going to own the session so the 
+ * buffers get allocated from its arena and first touched on its NUMA node. */
+int session_frames_renew(stomp_session_t *s);
+
+/* opaque pointer to the reactor shard owning the session, NULL if none. 
+ * Safe to call from any thread. */
+void *session_owner_get(stomp_session_t *s);
+void session_owner_set(stomp_session_t *s, void *owner);
+
+/* index of the session in the array of the shard owning it. 
+ * Only used by that shard's thread. */
+size_t session_slot_get(stomp_session_t *s);
+void session_slot_set(stomp_session_t *s, size_t slot);
+
+/* changes every time the session connects to the broker, 
+ * the file descriptor number alone may be reused */
+unsigned long session_conn_seq(stomp_session_t *s);
+
+#endif /* SESSION_H */
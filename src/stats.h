@@ -0,0 +1,33 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include "stomp.h"
+
+/* 
+ * Session counters, see struct stomp_stats. 
+ *
+ * A counter has a single writer, the thread running the session, so it is
+ * bumped with a relaxed load and store instead of a locked read-modify-write.
+ * Readers on other threads use STATS_GET() and never see a torn value.
+ */
+#define STATS_ADD(c, n) __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STATS_SET(c, v) __atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define STATS_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+#endif /* STATS_H */
@@ -23,11 +23,23 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "stomp.h"
 #include "frame.h"
 #include "hdr.h"
+#include "receipt.h"
+#include "session.h"
+#include "sub.h"
+#include "net.h"
+#include "pool.h"
+#include "alloc.h"
+#include "stats.h"
+#include "hist.h"
+#include "probes.h"
+#include "io.h"
+#include "tls.h"
 
 /* enough space for ULLONG_MAX as string */
 #define MAXBUFLEN 25
@@ -35,6 +47,43 @@
 /* max number of broker heartbeat timeouts */
 #define MAXBROKERTMOUTS 5
 
+/* prefix of the receipt ids generated by stomp_send_async() */
+#define RECEIPTPREFIX "send-"
+
+/* prefix of the transaction and receipt ids generated for stomp_send() batches */
+#define BATCHPREFIX "batch-"
+
+/* default max number of in-flight stomp_send_async() messages */
+#define SENDWINDOW 256
+
+/* default number of milliseconds resolved broker addresses are used for */
+#define DNSTTL 60000
+
+/* default number of milliseconds a connect may take. reconnects block 
+ * the loop stepping the session, so they must not wait for ever */
+#define CONNECTTIMEOUT 10000
+
+/* stomp_connect() host prefix of Unix socket paths */
+#define UNIXPREFIX "unix:"
+
+/* number of elements to add to s->queue when full */
+#define QUEUEINCLEN 16
+
+/* min number of bytes to add to s->cork when full */
+#define CORKINCLEN 512
+
+/* number of elements to add to s->txs and s->commits when full */
+#define TXINCLEN 4
+
+/* number of retained frames kept for reuse once released */
+#define POOLMAX 16
+
+/* default size up to which frame buffers are never trimmed */
+#define FRAMEKEEP 65536
+
+/* number of steps after which the buffer capacity is sampled even if no buffer grew */
+#define STATSSAMPLE 64
+
 
 enum stomp_prot {
 	SPL_10,
@@ -48,6 +97,16 @@ struct stomp_callbacks {
 	void(*error)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
 	void(*receipt)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
 	void(*user)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
+	void(*confirm)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
+	void(*batch)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
+};
+
+/* a committed batch waiting for its receipt */
+struct batch {
+	unsigned long seq;
+	size_t messages;
+	size_t bytes;
+	unsigned long long sent; /* time COMMIT was sent in nanoseconds, for SLT_RECEIPT */
 };
 
 struct _stomp_session {
@@ -55,19 +114,110 @@ struct _stomp_session {
 	void *ctx; /* pointer to user supplied session context */
 
 	frame_t *frame_out; /* library -> broker */
-	frame_t *frame_in; /* broker -> library */
+	frame_t *frame_in; /* broker -> library, s->in->frame */
+	stomp_message_t *in; /* holder of frame_in, NULL once retained until the next read */
+	pool_t *pool; /* recycles the frames retained by the client code */
+	int dispatching; /* a received frame is being handed to the callbacks */
+	struct stomp_allocator alloc; /* hooks the frames are allocated with */
+	struct stomp_limits limits; /* enforced on received frames */
+	size_t peak; /* largest frame received */
+	unsigned long trims; /* oversized frame buffers released */
+	struct stomp_stats stats; /* written by the session thread only, see stats.h */
+	unsigned long long sampled_reallocs; /* stats.reallocs when capacity was last sampled */
+	unsigned long sampled_trims; /* trims when capacity was last sampled */
+	unsigned int sample_steps; /* steps since capacity was last sampled */
+	struct hist *latency; /* SLT_MAX histograms, allocated with the first sample */
+	unsigned long long readable_at; /* time the broker connection was found readable, ns */
+	unsigned long long connect_sent; /* time CONNECT was sent, ns */
 
 	enum stomp_prot protocol;
 	int broker_fd;
-	int client_id; /* unique ids for subscribe */
+	struct io io; /* stream of the broker connection, io.t is NULL without one */
+	const struct stomp_transport *transport; /* stomp_transport_set(), NULL for the built-in ones */
+	void *transport_ctx;
+	enum stomp_tls_mode tls_mode;
+	tls_t *tls; /* stomp_tls_set() settings, NULL for plain TCP */
+	int client_id; /* last id generated for subscribe */
 	unsigned long client_hb; /* client heart beat period in milliseconds */
 	unsigned long broker_hb; /* broker heart beat period in milliseconds */
 	struct timespec last_write;
 	struct timespec last_read;
 	int broker_timeouts; 
 	int run;
+	void *owner; /* reactor shard running the session */
+	size_t slot; /* index in the owning shard's session array */
+
+	subs_t *subs; /* active subscriptions */
+
+	receipts_t *receipts; /* in-flight stomp_send_async() messages */
+	unsigned long receipt_seq; /* last generated receipt id */
+	unsigned long receipt_oldest; /* no in-flight receipt id is older than this */
+	size_t send_window; /* max number of in-flight messages */
+	unsigned long send_timeout; /* milliseconds to wait for a receipt, 0 for ever */
+
+	char *host; /* stomp_connect() arguments, kept for reconnecting */
+	char *service;
+	size_t connect_hdrc;
+	struct stomp_hdr *connect_hdrs;
+	struct addrinfo *addrs; /* resolved broker addresses */
+	struct addrinfo *addr; /* address of the last successful connection */
+	struct timespec addrs_expire; /* time after which addrs are resolved again */
+	unsigned long dns_ttl; /* milliseconds to cache addrs for */
+	unsigned long connect_timeout; /* milliseconds to wait for a connection, 0 for ever */
+	unsigned long conn_seq; /* number of connections made */
+	int passcred; /* send SCM_CREDENTIALS over unix: connections */
+
+	unsigned long reconnect_min; /* first backoff delay in milliseconds, 0 disables reconnecting */
+	unsigned long reconnect_max; /* max backoff delay in milliseconds */
+	unsigned int reconnect_attempts; /* max number of consecutive attempts, 0 for no limit */
+	unsigned int attempts; /* consecutive attempts made so far */
+	unsigned int seed; /* backoff jitter */
+	struct timespec reconnect_at; /* time of the next attempt */
+	int lost; /* the connection dropped, waiting to reconnect */
+	int resume; /* subscribe again and flush the queue on CONNECTED */
+	int disconnecting; /* DISCONNECT was sent, the broker closing the connection is expected */
+
+	frame_t **queue; /* SEND frames waiting for the connection to come back */
+	size_t queue_len;
+	size_t queue_capacity;
+
+	int connected; /* CONNECTED was received on the current connection */
+	int refused; /* the broker answered CONNECT with an ERROR */
+	char *cork; /* frames written while corked, sent by uncork() */
+	size_t cork_len;
+	size_t cork_capacity;
+	int corked; /* cork() nesting level */
+
+	char **txs; /* ids of the open transactions */
+	size_t txs_len;
+	size_t txs_capacity;
+
+	size_t batch_max_msgs; /* max number of messages per batch, 0 disables batching */
+	size_t batch_max_bytes; /* max number of body bytes per batch, 0 for no limit */
+	unsigned long batch_timeout; /* max milliseconds a batch stays open, 0 for no limit */
+	int batch_open; /* a batch transaction was begun and not committed yet */
+	unsigned long batch_seq; /* id of the last batch */
+	size_t batch_msgs; /* number of messages in the open batch */
+	size_t batch_bytes; /* number of body bytes in the open batch */
+	struct timespec batch_deadline; /* time to commit the open batch */
+	struct batch *commits; /* committed batches waiting for a receipt, oldest first */
+	size_t commits_len;
+	size_t commits_capacity;
 };
 
+static void addrs_free(stomp_session_t *s);
+static void hangup(stomp_session_t *s);
+static int session_write(stomp_session_t *s);
+static int connect_batch(stomp_session_t *s);
+static int subscribe_frame(stomp_session_t *s, struct sub *sub);
+static void confirm_all(stomp_session_t *s, int status);
+static void confirm_upto(stomp_session_t *s, int status, unsigned long seq);
+static void tx_clear(stomp_session_t *s);
+static void cork_discard(stomp_session_t *s);
+static void batch_fail_all(stomp_session_t *s, int status);
+static int batch_commit(stomp_session_t *s);
+static int batch_end(stomp_session_t *s);
+
 static int parse_version(const char *s, enum stomp_prot *v)
 {
 	enum stomp_prot tmp_v;
@@ -152,33 +302,102 @@ static int parse_heartbeat(const char *s, unsigned long *x, unsigned long *y)
 
 stomp_session_t *stomp_session_new(void *session_ctx)
 {
-	stomp_session_t *s = calloc(1, sizeof(*s));
+	stomp_session_t *s = alloc_calloc(NULL, 1, sizeof(*s));
 	if (!s) {
 		return NULL;
 	}
 
 	s->ctx = session_ctx;
 	s->broker_fd = -1;
+	s->send_window = SENDWINDOW;
+	s->receipt_oldest = 1;
+	s->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)s;
+	s->dns_ttl = DNSTTL;
+	s->connect_timeout = CONNECTTIMEOUT;
+	s->limits.keep = FRAMEKEEP;
+
+	alloc_global_get(&s->alloc);
 
-	s->frame_out = frame_new();
+	s->frame_out = frame_new_with(&s->alloc);
 	if (!s->frame_out) {
-		free(s);
+		goto stomp_session_new_error;
 	}
 
-	s->frame_in = frame_new();
-	if (!s->frame_in) {
-		free(s->frame_out);
-		free(s);
+	s->pool = pool_new(POOLMAX, &s->alloc);
+	if (!s->pool) {
+		goto stomp_session_new_error;
+	}
+
+	s->in = pool_get(s->pool);
+	if (!s->in) {
+		goto stomp_session_new_error;
+	}
+	s->frame_in = s->in->frame;
+
+	s->receipts = receipts_new(&s->alloc);
+	if (!s->receipts) {
+		goto stomp_session_new_error;
+	}
+
+	s->subs = subs_new(&s->alloc);
+	if (!s->subs) {
+		goto stomp_session_new_error;
 	}
 
 	return s;
+
+stomp_session_new_error:
+
+	if (s->receipts) {
+		receipts_free(s->receipts);
+	}
+
+	if (s->in) {
+		pool_put(s->in);
+	}
+
+	if (s->pool) {
+		pool_free(s->pool);
+	}
+
+	if (s->frame_out) {
+		frame_free(s->frame_out);
+	}
+
+	alloc_free(NULL, s);
+	return NULL;
 }
 
 void stomp_session_free(stomp_session_t *s)
 {
+	size_t i;
+
+	for (i = 0; i < s->queue_len; i++) {
+		frame_free(s->queue[i]);
+	}
+
+	hangup(s);
+	addrs_free(s);
+#ifdef STOMP_TLS
+	tls_free(s->tls);
+#endif
+	tx_clear(s);
+	alloc_free(NULL, s->txs);
+	alloc_free(&s->alloc, s->commits);
+	alloc_free(&s->alloc, s->queue);
+	alloc_free(NULL, s->latency);
+	alloc_free(&s->alloc, s->cork);
+	alloc_free(NULL, s->host);
+	alloc_free(NULL, s->service);
+	alloc_free(NULL, s->connect_hdrs);
 	frame_free(s->frame_out);
-	frame_free(s->frame_in);
-	free(s);
+	if (s->in) {
+		pool_put(s->in);
+	}
+	pool_free(s->pool);
+	receipts_free(s->receipts);
+	subs_free(s->subs);
+	alloc_free(NULL, s);
 }
 
 void stomp_callback_set(stomp_session_t *s, enum stomp_cb_type type, stomp_cb_t cb)
@@ -202,6 +421,13 @@ void stomp_callback_set(stomp_session_t *s, enum stomp_cb_type type, stomp_cb_t
 			break;
 		case SCB_USER:
 			s->callbacks.user = cb;
+			break;
+		case SCB_CONFIRM:
+			s->callbacks.confirm = cb;
+			break;
+		case SCB_BATCH:
+			s->callbacks.batch = cb;
+			break;
 		default:
 			return;
 	}
@@ -228,554 +454,2303 @@ void stomp_callback_del(stomp_session_t *s, enum stomp_cb_type type)
 			break;
 		case SCB_USER:
 			s->callbacks.user = NULL;
+			break;
+		case SCB_CONFIRM:
+			s->callbacks.confirm = NULL;
+			break;
+		case SCB_BATCH:
+			s->callbacks.batch = NULL;
+			break;
 		default:
 			return;
 	}
 }
 
 
-int stomp_connect(stomp_session_t *s, const char *host, const char *service, size_t hdrc, const struct stomp_hdr *hdrs)
+static void addrs_free(stomp_session_t *s)
+{
+	if (s->addrs) {
+		freeaddrinfo(s->addrs);
+	}
+
+	s->addrs = NULL;
+	s->addr = NULL;
+}
+
+/* connect to one of the broker addresses, the last working one first */
+static int dial_inet(stomp_session_t *s)
 {
 	struct addrinfo hints;
-	struct addrinfo *result, *rp;
+	struct timespec now;
 	int sfd;
 	int err;
-	unsigned long x = 0;
-	unsigned long y = 0;
-	const char *hb = hdr_get(hdrc, hdrs, "heart-beat");
-
-	if (hb && parse_heartbeat(hb, &x, &y)) {
-		errno = EINVAL;
-		return -1;
-	}
-	
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
 
-	err = getaddrinfo(host, service, &hints, &result);
-	if (err != 0) {
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (s->addrs && (now.tv_sec > s->addrs_expire.tv_sec || 
+	   (now.tv_sec == s->addrs_expire.tv_sec && now.tv_nsec >= s->addrs_expire.tv_nsec))) {
+		addrs_free(s);
 	}
 
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (sfd == -1)
-			continue;
+	if (!s->addrs) {
+		memset(&hints, 0, sizeof(struct addrinfo));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = 0;
+		hints.ai_protocol = 0;
 
-		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
-			break; 
+		err = getaddrinfo(s->host, s->service, &hints, &s->addrs);
+		if (err != 0) {
+			s->addrs = NULL;
+			return -1;
+		}
 
-		close(sfd);
+		s->addrs_expire = now;
+		s->addrs_expire.tv_sec += s->dns_ttl / 1000;
+		s->addrs_expire.tv_nsec += (s->dns_ttl % 1000) * 1000000;
+		if (s->addrs_expire.tv_nsec >= 1000000000) {
+			s->addrs_expire.tv_sec += 1;
+			s->addrs_expire.tv_nsec -= 1000000000;
+		}
 	}
 
-
-	if (rp == NULL) { 
-		freeaddrinfo(result);
+	sfd = net_dial(s->addrs, s->addr, s->connect_timeout, &s->addr);
+	if (sfd == -1) {
+		/* none of them works, the name may point elsewhere by now */
+		err = errno;
+		addrs_free(s);
+		errno = err;
 		return -1;
 	}
-	
-	freeaddrinfo(result);
 
-	s->broker_fd = sfd;
-	s->run = 1;
-	
-	frame_reset(s->frame_out);
+	return sfd;
+}
 
-	if (frame_cmd_set(s->frame_out, "CONNECT")) {
-		return -1;
-	}
-	
-	s->client_hb = x;
-	s->broker_hb = y;
-	
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+/* connect to the broker over TCP or a Unix socket, and TLS if configured */
+static int dial_sock(stomp_session_t *s)
+{
+	int sfd;
+
+	if (!strncmp(s->host, UNIXPREFIX, strlen(UNIXPREFIX))) {
+		sfd = net_dial_unix(s->host + strlen(UNIXPREFIX), s->connect_timeout, s->passcred);
+	} else {
+		sfd = dial_inet(s);
 	}
 
-	if (frame_write(sfd, s->frame_out) < 0) {
-		s->run = 0;
+	if (sfd == -1) {
 		return -1;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+	s->broker_fd = sfd;
+	s->io.t = &net_sock;
+	s->io.ctx = &s->broker_fd;
+
+#ifdef STOMP_TLS
+	if (s->tls) {
+		int mode = tls_open(s->tls, sfd, s->host, s->connect_timeout, &s->io);
+		int err;
+
+		if (mode == -1) {
+			err = errno;
+			hangup(s);
+			errno = err;
+			return -1;
+		}
+
+		s->tls_mode = mode;
+	}
+#endif
 
 	return 0;
 }
 
-int stomp_disconnect(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+/* connect to the broker and set up s->io and s->broker_fd */
+static int dial(stomp_session_t *s)
 {
-	frame_reset(s->frame_out);
+	if (s->transport) {
+		if (s->transport->connect(s->transport_ctx, s->host, s->service, s->connect_timeout)) {
+			return -1;
+		}
 
-	if (frame_cmd_set(s->frame_out, "DISCONNECT")) {
+		s->io.t = s->transport;
+		s->io.ctx = s->transport_ctx;
+		s->broker_fd = s->transport->fd(s->transport_ctx);
+	} else if (dial_sock(s)) {
 		return -1;
 	}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
-	}
+	s->conn_seq++;
+	PROBE2(connect, s, s->conn_seq);
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
-		return -1;
-	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
-	
 	return 0;
 }
 
-// TODO enforce different client-ids in case they are provided with hdrs
-int stomp_subscribe(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+/* close the broker connection */
+static void hangup(stomp_session_t *s)
 {
-	const char *ack;
-	char buf[MAXBUFLEN];
-	int client_id = 0;
-
-	if (!hdr_get(hdrc, hdrs, "destination")) {
-		errno = EINVAL;
-		return -1;
+	if (s->io.t) {
+		s->io.t->close(s->io.ctx);
 	}
-	
-	ack = hdr_get(hdrc, hdrs, "ack");
-	if (ack && strcmp(ack, "auto") && strcmp(ack, "client") && strcmp(ack, "client-individual")) {
-		errno = EINVAL;
-		return -1;
+
+	s->io.t = NULL;
+	s->io.ctx = NULL;
+	s->tls_mode = STLS_NONE;
+	s->broker_fd = -1;
+}
+
+/* data was taken off the socket, by TLS or a transport, and waits to be read */
+static int buffered(stomp_session_t *s)
+{
+	return io_pending(&s->io) > 0;
+}
+
+/* reset the outgoing frame, releasing its buffers if an earlier frame left them oversized */
+static void out_reset(stomp_session_t *s)
+{
+	if (frame_trim(s->frame_out, s->limits.keep)) {
+		s->trims++;
 	}
 
 	frame_reset(s->frame_out);
+	frame_stats_set(s->frame_out, &s->stats);
+}
 
-	if (frame_cmd_set(s->frame_out, "SUBSCRIBE")) {
-		return -1;
-	}
-	
-	if (!hdr_get(hdrc, hdrs, "id")) {
-		client_id = s->client_id;
-		if (client_id == INT_MAX) {
-			client_id = 0;
-		}
-		client_id++;
-		snprintf(buf, MAXBUFLEN, "%d", client_id);
-		if (frame_hdr_add(s->frame_out, "id", buf)) {
-			return -1;
-		}
-	} 
+static enum stomp_stats_cmd stats_cmd(const char *cmd, size_t len)
+{
+	static const char *cmds[SSC_HEARTBEAT] = {
+		"CONNECT", "SEND", "SUBSCRIBE", "UNSUBSCRIBE", "BEGIN", "COMMIT", "ABORT",
+		"ACK", "NACK", "DISCONNECT", "CONNECTED", "MESSAGE", "RECEIPT", "ERROR",
+	};
+	size_t i;
 
-	
-	if (!ack && frame_hdr_add(s->frame_out, "ack", "auto")) {
-		return -1;
-	}
-	
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+	if (!len) {
+		return SSC_HEARTBEAT;
 	}
-	
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
-		return -1;
+
+	for (i = 0; i < SSC_HEARTBEAT; i++) {
+		if (!strncmp(cmds[i], cmd, len) && !cmds[i][len]) {
+			return i;
+		}
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
-	s->client_id = client_id;
+	return SSC_OTHER;
+}
 
-	return client_id;
+static enum stomp_stats_cmd stats_frame(unsigned long long *frames, unsigned long long *bytes, frame_t *f, size_t len)
+{
+	const char *cmd = NULL;
+	size_t cmd_len = frame_cmd_get(f, &cmd);
+	enum stomp_stats_cmd c = stats_cmd(cmd, cmd_len);
+
+	STATS_ADD(frames[c], 1);
+	STATS_ADD(bytes[c], len);
+
+	return c;
 }
 
-int stomp_unsubscribe(stomp_session_t *s, int client_id, size_t hdrc, const struct stomp_hdr *hdrs)
+static unsigned long long stats_clock(void)
 {
-	char buf[MAXBUFLEN];
-	const char *id = hdr_get(hdrc, hdrs, "id");
-	const char *destination = hdr_get(hdrc, hdrs, "destination");
+	struct timespec ts;
 
-	if (s->protocol == SPL_10) {
-		if (!destination && !id && !client_id) {
-			errno = EINVAL;
-			return -1;
-		}
-	} else {
-		if (!id && !client_id) {
-			errno = EINVAL;
-			return -1;
-		}
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	frame_reset(s->frame_out);
+#if defined(STOMP_HISTOGRAMS) || defined(STOMP_USDT)
+#define latency_clock() stats_clock()
+#else
+#define latency_clock() 0ULL
+#endif
 
-	if (frame_cmd_set(s->frame_out, "UNSUBSCRIBE")) {
-		return -1;
-	}
-	
-	// user provided client id. overrride all other supplied headers
-	if (client_id) {
-		snprintf(buf, MAXBUFLEN, "%lu", (unsigned long)client_id);
-		if (frame_hdr_add(s->frame_out, "id", buf)) {
-			return -1;
+/* record a latency sample, unless the histograms are compiled out */
+static void latency(stomp_session_t *s, enum stomp_latency_type type, unsigned long long start, unsigned long long end)
+{
+#ifdef STOMP_HISTOGRAMS
+	struct hist *h = s->latency;
+
+	if (!h) {
+		h = alloc_calloc(NULL, SLT_MAX, sizeof(*h));
+		if (!h) {
+			return;
 		}
-	}
-	
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+		__atomic_store_n(&s->latency, h, __ATOMIC_RELEASE);
 	}
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
-		return -1;
-	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+	hist_record(&h[type], end > start ? end - start : 0);
+#endif
+}
 
-	return 0;
+/* account for a callback run since start, returns its duration in ns */
+static unsigned long long stats_callback(stomp_session_t *s, unsigned long long start)
+{
+	unsigned long long end = stats_clock();
+
+	STATS_ADD(s->stats.callbacks, 1);
+	STATS_ADD(s->stats.callback_ns, end - start);
+	latency(s, SLT_CALLBACK, start, end);
+
+	return end - start;
 }
 
-// TODO enforce different tx_ids
-int stomp_begin(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+/* update the gauges; walking the frames is only worth it if a buffer changed */
+static void stats_sample(stomp_session_t *s)
 {
-	if (!hdr_get(hdrc, hdrs, "transaction")) {
-		errno = EINVAL;
-		return -1;
+	struct stomp_memory m;
+
+	STATS_SET(s->stats.queue, s->queue_len);
+	STATS_SET(s->stats.inflight, receipts_len(s->receipts));
+
+	if (s->sampled_reallocs == s->stats.reallocs && s->sampled_trims == s->trims && 
+	    ++s->sample_steps < STATSSAMPLE) {
+		return;
 	}
 
-	frame_reset(s->frame_out);
+	s->sampled_reallocs = s->stats.reallocs;
+	s->sampled_trims = s->trims;
+	s->sample_steps = 0;
 
-	if (frame_cmd_set(s->frame_out, "BEGIN")) {
-		return -1;
+	stomp_session_memory(s, &m);
+	STATS_SET(s->stats.capacity, m.frames + m.cork);
+}
+
+static int connect_frame(stomp_session_t *s)
+{
+	unsigned long x = 0;
+	unsigned long y = 0;
+	const char *hb = hdr_get(s->connect_hdrc, s->connect_hdrs, "heart-beat");
+
+	if (hb) {
+		(void)parse_heartbeat(hb, &x, &y);
 	}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "CONNECT")) {
 		return -1;
 	}
 	
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
+	s->client_hb = x;
+	s->broker_hb = y;
+	
+	if (frame_hdrs_add(s->frame_out, s->connect_hdrc, s->connect_hdrs)) {
 		return -1;
 	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
 
 	return 0;
 }
 
-int stomp_abort(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+int stomp_connect(stomp_session_t *s, const char *host, const char *service, size_t hdrc, const struct stomp_hdr *hdrs)
 {
-	if (!hdr_get(hdrc, hdrs, "transaction")) {
+	unsigned long x = 0;
+	unsigned long y = 0;
+	char *h;
+	char *srv;
+	struct stomp_hdr *dup;
+	const char *hb = hdr_get(hdrc, hdrs, "heart-beat");
+
+	/* unix: hosts need no service */
+	if (!service) {
+		service = "";
+	}
+
+	if (hb && parse_heartbeat(hb, &x, &y)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	frame_reset(s->frame_out);
-
-	if (frame_cmd_set(s->frame_out, "ABORT")) {
+	/* everything needed to connect again later on */
+	h = alloc_strdup(NULL, host);
+	srv = alloc_strdup(NULL, service);
+	dup = hdr_dup(NULL, hdrc, hdrs);
+	if (!h || !srv || !dup) {
+		alloc_free(NULL, h);
+		alloc_free(NULL, srv);
+		alloc_free(NULL, dup);
 		return -1;
 	}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+	/* the cached addresses are of no use for another broker */
+	if (!s->host || strcmp(s->host, host) || strcmp(s->service, service)) {
+		addrs_free(s);
+	}
+
+	alloc_free(NULL, s->host);
+	alloc_free(NULL, s->service);
+	alloc_free(NULL, s->connect_hdrs);
+	s->host = h;
+	s->service = srv;
+	s->connect_hdrs = dup;
+	s->connect_hdrc = hdrc;
+	
+	if (dial(s)) {
 		return -1;
 	}
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
+	s->lost = 0;
+	s->resume = 0;
+	s->disconnecting = 0;
+	s->attempts = 0;
+
+	/* a failing write is reported to the caller rather than reconnected */
+	s->run = 0;
+	if (connect_batch(s)) {
+		hangup(s);
 		return -1;
 	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+
+	s->run = 1;
 
 	return 0;
 }
 
-int stomp_ack(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+int stomp_connect_timeout_set(stomp_session_t *s, unsigned long timeout, unsigned long dns_ttl)
 {
-	switch(s->protocol) {
-		case SPL_12:
-			if (!hdr_get(hdrc, hdrs, "id")) {
-				errno = EINVAL;
-				return -1;
-			}
-			break;
-		case SPL_11:
-			if (!hdr_get(hdrc, hdrs, "message-id")) {
-				errno = EINVAL;
-				return -1;
-			}
-			if (!hdr_get(hdrc, hdrs, "subscription")) {
-				errno = EINVAL;
-				return -1;
-			}
-			break;
-		default: /* SPL_10 */
-			if (!hdr_get(hdrc, hdrs, "message-id")) {
-				errno = EINVAL;
-				return -1;
-			}
-	}
+	s->connect_timeout = timeout;
+	s->dns_ttl = dns_ttl;
 
-	
-	frame_reset(s->frame_out);
+	/* a shorter ttl applies to the cached addresses as well */
+	addrs_free(s);
 
-	if (frame_cmd_set(s->frame_out, "ACK")) {
-		return -1;
-	}
+	return 0;
+}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
-	}
+int stomp_passcred_set(stomp_session_t *s, int passcred)
+{
+	s->passcred = passcred != 0;
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
+	return 0;
+}
+
+int stomp_transport_set(stomp_session_t *s, const struct stomp_transport *t, void *ctx)
+{
+	if (t && (!t->connect || !t->readv || !t->writev || !t->fd || !t->close)) {
+		errno = EINVAL;
 		return -1;
 	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+
+	/* the current connection keeps the transport it was made with */
+	s->transport = t;
+	s->transport_ctx = ctx;
 
 	return 0;
 }
 
-int stomp_nack(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+int stomp_tls_set(stomp_session_t *s, const struct stomp_tls *tls)
 {
-	switch(s->protocol) {
-		case SPL_12:
-			if (!hdr_get(hdrc, hdrs, "id")) {
-				errno = EINVAL;
-				return -1;
-			}
-			break;
-		case SPL_11:
-			if (!hdr_get(hdrc, hdrs, "message-id")) {
-				errno = EINVAL;
-				return -1;
-			}
-			if (!hdr_get(hdrc, hdrs, "subscription")) {
-				errno = EINVAL;
-				return -1;
-			}
-			break;
-		default: /* SPL_10 */
-			errno = EINVAL;
+#ifdef STOMP_TLS
+	tls_t *t = NULL;
+
+	if (tls) {
+		t = tls_new(tls);
+		if (!t) {
 			return -1;
+		}
 	}
 
-	frame_reset(s->frame_out);
+	/* the current connection keeps its own reference to the settings */
+	tls_free(s->tls);
+	s->tls = t;
 
-	if (frame_cmd_set(s->frame_out, "NACK")) {
-		return -1;
-	}
-	
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+	return 0;
+#else
+	if (!tls) {
+		return 0;
 	}
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
-		return -1;
-	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+	errno = ENOSYS;
+	return -1;
+#endif
+}
 
-	return 0;
+enum stomp_tls_mode stomp_session_tls(stomp_session_t *s)
+{
+	return s->broker_fd == -1 ? STLS_NONE : s->tls_mode;
 }
 
-int stomp_commit(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+int stomp_reconnect_set(stomp_session_t *s, unsigned long min_delay, unsigned long max_delay, unsigned int attempts)
 {
-	if (!hdr_get(hdrc, hdrs, "transaction")) {
+	if (min_delay > max_delay) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	frame_reset(s->frame_out);
+	s->reconnect_min = min_delay;
+	s->reconnect_max = max_delay;
+	s->reconnect_attempts = attempts;
 
-	if (frame_cmd_set(s->frame_out, "COMMIT")) {
-		return -1;
+	return 0;
+}
+
+int stomp_session_reconnecting(stomp_session_t *s)
+{
+	return s->lost;
+}
+
+/* the first attempt is made right away, then the delay doubles up to 
+ * reconnect_max. half of it is random so a broker restart does not 
+ * bring all of its clients back at the same moment */
+static void backoff(stomp_session_t *s)
+{
+	unsigned long delay = 0;
+	unsigned int i;
+
+	if (s->attempts) {
+		delay = s->reconnect_min;
+		for (i = 1; i < s->attempts && delay < s->reconnect_max; i++) {
+			delay *= 2;
+		}
+
+		if (delay > s->reconnect_max) {
+			delay = s->reconnect_max;
+		}
+
+		delay = delay / 2 + (unsigned long)rand_r(&s->seed) % (delay / 2 + 1);
 	}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &s->reconnect_at);
+	s->reconnect_at.tv_sec += delay / 1000;
+	s->reconnect_at.tv_nsec += (delay % 1000) * 1000000;
+	if (s->reconnect_at.tv_nsec >= 1000000000) {
+		s->reconnect_at.tv_sec += 1;
+		s->reconnect_at.tv_nsec -= 1000000000;
 	}
+}
 
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
+/* the broker connection is gone. messages with a receipt id up to seq 
+ * are reported as lost. returns 0 if the session is going to reconnect */
+static int lost(stomp_session_t *s, unsigned long seq)
+{
+	if (!s->reconnect_min || s->disconnecting || !s->run) {
+		PROBE2(lost, s, errno);
 		s->run = 0;
 		return -1;
 	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+
+	if (s->lost) {
+		return 0;
+	}
+
+	PROBE2(lost, s, errno);
+	hangup(s);
+	s->lost = 1;
+	s->resume = 0;
+	s->connected = 0;
+	backoff(s);
+	/* the broker aborts the open transactions */
+	tx_clear(s);
+	batch_fail_all(s, ECONNRESET);
+	cork_discard(s);
+	confirm_upto(s, ECONNRESET, seq);
 
 	return 0;
 }
 
-int stomp_send(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, void *body, size_t body_len)
+/* not connected to the broker, the session may still be set up */
+static int offline(stomp_session_t *s)
 {
-	char buf[MAXBUFLEN];
-	const char *len;
+	return s->lost || s->broker_fd == -1;
+}
 
-	if (!hdr_get(hdrc, hdrs, "destination")) {
-		errno = EINVAL;
-		return -1;
-	}
+/* reconnected, but the messages queued meanwhile wait for CONNECTED. 
+ * newer ones must queue up behind them to keep their order */
+static int queueing(stomp_session_t *s)
+{
+	return s->resume && s->queue_len;
+}
 
-	frame_reset(s->frame_out);
+/* write a frame to the broker, or append it to the cork buffer */
+static int session_write_frame(stomp_session_t *s, frame_t *f)
+{
+	enum stomp_stats_cmd c;
+	const void *data;
+	ssize_t len;
+	char *tmp;
 
-	if (frame_cmd_set(s->frame_out, "SEND")) {
+	if (offline(s)) {
+		errno = ENOTCONN;
 		return -1;
 	}
-	
-	// frames SHOULD include a content-length
-	len = hdr_get(hdrc, hdrs, "content-length");
-	if (!len) {
-		snprintf(buf, MAXBUFLEN, "%lu", (unsigned long)body_len);
-		if (frame_hdr_add(s->frame_out, "content-length", buf)) {
+
+	if (!s->corked) {
+		frame_io_set(f, &s->io);
+		len = frame_write(s->broker_fd, f);
+		if (len < 0) {
+			(void)lost(s, s->receipt_seq);
 			return -1;
 		}
-	}
 
-	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
-		return -1;
+		c = stats_frame(s->stats.frames_out, s->stats.bytes_out, f, len);
+		PROBE3(frame__write, s, c, len);
+		clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+		return 0;
 	}
 
-	if (frame_body_set(s->frame_out, body, body_len)) {
+	len = frame_data(f, &data);
+	if (len < 0) {
 		return -1;
 	}
-	
-	if (frame_write(s->broker_fd, s->frame_out) < 0) {
-		s->run = 0;
-		return -1;
+	c = stats_frame(s->stats.frames_out, s->stats.bytes_out, f, len);
+	PROBE3(frame__write, s, c, len);
+
+	if (s->cork_capacity - s->cork_len < (size_t)len) {
+		size_t capacity = s->cork_capacity * 2;
+		if (capacity < s->cork_len + len + CORKINCLEN) {
+			capacity = s->cork_len + len + CORKINCLEN;
+		}
+
+		tmp = alloc_realloc(&s->alloc, s->cork, capacity);
+		if (!tmp) {
+			return -1;
+		}
+		STATS_ADD(s->stats.reallocs, 1);
+
+		s->cork = tmp;
+		s->cork_capacity = capacity;
 	}
-	
-	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
+
+	memcpy(s->cork + s->cork_len, data, len);
+	s->cork_len += len;
 
 	return 0;
 }
 
-static void on_connected(stomp_session_t *s) 
-{ 
-	struct stomp_ctx_connected e;
-	frame_t *f = s->frame_in;
-	unsigned long x, y;
-	const char *h;
-	size_t hdrc;
-	const struct stomp_hdr *hdrs;
-	enum stomp_prot v;
+/* write s->frame_out to the broker */
+static int session_write(stomp_session_t *s)
+{
+	return session_write_frame(s, s->frame_out);
+}
 
-	hdrc = frame_hdrs_get(f, &hdrs);
-	h = hdr_get(hdrc, hdrs, "version");
-	if (h && !parse_version(h, &v)) {
-		s->protocol = v;
+/* batch the frames written until the matching uncork() into a single write */
+static void cork(stomp_session_t *s)
+{
+	s->corked++;
+}
+
+static int uncork(stomp_session_t *s)
+{
+	size_t len = s->cork_len;
+
+	if (!s->corked || --s->corked || !len) {
+		return 0;
 	}
 
-	h = hdr_get(hdrc, hdrs, "heart-beat");
-	if (h && !parse_heartbeat(h, &x, &y)) {
-		if (!s->client_hb || !y) {
-			s->client_hb = 0;
-		} else {
-			s->client_hb = s->client_hb > y ? s->client_hb : y;
-		}
+	s->cork_len = 0;
 
-		if (!s->broker_hb || !x) {
-			s->broker_hb = 0;
-		} else {
-			s->broker_hb = s->broker_hb > x ? s->broker_hb : x;
-		}
-	} else {
-		s->client_hb = 0;
-		s->broker_hb = 0;
+	if (offline(s)) {
+		errno = ENOTCONN;
+		return -1;
 	}
 
-	if (!s->callbacks.connected) {
-		return;
+	STATS_ADD(s->stats.writes, 1);
+	if (net_write(&s->io, s->broker_fd, s->cork, len) < 0) {
+		(void)lost(s, s->receipt_seq);
+		return -1;
 	}
 
-	e.hdrc = hdrc;
-	e.hdrs = hdrs;
+	clock_gettime(CLOCK_MONOTONIC, &s->last_write);
 
-	s->callbacks.connected(s, &e, s->ctx);
+	return 0;
 }
 
-static void on_receipt(stomp_session_t *s) 
-{ 
-	struct stomp_ctx_receipt e;
-	frame_t *f = s->frame_in;
+/* drop whatever was written since cork() */
+static void cork_discard(stomp_session_t *s)
+{
+	s->corked = 0;
+	s->cork_len = 0;
+}
 
-	if (!s->callbacks.receipt) {
-		return;
-	}
+/* keep s->frame_out until the connection is back */
+static int queue_frame(stomp_session_t *s)
+{
+	frame_t **q;
+	frame_t *f;
 
-	e.hdrc = frame_hdrs_get(f, &e.hdrs);
+	if (s->queue_len >= s->send_window) {
+		errno = EAGAIN;
+		return -1;
+	}
 
-	s->callbacks.receipt(s, &e, s->ctx);
-}
+	if (s->queue_len == s->queue_capacity) {
+		size_t capacity = s->queue_capacity + QUEUEINCLEN;
+		q = alloc_realloc(&s->alloc, s->queue, capacity * sizeof(*q));
+		if (!q) {
+			return -1;
+		}
 
-static void on_error(stomp_session_t *s) 
-{ 
-	struct stomp_ctx_error e;
-	frame_t *f = s->frame_in;
+		s->queue = q;
+		s->queue_capacity = capacity;
+	}
 
-	if (!s->callbacks.error) {
-		return;
+	f = frame_new_with(&s->alloc);
+	if (!f) {
+		return -1;
 	}
 
-	e.hdrc = frame_hdrs_get(f, &e.hdrs);
-	e.body_len = frame_body_get(f, &e.body);
+	s->queue[s->queue_len++] = s->frame_out;
+	s->frame_out = f;
 
-	s->callbacks.error(s, &e, s->ctx);
+	return 0;
 }
 
-static void on_message(stomp_session_t *s) 
-{ 
-	struct stomp_ctx_message e;
-	frame_t *f = s->frame_in;
+static int resubscribe(struct sub *sub, void *ctx)
+{
+	stomp_session_t *s = ctx;
 
-	if (!s->callbacks.message) {
-		return;
+	if (subscribe_frame(s, sub)) {
+		return -1;
 	}
-	
-	e.hdrc = frame_hdrs_get(f, &e.hdrs);
-	e.body_len = frame_body_get(f, &e.body);
 
-	s->callbacks.message(s, &e, s->ctx);
+	return session_write(s);
 }
 
-static int on_server_cmd(stomp_session_t *s)
+/* CONNECT and every registered subscription in a single write. 
+ * the broker processes them in order, so messages can flow right after CONNECTED */
+static int connect_batch(stomp_session_t *s)
 {
-	int err;
-	const char *cmd;
-	size_t cmd_len;
-	frame_t *f = s->frame_in;
+	s->connected = 0;
+	s->refused = 0;
+	/* anything outstanding is redelivered on the new connection */
+	subs_credit_reset(s->subs);
 
-	frame_reset(f);
+	cork(s);
+	s->connect_sent = latency_clock();
 
-	err = frame_read(s->broker_fd, f);
-	if (err) {
+	if (connect_frame(s) || session_write(s) || subs_foreach(s->subs, resubscribe, s)) {
+		cork_discard(s);
 		return -1;
 	}
-	
-	cmd_len = frame_cmd_get(f, &cmd);
-	/* heart-beat */
-	if (!cmd_len) {
+
+	return uncork(s);
+}
+
+static int reconnect(stomp_session_t *s)
+{
+	s->attempts++;
+
+	if (dial(s)) {
+		if (s->reconnect_attempts && s->attempts >= s->reconnect_attempts) {
+			errno = ECONNREFUSED;
+			return -1;
+		}
+
+		backoff(s);
 		return 0;
 	}
 
-	if (!strncmp(cmd, "CONNECTED", cmd_len)) {
-		on_connected(s);
-	} else if (!strncmp(cmd, "ERROR", cmd_len)) {
-		on_error(s);
-	} else if (!strncmp(cmd, "RECEIPT", cmd_len)) {
-		on_receipt(s);
-	} else if (!strncmp(cmd, "MESSAGE", cmd_len)) {
-		on_message(s);
-	} else {
+	s->lost = 0;
+	s->resume = 1;
+	s->broker_timeouts = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s->last_read);
+
+	if (connect_batch(s) && !s->lost) {
 		return -1;
 	}
-	
+
 	return 0;
 }
 
-int stomp_run(stomp_session_t *s)
+/* send what could not be sent while the connection was down */
+static int resume(stomp_session_t *s)
 {
-	fd_set rd;
-	int r;
-	struct timeval tv;
-	unsigned long t; /* select timeout in milliseconds */
-	struct timespec now;
-	unsigned long elapsed;
+	size_t i;
+
+	s->resume = 0;
+	s->attempts = 0;
+
+	cork(s);
+	for (i = 0; i < s->queue_len; i++) {
+		if (session_write_frame(s, s->queue[i])) {
+			cork_discard(s);
+			return -1;
+		}
+	}
+
+	/* the frames stay queued for the next connection if this one fails */
+	if (uncork(s)) {
+		return -1;
+	}
+
+	for (i = 0; i < s->queue_len; i++) {
+		frame_free(s->queue[i]);
+	}
+
+	s->queue_len = 0;
+
+	return 0;
+}
+
+static void queue_clear(stomp_session_t *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->queue_len; i++) {
+		frame_free(s->queue[i]);
+	}
+
+	s->queue_len = 0;
+}
+
+/* the session is over */
+static void session_close(stomp_session_t *s)
+{
+	int err = errno;
+
+	hangup(s);
+	s->lost = 0;
+	s->connected = 0;
+	tx_clear(s);
+	batch_fail_all(s, ECONNRESET);
+	cork_discard(s);
+	queue_clear(s);
+	confirm_all(s, ECONNRESET);
+	errno = err;
+}
+
+int stomp_disconnect(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	s->disconnecting = 1;
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "DISCONNECT")) {
+		return -1;
+	}
+
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	if (session_write(s)) {
+		return -1;
+	}
+	PROBE1(disconnect, s);
+	
+	return 0;
+}
+
+/* build the SUBSCRIBE frame of a registered subscription */
+static int subscribe_frame(stomp_session_t *s, struct sub *sub)
+{
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "SUBSCRIBE")) {
+		return -1;
+	}
+	
+	if (sub->client_id && frame_hdr_add(s->frame_out, "id", sub->id)) {
+		return -1;
+	}
+	
+	if (!hdr_get(sub->hdrc, sub->hdrs, "ack") && frame_hdr_add(s->frame_out, "ack", "auto")) {
+		return -1;
+	}
+	
+	if (frame_hdrs_add(s->frame_out, sub->hdrc, sub->hdrs)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int subscribe(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, stomp_cb_t cb, void *ctx)
+{
+	const char *ack;
+	const char *id;
+	const char *destination;
+	char buf[MAXBUFLEN];
+	int client_id = 0;
+	struct sub *sub;
+
+	destination = hdr_get(hdrc, hdrs, "destination");
+	if (!destination) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	ack = hdr_get(hdrc, hdrs, "ack");
+	if (ack && strcmp(ack, "auto") && strcmp(ack, "client") && strcmp(ack, "client-individual")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	id = hdr_get(hdrc, hdrs, "id");
+	if (id && subs_get(s->subs, id)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (!id) {
+		/* skips ids still in use, including user supplied numeric ones */
+		client_id = subs_client_id_next(s->subs, s->client_id);
+		if (client_id < 0) {
+			return -1;
+		}
+		snprintf(buf, MAXBUFLEN, "%d", client_id);
+
+		id = buf;
+	} 
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	sub = subs_add(s->subs, id, client_id, destination);
+	if (!sub) {
+		return -1;
+	}
+
+	/* kept to subscribe again after a reconnect */
+	if (subs_hdrs_set(s->subs, sub, hdrc, hdrs)) {
+		subs_del(s->subs, sub);
+		return -1;
+	}
+
+	sub->cb = cb;
+	sub->ctx = ctx;
+	if (ack && !strcmp(ack, "client")) {
+		sub->ack_mode = SUB_ACK_CLIENT;
+	} else if (ack && !strcmp(ack, "client-individual")) {
+		sub->ack_mode = SUB_ACK_CLIENT_INDIVIDUAL;
+	}
+
+	if (subscribe_frame(s, sub)) {
+		subs_del(s->subs, sub);
+		return -1;
+	}
+	
+	/* without a connection the subscription is made by the next (re)connect */
+	if (session_write(s) && !offline(s)) {
+		subs_del(s->subs, sub);
+		return -1;
+	}
+
+	if (client_id) {
+		s->client_id = client_id;
+	}
+
+	return client_id;
+}
+
+int stomp_subscribe(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	return subscribe(s, hdrc, hdrs, NULL, NULL);
+}
+
+int stomp_subscribe_cb(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, stomp_cb_t cb, void *sub_ctx)
+{
+	if (!cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return subscribe(s, hdrc, hdrs, cb, sub_ctx);
+}
+
+int stomp_unsubscribe(stomp_session_t *s, int client_id, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	char buf[MAXBUFLEN];
+	const char *id = hdr_get(hdrc, hdrs, "id");
+	const char *destination = hdr_get(hdrc, hdrs, "destination");
+	struct sub *sub;
+
+	if (s->protocol == SPL_10) {
+		if (!destination && !id && !client_id) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else {
+		if (!id && !client_id) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "UNSUBSCRIBE")) {
+		return -1;
+	}
+	
+	// user provided client id. overrride all other supplied headers
+	if (client_id) {
+		snprintf(buf, MAXBUFLEN, "%lu", (unsigned long)client_id);
+		if (frame_hdr_add(s->frame_out, "id", buf)) {
+			return -1;
+		}
+	}
+	
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	/* without a connection there is nothing to unsubscribe from, 
+	 * dropping it from the registry keeps it from being resumed */
+	if (session_write(s) && !offline(s)) {
+		return -1;
+	}
+
+	if (client_id) {
+		sub = subs_get_client_id(s->subs, client_id);
+	} else if (id) {
+		sub = subs_get(s->subs, id);
+	} else {
+		sub = subs_get_destination(s->subs, destination);
+	}
+
+	if (sub) {
+		subs_del(s->subs, sub);
+	}
+
+	return 0;
+}
+
+static ssize_t tx_find(stomp_session_t *s, const char *id)
+{
+	size_t i;
+
+	for (i = 0; i < s->txs_len; i++) {
+		if (!strcmp(s->txs[i], id)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int tx_add(stomp_session_t *s, const char *id)
+{
+	char **tmp;
+	char *dup;
+
+	if (tx_find(s, id) >= 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (s->txs_len == s->txs_capacity) {
+		size_t capacity = s->txs_capacity + TXINCLEN;
+		tmp = alloc_realloc(NULL, s->txs, capacity * sizeof(*tmp));
+		if (!tmp) {
+			return -1;
+		}
+
+		s->txs = tmp;
+		s->txs_capacity = capacity;
+	}
+
+	dup = alloc_strdup(NULL, id);
+	if (!dup) {
+		return -1;
+	}
+
+	s->txs[s->txs_len++] = dup;
+
+	return 0;
+}
+
+static void tx_del(stomp_session_t *s, const char *id)
+{
+	ssize_t i = tx_find(s, id);
+
+	if (i < 0) {
+		return;
+	}
+
+	alloc_free(NULL, s->txs[i]);
+	s->txs[i] = s->txs[--s->txs_len];
+}
+
+static void tx_clear(stomp_session_t *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->txs_len; i++) {
+		alloc_free(NULL, s->txs[i]);
+	}
+
+	s->txs_len = 0;
+}
+
+int stomp_begin(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	const char *tx = hdr_get(hdrc, hdrs, "transaction");
+
+	if (!tx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tx_find(s, tx) >= 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "BEGIN")) {
+		return -1;
+	}
+
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+	
+	if (session_write(s)) {
+		return -1;
+	}
+
+	/* failing to remember it only means the id is not checked */
+	(void)tx_add(s, tx);
+
+	return 0;
+}
+
+int stomp_abort(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	if (!hdr_get(hdrc, hdrs, "transaction")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "ABORT")) {
+		return -1;
+	}
+
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	if (session_write(s)) {
+		return -1;
+	}
+
+	tx_del(s, hdr_get(hdrc, hdrs, "transaction"));
+
+	return 0;
+}
+
+/* the value identifying a message in ACK/NACK frames */
+static const char *ack_key(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, int message)
+{
+	if (s->protocol == SPL_12) {
+		return hdr_get(hdrc, hdrs, message ? "ack" : "id");
+	}
+
+	return hdr_get(hdrc, hdrs, "message-id");
+}
+
+/* give the credit held by the acknowledged messages back */
+static void release(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	const char *key;
+	const char *id;
+	struct sub *sub = NULL;
+
+	key = ack_key(s, hdrc, hdrs, 0);
+
+	id = hdr_get(hdrc, hdrs, "subscription");
+	if (id) {
+		sub = subs_get(s->subs, id);
+	} 
+	
+	if (!sub) {
+		/* STOMP 1.2 acks do not carry the subscription */
+		sub = subs_get_pending(s->subs, key);
+	}
+
+	if (sub) {
+		subs_release(s->subs, sub, key, 0);
+	}
+}
+
+static struct sub *sub_find(stomp_session_t *s, int client_id, const char *id)
+{
+	if (client_id) {
+		return subs_get_client_id(s->subs, client_id);
+	}
+
+	return subs_get(s->subs, id);
+}
+
+int stomp_subscription_window_set(stomp_session_t *s, int client_id, const char *id, size_t messages, size_t bytes)
+{
+	struct sub *sub;
+
+	sub = sub_find(s, client_id, id);
+	if (!sub) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	subs_window_set(s->subs, sub, messages, bytes);
+
+	return 0;
+}
+
+int stomp_subscription_credit_get(stomp_session_t *s, int client_id, const char *id, size_t *messages, size_t *bytes)
+{
+	struct sub *sub;
+
+	sub = sub_find(s, client_id, id);
+	if (!sub) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (messages) {
+		if (!sub->window_msgs) {
+			*messages = SIZE_MAX;
+		} else {
+			*messages = sub->msgs < sub->window_msgs ? sub->window_msgs - sub->msgs : 0;
+		}
+	}
+
+	if (bytes) {
+		if (!sub->window_bytes) {
+			*bytes = SIZE_MAX;
+		} else {
+			*bytes = sub->bytes < sub->window_bytes ? sub->window_bytes - sub->bytes : 0;
+		}
+	}
+
+	return 0;
+}
+
+int stomp_session_throttled(stomp_session_t *s)
+{
+	return subs_exhausted(s->subs) > 0;
+}
+
+int stomp_ack(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	switch(s->protocol) {
+		case SPL_12:
+			if (!hdr_get(hdrc, hdrs, "id")) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		case SPL_11:
+			if (!hdr_get(hdrc, hdrs, "message-id")) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (!hdr_get(hdrc, hdrs, "subscription")) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		default: /* SPL_10 */
+			if (!hdr_get(hdrc, hdrs, "message-id")) {
+				errno = EINVAL;
+				return -1;
+			}
+	}
+
+	
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "ACK")) {
+		return -1;
+	}
+
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	if (session_write(s)) {
+		return -1;
+	}
+	release(s, hdrc, hdrs);
+
+	return 0;
+}
+
+int stomp_nack(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	switch(s->protocol) {
+		case SPL_12:
+			if (!hdr_get(hdrc, hdrs, "id")) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		case SPL_11:
+			if (!hdr_get(hdrc, hdrs, "message-id")) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (!hdr_get(hdrc, hdrs, "subscription")) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		default: /* SPL_10 */
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "NACK")) {
+		return -1;
+	}
+	
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	if (session_write(s)) {
+		return -1;
+	}
+	release(s, hdrc, hdrs);
+
+	return 0;
+}
+
+int stomp_commit(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	if (!hdr_get(hdrc, hdrs, "transaction")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "COMMIT")) {
+		return -1;
+	}
+
+	if (frame_hdrs_add(s->frame_out, hdrc, hdrs)) {
+		return -1;
+	}
+
+	if (session_write(s)) {
+		return -1;
+	}
+
+	tx_del(s, hdr_get(hdrc, hdrs, "transaction"));
+
+	return 0;
+}
+
+static int send_frame(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, const struct stomp_hdr_len *lens, 
+		void *body, size_t body_len, const char *receipt, const char *tx)
+{
+	char buf[MAXBUFLEN];
+	const char *len;
+
+	if (!hdr_get(hdrc, hdrs, "destination")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "SEND")) {
+		return -1;
+	}
+	
+	// frames SHOULD include a content-length
+	len = hdr_get(hdrc, hdrs, "content-length");
+	if (!len) {
+		snprintf(buf, MAXBUFLEN, "%lu", (unsigned long)body_len);
+		if (frame_hdr_add(s->frame_out, "content-length", buf)) {
+			return -1;
+		}
+	}
+
+	if (receipt && frame_hdr_add(s->frame_out, "receipt", receipt)) {
+		return -1;
+	}
+
+	if (tx && frame_hdr_add(s->frame_out, "transaction", tx)) {
+		return -1;
+	}
+
+	if (frame_hdrs_addn(s->frame_out, hdrc, hdrs, lens)) {
+		return -1;
+	}
+
+	if (frame_body_set(s->frame_out, body, body_len)) {
+		return -1;
+	}
+
+	if (queueing(s)) {
+		return queue_frame(s);
+	}
+	
+	if (!session_write(s)) {
+		return 0;
+	}
+
+	/* written as soon as the connection is back */
+	if (s->lost) {
+		return queue_frame(s);
+	}
+
+	return -1;
+}
+
+static void batch_report(stomp_session_t *s, const struct batch *b, int status, frame_t *f)
+{
+	struct stomp_ctx_batch e;
+	char buf[MAXBUFLEN + sizeof(BATCHPREFIX)];
+
+	if (!s->callbacks.batch) {
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	snprintf(buf, sizeof(buf), BATCHPREFIX "%lu", b->seq);
+	e.transaction = buf;
+	e.messages = b->messages;
+	e.bytes = b->bytes;
+	e.status = status;
+
+	if (f) {
+		e.hdrc = frame_hdrs_get(f, &e.hdrs);
+		e.body_len = frame_body_get(f, &e.body);
+	}
+
+	s->callbacks.batch(s, &e, s->ctx);
+}
+
+/* start a transaction and hold back the writes until it is committed */
+static int batch_begin(stomp_session_t *s)
+{
+	char buf[MAXBUFLEN + sizeof(BATCHPREFIX)];
+	struct batch *tmp;
+
+	/* room for the commit, so committing never fails for lack of memory */
+	if (s->commits_len == s->commits_capacity) {
+		size_t capacity = s->commits_capacity + TXINCLEN;
+		tmp = alloc_realloc(&s->alloc, s->commits, capacity * sizeof(*tmp));
+		if (!tmp) {
+			return -1;
+		}
+
+		s->commits = tmp;
+		s->commits_capacity = capacity;
+	}
+
+	/* unique among the open transactions, including the user's */
+	do {
+		s->batch_seq++;
+		if (!s->batch_seq) {
+			s->batch_seq++;
+		}
+		snprintf(buf, sizeof(buf), BATCHPREFIX "%lu", s->batch_seq);
+	} while (tx_find(s, buf) >= 0);
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "BEGIN")) {
+		return -1;
+	}
+
+	if (frame_hdr_add(s->frame_out, "transaction", buf)) {
+		return -1;
+	}
+
+	if (tx_add(s, buf)) {
+		return -1;
+	}
+
+	cork(s);
+
+	if (session_write(s)) {
+		tx_del(s, buf);
+		(void)uncork(s);
+		return -1;
+	}
+
+	s->batch_open = 1;
+	s->batch_msgs = 0;
+	s->batch_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s->batch_deadline);
+	s->batch_deadline.tv_sec += s->batch_timeout / 1000;
+	s->batch_deadline.tv_nsec += (s->batch_timeout % 1000) * 1000000;
+	if (s->batch_deadline.tv_nsec >= 1000000000) {
+		s->batch_deadline.tv_sec += 1;
+		s->batch_deadline.tv_nsec -= 1000000000;
+	}
+
+	return 0;
+}
+
+/* COMMIT the open batch and write everything held back since BEGIN */
+static int batch_commit(stomp_session_t *s)
+{
+	char buf[MAXBUFLEN + sizeof(BATCHPREFIX)];
+	struct batch *b;
+
+	if (!s->batch_open) {
+		return 0;
+	}
+
+	s->batch_open = 0;
+	snprintf(buf, sizeof(buf), BATCHPREFIX "%lu", s->batch_seq);
+	tx_del(s, buf);
+
+	b = &s->commits[s->commits_len];
+	b->seq = s->batch_seq;
+	b->messages = s->batch_msgs;
+	b->bytes = s->batch_bytes;
+	b->sent = latency_clock();
+
+	out_reset(s);
+
+	if (frame_cmd_set(s->frame_out, "COMMIT") || 
+	    frame_hdr_add(s->frame_out, "transaction", buf) ||
+	    frame_hdr_add(s->frame_out, "receipt", buf) ||
+	    session_write(s)) {
+		/* without the COMMIT the broker would hold the messages until the connection ends */
+		cork_discard(s);
+		batch_report(s, b, errno, NULL);
+		return -1;
+	}
+
+	s->commits_len++;
+
+	/* a failing write reports the batch once the connection is found lost */
+	return uncork(s);
+}
+
+/* commit the open batch before a frame that is not one of its SENDs, 
+ * so the frame is written right away and never discarded with the batch. 
+ * a lost connection is left to the write of the frame to report */
+static int batch_end(stomp_session_t *s)
+{
+	if (batch_commit(s) && !offline(s)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void batch_confirm(stomp_session_t *s, unsigned long seq, int status, frame_t *f)
+{
+	struct batch b;
+	size_t i;
+
+	for (i = 0; i < s->commits_len; i++) {
+		if (s->commits[i].seq == seq) {
+			break;
+		}
+	}
+
+	if (i == s->commits_len) {
+		return;
+	}
+
+	b = s->commits[i];
+	memmove(&s->commits[i], &s->commits[i + 1], (s->commits_len - i - 1) * sizeof(*s->commits));
+	s->commits_len--;
+
+	if (!status) {
+		latency(s, SLT_RECEIPT, b.sent, latency_clock());
+	}
+
+	batch_report(s, &b, status, f);
+}
+
+static void batch_fail_all(stomp_session_t *s, int status)
+{
+	struct batch b;
+	int err = errno;
+
+	if (s->batch_open) {
+		s->batch_open = 0;
+		b.seq = s->batch_seq;
+		b.messages = s->batch_msgs;
+		b.bytes = s->batch_bytes;
+		batch_report(s, &b, status, NULL);
+	}
+
+	while (s->commits_len) {
+		batch_confirm(s, s->commits[0].seq, status, NULL);
+	}
+
+	errno = err;
+}
+
+static void batch_expired(stomp_session_t *s)
+{
+	struct timespec now;
+
+	if (!s->batch_open || !s->batch_timeout) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > s->batch_deadline.tv_sec || 
+	   (now.tv_sec == s->batch_deadline.tv_sec && now.tv_nsec >= s->batch_deadline.tv_nsec)) {
+		(void)batch_commit(s);
+	}
+}
+
+/* numeric part of a transaction id generated for a batch, 0 if none */
+static unsigned long batch_seq(const char *id)
+{
+	unsigned long seq;
+	char *endptr;
+
+	if (!id || strncmp(id, BATCHPREFIX, sizeof(BATCHPREFIX) - 1)) {
+		return 0;
+	}
+
+	id += sizeof(BATCHPREFIX) - 1;
+	errno = 0;
+	seq = strtoul(id, &endptr, 10);
+	if (errno || endptr == id || *endptr) {
+		return 0;
+	}
+
+	return seq;
+}
+
+int stomp_batch_set(stomp_session_t *s, size_t messages, size_t bytes, unsigned long timeout)
+{
+	/* the open batch was started with the old limits */
+	if (batch_commit(s)) {
+		return -1;
+	}
+
+	s->batch_max_msgs = messages;
+	s->batch_max_bytes = bytes;
+	s->batch_timeout = timeout;
+
+	return 0;
+}
+
+int stomp_batch_flush(stomp_session_t *s)
+{
+	return batch_commit(s);
+}
+
+int stomp_send(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, void *body, size_t body_len)
+{
+	return stomp_send_len(s, hdrc, hdrs, NULL, body, body_len);
+}
+
+int stomp_send_len(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, const struct stomp_hdr_len *lens, 
+		void *body, size_t body_len)
+{
+	char buf[MAXBUFLEN + sizeof(BATCHPREFIX)];
+
+	if (!s->batch_max_msgs || offline(s) || queueing(s) || hdr_get(hdrc, hdrs, "transaction")) {
+		if (batch_end(s)) {
+			return -1;
+		}
+		return send_frame(s, hdrc, hdrs, lens, body, body_len, NULL, NULL);
+	}
+
+	if (!s->batch_open && batch_begin(s)) {
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), BATCHPREFIX "%lu", s->batch_seq);
+	if (send_frame(s, hdrc, hdrs, lens, body, body_len, NULL, buf)) {
+		return -1;
+	}
+
+	s->batch_msgs++;
+	s->batch_bytes += body_len;
+
+	if (s->batch_msgs >= s->batch_max_msgs || 
+	    (s->batch_max_bytes && s->batch_bytes >= s->batch_max_bytes)) {
+		return batch_commit(s);
+	}
+
+	return 0;
+}
+
+int stomp_send_async(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, void *body, size_t body_len, void *msg_ctx)
+{
+	char buf[MAXBUFLEN + sizeof(RECEIPTPREFIX)];
+	struct receipt *r;
+	unsigned long seq;
+
+	if (hdr_get(hdrc, hdrs, "receipt")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (receipts_len(s->receipts) >= s->send_window) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (batch_end(s)) {
+		return -1;
+	}
+
+	seq = s->receipt_seq + 1;
+	if (!seq) {
+		seq = 1;
+	}
+
+	/* record first, so a failing allocation does not leave an untracked message behind */
+	r = receipts_add(s->receipts, seq);
+	if (!r) {
+		return -1;
+	}
+
+	r->ctx = msg_ctx;
+	if (s->send_timeout) {
+		clock_gettime(CLOCK_MONOTONIC, &r->deadline);
+		r->deadline.tv_sec += s->send_timeout / 1000;
+		r->deadline.tv_nsec += (s->send_timeout % 1000) * 1000000;
+		if (r->deadline.tv_nsec >= 1000000000) {
+			r->deadline.tv_sec += 1;
+			r->deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	snprintf(buf, sizeof(buf), RECEIPTPREFIX "%lu", seq);
+	r->sent = latency_clock();
+	if (send_frame(s, hdrc, hdrs, NULL, body, body_len, buf, NULL)) {
+		receipts_del(s->receipts, seq);
+		return -1;
+	}
+
+	s->receipt_seq = seq;
+
+	return 0;
+}
+
+int stomp_send_window_set(stomp_session_t *s, size_t window, unsigned long timeout)
+{
+	if (!window) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (receipts_reserve(s->receipts, window)) {
+		return -1;
+	}
+
+	s->send_window = window;
+	s->send_timeout = timeout;
+
+	return 0;
+}
+
+/* numeric part of a receipt id generated by stomp_send_async(), 0 if none */
+static unsigned long receipt_seq(const char *id)
+{
+	unsigned long seq;
+	char *endptr;
+
+	if (!id || strncmp(id, RECEIPTPREFIX, sizeof(RECEIPTPREFIX) - 1)) {
+		return 0;
+	}
+
+	id += sizeof(RECEIPTPREFIX) - 1;
+	errno = 0;
+	seq = strtoul(id, &endptr, 10);
+	if (errno || endptr == id || *endptr) {
+		return 0;
+	}
+
+	return seq;
+}
+
+static void confirm(stomp_session_t *s, struct receipt *r, int status, frame_t *f)
+{
+	struct stomp_ctx_confirm e;
+	char buf[MAXBUFLEN + sizeof(RECEIPTPREFIX)];
+	unsigned long seq = r->seq;
+
+	memset(&e, 0, sizeof(e));
+	snprintf(buf, sizeof(buf), RECEIPTPREFIX "%lu", seq);
+	e.receipt = buf;
+	e.msg_ctx = r->ctx;
+	e.status = status;
+
+	if (!status) {
+		latency(s, SLT_RECEIPT, r->sent, latency_clock());
+	}
+
+	if (f) {
+		e.hdrc = frame_hdrs_get(f, &e.hdrs);
+		e.body_len = frame_body_get(f, &e.body);
+	}
+
+	/* the callback may send, which can move entries around */
+	receipts_del(s->receipts, seq);
+	while (s->receipt_oldest <= s->receipt_seq && !receipts_get(s->receipts, s->receipt_oldest)) {
+		s->receipt_oldest++;
+	}
+
+	if (s->callbacks.confirm) {
+		s->callbacks.confirm(s, &e, s->ctx);
+	}
+}
+
+/* report timed out in-flight messages. they are sent in deadline order 
+ * and receipt_oldest skips the answered ones, so only the oldest need to be looked at */
+static void confirm_expired(stomp_session_t *s)
+{
+	struct timespec now;
+	struct receipt *r;
+
+	if (!s->send_timeout) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (receipts_len(s->receipts)) {
+		r = receipts_get(s->receipts, s->receipt_oldest);
+		if (!r) {
+			s->receipt_oldest++;
+			continue;
+		}
+
+		if (r->deadline.tv_sec > now.tv_sec || 
+		   (r->deadline.tv_sec == now.tv_sec && r->deadline.tv_nsec > now.tv_nsec)) {
+			break;
+		}
+
+		confirm(s, r, ETIMEDOUT, NULL);
+	}
+}
+
+/* report the in-flight messages with a receipt id up to seq as lost */
+static void confirm_upto(stomp_session_t *s, int status, unsigned long seq)
+{
+	struct receipt *r;
+	int err = errno;
+
+	while (receipts_len(s->receipts) && s->receipt_oldest <= seq) {
+		r = receipts_get(s->receipts, s->receipt_oldest);
+		if (!r) {
+			s->receipt_oldest++;
+			continue;
+		}
+
+		confirm(s, r, status, NULL);
+	}
+
+	errno = err;
+}
+
+/* report every in-flight message as lost */
+static void confirm_all(stomp_session_t *s, int status)
+{
+	confirm_upto(s, status, ULONG_MAX);
+}
+
+static void on_connected(stomp_session_t *s) 
+{ 
+	struct stomp_ctx_connected e;
+	frame_t *f = s->frame_in;
+	unsigned long x, y;
+	const char *h;
+	size_t hdrc;
+	const struct stomp_hdr *hdrs;
+	enum stomp_prot v;
+
+	hdrc = frame_hdrs_get(f, &hdrs);
+	s->connected = 1;
+	latency(s, SLT_CONNECT, s->connect_sent, latency_clock());
+	PROBE2(connected, s, latency_clock() - s->connect_sent);
+
+	h = hdr_get(hdrc, hdrs, "version");
+	if (h && !parse_version(h, &v)) {
+		s->protocol = v;
+	}
+
+	h = hdr_get(hdrc, hdrs, "heart-beat");
+	if (h && !parse_heartbeat(h, &x, &y)) {
+		if (!s->client_hb || !y) {
+			s->client_hb = 0;
+		} else {
+			s->client_hb = s->client_hb > y ? s->client_hb : y;
+		}
+
+		if (!s->broker_hb || !x) {
+			s->broker_hb = 0;
+		} else {
+			s->broker_hb = s->broker_hb > x ? s->broker_hb : x;
+		}
+	} else {
+		s->client_hb = 0;
+		s->broker_hb = 0;
+	}
+
+	if (s->resume && resume(s)) {
+		return;
+	}
+
+	if (!s->callbacks.connected) {
+		return;
+	}
+
+	e.hdrc = hdrc;
+	e.hdrs = hdrs;
+
+	s->callbacks.connected(s, &e, s->ctx);
+}
+
+static void on_receipt(stomp_session_t *s) 
+{ 
+	struct stomp_ctx_receipt e;
+	frame_t *f = s->frame_in;
+	struct receipt *r;
+	unsigned long seq;
+
+	e.hdrc = frame_hdrs_get(f, &e.hdrs);
+
+	seq = receipt_seq(hdr_get(e.hdrc, e.hdrs, "receipt-id"));
+	if (seq) {
+		r = receipts_get(s->receipts, seq);
+		if (r) {
+			confirm(s, r, 0, f);
+		}
+		return;
+	}
+
+	seq = batch_seq(hdr_get(e.hdrc, e.hdrs, "receipt-id"));
+	if (seq) {
+		batch_confirm(s, seq, 0, f);
+		return;
+	}
+
+	if (!s->callbacks.receipt) {
+		return;
+	}
+
+	s->callbacks.receipt(s, &e, s->ctx);
+}
+
+static void on_error(stomp_session_t *s) 
+{ 
+	struct stomp_ctx_error e;
+	frame_t *f = s->frame_in;
+	struct receipt *r;
+	unsigned long seq;
+
+	e.hdrc = frame_hdrs_get(f, &e.hdrs);
+	e.body_len = frame_body_get(f, &e.body);
+
+	r = receipts_get(s->receipts, receipt_seq(hdr_get(e.hdrc, e.hdrs, "receipt-id")));
+	if (r) {
+		confirm(s, r, EPROTO, f);
+	}
+
+	seq = batch_seq(hdr_get(e.hdrc, e.hdrs, "receipt-id"));
+	if (seq) {
+		batch_confirm(s, seq, EPROTO, f);
+	}
+
+	/* CONNECT was rejected along with anything pipelined after it. 
+	 * connecting again would not change that, the session is over. 
+	 * the subscriptions stay registered for the next stomp_connect() */
+	if (!s->connected) {
+		s->refused = 1;
+		s->run = 0;
+	}
+
+	if (!s->callbacks.error) {
+		return;
+	}
+
+	s->callbacks.error(s, &e, s->ctx);
+}
+
+static int on_message(stomp_session_t *s) 
+{ 
+	struct stomp_ctx_message e;
+	frame_t *f = s->frame_in;
+	struct sub *sub;
+	const char *id;
+
+	e.hdrc = frame_hdrs_get(f, &e.hdrs);
+	e.body_len = frame_body_get(f, &e.body);
+	e.body_fd = frame_body_fd(f);
+
+	id = hdr_get(e.hdrc, e.hdrs, "subscription");
+	sub = subs_get(s->subs, id);
+	if (sub && subs_consume(s->subs, sub, ack_key(s, e.hdrc, e.hdrs, 1), e.body_len)) {
+		return -1;
+	}
+
+	if (sub && sub->cb) {
+		sub->cb(s, &e, sub->ctx);
+	} else if (s->callbacks.message) {
+		s->callbacks.message(s, &e, s->ctx);
+	}
+
+	/* auto acked messages are done once dispatched. the callback 
+	 * may have unsubscribed so look the subscription up again */
+	sub = subs_get(s->subs, id);
+	if (sub && sub->ack_mode == SUB_ACK_AUTO) {
+		subs_release(s->subs, sub, NULL, e.body_len);
+	}
+
+	return 0;
+}
+
+static int on_server_cmd(stomp_session_t *s)
+{
+	unsigned long long start, ns;
+	enum stomp_stats_cmd c;
+	int err;
+	const char *cmd;
+	size_t cmd_len;
+	frame_t *f;
+
+	/* the previous frame was retained, take a recycled one */
+	if (!s->in) {
+		s->in = pool_get(s->pool);
+		if (!s->in) {
+			return -1;
+		}
+		s->frame_in = s->in->frame;
+	}
+
+	f = s->frame_in;
+	if (frame_trim(f, s->limits.keep)) {
+		s->trims++;
+	}
+	frame_reset(f);
+	frame_limits_set(f, &s->limits);
+	frame_stats_set(f, &s->stats);
+	frame_io_set(f, &s->io);
+
+	PROBE1(frame__read__start, s);
+	err = frame_read(s->broker_fd, f);
+	if (err) {
+		return -1;
+	}
+
+	if (frame_len(f) > s->peak) {
+		s->peak = frame_len(f);
+	}
+	
+	cmd_len = frame_cmd_get(f, &cmd);
+	/* heart-beat */
+	if (!cmd_len) {
+		STATS_ADD(s->stats.frames_in[SSC_HEARTBEAT], 1);
+		STATS_ADD(s->stats.bytes_in[SSC_HEARTBEAT], 1);
+		PROBE3(frame__read__end, s, SSC_HEARTBEAT, 1);
+		PROBE1(heartbeat__received, s);
+		return 0;
+	}
+
+	c = stats_frame(s->stats.frames_in, s->stats.bytes_in, f, frame_len(f));
+	PROBE3(frame__read__end, s, c, frame_len(f));
+	start = stats_clock();
+	latency(s, SLT_DISPATCH, s->readable_at, start);
+	s->dispatching = 1;
+
+	if (!strncmp(cmd, "CONNECTED", cmd_len)) {
+		on_connected(s);
+	} else if (!strncmp(cmd, "ERROR", cmd_len)) {
+		on_error(s);
+	} else if (!strncmp(cmd, "RECEIPT", cmd_len)) {
+		on_receipt(s);
+	} else if (!strncmp(cmd, "MESSAGE", cmd_len)) {
+		err = on_message(s);
+	} else {
+		err = -1;
+	}
+
+	s->dispatching = 0;
+	ns = stats_callback(s, start);
+	PROBE3(dispatch, s, c, ns);
+
+	/* the client code owns the frame now */
+	if (__atomic_load_n(&s->in->refs, __ATOMIC_ACQUIRE) > 1) {
+		pool_put(s->in);
+		s->in = NULL;
+		s->frame_in = NULL;
+	}
+	
+	return err;
+}
+
+int stomp_stats_get(stomp_session_t *s, struct stomp_stats *st)
+{
+	size_t i;
+
+	if (!s || !st) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < SSC_MAX; i++) {
+		st->frames_in[i] = STATS_GET(s->stats.frames_in[i]);
+		st->bytes_in[i] = STATS_GET(s->stats.bytes_in[i]);
+		st->frames_out[i] = STATS_GET(s->stats.frames_out[i]);
+		st->bytes_out[i] = STATS_GET(s->stats.bytes_out[i]);
+	}
+
+	st->reads = STATS_GET(s->stats.reads);
+	st->writes = STATS_GET(s->stats.writes);
+	st->reallocs = STATS_GET(s->stats.reallocs);
+	st->hb_missed = STATS_GET(s->stats.hb_missed);
+	st->callbacks = STATS_GET(s->stats.callbacks);
+	st->callback_ns = STATS_GET(s->stats.callback_ns);
+	st->capacity = STATS_GET(s->stats.capacity);
+	st->queue = STATS_GET(s->stats.queue);
+	st->inflight = STATS_GET(s->stats.inflight);
+
+	return 0;
+}
+
+int stomp_latency_get(stomp_session_t *s, enum stomp_latency_type type, struct stomp_latency *l, int reset)
+{
+#ifdef STOMP_HISTOGRAMS
+	struct hist *h;
+
+	if (!s || !l || type < 0 || type >= SLT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h = __atomic_load_n(&s->latency, __ATOMIC_ACQUIRE);
+	if (!h) {
+		memset(l, 0, sizeof(*l));
+		return 0;
+	}
+
+	hist_read(&h[type], l, reset);
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int stomp_limits_set(stomp_session_t *s, const struct stomp_limits *l)
+{
+	if (!l) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->limits = *l;
+
+	return 0;
+}
+
+void stomp_session_memory(stomp_session_t *s, struct stomp_memory *m)
+{
+	size_t i;
+
+	memset(m, 0, sizeof(*m));
+
+	m->frames = frame_held(s->frame_out) + pool_held(s->pool);
+	if (s->frame_in) {
+		m->frames += frame_held(s->frame_in);
+	}
+
+	for (i = 0; i < s->queue_len; i++) {
+		m->frames += frame_held(s->queue[i]);
+	}
+
+	m->cork = s->cork_capacity;
+	m->peak = s->peak;
+	m->trims = s->trims;
+}
+
+int stomp_set_allocator(stomp_session_t *s, const struct stomp_allocator *a)
+{
+	struct stomp_allocator old;
+	frame_t **queue = NULL;
+	struct batch *commits = NULL;
+	receipts_t *receipts = NULL;
+	subs_t *subs = NULL;
+
+	if (!s) {
+		return alloc_global_set(a);
+	}
+
+	/* the frame handed to the callback would be freed under it */
+	if (s->dispatching) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* subscriptions are referred to by pointer, they cannot be moved */
+	if (subs_len(s->subs)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (a && (!a->malloc_fn || !a->realloc_fn || !a->free_fn)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	old = s->alloc;
+	if (a) {
+		s->alloc = *a;
+	} else {
+		alloc_global_get(&s->alloc);
+	}
+
+	/* everything which can fail first, the old hooks stay in use until it did not */
+	if (s->queue_capacity) {
+		queue = alloc_malloc(&s->alloc, s->queue_capacity * sizeof(*queue));
+		if (!queue) {
+			goto stomp_set_allocator_error;
+		}
+	}
+
+	if (s->commits_capacity) {
+		commits = alloc_malloc(&s->alloc, s->commits_capacity * sizeof(*commits));
+		if (!commits) {
+			goto stomp_set_allocator_error;
+		}
+	}
+
+	receipts = receipts_copy(s->receipts, &s->alloc);
+	if (!receipts) {
+		goto stomp_set_allocator_error;
+	}
+
+	subs = subs_new(&s->alloc);
+	if (!subs) {
+		goto stomp_set_allocator_error;
+	}
+
+	if (session_frames_renew(s)) {
+		goto stomp_set_allocator_error;
+	}
+
+	if (queue) {
+		memcpy(queue, s->queue, s->queue_len * sizeof(*queue));
+	}
+	alloc_free(&old, s->queue);
+	s->queue = queue;
+
+	if (commits) {
+		memcpy(commits, s->commits, s->commits_len * sizeof(*commits));
+	}
+	alloc_free(&old, s->commits);
+	s->commits = commits;
+
+	receipts_free(s->receipts);
+	s->receipts = receipts;
+
+	subs_free(s->subs);
+	s->subs = subs;
+
+	/* empty between calls, grown again with the new hooks on the next cork() */
+	alloc_free(&old, s->cork);
+	s->cork = NULL;
+	s->cork_capacity = 0;
+
+	pool_allocator_set(s->pool, &s->alloc);
+
+	return 0;
+
+stomp_set_allocator_error:
+
+	if (subs) {
+		subs_free(subs);
+	}
+
+	if (receipts) {
+		receipts_free(receipts);
+	}
+
+	alloc_free(&s->alloc, commits);
+	alloc_free(&s->alloc, queue);
+	s->alloc = old;
+
+	return -1;
+}
+
+stomp_message_t *stomp_message_retain(stomp_session_t *s)
+{
+	if (!s->dispatching) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	__atomic_add_fetch(&s->in->refs, 1, __ATOMIC_RELAXED);
+
+	return s->in;
+}
+
+void stomp_message_release(stomp_message_t *m)
+{
+	pool_put(m);
+}
+
+size_t stomp_message_hdrs_get(stomp_message_t *m, const struct stomp_hdr **hdrs)
+{
+	return frame_hdrs_get(m->frame, hdrs);
+}
+
+size_t stomp_message_body_get(stomp_message_t *m, const void **body)
+{
+	return frame_body_get(m->frame, body);
+}
+
+int stomp_message_body_fd(stomp_message_t *m)
+{
+	return frame_body_fd(m->frame);
+}
+
+int stomp_session_fd(stomp_session_t *s)
+{
+	return s->broker_fd;
+}
+
+unsigned long stomp_session_timeout(stomp_session_t *s)
+{
+	struct timespec now;
+	long elapsed;
+	long t;
+
+	if (s->lost) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t = (s->reconnect_at.tv_sec - now.tv_sec) * 1000 + \
+		    (s->reconnect_at.tv_nsec - now.tv_nsec) / 1000000;
+		return t < 0 ? 0 : t < 1000 ? t : 1000;
+	}
+
+	/* the socket may never become readable for it */
+	if (buffered(s) && !stomp_session_throttled(s)) {
+		return 0;
+	}
 
 	if (!s->broker_hb && !s->client_hb) {
 		t = 1000;
@@ -784,69 +2759,260 @@ int stomp_run(stomp_session_t *s)
 	} else {
 		t = s->broker_hb > s->client_hb ? s->broker_hb : s->client_hb;
 	}
+
+	/* wake up in time for the next heart-beat, not a period after the last wake up */
+	if (s->client_hb) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - s->last_write.tv_sec) * 1000 + \
+			  (now.tv_nsec - s->last_write.tv_nsec) / 1000000;
+		elapsed = (long)s->client_hb - elapsed;
+		if (elapsed < t) {
+			t = elapsed < 0 ? 0 : elapsed;
+		}
+	}
+
+	/* wake up in time to commit the open batch */
+	if (s->batch_open && s->batch_timeout) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (s->batch_deadline.tv_sec - now.tv_sec) * 1000 + \
+			  (s->batch_deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (elapsed < t) {
+			t = elapsed < 0 ? 0 : elapsed;
+		}
+	}
+
+	return t;
+}
+
+int stomp_session_step(stomp_session_t *s, int readable)
+{
+	struct timespec now;
+	unsigned long elapsed;
+	int throttled = stomp_session_throttled(s);
+
+	stats_sample(s);
+
+	if (s->lost) {
+		confirm_expired(s);
+
+		if (s->callbacks.user) {
+			unsigned long long start = stats_clock(), ns;
+			s->callbacks.user(s, NULL, s->ctx);
+			ns = stats_callback(s, start);
+			PROBE2(user, s, ns);
+		}
+
+		/* stomp_connect() was called from the callback */
+		if (!s->lost) {
+			return 1;
+		}
+
+		if (s->disconnecting) {
+			s->lost = 0;
+			s->run = 0;
+			confirm_all(s, ECONNRESET);
+			return 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < s->reconnect_at.tv_sec || 
+		   (now.tv_sec == s->reconnect_at.tv_sec && now.tv_nsec < s->reconnect_at.tv_nsec)) {
+			return 1;
+		}
+
+		if (reconnect(s)) {
+			s->run = 0;
+			session_close(s);
+			return -1;
+		}
+
+		return 1;
+	}
+
+	if ((readable || buffered(s)) && !throttled) {
+		s->readable_at = latency_clock();
+		clock_gettime(CLOCK_MONOTONIC, &s->last_read);
+		s->broker_timeouts = 0;
+		if (on_server_cmd(s)) {
+			goto stomp_session_step_error;
+		}
+	}
+
+	confirm_expired(s);
+	batch_expired(s);
+
+	if (s->callbacks.user) {
+		unsigned long long start = stats_clock(), ns;
+		s->callbacks.user(s, NULL, s->ctx);
+		ns = stats_callback(s, start);
+		PROBE2(user, s, ns);
+	}
+
+	/* a write in one of the callbacks found the connection gone */
+	if (s->lost) {
+		return 1;
+	}
+
+	if (s->client_hb || s->broker_hb) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
 	
-	tv.tv_sec = t / 1000;
-	tv.tv_usec = (t % 1000) * 1000;
+	/* we are not reading so the broker's heart-beats pile up
+	 * unseen in the socket buffer. do not hold that against it */
+	if (s->broker_hb && throttled) {
+		memcpy(&s->last_read, &now, sizeof(s->last_read));
+		s->broker_timeouts = 0;
+	} else if (s->broker_hb) {
+		elapsed = (now.tv_sec - s->last_read.tv_sec) * 1000 + \
+			  (now.tv_nsec - s->last_read.tv_nsec) / 1000000;
+
+		if (elapsed > s->broker_hb) {
+			memcpy(&s->last_read, &now, sizeof(s->last_write));
+			s->broker_timeouts++;
+			STATS_ADD(s->stats.hb_missed, 1);
+			PROBE2(heartbeat__missed, s, s->broker_timeouts);
+		}
+
+		if (s->broker_timeouts > MAXBROKERTMOUTS) {
+			errno = ETIMEDOUT;
+			goto stomp_session_step_error;
+		}
+	}
 	
+	if (s->client_hb) {
+		elapsed = (now.tv_sec - s->last_write.tv_sec) * 1000 + \
+			  (now.tv_nsec - s->last_write.tv_nsec) / 1000000;
+
+		if (elapsed >= s->client_hb) {
+			memcpy(&s->last_write, &now, sizeof(s->last_write));
+			STATS_ADD(s->stats.writes, 1);
+			if (io_write(&s->io, s->broker_fd, "\n", 1) == -1) {
+				goto stomp_session_step_error;
+			}
+			STATS_ADD(s->stats.frames_out[SSC_HEARTBEAT], 1);
+			STATS_ADD(s->stats.bytes_out[SSC_HEARTBEAT], 1);
+			PROBE1(heartbeat__sent, s);
+		}
+	}
+
+	if (!s->run) {
+		session_close(s);
+		if (s->refused) {
+			errno = ECONNREFUSED;
+			return -1;
+		}
+		return 0;
+	}
+
+	return 1;
+
+stomp_session_step_error:
+
+	/* the broker closed the connection after DISCONNECT, as it should */
+	if (s->disconnecting && errno == ECONNRESET) {
+		s->run = 0;
+		session_close(s);
+		return 0;
+	}
+
+	if (!lost(s, s->receipt_seq)) {
+		return 1;
+	}
+
+	session_close(s);
+	if (s->refused) {
+		errno = ECONNREFUSED;
+	}
+	return -1;
+}
+
+int stomp_run(stomp_session_t *s)
+{
+	fd_set rd;
+	int fd;
+	int r;
+	struct timeval tv;
+	unsigned long t; /* select timeout in milliseconds */
+
 	while(s->run) {
+		/* heart-beats may change once CONNECTED arrives and 
+		 * select() is free to modify tv, so recalculate it every time */
+		t = stomp_session_timeout(s);
+		tv.tv_sec = t / 1000;
+		tv.tv_usec = (t % 1000) * 1000;
+
 		FD_ZERO(&rd);
-		FD_SET(s->broker_fd, &rd);
+		fd = s->broker_fd;
+		if (fd != -1 && !stomp_session_throttled(s)) {
+			FD_SET(fd, &rd);
+		}
 	
-		r = select(s->broker_fd + 1, &rd, 0, 0, &tv);
+		r = select(fd + 1, &rd, 0, 0, &tv);
 		if(r < 0 && errno != EINTR) {
-			goto stomp_run_error;
+			session_close(s);
+			return -1;
 		} 
 	
-		if(r && FD_ISSET(s->broker_fd, &rd)) {
-			clock_gettime(CLOCK_MONOTONIC, &s->last_read);
-			s->broker_timeouts = 0;
-			if (on_server_cmd(s)) {
-				goto stomp_run_error;
-			}
+		r = stomp_session_step(s, r > 0 && fd != -1 && FD_ISSET(fd, &rd));
+		if (r <= 0) {
+			return r;
 		}
+	}
 
-		if (s->callbacks.user) {
-			s->callbacks.user(s, NULL, s->ctx);
-		}
+	session_close(s);
+	return 0;
+}
 
-		if (s->client_hb || s->broker_hb) {
-			clock_gettime(CLOCK_MONOTONIC, &now);
-		}
-		
-		if (s->broker_hb) {
-			elapsed = (now.tv_sec - s->last_read.tv_sec) * 1000 + \
-				  (now.tv_nsec - s->last_read.tv_nsec) / 1000000;
+int session_frames_renew(stomp_session_t *s)
+{
+	frame_t *out;
+	frame_t *in = NULL;
 
-			if (elapsed > s->broker_hb) {
-				memcpy(&s->last_read, &now, sizeof(s->last_write));
-				s->broker_timeouts++;
-			}
+	out = frame_new_with(&s->alloc);
+	if (!out) {
+		return -1;
+	}
 
-			if (s->broker_timeouts > MAXBROKERTMOUTS) {
-				errno = ETIMEDOUT;
-				goto stomp_run_error;
-			}
+	/* a retained frame is replaced on the next read anyway */
+	if (s->in) {
+		in = frame_new_with(&s->alloc);
+		if (!in) {
+			frame_free(out);
+			return -1;
 		}
-		
-		if (s->client_hb) {
-			elapsed = (now.tv_sec - s->last_write.tv_sec) * 1000 + \
-				  (now.tv_nsec - s->last_write.tv_nsec) / 1000000;
 
-			if (elapsed > s->client_hb) {
-				memcpy(&s->last_write, &now, sizeof(s->last_write));
-				if (write(s->broker_fd, "\n", 1) == -1) {
-					goto stomp_run_error;
-				}
-			}
-		}
+		frame_free(s->in->frame);
+		s->in->frame = in;
+		s->frame_in = in;
 	}
 
-	(void)close(s->broker_fd);
+	frame_free(s->frame_out);
+	s->frame_out = out;
+
 	return 0;
+}
 
-stomp_run_error:
+void *session_owner_get(stomp_session_t *s)
+{
+	return __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+}
 
-	(void)close(s->broker_fd);
-	return -1;
+void session_owner_set(stomp_session_t *s, void *owner)
+{
+	__atomic_store_n(&s->owner, owner, __ATOMIC_RELEASE);
 }
 
+size_t session_slot_get(stomp_session_t *s)
+{
+	return s->slot;
+}
+
+void session_slot_set(stomp_session_t *s, size_t slot)
+{
+	s->slot = slot;
+}
+
+unsigned long session_conn_seq(stomp_session_t *s)
+{
+	return s->conn_seq;
+}
@@ -18,6 +18,7 @@
 #define STOMP_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +32,127 @@ extern "C" {
  */
 typedef struct _stomp_session stomp_session_t;
 
+/**
+ * An opaque handle of a received frame retained by the client code
+ *
+ * @see stomp_message_retain()
+ * @see stomp_message_release()
+ */
+typedef struct _stomp_message stomp_message_t;
+
+/**
+ * Memory allocation hooks
+ *
+ * @see stomp_set_allocator()
+ */
+struct stomp_allocator {
+	void *(*malloc_fn)(void *ctx, size_t size); /**< like malloc(3) */
+	void *(*realloc_fn)(void *ctx, void *ptr, size_t size); /**< like realloc(3), ptr is never NULL */
+	void (*free_fn)(void *ctx, void *ptr); /**< like free(3), ptr is never NULL */
+	void *ctx; /**< passed to the hooks */
+	size_t arena; /**< if not 0, frames carve their buffers out of chunks of at least 
+			that many bytes which are rewound in one go when the frame is reused */
+};
+
+/**
+ * Limits on received frames and the memory kept for frame buffers
+ *
+ * @see stomp_limits_set()
+ */
+struct stomp_limits {
+	size_t frame; /**< max bytes of a received frame; 0 for no limit */
+	size_t hdr; /**< max bytes of a received header, key and value; 0 for no limit */
+	size_t hdrs; /**< max number of headers of a received frame; 0 for no limit */
+	size_t keep; /**< frame buffers up to this many bytes are never trimmed */
+	size_t spill; /**< bodies larger than this are received into a memory mapped temporary file; 0 never */
+	int spill_huge; /**< advise huge pages for the mappings of spilled bodies */
+};
+
+/**
+ * Memory held by a session
+ *
+ * @see stomp_session_memory()
+ */
+struct stomp_memory {
+	size_t frames; /**< bytes held by frame buffers, queued and pooled frames included */
+	size_t cork; /**< bytes held by the buffer batching writes */
+	size_t peak; /**< size of the largest frame received in bytes */
+	unsigned long trims; /**< number of times an oversized frame buffer was trimmed */
+};
+
+/**
+ * Frame commands counted by struct stomp_stats
+ */
+enum stomp_stats_cmd {
+	SSC_CONNECT,
+	SSC_SEND,
+	SSC_SUBSCRIBE,
+	SSC_UNSUBSCRIBE,
+	SSC_BEGIN,
+	SSC_COMMIT,
+	SSC_ABORT,
+	SSC_ACK,
+	SSC_NACK,
+	SSC_DISCONNECT,
+	SSC_CONNECTED,
+	SSC_MESSAGE,
+	SSC_RECEIPT,
+	SSC_ERROR,
+	SSC_HEARTBEAT, /**< an EOL sent or received as heart-beat */
+	SSC_OTHER,
+	SSC_MAX
+};
+
+/**
+ * Performance counters of a session
+ *
+ * @see stomp_stats_get()
+ */
+struct stomp_stats {
+	unsigned long long frames_in[SSC_MAX]; /**< frames received per command */
+	unsigned long long bytes_in[SSC_MAX]; /**< bytes received per command */
+	unsigned long long frames_out[SSC_MAX]; /**< frames sent per command */
+	unsigned long long bytes_out[SSC_MAX]; /**< bytes sent per command */
+	unsigned long long reads; /**< read(2) calls on the broker connection */
+	unsigned long long writes; /**< write(2) calls on the broker connection */
+	unsigned long long reallocs; /**< times a frame buffer had to grow */
+	unsigned long long hb_missed; /**< heart-beat periods the broker stayed silent for */
+	unsigned long long callbacks; /**< number of callbacks called */
+	unsigned long long callback_ns; /**< time spent in callbacks, in nanoseconds */
+	size_t capacity; /**< bytes held by frame and write buffers */
+	size_t queue; /**< frames queued until the connection is back */
+	size_t inflight; /**< stomp_send_async() messages waiting for an answer */
+};
+
+/**
+ * Latencies recorded per session
+ *
+ * @see stomp_latency_get()
+ */
+enum stomp_latency_type {
+	SLT_DISPATCH, /**< from the broker connection being readable to the callbacks being called */
+	SLT_CALLBACK, /**< time spent in the callbacks of a received frame, or in SCB_USER */
+	SLT_RECEIPT, /**< from sending a stomp_send_async() message or a batch COMMIT to its RECEIPT */
+	SLT_CONNECT, /**< from sending CONNECT to receiving CONNECTED */
+	SLT_MAX
+};
+
+/**
+ * Latency distribution, all values in nanoseconds
+ *
+ * @see stomp_latency_get()
+ */
+struct stomp_latency {
+	unsigned long long count; /**< number of samples */
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long mean;
+	unsigned long long p50; /**< median */
+	unsigned long long p90;
+	unsigned long long p99;
+	unsigned long long p999; /**< 99.9th percentile */
+};
+
 /**
  * Structure representing a STOMP header entry
  *
@@ -42,6 +164,17 @@ struct stomp_hdr {
 	const char *val; /**< null terminated string */
 };
 
+/**
+ * Lengths of the key and value of a struct stomp_hdr, without the 
+ * terminating null, when the caller knows them already.
+ *
+ * @see stomp_send_len()
+ */
+struct stomp_hdr_len {
+	size_t key_len;
+	size_t val_len;
+};
+
 /**
  * This structure is provided to the client code
  * which registered a callback for SCB_CONNECTED.
@@ -81,6 +214,36 @@ struct stomp_ctx_message {
 	const struct stomp_hdr *hdrs; /**< pointer to an array of headers */
 	const void *body; /**< pointer to the body of the message */
 	size_t body_len; /**< length of body in bytes */
+	int body_fd; /**< file holding the body if it was spilled, -1 otherwise. @see stomp_limits_set() */
+};
+
+/**
+ * This structure is provided to the client code
+ * which registered a callback for SCB_CONFIRM.
+ */
+struct stomp_ctx_confirm {
+	const char *receipt; /**< receipt id generated by stomp_send_async() */
+	void *msg_ctx; /**< pointer passed to stomp_send_async() */
+	int status; /**< 0 on RECEIPT; EPROTO on ERROR; ETIMEDOUT or ECONNRESET if no answer came */
+	size_t hdrc; /**< number of headers of the RECEIPT or ERROR frame */
+	const struct stomp_hdr *hdrs; /**< pointer to an array of headers */
+	const void *body; /**< pointer to the body of the ERROR frame */
+	size_t body_len; /**< length of body in bytes */
+};
+
+/**
+ * This structure is provided to the client code
+ * which registered a callback for SCB_BATCH.
+ */
+struct stomp_ctx_batch {
+	const char *transaction; /**< transaction id generated for the batch */
+	size_t messages; /**< number of messages in the batch */
+	size_t bytes; /**< sum of the body lengths of the messages */
+	int status; /**< 0 if committed; EPROTO on ERROR; ECONNRESET if the connection dropped first */
+	size_t hdrc; /**< number of headers of the RECEIPT or ERROR frame */
+	const struct stomp_hdr *hdrs; /**< pointer to an array of headers */
+	const void *body; /**< pointer to the body of the ERROR frame */
+	size_t body_len; /**< length of body in bytes */
 };
 
 
@@ -103,7 +266,9 @@ enum stomp_cb_type {
 	SCB_ERROR, /**< server sended ERROR */
 	SCB_MESSAGE, /**< server sended MESSAGE  */
 	SCB_RECEIPT, /**< server sended RECEIPT  */
-	SCB_USER /**< user slot */
+	SCB_USER, /**< user slot */
+	SCB_CONFIRM, /**< server answered a stomp_send_async() message */
+	SCB_BATCH /**< server answered the COMMIT of a stomp_send() batch */
 };
 
 typedef void(*stomp_cb_t)(stomp_session_t *s, void *callback_ctx, void *session_ctx);
@@ -126,6 +291,169 @@ void stomp_callback_set(stomp_session_t *s, enum stomp_cb_type type, stomp_cb_t
  */
 void stomp_callback_del(stomp_session_t *s, enum stomp_cb_type type);
 
+/**
+ * Replace the memory allocation hooks.
+ *
+ * With a NULL session the library wide allocator is replaced. Everything 
+ * the library allocates goes through it, so it may only be replaced 
+ * before the first session or reactor is created, otherwise errno is 
+ * set to EBUSY.
+ *
+ * With a session the frames of that session, the bulk of its memory,
+ * and the buffers which grow with its traffic are allocated with the
+ * given hooks: the buffer batching writes, the queue of messages waiting
+ * for a reconnect, the receipts waited for and the subscriptions. The
+ * session handle and its connection settings stay with the library wide
+ * allocator. The frames are replaced right away, frames already queued
+ * or retained are freed with the hooks they were allocated with; the
+ * other buffers are moved over. Subscriptions cannot be moved, so errno
+ * is set to EBUSY while the session has any. Must not be called from
+ * within a callback.
+ *
+ * The hooks must stay usable until the last frame allocated with 
+ * them is freed, which may be after stomp_session_free() if messages 
+ * are retained.
+ *
+ * @param s Pointer to a session handle or NULL.
+ * @param a Allocation hooks, all three required; NULL restores the default.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_set_allocator(stomp_session_t *s, const struct stomp_allocator *a);
+
+/**
+ * Limit the size of received frames and of the buffers kept between frames.
+ *
+ * The limits are checked while a frame is parsed, before memory is 
+ * allocated for it; a frame over a limit is a connection error with 
+ * errno set to EMSGSIZE. A body announced with content-length which would 
+ * not fit is rejected as soon as the headers are read.
+ *
+ * Frame buffers grow to fit the largest frame and are reused. Every 64 frames 
+ * a buffer larger than keep is released if none of those frames needed 
+ * half of it, so one outlier does not pin its memory for the lifetime 
+ * of the session. keep defaults to 64 KiB, the other limits to none.
+ * Buffers grow by doubling, so frames of about the same size always use 
+ * more than half of theirs and receiving them allocates nothing after 
+ * the first. Only a large frame followed by a window of small ones has its 
+ * buffer released, and the next large frame grows it again.
+ *
+ * A body larger than spill is not read into the heap but into an anonymous 
+ * memory mapped file (memfd, or an unlinked file in P_tmpdir). The body 
+ * pointer then points into the mapping and body_fd is the file, which 
+ * holds the body followed by a '\0' byte, e.g. to sendfile(2) body_len 
+ * bytes of it onward. If content-length is given the body is read straight 
+ * into the mapping. Both are valid until the callback returns or, if 
+ * retained, until the message is released. 
+ *
+ * @param s Pointer to a session handle.
+ * @param l New limits.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_limits_set(stomp_session_t *s, const struct stomp_limits *l);
+
+/**
+ * Report the memory held by a session.
+ *
+ * @param s Pointer to a session handle.
+ * @param m Filled in with the current figures.
+ */
+void stomp_session_memory(stomp_session_t *s, struct stomp_memory *m);
+
+/**
+ * Read the performance counters of a session.
+ *
+ * The counters are updated without locks by the thread running the
+ * session and may be read from any other thread, e.g. by a metrics 
+ * exporter, while the session runs. Each counter is read atomically, 
+ * the set as a whole is not a snapshot. Counters only grow; capacity, 
+ * queue and inflight are sampled once per stomp_session_step().
+ *
+ * @param s Pointer to a session handle.
+ * @param st Filled in with the current counters.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_stats_get(stomp_session_t *s, struct stomp_stats *st);
+
+/**
+ * Read a latency distribution of a session.
+ *
+ * Latencies are recorded into log-linear histograms with CLOCK_MONOTONIC,
+ * percentiles are accurate to about 6%. Like stomp_stats_get() this may be 
+ * called from any thread. With reset set the histogram starts over, 
+ * e.g. to report one interval at a time; every sample ends up in exactly one interval.
+ *
+ * The histograms are left out if the library is configured with
+ * --disable-histograms, this function then fails with ENOSYS.
+ *
+ * @param s Pointer to a session handle.
+ * @param type Latency to read.
+ * @param l Filled in with the distribution; all zero if there are no samples.
+ * @param reset Non zero to clear the histogram.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_latency_get(stomp_session_t *s, enum stomp_latency_type type, struct stomp_latency *l, int reset);
+
+/**
+ * Take ownership of the frame currently handed to a callback.
+ *
+ * May only be called from within an SCB_CONNECTED, SCB_ERROR, 
+ * SCB_RECEIPT or SCB_MESSAGE callback (including subscription 
+ * callbacks). The header and body pointers of the callback context 
+ * stay valid until the message is released, the session reads the 
+ * next frame into a recycled buffer. 
+ *
+ * Every call takes a reference which has to be released.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return message handle on success; NULL on error and errno is set appropriately.
+ * EINVAL if not called from a callback.
+ */
+stomp_message_t *stomp_message_retain(stomp_session_t *s);
+
+/**
+ * Drop a reference taken with stomp_message_retain(). 
+ *
+ * Safe to call from any thread, also after stomp_session_free().
+ *
+ * @param m Message handle.
+ */
+void stomp_message_release(stomp_message_t *m);
+
+/**
+ * Headers of a retained message.
+ *
+ * @param m Message handle.
+ * @param hdrs Set to point to an array of headers.
+ *
+ * @return number of headers
+ */
+size_t stomp_message_hdrs_get(stomp_message_t *m, const struct stomp_hdr **hdrs);
+
+/**
+ * Body of a retained message.
+ *
+ * @param m Message handle.
+ * @param body Set to point to the body. Not touched if there is no body.
+ *
+ * @return length of the body in bytes
+ */
+size_t stomp_message_body_get(stomp_message_t *m, const void **body);
+
+/**
+ * File holding the body of a retained message.
+ *
+ * @param m Message handle.
+ *
+ * @return file descriptor if the body was spilled to a file, -1 otherwise.
+ * @see stomp_limits_set()
+ */
+int stomp_message_body_fd(stomp_message_t *m);
+
 /**
  * Create a STOMP session handle.
  *
@@ -153,9 +481,14 @@ void stomp_session_free(stomp_session_t *s);
  * Note that in order to get notified of the server responses you must
  * register the appropriate handler and call stomp_run()
  *
+ * A host of "unix:/path/to/socket" connects to a broker on the same 
+ * machine over a Unix stream socket instead of TCP, and "unix:@name" 
+ * to one in the abstract namespace; the service is ignored then. 
+ * Framing and heart-beats are the same on both.
+ *
  * @param s Pointer to a session handle.
- * @param host Hostname to connect to.
- * @param service Service of port to connect to.
+ * @param host Hostname to connect to, or "unix:" followed by a socket path.
+ * @param service Service of port to connect to; may be NULL for a Unix socket.
  * @param hdrc Number of STOMP headers.
  * @param hdrs Pointer to an array of STOMP headers.
  *
@@ -163,6 +496,267 @@ void stomp_session_free(stomp_session_t *s);
  */
 int stomp_connect(stomp_session_t *s, const char *host, const char *service, size_t hdrc, const struct stomp_hdr *hdrs);
 
+/**
+ * Set how long connecting to the broker may take.
+ *
+ * The broker addresses are tried in parallel, alternating IPv6 and IPv4 ones
+ * (RFC 8305), so an unreachable address only delays the connection by 
+ * 250 milliseconds. The addresses resolved by stomp_connect() are reused 
+ * by later connects and reconnects to the same broker for dns_ttl milliseconds.
+ * The defaults are a timeout of 10 seconds and a dns_ttl of 60 seconds.
+ *
+ * The timeout does not cover name resolution. Resolving the host is a 
+ * blocking getaddrinfo(3) made before the timeout starts, bounded only by 
+ * the resolver configuration (resolv.conf timeout and attempts). It is 
+ * made at most once per dns_ttl; numeric addresses and Unix sockets do 
+ * not ask a name server.
+ *
+ * @param s Pointer to a session handle.
+ * @param timeout Max number of milliseconds to wait for a connection; 0 for no limit.
+ * @param dns_ttl Number of milliseconds to cache the broker addresses for; 0 disables caching.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_connect_timeout_set(stomp_session_t *s, unsigned long timeout, unsigned long dns_ttl);
+
+/**
+ * Send the credentials of the process with every write to a Unix socket.
+ *
+ * Sets SO_PASSCRED on the "unix:" connections made from then on, which
+ * makes the kernel attach SCM_CREDENTIALS (pid, uid and gid) to all the 
+ * session writes, the CONNECT frame included, even if the broker turns 
+ * SO_PASSCRED on for its end only after it arrived. Brokers checking 
+ * SO_PEERCRED need nothing of the sort. Off by default; TCP connections 
+ * are not affected.
+ *
+ * @param s Pointer to a session handle.
+ * @param passcred Non-zero to send the credentials.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_passcred_set(stomp_session_t *s, int passcred);
+
+/**
+ * TLS settings of a session
+ *
+ * @see stomp_tls_set()
+ */
+struct stomp_tls {
+	const char *ca_file; /**< PEM file with the CAs the broker certificate is verified against; NULL for the system ones */
+	const char *cert_file; /**< PEM file with the client certificate chain; NULL for none */
+	const char *key_file; /**< PEM file with the private key of cert_file; NULL if cert_file holds it */
+	const char *server_name; /**< name sent with SNI and verified; NULL for the host passed to stomp_connect() */
+	int insecure; /**< do not verify the broker certificate */
+	int no_ktls; /**< keep the encryption in user space even if the kernel can take it over */
+};
+
+/**
+ * How the broker connection is secured
+ *
+ * @see stomp_session_tls()
+ */
+enum stomp_tls_mode {
+	STLS_NONE, /**< plain TCP */
+	STLS_USER, /**< TLS, records are read and written by OpenSSL */
+	STLS_KERNEL /**< TLS, records are encrypted by the kernel (kTLS), and decrypted by it if it can */
+};
+
+/**
+ * Connect to the broker over TLS.
+ *
+ * Applies to the connections made by stomp_connect() and reconnects 
+ * from then on. After the handshake the symmetric encryption is handed 
+ * over to the kernel if it supports kTLS for the negotiated cipher; 
+ * writes then need no user space copies. Reads still go through 
+ * OpenSSL, which handles records other than application data, such as 
+ * TLS 1.3 session tickets, even when the kernel decrypts them. Otherwise 
+ * OpenSSL does the encryption. A broker failing verification is 
+ * reported with EPROTO. TLS needs OpenSSL 3.0 or later.
+ *
+ * @param s Pointer to a session handle.
+ * @param tls Settings to use; NULL for plain TCP. The strings are copied or read right away.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately. 
+ * errno is ENOSYS if the library was built without OpenSSL, EINVAL if a file could not be loaded.
+ */
+int stomp_tls_set(stomp_session_t *s, const struct stomp_tls *tls);
+
+/**
+ * Get how the current broker connection is secured.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return STLS_NONE if the session is not connected or without TLS
+ */
+enum stomp_tls_mode stomp_session_tls(stomp_session_t *s);
+
+/**
+ * Byte stream to the broker
+ *
+ * The library connects over TCP, Unix sockets and TLS through 
+ * implementations of this interface; stomp_transport_set() plugs in 
+ * another one. Except for connect() and close() the calls behave like 
+ * their system call namesakes on a blocking socket: they return the 
+ * number of bytes moved, which may be fewer than asked for, 0 from 
+ * readv() at the end of the stream, or -1 with errno set.
+ *
+ * @see stomp_transport_set()
+ */
+struct stomp_transport {
+	/** Open the stream; host and service are the ones passed to stomp_connect(), timeout is in ms, 0 for none. @return 0 on success */
+	int (*connect)(void *ctx, const char *host, const char *service, unsigned long timeout);
+	ssize_t (*readv)(void *ctx, const struct iovec *iov, int iovcnt);
+	ssize_t (*writev)(void *ctx, const struct iovec *iov, int iovcnt);
+	/** Write count bytes of in_fd from *offset on, like sendfile(2); NULL if not supported */
+	ssize_t (*sendfile)(void *ctx, int in_fd, off_t *offset, size_t count);
+	/** Bytes readv() returns without fd() polling readable; NULL if there never are any */
+	size_t (*pending)(void *ctx);
+	/** Descriptor that polls readable when readv() does not block, returned by stomp_session_fd() */
+	int (*fd)(void *ctx);
+	/** Close the stream; connect() may be called again afterwards */
+	void (*close)(void *ctx);
+};
+
+/**
+ * Connect to the broker through a transport of the caller.
+ *
+ * Applies to the connections made by stomp_connect() and reconnects 
+ * from then on, in place of the TCP, Unix socket and TLS ones of the 
+ * library; stomp_tls_set() and stomp_passcred_set() have no effect on it. 
+ * The session calls connect() and close() for every connection and 
+ * never frees ctx.
+ *
+ * @param s Pointer to a session handle.
+ * @param t Transport to use, which must stay valid while it is set; NULL for the built-in ones.
+ * @param ctx Pointer passed to the calls of t.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_transport_set(stomp_session_t *s, const struct stomp_transport *t, void *ctx);
+
+/**
+ * One end of an in-memory transport pair
+ *
+ * Whatever is written to one end is read from the other, without a 
+ * kernel round trip: the ends are plain buffers, and stomp_session_step() 
+ * reads buffered bytes without polling. The descriptor of an end is an 
+ * eventfd, readable while the end has something to read, so run loops 
+ * polling stomp_session_fd() work as well. Both ends may be used from 
+ * different threads. A session is given one end with 
+ * stomp_transport_set(s, stomp_mem_transport(), end); a test or benchmark 
+ * plays the broker on the other with stomp_mem_write() and stomp_mem_read().
+ *
+ * @see stomp_mem_pair()
+ */
+typedef struct stomp_mem stomp_mem_t;
+
+/**
+ * Create a connected pair of in-memory transport ends.
+ *
+ * @param ends Set to the two ends, each to be freed with stomp_mem_free().
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_mem_pair(stomp_mem_t *ends[2]);
+
+/**
+ * Free one end of a pair; the other end reads the end of the stream.
+ *
+ * @param m End to free, may be NULL.
+ */
+void stomp_mem_free(stomp_mem_t *m);
+
+/**
+ * The transport to use with an end as its ctx.
+ *
+ * Its connect() fails with ECONNREFUSED once either end was closed: 
+ * a pair carries a single connection.
+ *
+ * @return a transport for stomp_transport_set()
+ */
+const struct stomp_transport *stomp_mem_transport(void);
+
+/**
+ * Write to the other end of the pair.
+ *
+ * Never blocks, the buffer of the other end grows as needed.
+ *
+ * @param m End to write from.
+ * @param buf Bytes to write.
+ * @param len Number of bytes.
+ *
+ * @return len on success; negative on error and errno is set appropriately. 
+ * errno is EPIPE if the other end was closed.
+ */
+ssize_t stomp_mem_write(stomp_mem_t *m, const void *buf, size_t len);
+
+/**
+ * Read what the other end of the pair wrote without blocking.
+ *
+ * @param m End to read from.
+ * @param buf Buffer to read into.
+ * @param len Size of buf.
+ *
+ * @return number of bytes read; 0 if the other end was closed and all was read; 
+ * negative on error and errno is set appropriately, EAGAIN if there is nothing to read yet.
+ */
+ssize_t stomp_mem_read(stomp_mem_t *m, void *buf, size_t len);
+
+/**
+ * Limit how much a single read from an end returns.
+ *
+ * Makes the reader of the end see the bytes trickle in: 1 delivers them 
+ * a byte at a time, a frame size splits frames across reads. 
+ * The default is 0, everything buffered at once.
+ *
+ * @param m End to limit the reads of.
+ * @param chunk Max number of bytes per read; 0 for no limit.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_mem_chunk_set(stomp_mem_t *m, size_t chunk);
+
+/**
+ * Close an end, the other end reads the end of the stream once it read everything.
+ *
+ * @param m End to close.
+ */
+void stomp_mem_close(stomp_mem_t *m);
+
+/**
+ * Reconnect automatically when the broker connection drops.
+ *
+ * Instead of ending the session, stomp_run() and stomp_session_step() 
+ * keep it running and connect again, to the address which worked last first.
+ * The first attempt is made right away, after that the delay doubles
+ * from min_delay up to max_delay with half of it randomized. 
+ * Once connected the CONNECT headers passed to stomp_connect() are sent 
+ * again, every active subscription is made again with the same headers 
+ * and id and the SCB_CONNECTED callback is called.
+ *
+ * While reconnecting stomp_subscribe() and stomp_unsubscribe() only 
+ * update the subscriptions to be made, stomp_send() and stomp_send_async()
+ * queue up to the send window (see stomp_send_window_set()) frames to be sent 
+ * after subscribing and the other commands fail with ENOTCONN. Until the 
+ * queued frames are sent on CONNECTED, newer messages queue up behind 
+ * them, so the order of the messages is kept. 
+ * In-flight stomp_send_async() messages are reported to SCB_CONFIRM as lost. 
+ * No reconnect is made after stomp_disconnect().
+ *
+ * An attempt is made from within stomp_session_step() and blocks it until 
+ * the connection is up or the connect timeout (see stomp_connect_timeout_set()) 
+ * has passed, so it also holds up the other sessions stepped by the same 
+ * loop, e.g. on the same stomp_reactor_t thread.
+ *
+ * @param s Pointer to a session handle.
+ * @param min_delay Delay before the second attempt in milliseconds; 0 disables reconnecting.
+ * @param max_delay Max delay between two attempts in milliseconds.
+ * @param attempts Number of consecutive failed attempts after which the session ends; 0 for no limit.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_reconnect_set(stomp_session_t *s, unsigned long min_delay, unsigned long max_delay, unsigned int attempts);
+
 /**
  * Disconnect from a STOMP broker.
  *
@@ -184,8 +778,13 @@ int stomp_disconnect(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hd
  * If no "id" header is provided one will be generated. The return value is the key, and it must be 
  * fed to stomp_unsibsribe().
  *
- * Note that if an "id" header si provided no attempt will be made
- * to assure the uniqueness of the value.
+ * If an "id" header is provided it must not be used by another active
+ * subscription of the session, otherwise errno is set to EEXIST.
+ *
+ * Subscriptions made before stomp_connect() are sent along with the 
+ * CONNECT frame in a single write, which saves waiting for SCB_CONNECTED.
+ * If the broker answers with an ERROR frame instead, the session ends with 
+ * errno set to ECONNREFUSED and the subscriptions are kept for the next stomp_connect().
  *
  * @param s Pointer to a session handle.
  * @param hdrc Number of STOMP headers.
@@ -195,6 +794,24 @@ int stomp_disconnect(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hd
 */
 int stomp_subscribe(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs);
 
+/**
+ * Subscribe to a destination with a dedicated message callback.
+ *
+ * Same as stomp_subscribe(), but MESSAGE frames of the subscription are passed
+ * to cb instead of the SCB_MESSAGE callback. The callback gets a 
+ * struct stomp_ctx_message as callback_ctx and sub_ctx in place of the session context.
+ * Messages are routed by their "subscription" header in constant time.
+ *
+ * @param s Pointer to a session handle.
+ * @param hdrc Number of STOMP headers.
+ * @param hdrs Pointer to an array of STOMP headers.
+ * @param cb Callback to call for every message of the subscription.
+ * @param sub_ctx A data pointer to pass to the callback.
+ *
+ * @return negative on error; or client_id to be used in stomp_unsubscribe()
+ */
+int stomp_subscribe_cb(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, stomp_cb_t cb, void *sub_ctx);
+
 /**
  * Unsubscribe from a destination.
  *
@@ -210,11 +827,51 @@ int stomp_subscribe(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdr
  */
 int stomp_unsubscribe(stomp_session_t *s, int client_id, size_t hdrc, const struct stomp_hdr *hdrs);
 
+/**
+ * Limit the number of outstanding messages of a subscription.
+ *
+ * A message is outstanding from the moment it is read until the
+ * message callback returns ("auto" ack mode) or until it is 
+ * acknowledged with stomp_ack() or stomp_nack() ("client" and 
+ * "client-individual" ack modes). Once either limit is reached the 
+ * session stops reading from the broker connection, leaving the 
+ * broker to hold back further messages via TCP flow control, 
+ * and resumes as soon as credit is released. 
+ * 
+ * The subscription is found by client_id if it is not 0, by its id otherwise.
+ *
+ * @param s Pointer to a session handle.
+ * @param client_id Handle returned by stomp_subscribe() or 0.
+ * @param id Value of the "id" header of the subscription.
+ * @param messages Max number of outstanding messages; 0 for no limit.
+ * @param bytes Max number of outstanding body bytes; 0 for no limit.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_subscription_window_set(stomp_session_t *s, int client_id, const char *id, size_t messages, size_t bytes);
+
+/**
+ * Get the remaining credit of a subscription.
+ *
+ * SIZE_MAX is reported for a window which is not limited.
+ *
+ * @param s Pointer to a session handle.
+ * @param client_id Handle returned by stomp_subscribe() or 0.
+ * @param id Value of the "id" header of the subscription.
+ * @param messages Where to store the number of messages, may be NULL.
+ * @param bytes Where to store the number of body bytes, may be NULL.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_subscription_credit_get(stomp_session_t *s, int client_id, const char *id, size_t *messages, size_t *bytes);
+
 /**
  * Start a transaction.
  *
  * Headers MUST contain a "transaction" header key 
  * with a value that is not an empty string.
+ * The value must not be used by another open transaction of the session,
+ * otherwise errno is set to EEXIST.
  *
  * @param s Pointer to a session handle.
  * @param hdrc Number of STOMP headers.
@@ -299,6 +956,95 @@ int stomp_commit(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs);
  */
 int stomp_send(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, void *body, size_t body_len);
 
+/**
+ * Send a message like stomp_send(), with the header lengths given.
+ *
+ * The key and value of hdrs[i] are lens[i].key_len and lens[i].val_len 
+ * bytes long, so they are not measured again, e.g. for headers made 
+ * of string literals. They must still be null terminated.
+ *
+ * @param s Pointer to a session handle.
+ * @param hdrc Number of STOMP headers.
+ * @param hdrs Pointer to an array of STOMP headers.
+ * @param lens Pointer to an array of hdrc header lengths; NULL measures them.
+ * @param body Pointer to the message body.
+ * @param body_len Length of the body in bytes.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_send_len(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, const struct stomp_hdr_len *lens, 
+		void *body, size_t body_len);
+
+/**
+ * Send a message and track its delivery asynchronously.
+ *
+ * A "receipt" header is generated and the message is recorded as in-flight. 
+ * Once the broker answers with the matching RECEIPT or ERROR frame, the 
+ * SCB_CONFIRM callback is called from stomp_run() with a struct stomp_ctx_confirm. 
+ * Messages not answered within the timeout set by stomp_send_window_set(), 
+ * or still in-flight when the session is over, are reported with ETIMEDOUT 
+ * or ECONNRESET. RECEIPT frames for these messages are not passed to SCB_RECEIPT.
+ *
+ * Headers MUST contain a "destination" header key and MUST NOT contain a "receipt" header key.
+ *
+ * @param s Pointer to a session handle.
+ * @param hdrc Number of STOMP headers.
+ * @param hdrs Pointer to an array of STOMP headers.
+ * @param body Pointer to the message body.
+ * @param body_len Length of the body in bytes.
+ * @param msg_ctx A data pointer to pass to the SCB_CONFIRM callback.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately. 
+ * errno is EAGAIN if the send window is full; the call should be repeated 
+ * after stomp_run() or stomp_session_step() had a chance to process receipts.
+ */
+int stomp_send_async(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, void *body, size_t body_len, void *msg_ctx);
+
+/**
+ * Configure the in-flight window of stomp_send_async().
+ *
+ * @param s Pointer to a session handle.
+ * @param window Maximum number of unanswered messages. Default is 256.
+ * @param timeout Time in milliseconds to wait for an answer before 
+ * reporting ETIMEDOUT; 0 waits forever. Default is 0.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_send_window_set(stomp_session_t *s, size_t window, unsigned long timeout);
+
+/**
+ * Batch stomp_send() messages into transactions.
+ *
+ * Messages sent with stomp_send() without a "transaction" header are
+ * wrapped into transactions with generated ids. A batch is committed once 
+ * it holds the given number of messages or bytes, or the given number of 
+ * milliseconds after its first message, whichever comes first. 
+ * BEGIN, the messages and COMMIT go to the broker in a single write. 
+ * Any other frame, including a stomp_send_async() or a stomp_send() in 
+ * a transaction of the caller, commits the open batch first, so it is 
+ * never held back by a batch.
+ *
+ * The outcome of every batch is reported to the SCB_BATCH callback 
+ * with a struct stomp_ctx_batch. 
+ *
+ * @param s Pointer to a session handle.
+ * @param messages Max number of messages per batch; 0 disables batching.
+ * @param bytes Max number of body bytes per batch; 0 for no limit.
+ * @param timeout Max number of milliseconds a message waits to be committed; 0 for no limit.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_batch_set(stomp_session_t *s, size_t messages, size_t bytes, unsigned long timeout);
+
+/**
+ * Commit the open batch right away.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_batch_flush(stomp_session_t *s);
+
 /**
  * Runs the library main loop.
  * 
@@ -311,6 +1057,156 @@ int stomp_send(stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, vo
  */
 int stomp_run(stomp_session_t *s);
 
+/**
+ * Get the file descriptor of the broker connection.
+ *
+ * Together with stomp_session_timeout() and stomp_session_step() this
+ * allows a session to be driven by an external event loop instead of stomp_run().
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return the file descriptor or -1 if the session is not connected.
+ * The descriptor changes when the session reconnects.
+ */
+int stomp_session_fd(stomp_session_t *s);
+
+/**
+ * Check if the session is waiting to reconnect.
+ *
+ * The session has no file descriptor meanwhile, but stomp_session_step()
+ * still has to be called after stomp_session_timeout() for it to reconnect.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return non zero if the session is reconnecting; 0 otherwise
+ *
+ * @see stomp_reconnect_set()
+ */
+int stomp_session_reconnecting(stomp_session_t *s);
+
+/**
+ * Check if the session ran out of subscription credit.
+ *
+ * While throttled stomp_session_step() does not read from the broker
+ * and external event loops should stop polling the file descriptor
+ * for readability.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return non zero if the session is throttled; 0 otherwise
+ */
+int stomp_session_throttled(stomp_session_t *s);
+
+/**
+ * Get the maximum amount of time the event loop may wait for the broker 
+ * file descriptor to become readable before calling stomp_session_step().
+ *
+ * With TLS in user space, data may already have been taken off the 
+ * file descriptor and wait to be read; the timeout is 0 then.
+ *
+ * @param s Pointer to a session handle.
+ *
+ * @return timeout in milliseconds
+ */
+unsigned long stomp_session_timeout(stomp_session_t *s);
+
+/**
+ * Runs a single iteration of the library main loop.
+ *
+ * Reads and dispatches one frame if the broker file descriptor is readable,
+ * or TLS data is waiting to be read, and the session is not throttled, calls the SCB_USER callback and takes care of the heart-beats. 
+ * The broker connection is closed once the function returns 0 or a negative value.
+ *
+ * @param s Pointer to a session handle.
+ * @param readable Non zero if the broker file descriptor is readable.
+ *
+ * @return 1 if the session is still running; 0 if the session is over; 
+ * negative on error and errno is set appropriately
+ */
+int stomp_session_step(stomp_session_t *s, int readable);
+
+/**
+ * An opaque handle of a group of event loop threads 
+ *
+ * Every thread (shard) is pinned to a CPU and runs the sessions 
+ * assigned to it. A session is owned by exactly one shard and must not 
+ * be used from other threads once added to a reactor. It must not be 
+ * freed before stomp_reactor_join() returned, or before 
+ * stomp_reactor_free() if the reactor is not joined: stomp_reactor_send() 
+ * calls may still be queued for it even when it is over.
+ *
+ * @see stomp_reactor_new()
+ * @see stomp_reactor_free()
+ */
+typedef struct _stomp_reactor stomp_reactor_t;
+
+/**
+ * Create a reactor and start its event loop threads.
+ *
+ * @param shards Number of event loop threads to start.
+ * @param cpus Array of shards CPU numbers to pin the threads to. 
+ * If NULL shard N is pinned to the N-th online CPU. 
+ * A negative value leaves the corresponding thread unpinned.
+ *
+ * @return a newly allocated reactor or NULL on errors.
+ */
+stomp_reactor_t *stomp_reactor_new(size_t shards, const int *cpus);
+
+/**
+ * Stop the event loop threads and delete the reactor.
+ *
+ * Sessions still owned by the reactor are not freed, but may be once 
+ * this returns.
+ *
+ * @param r Pointer to a reactor handle.
+ */
+void stomp_reactor_free(stomp_reactor_t *r);
+
+/**
+ * Hand a connected session over to a reactor shard.
+ *
+ * The session buffers get reallocated by the shard thread, so they 
+ * end up on the NUMA node local to the CPU the shard is pinned to.
+ *
+ * @param r Pointer to a reactor handle.
+ * @param s Pointer to a session handle, already passed to stomp_connect().
+ * @param shard Index of the shard to own the session. Negative to 
+ * pick one in round-robin fashion.
+ *
+ * @return index of the owning shard; negative on error and errno is set appropriately.
+ */
+int stomp_reactor_add(stomp_reactor_t *r, stomp_session_t *s, int shard);
+
+/**
+ * Send a message on a session owned by a reactor from any thread.
+ *
+ * Headers and body are copied and the actual stomp_send() is executed 
+ * by the thread owning the session. Messages to a session that is over 
+ * by the time they are processed are dropped.
+ *
+ * @param r Pointer to a reactor handle.
+ * @param s Pointer to a session handle, previously passed to stomp_reactor_add().
+ * @param hdrc Number of STOMP headers.
+ * @param hdrs Pointer to an array of STOMP headers.
+ * @param body Pointer to the message body.
+ * @param body_len Length of the body in bytes.
+ *
+ * @return 0 if the message was queued; negative on error and errno is set appropriately.
+ */
+int stomp_reactor_send(stomp_reactor_t *r, stomp_session_t *s, size_t hdrc, const struct stomp_hdr *hdrs, const void *body, size_t body_len);
+
+/**
+ * Wait until all sessions owned by the reactor are over.
+ *
+ * The event loop threads exit as soon as they do not own any sessions. 
+ * The reactor must still be deleted with stomp_reactor_free().
+ *
+ * @param r Pointer to a reactor handle.
+ *
+ * @return 0 on success; negative on error and errno is set appropriately.
+ */
+int stomp_reactor_join(stomp_reactor_t *r);
+
 #ifdef __cplusplus
 }
 #endif
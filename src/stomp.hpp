@@ -0,0 +1,661 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STOMP_HPP
+#define STOMP_HPP
+
+/**
+ * Header-only C++17 wrapper around the C API.
+ *
+ * Errors reported by the C API through errno are thrown as std::system_error.
+ */
+
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include <poll.h>
+
+#include "stomp.h"
+
+namespace stomp {
+
+#if defined(__cpp_lib_span)
+/** A view over a message body. */
+using bytes = std::span<const std::byte>;
+#else
+/** A view over a message body; std::span<const std::byte> when available. */
+class bytes {
+public:
+	constexpr bytes() noexcept = default;
+	constexpr bytes(const std::byte *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+	constexpr const std::byte *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr std::size_t size_bytes() const noexcept { return size_; }
+	constexpr bool empty() const noexcept { return !size_; }
+	constexpr const std::byte *begin() const noexcept { return data_; }
+	constexpr const std::byte *end() const noexcept { return data_ + size_; }
+	constexpr const std::byte &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+	const std::byte *data_ = nullptr;
+	std::size_t size_ = 0;
+};
+#endif
+
+/** Reinterpret a body view as characters. */
+inline std::string_view as_string(bytes b) noexcept
+{
+	return std::string_view(reinterpret_cast<const char *>(b.data()), b.size());
+}
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/** A single header as a pair of views. */
+using header = std::pair<std::string_view, std::string_view>;
+
+/**
+ * A zero-copy view over an array of struct stomp_hdr.
+ *
+ * Valid only as long as the underlying array.
+ */
+class headers_view {
+public:
+	/* yields headers by value, which only an input iterator may do; 
+	 * -- and +/- still move it like the pointer it wraps */
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = header;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = header;
+
+		constexpr iterator() noexcept = default;
+		constexpr explicit iterator(const struct stomp_hdr *h) noexcept : h_(h) {}
+
+		header operator*() const noexcept { return header(h_->key, h_->val); }
+		iterator &operator++() noexcept { ++h_; return *this; }
+		iterator operator++(int) noexcept { iterator t = *this; ++h_; return t; }
+		iterator &operator--() noexcept { --h_; return *this; }
+		iterator operator+(difference_type n) const noexcept { return iterator(h_ + n); }
+		difference_type operator-(const iterator &o) const noexcept { return h_ - o.h_; }
+		bool operator==(const iterator &o) const noexcept { return h_ == o.h_; }
+		bool operator!=(const iterator &o) const noexcept { return h_ != o.h_; }
+
+	private:
+		const struct stomp_hdr *h_ = nullptr;
+	};
+
+	constexpr headers_view() noexcept = default;
+	constexpr headers_view(const struct stomp_hdr *hdrs, std::size_t hdrc) noexcept : hdrs_(hdrs), hdrc_(hdrc) {}
+
+	constexpr std::size_t size() const noexcept { return hdrc_; }
+	constexpr bool empty() const noexcept { return !hdrc_; }
+	constexpr const struct stomp_hdr *data() const noexcept { return hdrs_; }
+	iterator begin() const noexcept { return iterator(hdrs_); }
+	iterator end() const noexcept { return iterator(hdrs_ + hdrc_); }
+	header operator[](std::size_t i) const noexcept { return header(hdrs_[i].key, hdrs_[i].val); }
+
+	/** Value of the first header with the given key, if any. */
+	std::optional<std::string_view> find(std::string_view key) const noexcept
+	{
+		for (std::size_t i = 0; i < hdrc_; i++) {
+			if (key == hdrs_[i].key) {
+				return std::string_view(hdrs_[i].val);
+			}
+		}
+
+		return std::nullopt;
+	}
+
+private:
+	const struct stomp_hdr *hdrs_ = nullptr;
+	std::size_t hdrc_ = 0;
+};
+
+class message;
+
+/**
+ * A received frame as seen from within a callback.
+ *
+ * Points into the library frame buffer and is valid only until the callback returns.
+ * Use retain() to keep the message beyond that.
+ * Views handed to session callbacks retain the library frame itself, others are copied.
+ */
+class message_view {
+public:
+	constexpr message_view() noexcept = default;
+	constexpr message_view(headers_view hdrs, bytes body, stomp_session_t *s = nullptr) noexcept : hdrs_(hdrs), body_(body), s_(s) {}
+
+	constexpr headers_view headers() const noexcept { return hdrs_; }
+	constexpr bytes body() const noexcept { return body_; }
+	std::optional<std::string_view> header(std::string_view key) const noexcept { return hdrs_.find(key); }
+
+	message retain() const;
+
+private:
+	headers_view hdrs_;
+	bytes body_;
+	stomp_session_t *s_ = nullptr; /* session the frame can be retained from */
+};
+
+/**
+ * A move-only message handle which outlives the callback it was created in.
+ *
+ * Either owns a frame retained with stomp_message_retain() or a copy 
+ * of the headers and body stored in a single allocation.
+ */
+class message {
+public:
+	message() noexcept = default;
+	message(message &&) noexcept = default;
+	message &operator=(message &&) noexcept = default;
+	message(const message &) = delete;
+	message &operator=(const message &) = delete;
+
+	explicit message(const message_view &v)
+	{
+		const headers_view h = v.headers();
+		std::size_t len = h.size() * sizeof(struct stomp_hdr) + v.body().size() + 1;
+
+		for (auto kv : h) {
+			len += kv.first.size() + kv.second.size() + 2;
+		}
+
+		buf_.reset(new std::byte[len]);
+		auto *hdrs = reinterpret_cast<struct stomp_hdr *>(buf_.get());
+		char *p = reinterpret_cast<char *>(hdrs + h.size());
+
+		body_len_ = v.body().size();
+		body_ = reinterpret_cast<const std::byte *>(p);
+		if (body_len_) {
+			std::memcpy(p, v.body().data(), body_len_);
+		}
+		p += body_len_;
+		*p++ = '\0';
+
+		for (std::size_t i = 0; i < h.size(); i++) {
+			auto kv = h[i];
+			hdrs[i].key = p;
+			std::memcpy(p, kv.first.data(), kv.first.size());
+			p += kv.first.size();
+			*p++ = '\0';
+
+			hdrs[i].val = p;
+			std::memcpy(p, kv.second.data(), kv.second.size());
+			p += kv.second.size();
+			*p++ = '\0';
+		}
+
+		hdrs_ = hdrs;
+		hdrc_ = h.size();
+	}
+
+	/** Takes over a reference from stomp_message_retain(); v must view the same frame. */
+	message(stomp_message_t *m, const message_view &v) noexcept
+		: frame_(m), hdrs_(v.headers().data()), hdrc_(v.headers().size()),
+		  body_(v.body().data()), body_len_(v.body().size()) {}
+
+	explicit operator bool() const noexcept { return buf_ || frame_; }
+	headers_view headers() const noexcept { return headers_view(hdrs_, hdrc_); }
+	bytes body() const noexcept { return bytes(body_, body_len_); }
+	std::optional<std::string_view> header(std::string_view key) const noexcept { return headers().find(key); }
+
+private:
+	struct release {
+		void operator()(stomp_message_t *m) const noexcept { stomp_message_release(m); }
+	};
+
+	std::unique_ptr<std::byte[]> buf_;
+	std::unique_ptr<stomp_message_t, release> frame_;
+	const struct stomp_hdr *hdrs_ = nullptr;
+	std::size_t hdrc_ = 0;
+	const std::byte *body_ = nullptr;
+	std::size_t body_len_ = 0;
+};
+
+inline message message_view::retain() const
+{
+	stomp_message_t *m = s_ ? stomp_message_retain(s_) : nullptr;
+
+	if (m) {
+		return message(m, *this);
+	}
+
+	return message(*this);
+}
+
+/**
+ * A header built from string literals.
+ *
+ * Key and value lengths are known at compile time and empty 
+ * literals, which the library rejects, fail to compile.
+ */
+struct literal_header {
+	const char *key;
+	const char *val;
+	std::size_t key_len;
+	std::size_t val_len;
+
+	constexpr operator struct stomp_hdr() const noexcept { return {key, val}; }
+	constexpr operator struct stomp_hdr_len() const noexcept { return {key_len, val_len}; }
+};
+
+template <std::size_t K, std::size_t V>
+constexpr literal_header hdr(const char (&key)[K], const char (&val)[V]) noexcept
+{
+	static_assert(K > 1, "STOMP header key must not be empty");
+	static_assert(V > 1, "STOMP header value must not be empty");
+	return {key, val, K - 1, V - 1};
+}
+
+template <std::size_t K, typename T, 
+	 typename = std::enable_if_t<std::is_same_v<T, const char *> || std::is_same_v<T, char *>>>
+constexpr struct stomp_hdr hdr(const char (&key)[K], T val) noexcept
+{
+	static_assert(K > 1, "STOMP header key must not be empty");
+	return {key, val};
+}
+
+template <std::size_t K>
+inline struct stomp_hdr hdr(const char (&key)[K], const std::string &val) noexcept
+{
+	static_assert(K > 1, "STOMP header key must not be empty");
+	return {key, val.c_str()};
+}
+
+/* the header would point into a destroyed temporary */
+template <std::size_t K>
+struct stomp_hdr hdr(const char (&key)[K], std::string &&val) = delete;
+
+/**
+ * Headers made of string literals only, with their lengths.
+ *
+ * Usable wherever an array of struct stomp_hdr is; session::send() 
+ * hands the lengths to stomp_send_len() so they are not measured again.
+ */
+template <std::size_t N>
+struct literal_headers {
+	std::array<struct stomp_hdr, N> hdrs;
+	std::array<struct stomp_hdr_len, N> lens;
+
+	constexpr std::size_t size() const noexcept { return N; }
+	constexpr const struct stomp_hdr *data() const noexcept { return hdrs.data(); }
+	constexpr const struct stomp_hdr *begin() const noexcept { return hdrs.data(); }
+	constexpr const struct stomp_hdr *end() const noexcept { return hdrs.data() + N; }
+	constexpr const struct stomp_hdr &operator[](std::size_t i) const noexcept { return hdrs[i]; }
+};
+
+/**
+ * Build a fixed size array of headers, usable with every session method.
+ *
+ * Made of hdr() string literals only it is a literal_headers.
+ *
+ * @code
+ * constexpr auto h = stomp::headers(stomp::hdr("destination", "/queue/a"), stomp::hdr("ack", "client"));
+ * @endcode
+ */
+template <typename... H>
+constexpr auto headers(const H &... h) noexcept
+{
+	if constexpr ((std::is_same_v<H, literal_header> && ...)) {
+		return literal_headers<sizeof...(H)>{{{static_cast<struct stomp_hdr>(h)...}}, 
+			{{static_cast<struct stomp_hdr_len>(h)...}}};
+	} else {
+		return std::array<struct stomp_hdr, sizeof...(H)>{{static_cast<struct stomp_hdr>(h)...}};
+	}
+}
+
+/**
+ * RAII owner of a stomp_session_t with callbacks taking callables.
+ *
+ * Move-only. Callbacks may call any method of the session they are invoked for.
+ * An exception thrown by a callback stops run() or step() and is rethrown 
+ * from there; no further callbacks are made until it has been.
+ */
+class session {
+public:
+	using message_cb = std::function<void(session &, const message_view &)>;
+	using headers_cb = std::function<void(session &, headers_view)>;
+	using user_cb = std::function<void(session &)>;
+	using confirm_cb = std::function<void(session &, const struct stomp_ctx_confirm &)>;
+	using batch_cb = std::function<void(session &, const struct stomp_ctx_batch &)>;
+
+	session() : impl_(new impl)
+	{
+		impl_->self = this;
+		impl_->s = stomp_session_new(impl_.get());
+		if (!impl_->s) {
+			throw_errno("stomp_session_new");
+		}
+	}
+
+	session(session &&o) noexcept : impl_(std::move(o.impl_))
+	{
+		if (impl_) {
+			impl_->self = this;
+		}
+	}
+
+	session &operator=(session &&o) noexcept
+	{
+		impl_ = std::move(o.impl_);
+		if (impl_) {
+			impl_->self = this;
+		}
+		return *this;
+	}
+
+	session(const session &) = delete;
+	session &operator=(const session &) = delete;
+	~session() = default;
+
+	stomp_session_t *native_handle() const noexcept { return impl_->s; }
+
+	void on_connected(headers_cb cb) { impl_->connected = std::move(cb); set(SCB_CONNECTED, impl_->connected ? &impl::on_connected : nullptr); }
+	void on_receipt(headers_cb cb) { impl_->receipt = std::move(cb); set(SCB_RECEIPT, impl_->receipt ? &impl::on_receipt : nullptr); }
+	void on_error(message_cb cb) { impl_->error = std::move(cb); set(SCB_ERROR, impl_->error ? &impl::on_error : nullptr); }
+	void on_message(message_cb cb) { impl_->message = std::move(cb); set(SCB_MESSAGE, impl_->message ? &impl::on_message : nullptr); }
+	void on_user(user_cb cb) { impl_->user = std::move(cb); set(SCB_USER, impl_->user ? &impl::on_user : nullptr); }
+	void on_confirm(confirm_cb cb) { impl_->confirm = std::move(cb); set(SCB_CONFIRM, impl_->confirm ? &impl::on_confirm : nullptr); }
+	void on_batch(batch_cb cb) { impl_->batch = std::move(cb); set(SCB_BATCH, impl_->batch ? &impl::on_batch : nullptr); }
+
+	template <typename Hdrs>
+	void connect(const char *host, const char *service, const Hdrs &h)
+	{
+		check(stomp_connect(impl_->s, host, service, h.size(), h.data()), "stomp_connect");
+	}
+
+	void connect(const char *host, const char *service, std::initializer_list<struct stomp_hdr> h)
+	{
+		check(stomp_connect(impl_->s, host, service, h.size(), h.begin()), "stomp_connect");
+	}
+
+	template <typename Hdrs>
+	void disconnect(const Hdrs &h) { check(stomp_disconnect(impl_->s, h.size(), h.data()), "stomp_disconnect"); }
+	void disconnect(std::initializer_list<struct stomp_hdr> h = {}) { check(stomp_disconnect(impl_->s, h.size(), h.begin()), "stomp_disconnect"); }
+
+	/** @return the client id to be passed to unsubscribe() */
+	template <typename Hdrs>
+	int subscribe(const Hdrs &h) { return check(stomp_subscribe(impl_->s, h.size(), h.data()), "stomp_subscribe"); }
+	int subscribe(std::initializer_list<struct stomp_hdr> h) { return check(stomp_subscribe(impl_->s, h.size(), h.begin()), "stomp_subscribe"); }
+
+	template <typename Hdrs>
+	void unsubscribe(int client_id, const Hdrs &h) { check(stomp_unsubscribe(impl_->s, client_id, h.size(), h.data()), "stomp_unsubscribe"); }
+	void unsubscribe(int client_id, std::initializer_list<struct stomp_hdr> h = {}) { check(stomp_unsubscribe(impl_->s, client_id, h.size(), h.begin()), "stomp_unsubscribe"); }
+
+	template <typename Hdrs>
+	void begin(const Hdrs &h) { check(stomp_begin(impl_->s, h.size(), h.data()), "stomp_begin"); }
+	void begin(std::initializer_list<struct stomp_hdr> h) { check(stomp_begin(impl_->s, h.size(), h.begin()), "stomp_begin"); }
+
+	template <typename Hdrs>
+	void abort(const Hdrs &h) { check(stomp_abort(impl_->s, h.size(), h.data()), "stomp_abort"); }
+	void abort(std::initializer_list<struct stomp_hdr> h) { check(stomp_abort(impl_->s, h.size(), h.begin()), "stomp_abort"); }
+
+	template <typename Hdrs>
+	void commit(const Hdrs &h) { check(stomp_commit(impl_->s, h.size(), h.data()), "stomp_commit"); }
+	void commit(std::initializer_list<struct stomp_hdr> h) { check(stomp_commit(impl_->s, h.size(), h.begin()), "stomp_commit"); }
+
+	template <typename Hdrs>
+	void ack(const Hdrs &h) { check(stomp_ack(impl_->s, h.size(), h.data()), "stomp_ack"); }
+	void ack(std::initializer_list<struct stomp_hdr> h) { check(stomp_ack(impl_->s, h.size(), h.begin()), "stomp_ack"); }
+
+	template <typename Hdrs>
+	void nack(const Hdrs &h) { check(stomp_nack(impl_->s, h.size(), h.data()), "stomp_nack"); }
+	void nack(std::initializer_list<struct stomp_hdr> h) { check(stomp_nack(impl_->s, h.size(), h.begin()), "stomp_nack"); }
+
+	template <typename Hdrs>
+	void send(const Hdrs &h, bytes body)
+	{
+		check(stomp_send(impl_->s, h.size(), h.data(), const_cast<std::byte *>(body.data()), body.size()), "stomp_send");
+	}
+
+	template <std::size_t N>
+	void send(const literal_headers<N> &h, bytes body)
+	{
+		check(stomp_send_len(impl_->s, N, h.hdrs.data(), h.lens.data(), 
+					const_cast<std::byte *>(body.data()), body.size()), "stomp_send_len");
+	}
+
+	void send(std::initializer_list<struct stomp_hdr> h, bytes body)
+	{
+		check(stomp_send(impl_->s, h.size(), h.begin(), const_cast<std::byte *>(body.data()), body.size()), "stomp_send");
+	}
+
+	template <typename Hdrs>
+	void send(const Hdrs &h, std::string_view body) { send(h, bytes(reinterpret_cast<const std::byte *>(body.data()), body.size())); }
+	void send(std::initializer_list<struct stomp_hdr> h, std::string_view body) { send(h, bytes(reinterpret_cast<const std::byte *>(body.data()), body.size())); }
+
+	/** 
+	 * stomp_send_async(); the outcome is reported to the on_confirm() callback.
+	 *
+	 * @return false if the send window is full
+	 */
+	template <typename Hdrs>
+	bool send_async(const Hdrs &h, bytes body, void *msg_ctx = nullptr)
+	{
+		if (stomp_send_async(impl_->s, h.size(), h.data(), const_cast<std::byte *>(body.data()), body.size(), msg_ctx)) {
+			if (errno == EAGAIN) {
+				return false;
+			}
+			throw_errno("stomp_send_async");
+		}
+		return true;
+	}
+
+	template <typename Hdrs>
+	bool send_async(const Hdrs &h, std::string_view body, void *msg_ctx = nullptr) 
+	{ 
+		return send_async(h, bytes(reinterpret_cast<const std::byte *>(body.data()), body.size()), msg_ctx); 
+	}
+
+	void send_window(std::size_t window, unsigned long timeout) { check(stomp_send_window_set(impl_->s, window, timeout), "stomp_send_window_set"); }
+
+	/** @see stomp_batch_set() */
+	void batch(std::size_t messages, std::size_t bytes, unsigned long timeout)
+	{
+		check(stomp_batch_set(impl_->s, messages, bytes, timeout), "stomp_batch_set");
+	}
+
+	void flush() { check(stomp_batch_flush(impl_->s), "stomp_batch_flush"); }
+
+	/** @see stomp_connect_timeout_set() */
+	void connect_timeout(unsigned long timeout, unsigned long dns_ttl)
+	{
+		check(stomp_connect_timeout_set(impl_->s, timeout, dns_ttl), "stomp_connect_timeout_set");
+	}
+
+	/** @see stomp_reconnect_set() */
+	void reconnect(unsigned long min_delay, unsigned long max_delay, unsigned int attempts = 0)
+	{
+		check(stomp_reconnect_set(impl_->s, min_delay, max_delay, attempts), "stomp_reconnect_set");
+	}
+
+	/**
+	 * Steps the session until it is over, like stomp_run().
+	 *
+	 * Throws if it fails or a callback threw.
+	 */
+	void run()
+	{
+		struct pollfd pfd = {-1, POLLIN, 0};
+		unsigned long t;
+		int n;
+
+		do {
+			/* heart-beats may change once CONNECTED arrives */
+			t = stomp_session_timeout(impl_->s);
+			pfd.fd = stomp_session_throttled(impl_->s) ? -1 : stomp_session_fd(impl_->s);
+			pfd.revents = 0;
+			n = ::poll(&pfd, 1, t > INT_MAX ? INT_MAX : static_cast<int>(t));
+			if (n < 0 && errno != EINTR) {
+				throw_errno("poll");
+			}
+		} while (step(n > 0 && pfd.revents));
+	}
+
+	/** @return false once the session is over; throws if a callback threw */
+	bool step(bool readable)
+	{
+		int r = stomp_session_step(impl_->s, readable);
+
+		if (auto e = exception()) {
+			std::rethrow_exception(e);
+		}
+		return check(r, "stomp_session_step") > 0;
+	}
+
+	/**
+	 * Takes the exception a callback threw, for code calling 
+	 * stomp_session_step() on native_handle() itself.
+	 */
+	std::exception_ptr exception() noexcept { return std::exchange(impl_->failed, nullptr); }
+
+	int fd() const noexcept { return stomp_session_fd(impl_->s); }
+	bool reconnecting() const noexcept { return stomp_session_reconnecting(impl_->s); }
+	unsigned long timeout() const noexcept { return stomp_session_timeout(impl_->s); }
+
+private:
+	/* heap allocated so the pointer handed to the C library survives moves */
+	struct impl {
+		session *self = nullptr;
+		stomp_session_t *s = nullptr;
+		headers_cb connected;
+		headers_cb receipt;
+		message_cb error;
+		message_cb message;
+		user_cb user;
+		confirm_cb confirm;
+		batch_cb batch;
+		std::exception_ptr failed; /* thrown by a callback, taken by exception() */
+
+		~impl()
+		{
+			if (s) {
+				stomp_session_free(s);
+			}
+		}
+
+		/* exceptions must not unwind through the C library */
+		template <typename F>
+		static void guard(impl *i, F &&f) noexcept
+		{
+			if (i->failed) {
+				return;
+			}
+
+			try {
+				f();
+			} catch (...) {
+				i->failed = std::current_exception();
+			}
+		}
+
+		static void on_connected(stomp_session_t *, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			auto *e = static_cast<struct stomp_ctx_connected *>(ctx);
+			guard(i, [&] { i->connected(*i->self, headers_view(e->hdrs, e->hdrc)); });
+		}
+
+		static void on_receipt(stomp_session_t *, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			auto *e = static_cast<struct stomp_ctx_receipt *>(ctx);
+			guard(i, [&] { i->receipt(*i->self, headers_view(e->hdrs, e->hdrc)); });
+		}
+
+		static void on_error(stomp_session_t *s, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			auto *e = static_cast<struct stomp_ctx_error *>(ctx);
+			guard(i, [&] { i->error(*i->self, message_view(headers_view(e->hdrs, e->hdrc), 
+						bytes(static_cast<const std::byte *>(e->body), e->body_len), s)); });
+		}
+
+		static void on_message(stomp_session_t *s, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			auto *e = static_cast<struct stomp_ctx_message *>(ctx);
+			guard(i, [&] { i->message(*i->self, message_view(headers_view(e->hdrs, e->hdrc), 
+						bytes(static_cast<const std::byte *>(e->body), e->body_len), s)); });
+		}
+
+		static void on_user(stomp_session_t *, void *, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			guard(i, [&] { i->user(*i->self); });
+		}
+
+		static void on_confirm(stomp_session_t *, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			guard(i, [&] { i->confirm(*i->self, *static_cast<struct stomp_ctx_confirm *>(ctx)); });
+		}
+
+		static void on_batch(stomp_session_t *, void *ctx, void *session_ctx)
+		{
+			auto *i = static_cast<impl *>(session_ctx);
+			guard(i, [&] { i->batch(*i->self, *static_cast<struct stomp_ctx_batch *>(ctx)); });
+		}
+	};
+
+	void set(enum stomp_cb_type type, stomp_cb_t cb)
+	{
+		if (cb) {
+			stomp_callback_set(impl_->s, type, cb);
+		} else {
+			stomp_callback_del(impl_->s, type);
+		}
+	}
+
+	static int check(int err, const char *what)
+	{
+		if (err < 0) {
+			throw_errno(what);
+		}
+		return err;
+	}
+
+	std::unique_ptr<impl> impl_;
+};
+
+} /* namespace stomp */
+
+#endif /* STOMP_HPP */
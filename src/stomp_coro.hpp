@@ -0,0 +1,803 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STOMP_CORO_HPP
+#define STOMP_CORO_HPP
+
+/**
+ * C++20 coroutine API on top of stomp.hpp.
+ *
+ * All sessions of an executor are driven by a single thread calling executor::run().
+ * Coroutines woken up by a frame are resumed right after the library is done 
+ * with it and before the next frame is read, so views returned by co_await 
+ * point into the library frame buffer and are valid until the coroutine 
+ * suspends again. Awaiters live in the coroutine frames, nothing is allocated 
+ * per awaited message unless messages arrive faster than a subscription is awaited.
+ */
+
+#include <poll.h>
+
+#include <coroutine>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+
+#include "stomp.hpp"
+
+namespace stomp::coro {
+
+class executor;
+
+/** Thrown when the broker answers with an ERROR frame. */
+class broker_error : public std::runtime_error {
+public:
+	explicit broker_error(const std::string &what) : std::runtime_error(what) {}
+};
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+	executor *detached = nullptr; /* set for tasks started with executor::spawn() */
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename P>
+struct final_awaiter {
+	bool await_ready() noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+	void await_resume() noexcept {}
+};
+
+/* intrusive list node of a suspended coroutine */
+struct waiter {
+	waiter *next = nullptr;
+	std::coroutine_handle<> handle;
+	const char *receipt = nullptr; /* receipt id waited for */
+	message_view result; /* frame which resumed the coroutine */
+	int err = 0;
+	std::string error;
+
+	void fail(int e, std::string what = std::string())
+	{
+		err = e;
+		error = std::move(what);
+	}
+
+	void check() const
+	{
+		if (!error.empty()) {
+			throw broker_error(error);
+		}
+		if (err) {
+			throw std::system_error(err, std::generic_category());
+		}
+	}
+};
+
+struct waiter_list {
+	waiter *head = nullptr;
+	waiter *tail = nullptr;
+
+	bool empty() const noexcept { return !head; }
+
+	void push(waiter *w) noexcept
+	{
+		w->next = nullptr;
+		if (tail) {
+			tail->next = w;
+		} else {
+			head = w;
+		}
+		tail = w;
+	}
+
+	waiter *pop() noexcept
+	{
+		waiter *w = head;
+		if (w) {
+			head = w->next;
+			if (!head) {
+				tail = nullptr;
+			}
+		}
+		return w;
+	}
+
+	template <typename F>
+	waiter *remove_if(F f) noexcept
+	{
+		waiter *prev = nullptr;
+		for (waiter *w = head; w; prev = w, w = w->next) {
+			if (!f(w)) {
+				continue;
+			}
+			if (prev) {
+				prev->next = w->next;
+			} else {
+				head = w->next;
+			}
+			if (tail == w) {
+				tail = prev;
+			}
+			return w;
+		}
+		return nullptr;
+	}
+};
+
+} /* namespace detail */
+
+/**
+ * A lazily started coroutine returning T.
+ */
+template <typename T>
+class task {
+public:
+	struct promise_type : detail::promise_base {
+		std::optional<T> value;
+
+		task get_return_object() noexcept { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		detail::final_awaiter<promise_type> final_suspend() noexcept { return {}; }
+		template <typename U>
+		void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+	};
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() { if (h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().continuation = c;
+		return h_;
+	}
+	T await_resume()
+	{
+		if (h_.promise().error) {
+			std::rethrow_exception(h_.promise().error);
+		}
+		return std::move(*h_.promise().value);
+	}
+
+private:
+	friend class executor;
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class task<void> {
+public:
+	struct promise_type : detail::promise_base {
+		task get_return_object() noexcept { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		detail::final_awaiter<promise_type> final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+	};
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() { if (h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().continuation = c;
+		return h_;
+	}
+	void await_resume()
+	{
+		if (h_.promise().error) {
+			std::rethrow_exception(h_.promise().error);
+		}
+	}
+
+private:
+	friend class executor;
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+class session;
+
+/**
+ * Single-threaded executor polling the file descriptors of its sessions.
+ */
+class executor {
+public:
+	executor() = default;
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	/** Start a task; it is owned by the executor from now on. */
+	void spawn(task<void> t)
+	{
+		auto h = std::exchange(t.h_, nullptr);
+		h.promise().detached = this;
+		post(h);
+	}
+
+	/** Resume a coroutine from within run(). */
+	void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+	/**
+	 * Run until there are neither runnable coroutines nor connected sessions.
+	 *
+	 * Rethrows the first exception which escaped a spawned task 
+	 * or a session callback.
+	 */
+	void run();
+
+private:
+	friend class session;
+	template <typename P> friend struct detail::final_awaiter;
+
+	void fail(std::exception_ptr e)
+	{
+		if (e && !error_) {
+			error_ = e;
+		}
+	}
+
+	void drain()
+	{
+		while (!ready_.empty()) {
+			running_.swap(ready_);
+			for (auto h : running_) {
+				h.resume();
+			}
+			running_.clear();
+		}
+
+		if (error_) {
+			std::rethrow_exception(std::exchange(error_, nullptr));
+		}
+	}
+
+	std::vector<session *> sessions_;
+	std::vector<session *> polled_;
+	std::vector<struct pollfd> pfds_;
+	std::vector<std::coroutine_handle<>> ready_;
+	std::vector<std::coroutine_handle<>> running_;
+	std::exception_ptr error_;
+};
+
+template <typename P>
+inline std::coroutine_handle<> detail::final_awaiter<P>::await_suspend(std::coroutine_handle<P> h) noexcept
+{
+	auto &p = h.promise();
+	if (p.detached) {
+		p.detached->fail(p.error);
+		h.destroy();
+		return std::noop_coroutine();
+	}
+	return p.continuation ? p.continuation : std::noop_coroutine();
+}
+
+class subscription;
+
+/**
+ * A session driven by an executor.
+ *
+ * Neither copyable nor movable, awaiters and subscriptions refer to it.
+ */
+class session {
+public:
+	explicit session(executor &ex) : ex_(ex)
+	{
+		ex_.sessions_.push_back(this);
+
+		s_.on_connected([this](stomp::session &, headers_view h) { guard([&] { on_connected(h); }); });
+		s_.on_receipt([this](stomp::session &, headers_view h) { guard([&] { on_receipt(h); }); });
+		s_.on_error([this](stomp::session &, const message_view &m) { guard([&] { on_error(m); }); });
+	}
+
+	session(const session &) = delete;
+	session &operator=(const session &) = delete;
+
+	~session()
+	{
+		for (auto &p : ex_.polled_) {
+			if (p == this) {
+				p = nullptr;
+			}
+		}
+
+		auto &v = ex_.sessions_;
+		for (auto it = v.begin(); it != v.end(); ++it) {
+			if (*it == this) {
+				v.erase(it);
+				break;
+			}
+		}
+	}
+
+	stomp::session &native() noexcept { return s_; }
+	bool connected() const noexcept { return connected_; }
+
+	/** co_await returns the CONNECTED headers; throws broker_error on ERROR. */
+	template <typename Hdrs>
+	auto connect(const char *host, const char *service, const Hdrs &h)
+	{
+		struct awaiter : detail::waiter {
+			session &s;
+			const char *host;
+			const char *service;
+			const Hdrs &hdrs;
+
+			awaiter(session &s, const char *host, const char *service, const Hdrs &h) : s(s), host(host), service(service), hdrs(h) {}
+
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> c)
+			{
+				handle = c;
+				if (stomp_connect(s.s_.native_handle(), host, service, hdrs.size(), hdrs.data())) {
+					err = errno;
+					return false;
+				}
+				s.connect_waiters_.push(this);
+				return true;
+			}
+			headers_view await_resume()
+			{
+				check();
+				return result.headers();
+			}
+		};
+
+		return awaiter(*this, host, service, h);
+	}
+
+	auto connect(const char *host, const char *service, std::initializer_list<struct stomp_hdr> h)
+	{
+		hdrs_.assign(h.begin(), h.end());
+		return connect(host, service, hdrs_);
+	}
+
+	/** Send without waiting for the broker. */
+	template <typename Hdrs>
+	void send(const Hdrs &h, std::string_view body) { s_.send(h, body); }
+
+	/**
+	 * Send a message with a generated "receipt" header.
+	 *
+	 * co_await resumes once the matching RECEIPT arrives; 
+	 * throws broker_error if an ERROR frame refers to the receipt.
+	 */
+	template <typename Hdrs>
+	auto send_with_receipt(const Hdrs &h, std::string_view body)
+	{
+		struct awaiter : detail::waiter {
+			session &s;
+			const Hdrs &hdrs;
+			std::string_view body;
+			char id[32];
+
+			awaiter(session &s, const Hdrs &h, std::string_view body) : s(s), hdrs(h), body(body) {}
+
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> c)
+			{
+				struct stomp_hdr buf[16];
+				std::vector<struct stomp_hdr> big;
+				struct stomp_hdr *out = buf;
+				size_t n = hdrs.size() + 1;
+
+				handle = c;
+				if (n > sizeof(buf)/sizeof(buf[0])) {
+					big.resize(n);
+					out = big.data();
+				}
+
+				std::snprintf(id, sizeof(id), "r-%lu", ++s.receipts_);
+				receipt = id;
+				std::copy(hdrs.begin(), hdrs.end(), out);
+				out[n - 1] = {"receipt", id};
+
+				if (stomp_send(s.s_.native_handle(), n, out, const_cast<char *>(body.data()), body.size())) {
+					err = errno;
+					return false;
+				}
+				s.receipt_waiters_.push(this);
+				return true;
+			}
+			void await_resume() { check(); }
+		};
+
+		return awaiter(*this, h, body);
+	}
+
+	auto send_with_receipt(std::initializer_list<struct stomp_hdr> h, std::string_view body)
+	{
+		hdrs_.assign(h.begin(), h.end());
+		return send_with_receipt(hdrs_, body);
+	}
+
+	template <typename Hdrs>
+	subscription subscribe(const Hdrs &h);
+	subscription subscribe(std::initializer_list<struct stomp_hdr> h);
+
+	/** co_await resumes once the session is over. */
+	auto closed()
+	{
+		struct awaiter : detail::waiter {
+			session &s;
+			explicit awaiter(session &s) : s(s) {}
+			bool await_ready() const noexcept { return s.closed_; }
+			void await_suspend(std::coroutine_handle<> c) { handle = c; s.closed_waiters_.push(this); }
+			void await_resume() const noexcept {}
+		};
+
+		return awaiter(*this);
+	}
+
+	/** Send DISCONNECT with a receipt and wait for it. */
+	auto disconnect()
+	{
+		struct awaiter : detail::waiter {
+			session &s;
+			char id[32];
+			explicit awaiter(session &s) : s(s) {}
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> c)
+			{
+				handle = c;
+				std::snprintf(id, sizeof(id), "r-%lu", ++s.receipts_);
+				receipt = id;
+				const struct stomp_hdr h[] = {{"receipt", id}};
+				if (stomp_disconnect(s.s_.native_handle(), 1, h)) {
+					err = errno;
+					return false;
+				}
+				s.receipt_waiters_.push(this);
+				return true;
+			}
+			void await_resume() { check(); }
+		};
+
+		return awaiter(*this);
+	}
+
+private:
+	friend class executor;
+	friend class subscription;
+
+	/* the executor steps the C session, so it rethrows what callbacks throw */
+	template <typename F>
+	void guard(F &&f) noexcept
+	{
+		try {
+			f();
+		} catch (...) {
+			ex_.fail(std::current_exception());
+		}
+	}
+
+	void on_connected(headers_view h);
+	void on_receipt(headers_view h);
+	void on_error(const message_view &m);
+	void on_closed(int err);
+
+	executor &ex_;
+	stomp::session s_;
+	std::vector<struct stomp_hdr> hdrs_; /* storage for initializer_list headers */
+	unsigned long receipts_ = 0;
+	bool connected_ = false;
+	bool closed_ = false;
+	detail::waiter_list connect_waiters_;
+	detail::waiter_list receipt_waiters_;
+	detail::waiter_list closed_waiters_;
+	std::vector<subscription *> subs_;
+};
+
+/**
+ * A subscription whose messages are consumed with co_await next().
+ *
+ * Neither copyable nor movable. Messages arriving while nobody awaits 
+ * next() are copied into a queue.
+ */
+class subscription {
+public:
+	subscription(const subscription &) = delete;
+	subscription &operator=(const subscription &) = delete;
+
+	/* the library must not call back into a destroyed subscription. 
+	 * offline this only drops it from the registry, so it is not 
+	 * sent with the next CONNECT */
+	~subscription()
+	{
+		if (!unsubscribed_) {
+			const struct stomp_hdr h[] = {{"id", id_.c_str()}};
+			(void)stomp_unsubscribe(s_.s_.native_handle(), 0, 1, h);
+		}
+
+		auto &v = s_.subs_;
+		for (auto it = v.begin(); it != v.end(); ++it) {
+			if (*it == this) {
+				v.erase(it);
+				break;
+			}
+		}
+	}
+
+	int client_id() const noexcept { return client_id_; }
+	const std::string &id() const noexcept { return id_; }
+
+	/** 
+	 * co_await returns the next message.
+	 *
+	 * The view is valid until the next call to next() or the coroutine 
+	 * suspends on this session again; use retain() to keep it.
+	 */
+	auto next()
+	{
+		struct awaiter : detail::waiter {
+			subscription &sub;
+
+			explicit awaiter(subscription &sub) : sub(sub) {}
+			bool await_ready()
+			{
+				if (sub.queue_.empty()) {
+					if (sub.s_.closed_) {
+						err = ECONNRESET;
+						return true;
+					}
+					return false;
+				}
+				sub.current_ = std::move(sub.queue_.front());
+				sub.queue_.pop_front();
+				result = message_view(sub.current_.headers(), sub.current_.body());
+				return true;
+			}
+			void await_suspend(std::coroutine_handle<> c)
+			{
+				handle = c;
+				sub.waiters_.push(this);
+			}
+			message_view await_resume()
+			{
+				check();
+				return result;
+			}
+		};
+
+		return awaiter(*this);
+	}
+
+	/** Send UNSUBSCRIBE; pending next() calls are not resumed. */
+	void unsubscribe()
+	{
+		s_.s_.unsubscribe(0, {{"id", id_.c_str()}});
+		unsubscribed_ = true;
+	}
+
+private:
+	friend class session;
+
+	template <typename Hdrs>
+	subscription(session &s, const Hdrs &h) : s_(s)
+	{
+		client_id_ = stomp_subscribe_cb(s_.s_.native_handle(), h.size(), h.data(), &subscription::on_message, this);
+		if (client_id_ < 0) {
+			throw_errno("stomp_subscribe_cb");
+		}
+
+		auto id = headers_view(h.data(), h.size()).find("id");
+		id_ = id ? std::string(*id) : std::to_string(client_id_);
+		s_.subs_.push_back(this);
+	}
+
+	static void on_message(stomp_session_t *s, void *ctx, void *sub_ctx)
+	{
+		auto *e = static_cast<struct stomp_ctx_message *>(ctx);
+		auto *sub = static_cast<subscription *>(sub_ctx);
+		/* copying into the queue may throw */
+		sub->s_.guard([&] { sub->deliver(message_view(headers_view(e->hdrs, e->hdrc), 
+						bytes(static_cast<const std::byte *>(e->body), e->body_len), s)); });
+	}
+
+	void deliver(const message_view &m)
+	{
+		detail::waiter *w = waiters_.pop();
+		if (!w) {
+			queue_.push_back(m.retain());
+			return;
+		}
+		w->result = m;
+		s_.ex_.post(w->handle);
+	}
+
+	session &s_;
+	int client_id_ = 0;
+	std::string id_;
+	bool unsubscribed_ = false;
+	detail::waiter_list waiters_;
+	std::deque<stomp::message> queue_;
+	stomp::message current_;
+};
+
+template <typename Hdrs>
+inline subscription session::subscribe(const Hdrs &h)
+{
+	return subscription(*this, h);
+}
+
+inline subscription session::subscribe(std::initializer_list<struct stomp_hdr> h)
+{
+	hdrs_.assign(h.begin(), h.end());
+	return subscription(*this, hdrs_);
+}
+
+inline void session::on_connected(headers_view h)
+{
+	connected_ = true;
+	while (auto *w = connect_waiters_.pop()) {
+		w->result = message_view(h, bytes());
+		ex_.post(w->handle);
+	}
+}
+
+inline void session::on_receipt(headers_view h)
+{
+	auto id = h.find("receipt-id");
+	if (!id) {
+		return;
+	}
+
+	auto *w = receipt_waiters_.remove_if([&id](detail::waiter *w) { return *id == w->receipt; });
+	if (w) {
+		w->result = message_view(h, bytes());
+		ex_.post(w->handle);
+	}
+}
+
+inline void session::on_error(const message_view &m)
+{
+	std::string what(m.header("message").value_or("ERROR"));
+	auto id = m.header("receipt-id");
+	detail::waiter *w = nullptr;
+
+	if (id) {
+		w = receipt_waiters_.remove_if([&id](detail::waiter *w) { return *id == w->receipt; });
+	}
+
+	if (!w) {
+		w = connect_waiters_.pop();
+	}
+
+	if (w) {
+		w->fail(0, what);
+		ex_.post(w->handle);
+	}
+}
+
+inline void session::on_closed(int err)
+{
+	detail::waiter *w;
+
+	connected_ = false;
+	closed_ = true;
+	if (!err) {
+		err = ECONNRESET;
+	}
+
+	while ((w = connect_waiters_.pop())) {
+		w->fail(err);
+		ex_.post(w->handle);
+	}
+
+	while ((w = receipt_waiters_.pop())) {
+		w->fail(err);
+		ex_.post(w->handle);
+	}
+
+	for (auto *sub : subs_) {
+		while ((w = sub->waiters_.pop())) {
+			w->fail(err);
+			ex_.post(w->handle);
+		}
+	}
+
+	while ((w = closed_waiters_.pop())) {
+		ex_.post(w->handle);
+	}
+}
+
+inline void executor::run()
+{
+	unsigned long t;
+	int timeout;
+	int n;
+	int r;
+	int err;
+
+	for (;;) {
+		drain();
+
+		polled_.clear();
+		pfds_.clear();
+		timeout = -1;
+		for (auto *s : sessions_) {
+			stomp_session_t *h = s->s_.native_handle();
+			int fd = s->s_.fd();
+			/* poll() skips a negative fd, the session still needs 
+			 * its steps to get the connection back */
+			if ((fd == -1 && !stomp_session_reconnecting(h)) || s->closed_) {
+				continue;
+			}
+
+			polled_.push_back(s);
+			/* out of subscription credit, the step will not read */
+			short events = stomp_session_throttled(h) ? 0 : POLLIN;
+			pfds_.push_back({fd, events, 0});
+			t = s->s_.timeout();
+			if (timeout < 0 || t < (unsigned long)timeout) {
+				timeout = t;
+			}
+		}
+
+		if (polled_.empty()) {
+			if (ready_.empty()) {
+				break;
+			}
+			continue;
+		}
+
+		n = ::poll(pfds_.data(), pfds_.size(), timeout);
+		if (n < 0 && errno != EINTR) {
+			throw_errno("poll");
+		}
+
+		for (size_t i = 0; i < polled_.size(); i++) {
+			/* destroyed by a coroutine resumed for a previous session */
+			if (!polled_[i]) {
+				continue;
+			}
+
+			int readable = n > 0 && pfds_[i].revents;
+			errno = 0;
+			r = stomp_session_step(polled_[i]->s_.native_handle(), readable);
+			err = errno;
+			/* thrown by a callback set on native() */
+			if (auto e = polled_[i]->s_.exception()) {
+				fail(e);
+			}
+			if (r <= 0) {
+				polled_[i]->on_closed(err);
+			}
+
+			/* the frame read by the step is still valid */
+			drain();
+		}
+	}
+
+	drain();
+}
+
+} /* namespace stomp::coro */
+
+#endif /* STOMP_CORO_HPP */
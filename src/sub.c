@@ -0,0 +1,767 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "sub.h"
+#include "alloc.h"
+#include "hdr.h"
+
+/* initial number of hash buckets, must be a power of 2 */
+#define MINBUCKETS 16
+
+/* number of elements to add to subs->by_client_id when full */
+#define CLIENTIDINCLEN 16
+
+/* number of elements to add to sub->pending when full */
+#define PENDINGINCLEN 16
+
+/* min number of bytes to add to sub->acks when full */
+#define ACKSINCLEN 256
+
+/* pending messages of a subscription with the same ack hash, for 
+ * finding the subscription from the ack alone */
+struct ack_node {
+	struct ack_node *next; /* hash bucket chain, or free list link */
+	unsigned long ack; /* hash of the ack value */
+	struct sub *sub;
+	size_t refs; /* number of pending messages */
+};
+
+struct _subs {
+	struct sub **buckets; /* subscriptions with user supplied ids */
+	size_t buckets_len; /* number of buckets, a power of 2 */
+
+	struct sub **by_client_id; /* subscriptions with generated ids, indexed by id */
+	size_t by_client_id_capacity; /* allocated number of elements */
+
+	size_t len; /* number of subscriptions */
+	size_t exhausted; /* number of subscriptions out of credit */
+	size_t windowed; /* number of subscriptions with a window */
+
+	struct ack_node **acks; /* pending client acks of every subscription, by hash */
+	size_t acks_buckets; /* number of buckets, a power of 2 or 0 */
+	size_t acks_len; /* number of nodes in the buckets */
+	struct ack_node *acks_free; /* nodes to reuse, so tracking acks does not allocate */
+
+	struct stomp_allocator alloc; /* hooks everything in the registry is allocated with */
+};
+
+static unsigned long hash(const char *s)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* value of a decimal id as generated by the library, 0 if it is not one */
+static int parse_client_id(const char *id)
+{
+	long v = 0;
+	const char *c = id;
+
+	if (*c < '1' || *c > '9') {
+		return 0;
+	}
+
+	for (; *c; c++) {
+		if (*c < '0' || *c > '9') {
+			return 0;
+		}
+		v = v * 10 + (*c - '0');
+		if (v > INT_MAX) {
+			return 0;
+		}
+	}
+
+	return v;
+}
+
+static int subs_rehash(subs_t *subs, size_t buckets_len)
+{
+	struct sub **buckets;
+	struct sub *sub;
+	struct sub *next;
+	size_t i;
+	size_t b;
+
+	buckets = alloc_calloc(&subs->alloc, buckets_len, sizeof(*buckets));
+	if (!buckets) {
+		return -1;
+	}
+
+	for (i = 0; i < subs->buckets_len; i++) {
+		for (sub = subs->buckets[i]; sub; sub = next) {
+			next = sub->next;
+			b = hash(sub->id) & (buckets_len - 1);
+			sub->next = buckets[b];
+			buckets[b] = sub;
+		}
+	}
+
+	alloc_free(&subs->alloc, subs->buckets);
+	subs->buckets = buckets;
+	subs->buckets_len = buckets_len;
+
+	return 0;
+}
+
+subs_t *subs_new(const struct stomp_allocator *a)
+{
+	subs_t *subs = alloc_calloc(a, 1, sizeof(*subs));
+	if (!subs) {
+		return NULL;
+	}
+
+	subs->alloc = *a;
+
+	if (subs_rehash(subs, MINBUCKETS)) {
+		alloc_free(a, subs);
+		return NULL;
+	}
+
+	return subs;
+}
+
+static void sub_free(subs_t *subs, struct sub *sub)
+{
+	alloc_free(&subs->alloc, sub->pending);
+	alloc_free(&subs->alloc, sub->acks);
+	alloc_free(&subs->alloc, sub->hdrs);
+	alloc_free(&subs->alloc, sub);
+}
+
+void subs_free(subs_t *subs)
+{
+	struct stomp_allocator a = subs->alloc;
+	struct sub *sub;
+	struct sub *next;
+	struct ack_node *n;
+	struct ack_node *n_next;
+	size_t i;
+
+	for (i = 0; i < subs->buckets_len; i++) {
+		for (sub = subs->buckets[i]; sub; sub = next) {
+			next = sub->next;
+			sub_free(subs, sub);
+		}
+	}
+
+	for (i = 0; i < subs->by_client_id_capacity; i++) {
+		if (subs->by_client_id[i]) {
+			sub_free(subs, subs->by_client_id[i]);
+		}
+	}
+
+	for (i = 0; i < subs->acks_buckets; i++) {
+		for (n = subs->acks[i]; n; n = n_next) {
+			n_next = n->next;
+			alloc_free(&subs->alloc, n);
+		}
+	}
+
+	for (n = subs->acks_free; n; n = n_next) {
+		n_next = n->next;
+		alloc_free(&subs->alloc, n);
+	}
+
+	alloc_free(&a, subs->acks);
+	alloc_free(&a, subs->by_client_id);
+	alloc_free(&a, subs->buckets);
+	alloc_free(&a, subs);
+}
+
+struct sub *subs_get_client_id(subs_t *subs, int client_id)
+{
+	if (client_id <= 0 || (size_t)client_id >= subs->by_client_id_capacity) {
+		return NULL;
+	}
+
+	return subs->by_client_id[client_id];
+}
+
+/* a subscription with a user supplied id */
+static struct sub *subs_get_hashed(subs_t *subs, const char *id)
+{
+	struct sub *sub;
+
+	for (sub = subs->buckets[hash(id) & (subs->buckets_len - 1)]; sub; sub = sub->next) {
+		if (!strcmp(sub->id, id)) {
+			return sub;
+		}
+	}
+
+	return NULL;
+}
+
+struct sub *subs_get(subs_t *subs, const char *id)
+{
+	struct sub *sub;
+
+	if (!id) {
+		return NULL;
+	}
+
+	sub = subs_get_client_id(subs, parse_client_id(id));
+	if (sub) {
+		return sub;
+	}
+
+	return subs_get_hashed(subs, id);
+}
+
+/* an id to generate for a new subscription, following last. the ids go 
+ * round by_client_id, which only grows once every slot is taken: it stays 
+ * as large as the most subscriptions active at once, and a freed id is 
+ * given out again as late as possible, after messages still on their way 
+ * to the old subscription had a chance to arrive */
+int subs_client_id_next(subs_t *subs, int last)
+{
+	char buf[16];
+	size_t slots = subs->by_client_id_capacity ? subs->by_client_id_capacity - 1 : 0;
+	size_t i;
+	int id;
+
+	if (last < 0 || (size_t)last > slots) {
+		last = 0;
+	}
+
+	for (i = 0; i < slots; i++) {
+		id = (last + i) % slots + 1;
+		if (subs->by_client_id[id]) {
+			continue;
+		}
+
+		/* taken by a numeric id of the user */
+		snprintf(buf, sizeof(buf), "%d", id);
+		if (!subs_get_hashed(subs, buf)) {
+			return id;
+		}
+	}
+
+	for (id = slots + 1; id < INT_MAX; id++) {
+		snprintf(buf, sizeof(buf), "%d", id);
+		if (!subs_get_hashed(subs, buf)) {
+			return id;
+		}
+	}
+
+	errno = ENOSPC;
+	return -1;
+}
+
+struct sub *subs_get_destination(subs_t *subs, const char *destination)
+{
+	struct sub *sub;
+	size_t i;
+
+	for (i = 0; i < subs->by_client_id_capacity; i++) {
+		sub = subs->by_client_id[i];
+		if (sub && !strcmp(sub->destination, destination)) {
+			return sub;
+		}
+	}
+
+	for (i = 0; i < subs->buckets_len; i++) {
+		for (sub = subs->buckets[i]; sub; sub = sub->next) {
+			if (!strcmp(sub->destination, destination)) {
+				return sub;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+struct sub *subs_add(subs_t *subs, const char *id, int client_id, const char *destination)
+{
+	struct sub *sub;
+	struct sub **tmp;
+	size_t id_len;
+	size_t destination_len;
+	size_t capacity;
+	size_t b;
+
+	if (!id || !destination || client_id < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (subs_get(subs, id)) {
+		errno = EEXIST;
+		return NULL;
+	}
+
+	if (client_id && (size_t)client_id >= subs->by_client_id_capacity) {
+		capacity = client_id + CLIENTIDINCLEN;
+		tmp = alloc_realloc(&subs->alloc, subs->by_client_id, capacity * sizeof(*tmp));
+		if (!tmp) {
+			return NULL;
+		}
+
+		memset(&tmp[subs->by_client_id_capacity], 0, sizeof(*tmp)*(capacity - subs->by_client_id_capacity));
+
+		subs->by_client_id = tmp;
+		subs->by_client_id_capacity = capacity;
+	}
+
+	if (!client_id && subs->len >= subs->buckets_len) {
+		if (subs_rehash(subs, subs->buckets_len * 2)) {
+			return NULL;
+		}
+	}
+
+	/* the strings follow the structure */
+	id_len = strlen(id) + 1;
+	destination_len = strlen(destination) + 1;
+	sub = alloc_calloc(&subs->alloc, 1, sizeof(*sub) + id_len + destination_len);
+	if (!sub) {
+		return NULL;
+	}
+
+	sub->id = memcpy((char *)(sub + 1), id, id_len);
+	sub->destination = memcpy((char *)(sub + 1) + id_len, destination, destination_len);
+	sub->client_id = client_id;
+
+	if (client_id) {
+		subs->by_client_id[client_id] = sub;
+	} else {
+		b = hash(id) & (subs->buckets_len - 1);
+		sub->next = subs->buckets[b];
+		subs->buckets[b] = sub;
+	}
+
+	subs->len++;
+
+	return sub;
+}
+
+/* keep a copy of the SUBSCRIBE headers to subscribe again after a reconnect */
+int subs_hdrs_set(subs_t *subs, struct sub *sub, size_t hdrc, const struct stomp_hdr *hdrs)
+{
+	struct stomp_hdr *dup;
+
+	dup = hdr_dup(&subs->alloc, hdrc, hdrs);
+	if (!dup) {
+		return -1;
+	}
+
+	alloc_free(&subs->alloc, sub->hdrs);
+	sub->hdrs = dup;
+	sub->hdrc = hdrc;
+
+	return 0;
+}
+
+/* link pointing to the node of sub and ack, or the NULL ending the chain */
+static struct ack_node **acks_link(subs_t *subs, struct sub *sub, unsigned long ack)
+{
+	struct ack_node **p;
+
+	for (p = &subs->acks[ack & (subs->acks_buckets - 1)]; *p; p = &(*p)->next) {
+		if ((*p)->ack == ack && (*p)->sub == sub) {
+			break;
+		}
+	}
+
+	return p;
+}
+
+static int acks_rehash(subs_t *subs, size_t buckets_len)
+{
+	struct ack_node **buckets;
+	struct ack_node *n;
+	struct ack_node *next;
+	size_t i;
+	size_t b;
+
+	buckets = alloc_calloc(&subs->alloc, buckets_len, sizeof(*buckets));
+	if (!buckets) {
+		return -1;
+	}
+
+	for (i = 0; i < subs->acks_buckets; i++) {
+		for (n = subs->acks[i]; n; n = next) {
+			next = n->next;
+			b = n->ack & (buckets_len - 1);
+			n->next = buckets[b];
+			buckets[b] = n;
+		}
+	}
+
+	alloc_free(&subs->alloc, subs->acks);
+	subs->acks = buckets;
+	subs->acks_buckets = buckets_len;
+
+	return 0;
+}
+
+static int acks_add(subs_t *subs, struct sub *sub, unsigned long ack)
+{
+	struct ack_node **p;
+	struct ack_node *n;
+
+	/* a failing rehash only makes the chains longer */
+	if (subs->acks_len >= subs->acks_buckets &&
+	    acks_rehash(subs, subs->acks_buckets ? subs->acks_buckets * 2 : MINBUCKETS) &&
+	    !subs->acks_buckets) {
+		return -1;
+	}
+
+	p = acks_link(subs, sub, ack);
+	if (*p) {
+		(*p)->refs++;
+		return 0;
+	}
+
+	n = subs->acks_free;
+	if (n) {
+		subs->acks_free = n->next;
+	} else {
+		n = alloc_malloc(&subs->alloc, sizeof(*n));
+		if (!n) {
+			return -1;
+		}
+	}
+
+	n->next = NULL;
+	n->ack = ack;
+	n->sub = sub;
+	n->refs = 1;
+	*p = n;
+	subs->acks_len++;
+
+	return 0;
+}
+
+static void acks_del(subs_t *subs, struct sub *sub, unsigned long ack)
+{
+	struct ack_node **p;
+	struct ack_node *n;
+
+	p = acks_link(subs, sub, ack);
+	n = *p;
+	if (!n || --n->refs) {
+		return;
+	}
+
+	*p = n->next;
+	n->next = subs->acks_free;
+	subs->acks_free = n;
+	subs->acks_len--;
+}
+
+/* forget the pending messages of sub */
+static void sub_pending_clear(subs_t *subs, struct sub *sub)
+{
+	size_t i;
+
+	for (i = 0; i < sub->pending_len; i++) {
+		acks_del(subs, sub, sub->pending[i].ack);
+	}
+
+	sub->pending_len = 0;
+	sub->acks_len = 0;
+}
+
+static int sub_exhausted(const struct sub *sub)
+{
+	return (sub->window_msgs && sub->msgs >= sub->window_msgs) ||
+		(sub->window_bytes && sub->bytes >= sub->window_bytes);
+}
+
+void subs_del(subs_t *subs, struct sub *sub)
+{
+	struct sub **p;
+
+	if (sub_exhausted(sub)) {
+		subs->exhausted--;
+	}
+
+	if (sub->window_msgs || sub->window_bytes) {
+		subs->windowed--;
+	}
+
+	if (sub->client_id) {
+		subs->by_client_id[sub->client_id] = NULL;
+	} else {
+		for (p = &subs->buckets[hash(sub->id) & (subs->buckets_len - 1)]; *p; p = &(*p)->next) {
+			if (*p == sub) {
+				*p = sub->next;
+				break;
+			}
+		}
+	}
+
+	sub_pending_clear(subs, sub);
+	subs->len--;
+	sub_free(subs, sub);
+}
+
+size_t subs_len(subs_t *subs)
+{
+	return subs->len;
+}
+
+/* calls fn for every subscription until it returns non zero. fn must not add or remove subscriptions */
+int subs_foreach(subs_t *subs, int (*fn)(struct sub *sub, void *ctx), void *ctx)
+{
+	struct sub *sub;
+	size_t i;
+	int r;
+
+	for (i = 0; i < subs->by_client_id_capacity; i++) {
+		sub = subs->by_client_id[i];
+		if (sub && (r = fn(sub, ctx))) {
+			return r;
+		}
+	}
+
+	for (i = 0; i < subs->buckets_len; i++) {
+		for (sub = subs->buckets[i]; sub; sub = sub->next) {
+			if ((r = fn(sub, ctx))) {
+				return r;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void subs_window_set(subs_t *subs, struct sub *sub, size_t msgs, size_t bytes)
+{
+	int was_exhausted = sub_exhausted(sub);
+	int was_windowed = sub->window_msgs || sub->window_bytes;
+
+	sub->window_msgs = msgs;
+	sub->window_bytes = bytes;
+
+	if (was_windowed && !msgs && !bytes) {
+		subs->windowed--;
+		/* untracked from now on */
+		sub->msgs = 0;
+		sub->bytes = 0;
+		sub_pending_clear(subs, sub);
+	} else if (!was_windowed && (msgs || bytes)) {
+		subs->windowed++;
+	}
+
+	subs->exhausted += sub_exhausted(sub) - was_exhausted;
+}
+
+int subs_consume(subs_t *subs, struct sub *sub, const char *ack, size_t bytes)
+{
+	struct sub_pending *p;
+	int was_exhausted = sub_exhausted(sub);
+	size_t len;
+	char *tmp;
+
+	if (!sub->window_msgs && !sub->window_bytes) {
+		return 0;
+	}
+
+	/* client acks need to know which messages an ack covers */
+	if (sub->ack_mode != SUB_ACK_AUTO) {
+		if (!ack) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (sub->pending_len == sub->pending_capacity) {
+			size_t capacity = sub->pending_capacity + PENDINGINCLEN;
+			p = alloc_realloc(&subs->alloc, sub->pending, capacity * sizeof(*p));
+			if (!p) {
+				return -1;
+			}
+
+			sub->pending = p;
+			sub->pending_capacity = capacity;
+		}
+
+		len = strlen(ack);
+		if (sub->acks_capacity - sub->acks_len < len) {
+			size_t capacity = sub->acks_capacity * 2;
+			if (capacity < sub->acks_len + len + ACKSINCLEN) {
+				capacity = sub->acks_len + len + ACKSINCLEN;
+			}
+
+			tmp = alloc_realloc(&subs->alloc, sub->acks, capacity);
+			if (!tmp) {
+				return -1;
+			}
+
+			sub->acks = tmp;
+			sub->acks_capacity = capacity;
+		}
+
+		p = &sub->pending[sub->pending_len];
+		p->ack = hash(ack);
+		if (acks_add(subs, sub, p->ack)) {
+			return -1;
+		}
+
+		p->ack_off = sub->acks_len;
+		p->ack_len = len;
+		p->bytes = bytes;
+		memcpy(sub->acks + sub->acks_len, ack, len);
+		sub->acks_len += len;
+		sub->pending_len++;
+	}
+
+	sub->msgs += 1;
+	sub->bytes += bytes;
+
+	subs->exhausted += sub_exhausted(sub) - was_exhausted;
+
+	return 0;
+}
+
+static int sub_pending_is(const struct sub *sub, size_t i, unsigned long h, const char *ack, size_t len)
+{
+	const struct sub_pending *p = &sub->pending[i];
+
+	return p->ack == h && p->ack_len == len && !memcmp(sub->acks + p->ack_off, ack, len);
+}
+
+/* cumulative acks are usually for the latest message, individual ones 
+ * for the oldest, so each is looked for from that end */
+static ssize_t sub_pending_find(const struct sub *sub, unsigned long h, const char *ack)
+{
+	size_t len = strlen(ack);
+	size_t i;
+
+	if (sub->ack_mode == SUB_ACK_CLIENT) {
+		for (i = sub->pending_len; i > 0; i--) {
+			if (sub_pending_is(sub, i - 1, h, ack, len)) {
+				return i - 1;
+			}
+		}
+	} else {
+		for (i = 0; i < sub->pending_len; i++) {
+			if (sub_pending_is(sub, i, h, ack, len)) {
+				return i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+void subs_release(subs_t *subs, struct sub *sub, const char *ack, size_t bytes)
+{
+	int was_exhausted = sub_exhausted(sub);
+	ssize_t i;
+	size_t first;
+	size_t last;
+	size_t n;
+	size_t off;
+	size_t cut;
+
+	if (!sub->window_msgs && !sub->window_bytes) {
+		return;
+	}
+
+	if (sub->ack_mode == SUB_ACK_AUTO) {
+		sub->msgs -= sub->msgs ? 1 : 0;
+		sub->bytes -= sub->bytes > bytes ? bytes : sub->bytes;
+	} else {
+		if (!ack) {
+			return;
+		}
+
+		i = sub_pending_find(sub, hash(ack), ack);
+		if (i < 0) {
+			return;
+		}
+
+		/* cumulative acks release every older message too */
+		last = i;
+		first = sub->ack_mode == SUB_ACK_CLIENT ? 0 : last;
+		for (n = first; n <= last; n++) {
+			sub->msgs -= 1;
+			sub->bytes -= sub->pending[n].bytes;
+			acks_del(subs, sub, sub->pending[n].ack);
+		}
+
+		/* the values of the released messages are next to each other */
+		off = sub->pending[first].ack_off;
+		cut = sub->pending[last].ack_off + sub->pending[last].ack_len - off;
+		memmove(sub->acks + off, sub->acks + off + cut, sub->acks_len - off - cut);
+		sub->acks_len -= cut;
+		for (n = last + 1; n < sub->pending_len; n++) {
+			sub->pending[n].ack_off -= cut;
+		}
+
+		n = last + 1 - first;
+		memmove(&sub->pending[first], &sub->pending[last + 1], (sub->pending_len - last - 1) * sizeof(*sub->pending));
+		sub->pending_len -= n;
+	}
+
+	subs->exhausted += sub_exhausted(sub) - was_exhausted;
+}
+
+struct sub *subs_get_pending(subs_t *subs, const char *ack)
+{
+	unsigned long h;
+	struct ack_node *n;
+
+	if (!ack || !subs->acks_len) {
+		return NULL;
+	}
+
+	h = hash(ack);
+
+	/* the hash only narrows it down to a few subscriptions */
+	for (n = subs->acks[h & (subs->acks_buckets - 1)]; n; n = n->next) {
+		if (n->ack == h && sub_pending_find(n->sub, h, ack) >= 0) {
+			return n->sub;
+		}
+	}
+
+	return NULL;
+}
+
+size_t subs_exhausted(subs_t *subs)
+{
+	return subs->exhausted;
+}
+
+static int sub_credit_reset(struct sub *sub, void *ctx)
+{
+	sub->msgs = 0;
+	sub->bytes = 0;
+	sub_pending_clear(ctx, sub);
+
+	return 0;
+}
+
+/* forget every outstanding message, e.g. the broker redelivers them on a new connection */
+void subs_credit_reset(subs_t *subs)
+{
+	(void)subs_foreach(subs, sub_credit_reset, subs);
+	subs->exhausted = 0;
+}
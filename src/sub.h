@@ -0,0 +1,92 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SUB_H
+#define SUB_H
+
+#include "stomp.h"
+
+/*
+ * Registry of the active subscriptions of a session.
+ *
+ * Subscriptions are looked up by the value of their "id" header. Ids 
+ * generated by the library are numeric and indexed by value, the ones
+ * supplied by the user are hashed. Generated ids are reused, so the 
+ * index does not outgrow the number of subscriptions.
+ *
+ * Messages holding credit in client ack modes are also indexed by the 
+ * hash of their ack value, so a STOMP 1.2 ACK, which does not name the 
+ * subscription, finds it without going through all of them.
+ */
+typedef struct _subs subs_t;
+
+enum sub_ack {
+	SUB_ACK_AUTO,
+	SUB_ACK_CLIENT,
+	SUB_ACK_CLIENT_INDIVIDUAL
+};
+
+/* a delivered message still holding credit */
+struct sub_pending {
+	unsigned long ack; /* hash of the value used to ack the message */
+	size_t ack_off; /* the value itself, in sub->acks */
+	size_t ack_len;
+	size_t bytes; /* body length */
+};
+
+struct sub {
+	struct sub *next; /* hash bucket chain */
+	const char *id; /* value of the "id" header */
+	const char *destination; /* value of the "destination" header */
+	int client_id; /* generated id, 0 if supplied by the user */
+	stomp_cb_t cb; /* per subscription SCB_MESSAGE callback */
+	void *ctx; /* pointer passed to cb */
+	enum sub_ack ack_mode;
+	size_t hdrc; /* number of SUBSCRIBE headers */
+	struct stomp_hdr *hdrs; /* copy of the SUBSCRIBE headers supplied by the user */
+
+	size_t window_msgs; /* max number of outstanding messages, 0 for no limit */
+	size_t window_bytes; /* max number of outstanding body bytes, 0 for no limit */
+	size_t msgs; /* number of outstanding messages */
+	size_t bytes; /* number of outstanding body bytes */
+	struct sub_pending *pending; /* messages waiting for an ack, oldest first */
+	size_t pending_len; /* number of elements in the array */
+	size_t pending_capacity; /* allocated number of elements */
+	char *acks; /* ack values of the pending messages, in the same order */
+	size_t acks_len; /* number of bytes used */
+	size_t acks_capacity; /* allocated number of bytes */
+};
+
+subs_t *subs_new(const struct stomp_allocator *a);
+void subs_free(subs_t *subs);
+struct sub *subs_add(subs_t *subs, const char *id, int client_id, const char *destination);
+int subs_hdrs_set(subs_t *subs, struct sub *sub, size_t hdrc, const struct stomp_hdr *hdrs);
+struct sub *subs_get(subs_t *subs, const char *id);
+struct sub *subs_get_client_id(subs_t *subs, int client_id);
+int subs_client_id_next(subs_t *subs, int last);
+struct sub *subs_get_destination(subs_t *subs, const char *destination);
+void subs_del(subs_t *subs, struct sub *sub);
+size_t subs_len(subs_t *subs);
+int subs_foreach(subs_t *subs, int (*fn)(struct sub *sub, void *ctx), void *ctx);
+
+void subs_window_set(subs_t *subs, struct sub *sub, size_t msgs, size_t bytes);
+int subs_consume(subs_t *subs, struct sub *sub, const char *ack, size_t bytes);
+void subs_release(subs_t *subs, struct sub *sub, const char *ack, size_t bytes);
+struct sub *subs_get_pending(subs_t *subs, const char *ack);
+size_t subs_exhausted(subs_t *subs);
+void subs_credit_reset(subs_t *subs);
+
+#endif /* SUB_H */
@@ -0,0 +1,321 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "alloc.h"
+
+struct tls {
+	SSL_CTX *ctx;
+	char *server_name; /* NULL to verify the host passed to stomp_connect() */
+};
+
+/* a connection */
+struct tls_conn {
+	SSL *ssl;
+	int fd;
+	int kernel; /* kTLS sends, fd can be written plain text */
+};
+
+tls_t *tls_new(const struct stomp_tls *conf)
+{
+	tls_t *t;
+
+	t = alloc_calloc(NULL, 1, sizeof(*t));
+	if (!t) {
+		return NULL;
+	}
+
+	if (conf->server_name) {
+		t->server_name = alloc_strdup(NULL, conf->server_name);
+		if (!t->server_name) {
+			goto tls_new_error;
+		}
+	}
+
+	t->ctx = SSL_CTX_new(TLS_client_method());
+	if (!t->ctx) {
+		errno = ENOMEM;
+		goto tls_new_error;
+	}
+
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	if (!conf->no_ktls) {
+		SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS);
+	}
+
+	if (!conf->insecure) {
+		SSL_CTX_set_verify(t->ctx, SSL_VERIFY_PEER, NULL);
+		if ((conf->ca_file && SSL_CTX_load_verify_locations(t->ctx, conf->ca_file, NULL) != 1) ||
+		    (!conf->ca_file && SSL_CTX_set_default_verify_paths(t->ctx) != 1)) {
+			errno = EINVAL;
+			goto tls_new_error;
+		}
+	}
+
+	if (conf->cert_file && 
+	    (SSL_CTX_use_certificate_chain_file(t->ctx, conf->cert_file) != 1 ||
+	     SSL_CTX_use_PrivateKey_file(t->ctx, conf->key_file ? conf->key_file : conf->cert_file, SSL_FILETYPE_PEM) != 1 ||
+	     SSL_CTX_check_private_key(t->ctx) != 1)) {
+		errno = EINVAL;
+		goto tls_new_error;
+	}
+
+	return t;
+
+tls_new_error:
+	ERR_clear_error();
+	tls_free(t);
+	return NULL;
+}
+
+void tls_free(tls_t *t)
+{
+	if (!t) {
+		return;
+	}
+
+	SSL_CTX_free(t->ctx);
+	alloc_free(NULL, t->server_name);
+	alloc_free(NULL, t);
+}
+
+/* map a failed SSL call to what read(2) or write(2) would have done */
+static ssize_t tls_error(SSL *ssl, int n, int err)
+{
+	int reason;
+
+	switch (SSL_get_error(ssl, n)) {
+		case SSL_ERROR_ZERO_RETURN:
+			/* close_notify */
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			errno = err ? err : ECONNRESET;
+			break;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			/* only with a socket timeout */
+			errno = EAGAIN;
+			break;
+		default:
+			reason = ERR_GET_REASON(ERR_peek_error());
+			ERR_clear_error();
+			/* the broker went away without close_notify */
+			if (reason == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+				return 0;
+			}
+			errno = EPROTO;
+			return -1;
+	}
+
+	ERR_clear_error();
+	return -1;
+}
+
+/* always through OpenSSL: a kTLS socket fails plain reads with EIO on 
+ * records other than application data, like the session tickets TLS 1.3 
+ * brokers send right after the handshake. OpenSSL fetches the record 
+ * type along with the data and still leaves the decryption to the kernel */
+static ssize_t tls_readv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct tls_conn *c = ctx;
+	int i;
+	int n;
+
+	/* one record at most, like a socket read */
+	for (i = 0; i < iovcnt && !iov[i].iov_len; i++) {
+	}
+	if (i == iovcnt) {
+		return 0;
+	}
+
+	n = SSL_read(c->ssl, iov[i].iov_base, iov[i].iov_len > INT_MAX ? INT_MAX : iov[i].iov_len);
+
+	return n > 0 ? n : tls_error(c->ssl, n, errno);
+}
+
+static ssize_t tls_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct tls_conn *c = ctx;
+	ssize_t total = 0;
+	int i;
+	int n;
+
+	if (c->kernel) {
+		return writev(c->fd, iov, iovcnt);
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len) {
+			continue;
+		}
+
+		n = SSL_write(c->ssl, iov[i].iov_base, iov[i].iov_len > INT_MAX ? INT_MAX : iov[i].iov_len);
+		if (n <= 0) {
+			/* report what was written already, the error comes again */
+			return total ? total : tls_error(c->ssl, n, errno);
+		}
+
+		total += n;
+		if ((size_t)n < iov[i].iov_len) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+static ssize_t tls_sendfile(void *ctx, int in_fd, off_t *offset, size_t count)
+{
+	struct tls_conn *c = ctx;
+
+	/* the kernel encrypts the pages as they go, no user space copies */
+	if (c->kernel) {
+		return sendfile(c->fd, in_fd, offset, count);
+	}
+
+	errno = ENOSYS;
+	return -1;
+}
+
+static size_t tls_pending(void *ctx)
+{
+	struct tls_conn *c = ctx;
+
+	return SSL_pending(c->ssl);
+}
+
+static int tls_fd(void *ctx)
+{
+	struct tls_conn *c = ctx;
+
+	return c->fd;
+}
+
+static void tls_close(void *ctx)
+{
+	struct tls_conn *c = ctx;
+
+	SSL_free(c->ssl);
+	(void)close(c->fd);
+	alloc_free(NULL, c);
+}
+
+/* connected by the session, see tls_open() */
+static const struct stomp_transport tls_transport = {
+	.readv = tls_readv,
+	.writev = tls_writev,
+	.sendfile = tls_sendfile,
+	.pending = tls_pending,
+	.fd = tls_fd,
+	.close = tls_close,
+};
+
+/* give the handshake timeout ms, 0 to wait for ever */
+static int tls_timeout(int fd, unsigned long timeout)
+{
+	struct timeval tv;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int tls_open(tls_t *t, int fd, const char *host, unsigned long timeout, struct io *io)
+{
+	const char *name = t->server_name ? t->server_name : host;
+	unsigned char addr[sizeof(struct in6_addr)];
+	struct tls_conn *c;
+	SSL *ssl;
+	int err;
+	int n;
+
+	ssl = SSL_new(t->ctx);
+	if (!ssl) {
+		ERR_clear_error();
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* an address is matched against the IP entries of the certificate */
+	if (inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1) {
+		n = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name);
+	} else {
+		n = SSL_set_tlsext_host_name(ssl, name) && SSL_set1_host(ssl, name);
+	}
+
+	if (!n || !SSL_set_fd(ssl, fd) || (timeout && tls_timeout(fd, timeout))) {
+		ERR_clear_error();
+		SSL_free(ssl);
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = SSL_connect(ssl);
+	err = errno;
+	if (timeout) {
+		(void)tls_timeout(fd, 0);
+	}
+
+	if (n != 1) {
+		if (tls_error(ssl, n, err) == 0) {
+			errno = ECONNRESET;
+		} else if (errno == EAGAIN) {
+			errno = ETIMEDOUT;
+		}
+		err = errno;
+		SSL_free(ssl);
+		errno = err;
+		return -1;
+	}
+
+	c = alloc_calloc(NULL, 1, sizeof(*c));
+	if (!c) {
+		SSL_free(ssl);
+		return -1;
+	}
+	c->ssl = ssl;
+	c->fd = fd;
+
+#ifdef BIO_get_ktls_send
+	c->kernel = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+
+	io->t = &tls_transport;
+	io->ctx = c;
+
+	return c->kernel ? STLS_KERNEL : STLS_USER;
+}
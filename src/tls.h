@@ -0,0 +1,47 @@
+/*
+ * Copyright 2013 Evgeni Dobrev <evgeni_dobrev@developer.bg>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TLS_H
+#define TLS_H
+
+#include "stomp.h"
+#include "io.h"
+
+/*
+ * TLS transport on top of OpenSSL, built with --with-openssl.
+ *
+ * Once the handshake is done OpenSSL is asked to hand the symmetric 
+ * encryption over to the kernel (kTLS, SOL_TLS). If the kernel takes 
+ * both directions the socket carries plain text as far as the library 
+ * is concerned and is read, written and sendfile()d directly; otherwise 
+ * every byte goes through SSL_read() and SSL_write().
+ */
+
+/* the settings of a session, shared by all of its connections */
+typedef struct tls tls_t;
+
+tls_t *tls_new(const struct stomp_tls *conf);
+void tls_free(tls_t *t);
+
+/* handshake over the connected blocking socket fd, within timeout ms, 0 for 
+ * no limit. host is verified unless the settings name another one.
+ * on success io is set up to read and write the connection, and to close 
+ * fd along with it, and the mode is returned. 
+ * returns -1 and sets errno on failure, EPROTO if the broker was not trusted; 
+ * fd is left open then. */
+int tls_open(tls_t *t, int fd, const char *host, unsigned long timeout, struct io *io);
+
+#endif /* TLS_H */
@@ -0,0 +1,1480 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+
+#ifdef STOMP_TLS
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#endif
+
+#include "broker.h"
+
+/* max headers kept per received frame, the rest is ignored */
+#define BROKER_HDRS 64
+
+/* how long a closing connection waits for the client to close its side, ms */
+#define BROKER_LINGER 1000
+
+static const char *cmds[] = {
+	"CONNECT", "STOMP", "SEND", "SUBSCRIBE", "UNSUBSCRIBE", "ACK", "NACK",
+	"BEGIN", "COMMIT", "ABORT", "DISCONNECT", "HEART-BEAT",
+};
+
+#define BROKER_CMDS (sizeof(cmds)/sizeof(*cmds))
+
+struct bframe {
+	char *cmd;
+	size_t hdrc;
+	char *keys[BROKER_HDRS];
+	char *vals[BROKER_HDRS];
+	char *body;
+	size_t body_len;
+	size_t beats; /* heart-beats ahead of the frame */
+};
+
+/* a SEND frame on its way to the subscribers */
+struct msg {
+	struct msg *next;
+	char *dest;
+	size_t hdrc;
+	char **kv; /* hdrc keys followed by hdrc values */
+	char *body;
+	size_t body_len;
+};
+
+struct sub {
+	struct sub *next;
+	char *id;
+	char *dest;
+	int ack; /* not "auto" */
+};
+
+struct tx {
+	struct tx *next;
+	char *id;
+	struct msg *head;
+	struct msg **tail;
+};
+
+struct conn {
+	struct conn *next;
+	struct broker *b;
+	pthread_t thread;
+	int fd;
+	int closed;
+#ifdef STOMP_TLS
+	/* with tls, fd is one end of a socket pair and a relay thread moves
+	 * the data between the other end and the TLS connection */
+	SSL *ssl;
+	pthread_t relay;
+	int tls_fd;
+	int relay_fd;
+#endif
+
+	int version; /* 10, 11, 12; 0 before CONNECT */
+	unsigned long hb_out; /* negotiated heart-beat intervals, ms */
+	unsigned long hb_in;
+	unsigned long last_out; /* when something was last written/read, ms */
+	unsigned long last_in;
+	unsigned long frames;
+
+	struct sub *subs;
+	struct tx *txs;
+
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+struct broker {
+	struct broker_opts o;
+	int fd;
+	char service[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	pthread_t thread;
+#ifdef STOMP_TLS
+	SSL_CTX *tls;
+	char ca[32]; /* PEM file with the self-signed certificate */
+#endif
+
+	pthread_mutex_t lock; /* everything below, and all writes */
+	pthread_cond_t cond;
+	struct conn *conns;
+	unsigned long counts[BROKER_CMDS];
+	unsigned long connections;
+	unsigned long ids;
+	int stop;
+};
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ns(unsigned long long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (nanosleep(&ts, &ts) && errno == EINTR) {
+	}
+}
+
+static void count(struct broker *b, const char *cmd)
+{
+	size_t i;
+
+	for (i = 0; i < BROKER_CMDS; i++) {
+		if (!strcmp(cmds[i], cmd)) {
+			b->counts[i]++;
+			pthread_cond_broadcast(&b->cond);
+			return;
+		}
+	}
+}
+
+static const char *hdr(const struct bframe *f, const char *key)
+{
+	size_t i;
+
+	/* the first occurence of a repeated header wins */
+	for (i = 0; i < f->hdrc; i++) {
+		if (!strcmp(f->keys[i], key)) {
+			return f->vals[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* call with b->lock held */
+static void conn_write(struct conn *c, const char *data, size_t len)
+{
+	size_t bandwidth = c->b->o.bandwidth;
+	ssize_t n;
+
+	while (len && !c->closed) {
+		n = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		data += n;
+		len -= n;
+
+		if (bandwidth) {
+			sleep_ns(n * 1000000000ULL / bandwidth);
+		}
+	}
+
+	c->last_out = now_ms();
+}
+
+static void put_escaped(FILE *f, int version, const char *s)
+{
+	for (; *s; s++) {
+		if (version < 11) {
+			fputc(*s, f);
+			continue;
+		}
+
+		switch (*s) {
+			case '\\':
+				fputs("\\\\", f);
+				break;
+			case '\n':
+				fputs("\\n", f);
+				break;
+			case ':':
+				fputs("\\c", f);
+				break;
+			case '\r':
+				fputs(version > 11 ? "\\r" : "\r", f);
+				break;
+			default:
+				fputc(*s, f);
+		}
+	}
+}
+
+static void put_hdr(FILE *f, int version, const char *key, const char *val)
+{
+	put_escaped(f, version, key);
+	fputc(':', f);
+	put_escaped(f, version, val);
+	fputc('\n', f);
+}
+
+/* call with b->lock held */
+static void send_error(struct conn *c, const struct bframe *req, const char *message)
+{
+	const char *receipt = req ? hdr(req, "receipt") : NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		return;
+	}
+
+	fputs("ERROR\n", f);
+	put_hdr(f, c->version, "message", message);
+	if (receipt) {
+		put_hdr(f, c->version, "receipt-id", receipt);
+	}
+	fprintf(f, "content-type:text/plain\ncontent-length:%zu\n\n%s", strlen(message), message);
+	fputc('\0', f);
+	fclose(f);
+
+	conn_write(c, buf, len);
+	free(buf);
+}
+
+/* call with b->lock held */
+static void send_receipt(struct conn *c, const char *receipt)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		return;
+	}
+
+	fputs("RECEIPT\n", f);
+	put_hdr(f, c->version, "receipt-id", receipt);
+	fputc('\n', f);
+	fputc('\0', f);
+	fclose(f);
+
+	conn_write(c, buf, len);
+	free(buf);
+}
+
+static void msg_free(struct msg *m)
+{
+	size_t i;
+
+	for (i = 0; i < 2 * m->hdrc; i++) {
+		free(m->kv[i]);
+	}
+	free(m->kv);
+	free(m->dest);
+	free(m->body);
+	free(m);
+}
+
+static struct msg *msg_new(const struct bframe *f, const char *dest)
+{
+	struct msg *m;
+	size_t i;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		return NULL;
+	}
+
+	m->kv = calloc(2 * f->hdrc + 1, sizeof(*m->kv));
+	m->dest = strdup(dest);
+	m->body = malloc(f->body_len + 1);
+	if (!m->kv || !m->dest || !m->body) {
+		msg_free(m);
+		return NULL;
+	}
+
+	memcpy(m->body, f->body, f->body_len);
+	m->body_len = f->body_len;
+
+	for (i = 0; i < f->hdrc; i++) {
+		const char *k = f->keys[i];
+
+		if (!strcmp(k, "destination") || !strcmp(k, "transaction") ||
+				!strcmp(k, "receipt") || !strcmp(k, "content-length")) {
+			continue;
+		}
+
+		m->kv[m->hdrc] = strdup(k);
+		m->kv[f->hdrc + m->hdrc] = strdup(f->vals[i]);
+		m->hdrc++;
+		if (!m->kv[m->hdrc - 1] || !m->kv[f->hdrc + m->hdrc - 1]) {
+			m->hdrc = f->hdrc;
+			msg_free(m);
+			return NULL;
+		}
+	}
+
+	/* keep the values right after the keys */
+	memmove(m->kv + m->hdrc, m->kv + f->hdrc, m->hdrc * sizeof(*m->kv));
+
+	return m;
+}
+
+/* fan a message out to every matching subscription; call with b->lock held */
+static void deliver(struct broker *b, const struct msg *m)
+{
+	char id[32];
+	struct conn *c;
+	struct sub *s;
+	char *buf;
+	size_t len;
+	size_t i;
+	FILE *f;
+
+	for (c = b->conns; c; c = c->next) {
+		for (s = c->subs; s && !c->closed; s = s->next) {
+			if (strcmp(s->dest, m->dest)) {
+				continue;
+			}
+
+			buf = NULL;
+			len = 0;
+			f = open_memstream(&buf, &len);
+			if (!f) {
+				continue;
+			}
+
+			snprintf(id, sizeof(id), "m-%lu", ++b->ids);
+
+			fputs("MESSAGE\n", f);
+			put_hdr(f, c->version, "destination", m->dest);
+			put_hdr(f, c->version, "message-id", id);
+			put_hdr(f, c->version, "subscription", s->id);
+			if (c->version > 11 && s->ack) {
+				put_hdr(f, c->version, "ack", id);
+			}
+			for (i = 0; i < m->hdrc; i++) {
+				put_hdr(f, c->version, m->kv[i], m->kv[m->hdrc + i]);
+			}
+			fprintf(f, "content-length:%zu\n\n", m->body_len);
+			fwrite(m->body, 1, m->body_len, f);
+			fputc('\0', f);
+			fclose(f);
+
+			conn_write(c, buf, len);
+			free(buf);
+		}
+	}
+}
+
+static void tx_free(struct tx *t)
+{
+	struct msg *m;
+
+	while ((m = t->head)) {
+		t->head = m->next;
+		msg_free(m);
+	}
+	free(t->id);
+	free(t);
+}
+
+static struct tx *tx_find(struct conn *c, const char *id, struct tx ***prev)
+{
+	struct tx **t;
+
+	for (t = &c->txs; *t; t = &(*t)->next) {
+		if (!strcmp((*t)->id, id)) {
+			if (prev) {
+				*prev = t;
+			}
+			return *t;
+		}
+	}
+
+	return NULL;
+}
+
+static void sub_free(struct sub *s)
+{
+	free(s->id);
+	free(s->dest);
+	free(s);
+}
+
+/* drop the subscriptions and transactions; call with b->lock held */
+static void conn_clear(struct conn *c)
+{
+	struct sub *s;
+	struct tx *t;
+
+	while ((s = c->subs)) {
+		c->subs = s->next;
+		sub_free(s);
+	}
+
+	while ((t = c->txs)) {
+		c->txs = t->next;
+		tx_free(t);
+	}
+}
+
+static const char *on_connect(struct conn *c, const struct bframe *f)
+{
+	const char *accept = hdr(f, "accept-version");
+	const char *hb = hdr(f, "heart-beat");
+	unsigned long cx = 0, cy = 0;
+	struct broker *b = c->b;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	if (c->version) {
+		return "already connected";
+	}
+
+	if (!accept) {
+		c->version = 10;
+	} else if (strstr(accept, "1.2")) {
+		c->version = 12;
+	} else if (strstr(accept, "1.1")) {
+		c->version = 11;
+	} else if (strstr(accept, "1.0")) {
+		c->version = 10;
+	} else {
+		c->version = 10;
+		return "supported protocol versions are 1.0,1.1,1.2";
+	}
+
+	if (hb && c->version > 10 && sscanf(hb, "%lu,%lu", &cx, &cy) != 2) {
+		return "malformed heart-beat header";
+	}
+
+	c->hb_out = b->o.hb_send && cy ? (b->o.hb_send > cy ? b->o.hb_send : cy) : 0;
+	c->hb_in = b->o.hb_recv && cx ? (b->o.hb_recv > cx ? b->o.hb_recv : cx) : 0;
+
+	out = open_memstream(&buf, &len);
+	if (!out) {
+		return "out of memory";
+	}
+
+	fputs("CONNECTED\n", out);
+	if (c->version > 10) {
+		fprintf(out, "version:1.%d\nheart-beat:%lu,%lu\n", c->version - 10, b->o.hb_send, b->o.hb_recv);
+	}
+	fprintf(out, "server:mock-broker/1.0\nsession:session-%lu\n\n", b->connections);
+	fputc('\0', out);
+	fclose(out);
+
+	conn_write(c, buf, len);
+	free(buf);
+
+	return NULL;
+}
+
+static const char *on_send(struct conn *c, const struct bframe *f)
+{
+	const char *dest = hdr(f, "destination");
+	const char *tid = hdr(f, "transaction");
+	struct tx *t = NULL;
+	struct msg *m;
+
+	if (!dest) {
+		return "missing destination header";
+	}
+
+	if (tid && !(t = tx_find(c, tid, NULL))) {
+		return "unknown transaction";
+	}
+
+	m = msg_new(f, dest);
+	if (!m) {
+		return "out of memory";
+	}
+
+	if (t) {
+		*t->tail = m;
+		t->tail = &m->next;
+		return NULL;
+	}
+
+	deliver(c->b, m);
+	msg_free(m);
+
+	return NULL;
+}
+
+static const char *on_subscribe(struct conn *c, const struct bframe *f)
+{
+	const char *dest = hdr(f, "destination");
+	const char *id = hdr(f, "id");
+	const char *ack = hdr(f, "ack");
+	struct sub *s;
+
+	if (!dest) {
+		return "missing destination header";
+	}
+
+	if (!id && c->version > 10) {
+		return "missing id header";
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		return "out of memory";
+	}
+
+	/* STOMP 1.0 subscriptions without an id go by their destination */
+	s->id = strdup(id ? id : dest);
+	s->dest = strdup(dest);
+	s->ack = ack && strcmp(ack, "auto");
+	if (!s->id || !s->dest) {
+		sub_free(s);
+		return "out of memory";
+	}
+
+	s->next = c->subs;
+	c->subs = s;
+
+	return NULL;
+}
+
+static const char *on_unsubscribe(struct conn *c, const struct bframe *f)
+{
+	const char *id = hdr(f, "id");
+	struct sub **p;
+	struct sub *s;
+
+	if (!id && c->version == 10) {
+		id = hdr(f, "destination");
+	}
+
+	if (!id) {
+		return "missing id header";
+	}
+
+	for (p = &c->subs; (s = *p); p = &s->next) {
+		if (!strcmp(s->id, id)) {
+			*p = s->next;
+			sub_free(s);
+			return NULL;
+		}
+	}
+
+	return "unknown subscription";
+}
+
+static const char *on_ack(struct conn *c, const struct bframe *f)
+{
+	if (!strcmp(f->cmd, "NACK") && c->version == 10) {
+		return "NACK is not supported by STOMP 1.0";
+	}
+
+	if (c->version > 11) {
+		return hdr(f, "id") ? NULL : "missing id header";
+	}
+
+	if (!hdr(f, "message-id")) {
+		return "missing message-id header";
+	}
+
+	if (c->version > 10 && !hdr(f, "subscription")) {
+		return "missing subscription header";
+	}
+
+	return NULL;
+}
+
+static const char *on_tx(struct conn *c, const struct bframe *f)
+{
+	const char *id = hdr(f, "transaction");
+	struct tx **prev;
+	struct tx *t;
+	struct msg *m;
+
+	if (!id || !*id) {
+		return "missing transaction header";
+	}
+
+	if (!strcmp(f->cmd, "BEGIN")) {
+		if (tx_find(c, id, NULL)) {
+			return "transaction already started";
+		}
+
+		t = calloc(1, sizeof(*t));
+		if (!t || !(t->id = strdup(id))) {
+			free(t);
+			return "out of memory";
+		}
+		t->tail = &t->head;
+		t->next = c->txs;
+		c->txs = t;
+
+		return NULL;
+	}
+
+	t = tx_find(c, id, &prev);
+	if (!t) {
+		return "unknown transaction";
+	}
+	*prev = t->next;
+
+	if (!strcmp(f->cmd, "COMMIT")) {
+		for (m = t->head; m; m = m->next) {
+			deliver(c->b, m);
+		}
+	}
+
+	tx_free(t);
+
+	return NULL;
+}
+
+/* 0 to go on, 1 to close gracefully, -1 to drop the connection */
+static int handle(struct conn *c, struct bframe *f)
+{
+	struct broker *b = c->b;
+	const char *receipt = hdr(f, "receipt");
+	const char *err = NULL;
+	int r = 0;
+
+	pthread_mutex_lock(&b->lock);
+
+	count(b, f->cmd);
+	c->frames++;
+
+	if (b->o.drop_after && c->frames > b->o.drop_after) {
+		pthread_mutex_unlock(&b->lock);
+		return -1;
+	}
+
+	if (b->o.error_after && c->frames > b->o.error_after) {
+		err = "injected fault";
+	} else if (!strcmp(f->cmd, "CONNECT") || !strcmp(f->cmd, "STOMP")) {
+		err = on_connect(c, f);
+		receipt = NULL;
+	} else if (!c->version) {
+		err = "not connected";
+	} else if (!strcmp(f->cmd, "SEND")) {
+		err = on_send(c, f);
+	} else if (!strcmp(f->cmd, "SUBSCRIBE")) {
+		err = on_subscribe(c, f);
+	} else if (!strcmp(f->cmd, "UNSUBSCRIBE")) {
+		err = on_unsubscribe(c, f);
+	} else if (!strcmp(f->cmd, "ACK") || !strcmp(f->cmd, "NACK")) {
+		err = on_ack(c, f);
+	} else if (!strcmp(f->cmd, "BEGIN") || !strcmp(f->cmd, "COMMIT") || !strcmp(f->cmd, "ABORT")) {
+		err = on_tx(c, f);
+	} else if (!strcmp(f->cmd, "DISCONNECT")) {
+		r = 1;
+	} else {
+		err = "unknown command";
+	}
+
+	if (err) {
+		send_error(c, f, err);
+		r = 1;
+	} else if (receipt && !b->o.no_receipts) {
+		send_receipt(c, receipt);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	return r;
+}
+
+static void unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++) {
+		if (*s != '\\') {
+			*d++ = *s;
+			continue;
+		}
+
+		switch (*++s) {
+			case 'n':
+				*d++ = '\n';
+				break;
+			case 'c':
+				*d++ = ':';
+				break;
+			case 'r':
+				*d++ = '\r';
+				break;
+			case '\\':
+				*d++ = '\\';
+				break;
+			default:
+				/* undefined escape, keep it as is */
+				*d++ = '\\';
+				if (!*s) {
+					*d = '\0';
+					return;
+				}
+				*d++ = *s;
+		}
+	}
+
+	*d = '\0';
+}
+
+/*
+ * parse a frame from the start of buf in place
+ *
+ * Returns the number of bytes the frame takes, 0 if it is not complete yet
+ * or -1 if it is malformed. Leading EOLs are heart-beats, if nothing but
+ * heart-beats was parsed f->cmd is NULL.
+ */
+static ssize_t parse(struct conn *c, char *buf, size_t len, struct bframe *f)
+{
+	char *end = buf + len;
+	char *p = buf;
+	char *line, *eol, *hend, *body, *colon;
+	size_t cl = 0;
+	int has_cl = 0;
+
+	memset(f, 0, sizeof(*f));
+
+	if (p < end && (*p == '\n' || *p == '\r')) {
+		while (p < end && (*p == '\n' || *p == '\r')) {
+			if (*p == '\n') {
+				f->beats++;
+			}
+			p++;
+		}
+		return p - buf;
+	}
+
+	/* find the blank line ending the headers without touching anything */
+	for (line = p; ; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol) {
+			return 0;
+		}
+		if (line != p && (eol == line || (eol == line + 1 && *line == '\r'))) {
+			break;
+		}
+		if (!has_cl && line != p && !strncmp(line, "content-length:", 15)) {
+			cl = strtoul(line + 15, NULL, 10);
+			has_cl = 1;
+		}
+	}
+	hend = line;
+	body = eol + 1;
+
+	if (has_cl) {
+		if ((size_t)(end - body) < cl + 1) {
+			return 0;
+		}
+		if (body[cl] != '\0') {
+			return -1;
+		}
+	} else {
+		char *z = memchr(body, '\0', end - body);
+		if (!z) {
+			return 0;
+		}
+		cl = z - body;
+	}
+
+	/* complete, split it up */
+	eol = memchr(p, '\n', hend - p);
+	*eol = '\0';
+	if (eol > p && eol[-1] == '\r') {
+		eol[-1] = '\0';
+	}
+	f->cmd = p;
+
+	for (line = eol + 1; line < hend; line = eol + 1) {
+		eol = memchr(line, '\n', hend - line);
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r') {
+			eol[-1] = '\0';
+		}
+
+		colon = strchr(line, ':');
+		if (!colon) {
+			return -1;
+		}
+		*colon = '\0';
+
+		if (f->hdrc == BROKER_HDRS) {
+			continue;
+		}
+
+		if (c->version > 10 && strcmp(f->cmd, "CONNECT") && strcmp(f->cmd, "STOMP")) {
+			unescape(line);
+			unescape(colon + 1);
+		}
+		f->keys[f->hdrc] = line;
+		f->vals[f->hdrc] = colon + 1;
+		f->hdrc++;
+	}
+
+	f->body = body;
+	f->body_len = cl;
+
+	return body + cl + 1 - buf;
+}
+
+static int conn_read(struct conn *c)
+{
+	char *buf;
+	ssize_t n;
+
+	if (c->cap - c->len < 4096) {
+		buf = realloc(c->buf, c->cap * 2 + 4096);
+		if (!buf) {
+			return -1;
+		}
+		c->buf = buf;
+		c->cap = c->cap * 2 + 4096;
+	}
+
+	n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+	if (n <= 0) {
+		return -1;
+	}
+	c->len += n;
+	c->last_in = now_ms();
+
+	return 0;
+}
+
+/* 0 to go on, 1 to close gracefully, -1 to drop the connection */
+static int conn_frames(struct conn *c)
+{
+	struct bframe f;
+	size_t off = 0;
+	ssize_t n;
+	int r = 0;
+
+	while (!r && off < c->len) {
+		n = parse(c, c->buf + off, c->len - off, &f);
+		if (n == 0) {
+			break;
+		}
+		if (n < 0) {
+			pthread_mutex_lock(&c->b->lock);
+			send_error(c, NULL, "malformed frame");
+			pthread_mutex_unlock(&c->b->lock);
+			r = 1;
+			break;
+		}
+		off += n;
+
+		if (!f.cmd) {
+			pthread_mutex_lock(&c->b->lock);
+			while (f.beats--) {
+				count(c->b, "HEART-BEAT");
+			}
+			pthread_mutex_unlock(&c->b->lock);
+			continue;
+		}
+
+		if (c->b->o.latency) {
+			sleep_ns(c->b->o.latency * 1000000ULL);
+		}
+
+		r = handle(c, &f);
+	}
+
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+
+	return r;
+}
+
+static void *conn_run(void *arg)
+{
+	struct conn *c = arg;
+	struct broker *b = c->b;
+	struct pollfd pfd;
+	unsigned long now, deadline;
+	int timeout;
+	int r = 0;
+
+	c->last_in = c->last_out = now_ms();
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+
+	while (!r) {
+		pthread_mutex_lock(&b->lock);
+		now = now_ms();
+		timeout = -1;
+		if (c->hb_out) {
+			deadline = c->last_out + c->hb_out;
+			timeout = deadline > now ? deadline - now : 0;
+		}
+		if (c->hb_in) {
+			/* be lenient, like brokers are */
+			deadline = c->last_in + 2 * c->hb_in;
+			if (deadline <= now) {
+				r = -1;
+			} else if (timeout == -1 || deadline - now < (unsigned long)timeout) {
+				timeout = deadline - now;
+			}
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		if (r) {
+			break;
+		}
+
+		if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+			break;
+		}
+
+		if (pfd.revents) {
+			if (conn_read(c)) {
+				break;
+			}
+			r = conn_frames(c);
+		}
+
+		pthread_mutex_lock(&b->lock);
+		if (!r && c->hb_out && now_ms() >= c->last_out + c->hb_out) {
+			conn_write(c, "\n", 1);
+		}
+		if (c->closed) {
+			r = -1;
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	if (r > 0) {
+		/* closing with unread data would reset the connection and
+		 * discard the frames not read by the client yet */
+		shutdown(c->fd, SHUT_WR);
+		pfd.revents = 0;
+		c->len = 0;
+		while (poll(&pfd, 1, BROKER_LINGER) > 0 && !conn_read(c)) {
+			c->len = 0;
+		}
+	}
+
+	pthread_mutex_lock(&b->lock);
+	shutdown(c->fd, SHUT_RDWR);
+#ifdef STOMP_TLS
+	if (r <= 0 && c->tls_fd != -1) {
+		/* dropped, no close_notify */
+		shutdown(c->tls_fd, SHUT_RDWR);
+	}
+#endif
+	c->closed = 1;
+	conn_clear(c);
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+#ifdef STOMP_TLS
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void *relay_run(void *arg)
+{
+	struct conn *c = arg;
+	struct pollfd pfd[2];
+	char buf[16384];
+	int in = 1; /* the client has not closed its side yet */
+	int pending;
+	sigset_t set;
+	int n;
+
+	/* SSL_write() on a connection reset by the client must fail with
+	 * EPIPE instead of killing the tests */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (SSL_accept(c->ssl) != 1) {
+		goto out;
+	}
+
+	pfd[0].fd = c->tls_fd;
+	pfd[1].fd = c->relay_fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	for (;;) {
+		/* records already read by OpenSSL do not show up in poll() */
+		pending = in && SSL_pending(c->ssl);
+		pfd[0].revents = pfd[1].revents = 0;
+		if (!pending && poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (pending || pfd[0].revents) {
+			n = SSL_read(c->ssl, buf, sizeof(buf));
+			if (n <= 0 || write_all(c->relay_fd, buf, n)) {
+				/* pass the close on and keep sending what the broker has left */
+				shutdown(c->relay_fd, SHUT_WR);
+				pfd[0].fd = -1;
+				in = 0;
+			}
+		}
+
+		if (pfd[1].revents) {
+			n = read(c->relay_fd, buf, sizeof(buf));
+			if (n <= 0 || SSL_write(c->ssl, buf, n) != n) {
+				break;
+			}
+		}
+	}
+
+	/* like the broker itself, let the client read everything and close first */
+	SSL_shutdown(c->ssl);
+	shutdown(c->tls_fd, SHUT_WR);
+	pfd[0].fd = c->tls_fd;
+	while (in && poll(pfd, 1, BROKER_LINGER) > 0 && SSL_read(c->ssl, buf, sizeof(buf)) > 0) {
+	}
+
+out:
+	shutdown(c->tls_fd, SHUT_RDWR);
+	shutdown(c->relay_fd, SHUT_RDWR);
+
+	return NULL;
+}
+
+/* put a TLS relay between the client on fd and the broker on c->fd */
+static int relay_start(struct conn *c, int fd)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		return -1;
+	}
+
+	c->ssl = SSL_new(c->b->tls);
+	if (!c->ssl || !SSL_set_fd(c->ssl, fd)) {
+		SSL_free(c->ssl);
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	c->fd = sv[0];
+	c->relay_fd = sv[1];
+	c->tls_fd = fd;
+
+	if (pthread_create(&c->relay, NULL, relay_run, c)) {
+		SSL_free(c->ssl);
+		close(sv[0]);
+		close(sv[1]);
+		c->fd = fd;
+		c->tls_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* free what relay_start() set up, after the relay thread ended */
+static void relay_free(struct conn *c)
+{
+	if (c->tls_fd == -1) {
+		return;
+	}
+
+	pthread_join(c->relay, NULL);
+	SSL_free(c->ssl);
+	close(c->tls_fd);
+	close(c->relay_fd);
+}
+
+/* a self-signed certificate for localhost and 127.0.0.1, trusted through b->ca */
+static int tls_init(struct broker *b)
+{
+	X509V3_CTX v3;
+	X509_EXTENSION *ext;
+	X509_NAME *name;
+	EVP_PKEY *key;
+	X509 *x;
+	FILE *f;
+	int fd;
+	int r = -1;
+
+	key = EVP_EC_gen("P-256");
+	x = X509_new();
+	if (!key || !x) {
+		goto out;
+	}
+
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), -60);
+	X509_gmtime_adj(X509_getm_notAfter(x), 24 * 3600);
+	X509_set_pubkey(x, key);
+	name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(x, name);
+
+	X509V3_set_ctx_nodb(&v3);
+	X509V3_set_ctx(&v3, x, x, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+	if (!ext || !X509_add_ext(x, ext, -1)) {
+		X509_EXTENSION_free(ext);
+		goto out;
+	}
+	X509_EXTENSION_free(ext);
+
+	if (!X509_sign(x, key, EVP_sha256())) {
+		goto out;
+	}
+
+	b->tls = SSL_CTX_new(TLS_server_method());
+	if (!b->tls || !SSL_CTX_use_certificate(b->tls, x) || !SSL_CTX_use_PrivateKey(b->tls, key)) {
+		goto out;
+	}
+	SSL_CTX_set_options(b->tls, SSL_OP_ENABLE_KTLS);
+
+	strcpy(b->ca, "/tmp/broker-ca-XXXXXX");
+	fd = mkstemp(b->ca);
+	if (fd == -1) {
+		b->ca[0] = '\0';
+		goto out;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto out;
+	}
+	if (PEM_write_X509(f, x)) {
+		r = 0;
+	}
+	if (fclose(f)) {
+		r = -1;
+	}
+
+out:
+	X509_free(x);
+	EVP_PKEY_free(key);
+	if (r) {
+		errno = EPROTO;
+	}
+
+	return r;
+}
+#endif
+
+static void *accept_run(void *arg)
+{
+	struct broker *b = arg;
+	struct conn *c;
+	int fd;
+
+	for (;;) {
+		fd = accept(b->fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->b = b;
+		c->fd = fd;
+#ifdef STOMP_TLS
+		c->tls_fd = -1;
+		if (b->tls && relay_start(c, fd)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+#endif
+
+		pthread_mutex_lock(&b->lock);
+		if (b->stop || pthread_create(&c->thread, NULL, conn_run, c)) {
+			pthread_mutex_unlock(&b->lock);
+			shutdown(c->fd, SHUT_RDWR);
+			close(c->fd);
+#ifdef STOMP_TLS
+			relay_free(c);
+#endif
+			free(c);
+			continue;
+		}
+		c->next = b->conns;
+		b->conns = c;
+		b->connections++;
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+static int listen_on(struct broker *b)
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	socklen_t len = sizeof(in);
+
+	if (b->o.path) {
+		if (strlen(b->o.path) >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, b->o.path);
+		strcpy(b->service, b->o.path);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(b->o.path);
+		if (b->o.path[0] == '@') {
+			un.sun_path[0] = '\0';
+		} else {
+			unlink(b->o.path);
+		}
+
+		b->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (b->fd == -1) {
+			return -1;
+		}
+
+		return bind(b->fd, (struct sockaddr *)&un, len) || listen(b->fd, 1024) ? -1 : 0;
+	}
+
+	b->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (b->fd == -1) {
+		return -1;
+	}
+
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(b->fd, (struct sockaddr *)&in, sizeof(in)) || listen(b->fd, 1024)) {
+		return -1;
+	}
+
+	if (getsockname(b->fd, (struct sockaddr *)&in, &len)) {
+		return -1;
+	}
+	snprintf(b->service, sizeof(b->service), "%d", ntohs(in.sin_port));
+
+	return 0;
+}
+
+static void tls_clear(struct broker *b)
+{
+#ifdef STOMP_TLS
+	SSL_CTX_free(b->tls);
+	if (b->ca[0]) {
+		unlink(b->ca);
+	}
+#else
+	(void)b;
+#endif
+}
+
+broker_t *broker_start(const struct broker_opts *o)
+{
+	struct broker *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		return NULL;
+	}
+
+	if (o) {
+		b->o = *o;
+	}
+	b->fd = -1;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+
+#ifdef STOMP_TLS
+	if (b->o.tls && tls_init(b)) {
+		goto fail;
+	}
+#else
+	if (b->o.tls) {
+		errno = ENOSYS;
+		goto fail;
+	}
+#endif
+
+	if (listen_on(b) || pthread_create(&b->thread, NULL, accept_run, b)) {
+		goto fail;
+	}
+
+	return b;
+
+fail:
+	if (b->fd != -1) {
+		close(b->fd);
+	}
+	tls_clear(b);
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+	return NULL;
+}
+
+void broker_drop(broker_t *b)
+{
+	struct conn *c;
+
+	pthread_mutex_lock(&b->lock);
+	for (c = b->conns; c; c = c->next) {
+		if (!c->closed) {
+			c->closed = 1;
+			shutdown(c->fd, SHUT_RDWR);
+#ifdef STOMP_TLS
+			if (c->tls_fd != -1) {
+				shutdown(c->tls_fd, SHUT_RDWR);
+			}
+#endif
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+void broker_stop(broker_t *b)
+{
+	struct conn *c;
+
+	pthread_mutex_lock(&b->lock);
+	b->stop = 1;
+	pthread_mutex_unlock(&b->lock);
+
+	broker_drop(b);
+
+	shutdown(b->fd, SHUT_RDWR);
+	pthread_join(b->thread, NULL);
+
+	/* no new connections from here on */
+	while ((c = b->conns)) {
+		b->conns = c->next;
+		pthread_join(c->thread, NULL);
+		close(c->fd);
+#ifdef STOMP_TLS
+		relay_free(c);
+#endif
+		free(c->buf);
+		free(c);
+	}
+
+	close(b->fd);
+	if (b->o.path && b->o.path[0] != '@') {
+		unlink(b->o.path);
+	}
+	tls_clear(b);
+
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+}
+
+const char *broker_service(broker_t *b)
+{
+	return b->service;
+}
+
+const char *broker_tls_ca(broker_t *b)
+{
+#ifdef STOMP_TLS
+	if (b->tls) {
+		return b->ca;
+	}
+#endif
+	(void)b;
+	return NULL;
+}
+
+unsigned long broker_count(broker_t *b, const char *cmd)
+{
+	unsigned long n = 0;
+	size_t i;
+
+	pthread_mutex_lock(&b->lock);
+	for (i = 0; i < BROKER_CMDS; i++) {
+		if (!strcmp(cmds[i], cmd)) {
+			n = b->counts[i];
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return n;
+}
+
+unsigned long broker_connections(broker_t *b)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&b->lock);
+	n = b->connections;
+	pthread_mutex_unlock(&b->lock);
+
+	return n;
+}
+
+int broker_wait(broker_t *b, const char *cmd, unsigned long n, unsigned long timeout)
+{
+	struct timespec ts;
+	size_t i;
+	int r = 0;
+
+	for (i = 0; i < BROKER_CMDS && strcmp(cmds[i], cmd); i++) {
+	}
+	if (i == BROKER_CMDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	while (b->counts[i] < n && !r) {
+		r = pthread_cond_timedwait(&b->cond, &b->lock, &ts);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	if (r) {
+		errno = r;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-process mock STOMP broker for the tests and benchmarks.
+ *
+ * Speaks STOMP 1.0 - 1.2 on a loopback TCP port or a Unix socket from a
+ * thread of its own: CONNECT/STOMP with version and heart-beat negotiation,
+ * SUBSCRIBE/UNSUBSCRIBE with fan-out of SEND to every matching subscription,
+ * ACK/NACK, BEGIN/COMMIT/ABORT, RECEIPT and DISCONNECT.
+ * With tls set it speaks TLS through a relay thread per connection, with a
+ * self-signed certificate for localhost and 127.0.0.1 made at start.
+ * Latency, bandwidth and faults can be injected through struct broker_opts.
+ */
+typedef struct broker broker_t;
+
+struct broker_opts {
+	const char *path; /* listen on this Unix socket instead of 127.0.0.1, "@name" for an abstract one */
+	unsigned long hb_send; /* heart-beat interval the broker can send at, ms; 0 none */
+	unsigned long hb_recv; /* heart-beat interval the broker wants to receive at, ms; 0 none */
+	unsigned long latency; /* ms to wait before handling every frame */
+	size_t bandwidth; /* max bytes per second written to a connection; 0 for no limit */
+	unsigned long drop_after; /* close connections abruptly after this many frames; 0 never */
+	unsigned long error_after; /* answer the frame after this many with ERROR and close; 0 never */
+	int no_receipts; /* never answer with RECEIPT */
+	int tls; /* accept TLS connections only, needs STOMP_TLS */
+};
+
+/* start a broker; o may be NULL for the defaults */
+broker_t *broker_start(const struct broker_opts *o);
+
+/* close all connections, stop the broker and free it */
+void broker_stop(broker_t *b);
+
+/* port or path to pass to stomp_connect() */
+const char *broker_service(broker_t *b);
+
+/* PEM file with the certificate to trust, NULL without tls */
+const char *broker_tls_ca(broker_t *b);
+
+/* abruptly close all connections accepted so far */
+void broker_drop(broker_t *b);
+
+/* number of frames received with the given command, "HEART-BEAT" counts heart-beats */
+unsigned long broker_count(broker_t *b, const char *cmd);
+
+/* number of connections accepted */
+unsigned long broker_connections(broker_t *b);
+
+/* block until broker_count(b, cmd) reaches n or timeout ms pass; 0 on success */
+int broker_wait(broker_t *b, const char *cmd, unsigned long n, unsigned long timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BROKER_H */
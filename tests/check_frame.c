@@ -1,6 +1,10 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "../src/frame.h"
 
@@ -250,6 +254,261 @@ START_TEST(test_hdrs_add)
 }
 END_TEST
 
+static size_t allocs;
+
+static void *count_malloc(void *ctx, size_t size)
+{
+	allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size)
+{
+	allocs++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static void fill(frame_t *f, char *body, size_t body_len)
+{
+	const struct stomp_hdr *hdrs;
+	const void *data;
+	char key[16];
+	int i;
+
+	fail_if(frame_cmd_set(f, "SEND") != 0, NULL);
+	for (i = 0; i < 20; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		fail_if(frame_hdr_add(f, key, "value") != 0, NULL);
+	}
+	fail_if(frame_body_set(f, body, body_len) != 0, NULL);
+
+	fail_unless(frame_hdrs_get(f, &hdrs) == 20, NULL);
+	fail_if(strncmp(hdrs[19].key, "key19:", 6), NULL);
+	fail_unless(frame_body_get(f, &data) == body_len, NULL);
+	fail_if(memcmp(data, body, body_len), NULL);
+}
+
+START_TEST(test_body_large)
+{
+	char body[4000];
+
+	memset(body, 'x', sizeof(body));
+	fill(frame, body, sizeof(body));
+}
+END_TEST
+
+START_TEST(test_arena)
+{
+	struct stomp_allocator a = {count_malloc, count_realloc, count_free, NULL, 1024};
+	char body[3000];
+	frame_t *f;
+	size_t n;
+
+	memset(body, 'x', sizeof(body));
+
+	f = frame_new_with(&a);
+	fail_if(f == NULL, NULL);
+	fill(f, body, sizeof(body));
+
+	/* once the chunks are there frames of the same size need no allocation */
+	frame_reset(f);
+	fill(f, body, sizeof(body));
+	n = allocs;
+	frame_reset(f);
+	fill(f, body, sizeof(body));
+	fail_unless(allocs == n, NULL);
+
+	frame_free(f);
+}
+END_TEST
+
+static int read_str(frame_t *f, const struct stomp_limits *l, const char *data, size_t len)
+{
+	int fds[2];
+	int r;
+
+	fail_if(pipe(fds), NULL);
+	fail_unless(write(fds[1], data, len) == (ssize_t)len, NULL);
+	close(fds[1]);
+
+	frame_limits_set(f, l);
+	r = frame_read(fds[0], f);
+	close(fds[0]);
+
+	return r;
+}
+
+START_TEST(test_read_limits)
+{
+	const char msg[] = "MESSAGE\ndestination:/q\nid:1\n\nhello\0";
+	const char big[] = "MESSAGE\ncontent-length:5000\n\nhello\0";
+	struct stomp_limits l = {0};
+	const void *body;
+
+	fail_unless(read_str(frame, &l, msg, sizeof(msg) - 1) == 0, NULL);
+	fail_unless(frame_body_get(frame, &body) == 5, NULL);
+
+	l.hdrs = 1;
+	frame_reset(frame);
+	errno = 0;
+	fail_unless(read_str(frame, &l, msg, sizeof(msg) - 1) == -1, NULL);
+	fail_unless(errno == EMSGSIZE, NULL);
+
+	l.hdrs = 0;
+	l.hdr = 8;
+	frame_reset(frame);
+	errno = 0;
+	fail_unless(read_str(frame, &l, msg, sizeof(msg) - 1) == -1, NULL);
+	fail_unless(errno == EMSGSIZE, NULL);
+
+	l.hdr = 0;
+	l.frame = 16;
+	frame_reset(frame);
+	errno = 0;
+	fail_unless(read_str(frame, &l, msg, sizeof(msg) - 1) == -1, NULL);
+	fail_unless(errno == EMSGSIZE, NULL);
+
+	/* rejected on the announced length before the body is read */
+	l.frame = 1024;
+	frame_reset(frame);
+	errno = 0;
+	fail_unless(read_str(frame, &l, big, sizeof(big) - 1) == -1, NULL);
+	fail_unless(errno == EMSGSIZE, NULL);
+	fail_unless(frame_len(frame) < 64, NULL);
+}
+END_TEST
+
+START_TEST(test_reset_reuse)
+{
+	const char msg[] = "MESSAGE\ndestination:/q\nid:1\n\nhello\0";
+	struct stomp_limits l = {0};
+	const struct stomp_hdr *hdrs;
+	char key[16];
+	int i;
+
+	fail_if(frame_cmd_set(frame, "SEND") != 0, NULL);
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		fail_if(frame_hdr_add(frame, key, "value") != 0, NULL);
+	}
+
+	/* stale header slots must not leak into the next frame */
+	frame_reset(frame);
+	fail_unless(read_str(frame, &l, msg, sizeof(msg) - 1) == 0, NULL);
+	fail_unless(frame_hdrs_get(frame, &hdrs) == 2, NULL);
+	fail_if(strcmp(hdrs[0].key, "destination"), NULL);
+	fail_if(strcmp(hdrs[0].val, "/q"), NULL);
+	fail_if(strcmp(hdrs[1].key, "id"), NULL);
+	fail_if(strcmp(hdrs[1].val, "1"), NULL);
+}
+END_TEST
+
+static void check_spilled(frame_t *f, const char *body, size_t body_len)
+{
+	const void *data;
+	struct stat st;
+	int fd;
+
+	fd = frame_body_fd(f);
+	fail_if(fd == -1, NULL);
+	fail_unless(frame_body_get(f, &data) == body_len, NULL);
+	fail_if(memcmp(data, body, body_len), NULL);
+	fail_unless(((const char *)data)[body_len] == '\0', NULL);
+	fail_if(fstat(fd, &st), NULL);
+	fail_unless(st.st_size == (off_t)body_len + 1, NULL);
+}
+
+START_TEST(test_spill)
+{
+	struct stomp_limits l = {0};
+	char body[20000];
+	char buf[sizeof(body) + 64];
+	size_t len;
+	const void *data;
+
+	memset(body, 'x', sizeof(body));
+	l.spill = 1000;
+
+	/* announced, read straight into the mapping */
+	len = snprintf(buf, sizeof(buf), "MESSAGE\ncontent-length:%zu\n\n", sizeof(body));
+	memcpy(buf + len, body, sizeof(body));
+	buf[len + sizeof(body)] = '\0';
+	fail_unless(read_str(frame, &l, buf, len + sizeof(body) + 1) == 0, NULL);
+	check_spilled(frame, body, sizeof(body));
+
+	/* not announced, moved once past the threshold */
+	frame_reset(frame);
+	fail_unless(frame_body_fd(frame) == -1, NULL);
+	len = snprintf(buf, sizeof(buf), "MESSAGE\n\n");
+	memcpy(buf + len, body, sizeof(body));
+	buf[len + sizeof(body)] = '\0';
+	fail_unless(read_str(frame, &l, buf, len + sizeof(body) + 1) == 0, NULL);
+	check_spilled(frame, body, sizeof(body));
+
+	/* below the threshold stays on the heap */
+	frame_reset(frame);
+	fail_unless(read_str(frame, &l, "MESSAGE\n\nhello\0", 16) == 0, NULL);
+	fail_unless(frame_body_fd(frame) == -1, NULL);
+	fail_unless(frame_body_get(frame, &data) == 5, NULL);
+}
+END_TEST
+
+START_TEST(test_trim)
+{
+	char body[100000];
+	int trimmed = 0;
+	int i;
+
+	memset(body, 'x', sizeof(body));
+	fill(frame, body, sizeof(body));
+	fail_unless(frame_held(frame) > sizeof(body), NULL);
+
+	for (i = 0; i < 128; i++) {
+		trimmed += frame_trim(frame, 4096);
+		frame_reset(frame);
+		fill(frame, body, 10);
+	}
+
+	fail_unless(trimmed == 1, NULL);
+	fail_unless(frame_held(frame) < 4096, NULL);
+}
+END_TEST
+
+START_TEST(test_trim_steady)
+{
+	struct stomp_allocator a = {count_malloc, count_realloc, count_free, NULL, 0};
+	static char body[65536];
+	int trimmed = 0;
+	frame_t *f;
+	size_t n;
+	int i;
+
+	memset(body, 'x', sizeof(body));
+
+	f = frame_new_with(&a);
+	fail_if(f == NULL, NULL);
+	fill(f, body, sizeof(body));
+	n = allocs;
+
+	/* the doubled buffer is more than half used, frames of the same size keep it */
+	for (i = 0; i < 128; i++) {
+		trimmed += frame_trim(f, 65536);
+		frame_reset(f);
+		fill(f, body, sizeof(body));
+	}
+
+	fail_unless(trimmed == 0, NULL);
+	fail_unless(allocs == n, NULL);
+
+	frame_free(f);
+}
+END_TEST
+
 Suite *frame_suite()
 {
 	Suite *s = suite_create ("frame");
@@ -272,6 +531,13 @@ Suite *frame_suite()
 	tcase_add_test(tc_core, test_hdr_add_body);
 	tcase_add_test(tc_core, test_hdrs_add_hdrs_null);
 	tcase_add_test(tc_core, test_hdrs_add);
+	tcase_add_test(tc_core, test_body_large);
+	tcase_add_test(tc_core, test_arena);
+	tcase_add_test(tc_core, test_read_limits);
+	tcase_add_test(tc_core, test_reset_reuse);
+	tcase_add_test(tc_core, test_spill);
+	tcase_add_test(tc_core, test_trim);
+	tcase_add_test(tc_core, test_trim_steady);
 	suite_add_tcase (s, tc_core);
 	
 	return s;
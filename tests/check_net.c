@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include <check.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "../src/net.h"
+
+static int listener = -1;
+static char listener_port[8];
+static char closed_port[8];
+
+static struct addrinfo *resolve(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	fail_unless(getaddrinfo("127.0.0.1", port, &hints, &res) == 0, NULL);
+
+	return res;
+}
+
+/* bind an ephemeral loopback port, closed again unless listen_too is set */
+static int open_port(char *port, size_t len, int listen_too)
+{
+	struct sockaddr_in sin;
+	socklen_t sin_len = sizeof(sin);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd == -1, NULL);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0, NULL);
+	fail_unless(getsockname(fd, (struct sockaddr *)&sin, &sin_len) == 0, NULL);
+	snprintf(port, len, "%u", ntohs(sin.sin_port));
+
+	if (listen_too) {
+		fail_unless(listen(fd, 4) == 0, NULL);
+		return fd;
+	}
+
+	close(fd);
+	return -1;
+}
+
+void setup()
+{
+	listener = open_port(listener_port, sizeof(listener_port), 1);
+	(void)open_port(closed_port, sizeof(closed_port), 0);
+}
+
+void teardown()
+{
+	close(listener);
+	listener = -1;
+}
+
+START_TEST(test_dial)
+{
+	struct addrinfo *addrs = resolve(listener_port);
+	struct addrinfo *used = NULL;
+	int fd;
+
+	fd = net_dial(addrs, NULL, 1000, &used);
+	fail_if(fd == -1, NULL);
+	fail_unless(used == addrs, NULL);
+
+	close(fd);
+	freeaddrinfo(addrs);
+}
+END_TEST
+
+START_TEST(test_dial_refused)
+{
+	struct addrinfo *addrs = resolve(closed_port);
+	struct addrinfo *used = NULL;
+
+	fail_unless(net_dial(addrs, NULL, 1000, &used) == -1, NULL);
+	fail_unless(errno == ECONNREFUSED, NULL);
+	fail_unless(used == NULL, NULL);
+
+	freeaddrinfo(addrs);
+}
+END_TEST
+
+START_TEST(test_dial_fallback)
+{
+	struct addrinfo *closed = resolve(closed_port);
+	struct addrinfo *open = resolve(listener_port);
+	struct addrinfo *used = NULL;
+	int fd;
+
+	/* the refused address is tried first, the next one right after it fails */
+	closed->ai_next = open;
+	fd = net_dial(closed, NULL, 1000, &used);
+	fail_if(fd == -1, NULL);
+	fail_unless(used == open, NULL);
+	close(fd);
+
+	/* the preferred address goes first */
+	used = NULL;
+	fd = net_dial(closed, open, 1000, &used);
+	fail_if(fd == -1, NULL);
+	fail_unless(used == open, NULL);
+	close(fd);
+
+	closed->ai_next = NULL;
+	freeaddrinfo(closed);
+	freeaddrinfo(open);
+}
+END_TEST
+
+START_TEST(test_dial_invalid)
+{
+	struct addrinfo *used = NULL;
+
+	fail_unless(net_dial(NULL, NULL, 0, &used) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+}
+END_TEST
+
+START_TEST(test_dial_unix)
+{
+	struct sockaddr_un un;
+	char name[64];
+	char path[sizeof(un.sun_path) + 8];
+	char ctl[CMSG_SPACE(sizeof(struct ucred))];
+	char ch;
+	struct iovec iov = {&ch, 1};
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct ucred cred;
+	int on = 1;
+	int fd, lfd, afd;
+
+	snprintf(name, sizeof(name), "@check_net-%d", (int)getpid());
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fail_if(lfd == -1, NULL);
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	memcpy(un.sun_path + 1, name + 1, strlen(name) - 1);
+	fail_unless(bind(lfd, (struct sockaddr *)&un, offsetof(struct sockaddr_un, sun_path) + strlen(name)) == 0, NULL);
+	fail_unless(listen(lfd, 4) == 0, NULL);
+
+	fd = net_dial_unix(name, 1000, 1);
+	fail_if(fd == -1, NULL);
+	afd = accept(lfd, NULL, NULL);
+	fail_if(afd == -1, NULL);
+
+	/* the credentials go with the data even if the receiver asks for them later */
+	fail_unless(write(fd, "x", 1) == 1, NULL);
+	fail_unless(setsockopt(afd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == 0, NULL);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+	fail_unless(recvmsg(afd, &msg, 0) == 1, NULL);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	fail_if(cmsg == NULL, NULL);
+	fail_unless(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS, NULL);
+	memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+	fail_unless(cred.pid == getpid() && cred.uid == getuid(), NULL);
+
+	close(afd);
+	close(fd);
+	close(lfd);
+
+	/* nobody listens there */
+	fail_unless(net_dial_unix("@check_net-none", 1000, 0) == -1, NULL);
+	fail_unless(errno == ECONNREFUSED, NULL);
+
+	memset(path, 'x', sizeof(path));
+	path[sizeof(path) - 1] = '\0';
+	fail_unless(net_dial_unix(path, 0, 0) == -1, NULL);
+	fail_unless(errno == ENAMETOOLONG, NULL);
+	fail_unless(net_dial_unix("", 0, 0) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+}
+END_TEST
+
+Suite *net_suite()
+{
+	Suite *s = suite_create ("net");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_checked_fixture (tc_core, setup, teardown);
+	tcase_add_test(tc_core, test_dial);
+	tcase_add_test(tc_core, test_dial_refused);
+	tcase_add_test(tc_core, test_dial_fallback);
+	tcase_add_test(tc_core, test_dial_invalid);
+	tcase_add_test(tc_core, test_dial_unix);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = net_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
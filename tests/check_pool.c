@@ -0,0 +1,124 @@
+#include <check.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "../src/pool.h"
+#include "../src/alloc.h"
+
+static pool_t *pool(size_t max)
+{
+	struct stomp_allocator a;
+
+	alloc_global_get(&a);
+
+	return pool_new(max, &a);
+}
+
+START_TEST(test_recycle)
+{
+	pool_t *p = pool(2);
+	stomp_message_t *m1, *m2;
+
+	fail_if(p == NULL, NULL);
+
+	m1 = pool_get(p);
+	fail_if(m1 == NULL, NULL);
+	fail_unless(m1->refs == 1, NULL);
+	fail_unless(frame_cmd_set(m1->frame, "MESSAGE") == 0, NULL);
+
+	pool_put(m1);
+
+	/* released frames come back reset */
+	m2 = pool_get(p);
+	fail_unless(m2 == m1, NULL);
+	fail_unless(m2->refs == 1, NULL);
+	fail_unless(frame_cmd_get(m2->frame, &(const char *){NULL}) == 0, NULL);
+
+	pool_put(m2);
+	pool_free(p);
+}
+END_TEST
+
+START_TEST(test_refs)
+{
+	pool_t *p = pool(2);
+	stomp_message_t *m1, *m2;
+
+	m1 = pool_get(p);
+	__atomic_add_fetch(&m1->refs, 1, __ATOMIC_RELAXED);
+
+	/* still held, a new frame is handed out */
+	pool_put(m1);
+	m2 = pool_get(p);
+	fail_if(m2 == m1, NULL);
+
+	pool_put(m1);
+	pool_put(m2);
+	pool_free(p);
+}
+END_TEST
+
+START_TEST(test_max)
+{
+	pool_t *p = pool(1);
+	stomp_message_t *m1, *m2, *m3;
+
+	m1 = pool_get(p);
+	m2 = pool_get(p);
+	pool_put(m1);
+	pool_put(m2);
+
+	/* only one kept for reuse */
+	m3 = pool_get(p);
+	fail_unless(m3 == m1 || m3 == m2, NULL);
+	pool_put(m3);
+	pool_free(p);
+}
+END_TEST
+
+static void *release(void *arg)
+{
+	pool_put(arg);
+	return NULL;
+}
+
+START_TEST(test_outlive)
+{
+	pool_t *p = pool(4);
+	stomp_message_t *m = pool_get(p);
+	pthread_t t;
+
+	fail_if(m == NULL, NULL);
+
+	/* the pool goes away with the last message */
+	pool_free(p);
+	fail_unless(pthread_create(&t, NULL, release, m) == 0, NULL);
+	fail_unless(pthread_join(t, NULL) == 0, NULL);
+}
+END_TEST
+
+Suite *pool_suite()
+{
+	Suite *s = suite_create ("pool");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_test(tc_core, test_recycle);
+	tcase_add_test(tc_core, test_refs);
+	tcase_add_test(tc_core, test_max);
+	tcase_add_test(tc_core, test_outlive);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = pool_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
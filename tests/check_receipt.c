@@ -0,0 +1,156 @@
+#include <check.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "../src/receipt.h"
+#include "../src/alloc.h"
+
+static receipts_t *receipts = NULL;
+
+void setup()
+{
+	struct stomp_allocator a;
+
+	alloc_global_get(&a);
+	receipts = receipts_new(&a);
+}
+
+void teardown()
+{
+	receipts_free(receipts);
+	receipts = NULL;
+}
+
+START_TEST(test_new)
+{
+	fail_if(receipts == NULL, NULL);
+	fail_unless(receipts_len(receipts) == 0, NULL);
+	fail_unless(receipts_get(receipts, 1) == NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_add_zero)
+{
+	errno = 0;
+	fail_unless(receipts_add(receipts, 0) == NULL, NULL);
+	fail_unless(errno == EINVAL, NULL);
+}
+END_TEST
+
+START_TEST(test_add_twice)
+{
+	fail_if(receipts_add(receipts, 7) == NULL, NULL);
+
+	errno = 0;
+	fail_unless(receipts_add(receipts, 7) == NULL, NULL);
+	fail_unless(errno == EEXIST, NULL);
+	fail_unless(receipts_len(receipts) == 1, NULL);
+}
+END_TEST
+
+START_TEST(test_add_get)
+{
+	struct receipt *r;
+	int ctx;
+
+	r = receipts_add(receipts, 42);
+	fail_if(r == NULL, NULL);
+	r->ctx = &ctx;
+
+	r = receipts_get(receipts, 42);
+	fail_if(r == NULL, NULL);
+	fail_unless(r->seq == 42, NULL);
+	fail_unless(r->ctx == &ctx, NULL);
+}
+END_TEST
+
+START_TEST(test_grow_del)
+{
+	unsigned long i;
+	struct receipt *r;
+
+	for (i = 1; i <= 1000; i++) {
+		r = receipts_add(receipts, i);
+		fail_if(r == NULL, NULL);
+		r->ctx = (void *)i;
+	}
+	fail_unless(receipts_len(receipts) == 1000, NULL);
+
+	/* every other one, so probe chains get shifted around */
+	for (i = 1; i <= 1000; i += 2) {
+		receipts_del(receipts, i);
+	}
+	fail_unless(receipts_len(receipts) == 500, NULL);
+
+	for (i = 1; i <= 1000; i++) {
+		r = receipts_get(receipts, i);
+		if (i % 2) {
+			fail_unless(r == NULL, NULL);
+		} else {
+			fail_if(r == NULL, NULL);
+			fail_unless(r->ctx == (void *)i, NULL);
+		}
+	}
+}
+END_TEST
+
+START_TEST(test_copy)
+{
+	unsigned long i;
+	struct receipt *r;
+	struct stomp_allocator a;
+	receipts_t *copy;
+
+	for (i = 1; i <= 100; i++) {
+		r = receipts_add(receipts, i);
+		fail_if(r == NULL, NULL);
+		r->ctx = (void *)i;
+	}
+
+	alloc_global_get(&a);
+	copy = receipts_copy(receipts, &a);
+	fail_if(copy == NULL, NULL);
+	fail_unless(receipts_len(copy) == 100, NULL);
+
+	for (i = 1; i <= 100; i++) {
+		r = receipts_get(copy, i);
+		fail_if(r == NULL, NULL);
+		fail_unless(r->ctx == (void *)i, NULL);
+	}
+
+	/* the original is left alone */
+	receipts_del(copy, 1);
+	fail_if(receipts_get(receipts, 1) == NULL, NULL);
+
+	receipts_free(copy);
+}
+END_TEST
+
+Suite *receipt_suite()
+{
+	Suite *s = suite_create ("receipt");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_checked_fixture (tc_core, setup, teardown);
+	tcase_add_test(tc_core, test_new);
+	tcase_add_test(tc_core, test_add_zero);
+	tcase_add_test(tc_core, test_add_twice);
+	tcase_add_test(tc_core, test_add_get);
+	tcase_add_test(tc_core, test_grow_del);
+	tcase_add_test(tc_core, test_copy);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = receipt_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,7 +1,1600 @@
+#define _GNU_SOURCE
 #include <check.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
 #include "../src/stomp.h"
+#include "broker.h"
+
+/* state shared by the callbacks of a test */
+struct state {
+	broker_t *b;
+	unsigned long connected;
+	unsigned long messages;
+	unsigned long receipts;
+	unsigned long errors;
+	unsigned long confirms;
+	unsigned long batches;
+	unsigned long user;
+	int status; /* of the last SCB_CONFIRM or SCB_BATCH */
+	enum stomp_tls_mode tls; /* of the connection, on SCB_CONNECTED */
+	char version[8];
+	char receipt[64];
+	char body[256];
+	char hdr[256]; /* value of the "x-hdr" header of the last message */
+	char ack[64]; /* value of the "ack" header of the last message */
+	size_t messages_max; /* disconnect after that many messages */
+	unsigned long user_max; /* disconnect after that many SCB_USER calls */
+};
+
+/* name resolutions made by the library, see test_dns_cache */
+static unsigned long resolved;
+
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res)
+{
+	static int (*real)(const char *, const char *, const struct addrinfo *, struct addrinfo **);
+
+	if (!real) {
+		real = dlsym(RTLD_NEXT, "getaddrinfo");
+	}
+
+	__atomic_add_fetch(&resolved, 1, __ATOMIC_RELAXED);
+	return real(node, service, hints, res);
+}
+
+static const char *get(size_t hdrc, const struct stomp_hdr *hdrs, const char *key)
+{
+	size_t i;
+
+	for (i = 0; i < hdrc; i++) {
+		if (!strcmp(hdrs[i].key, key)) {
+			return hdrs[i].val;
+		}
+	}
+
+	return NULL;
+}
+
+static void copy(char *dst, size_t size, const char *src)
+{
+	snprintf(dst, size, "%s", src ? src : "");
+}
+
+static void bye(stomp_session_t *s)
+{
+	struct stomp_hdr hdrs[] = {
+		{"receipt", "bye"},
+	};
+
+	fail_unless(stomp_disconnect(s, 1, hdrs) == 0, NULL);
+}
+
+static void _connected(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_connected *c = ctx;
+	struct state *st = session_ctx;
+
+	st->connected++;
+	st->tls = stomp_session_tls(s);
+	copy(st->version, sizeof(st->version), get(c->hdrc, c->hdrs, "version"));
+}
+
+static void _message(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_message *m = ctx;
+	struct state *st = session_ctx;
+
+	st->messages++;
+	snprintf(st->body, sizeof(st->body), "%.*s", (int)m->body_len, (const char *)m->body);
+	copy(st->hdr, sizeof(st->hdr), get(m->hdrc, m->hdrs, "x-hdr"));
+	copy(st->ack, sizeof(st->ack), get(m->hdrc, m->hdrs, "ack"));
+
+	if (st->messages_max && st->messages == st->messages_max) {
+		bye(s);
+	}
+}
+
+static void _receipt(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_receipt *r = ctx;
+	struct state *st = session_ctx;
+
+	st->receipts++;
+	copy(st->receipt, sizeof(st->receipt), get(r->hdrc, r->hdrs, "receipt-id"));
+}
+
+static void _error(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+
+	st->errors++;
+}
+
+static void _confirm(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_confirm *c = ctx;
+	struct state *st = session_ctx;
+
+	st->confirms++;
+	st->status = c->status;
+}
+
+static void _batch(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct stomp_ctx_batch *b = ctx;
+	struct state *st = session_ctx;
+
+	st->batches++;
+	st->status = b->status;
+}
+
+static void _user(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+
+	st->user++;
+	if (st->user_max && st->user == st->user_max) {
+		bye(s);
+	}
+}
+
+static stomp_session_t *session(struct state *st, const struct broker_opts *o)
+{
+	stomp_session_t *s;
+
+	memset(st, 0, sizeof(*st));
+	st->b = broker_start(o);
+	fail_if(st->b == NULL, NULL);
+
+	s = stomp_session_new(st);
+	fail_if(s == NULL, NULL);
+
+	stomp_callback_set(s, SCB_CONNECTED, _connected);
+	stomp_callback_set(s, SCB_MESSAGE, _message);
+	stomp_callback_set(s, SCB_RECEIPT, _receipt);
+	stomp_callback_set(s, SCB_ERROR, _error);
+	stomp_callback_set(s, SCB_CONFIRM, _confirm);
+	stomp_callback_set(s, SCB_BATCH, _batch);
+	stomp_callback_set(s, SCB_USER, _user);
+
+	return s;
+}
+
+static int connect_to(stomp_session_t *s, struct state *st, const char *version, const char *hb)
+{
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", version},
+		{"host", "localhost"},
+		{"heart-beat", hb ? hb : "0,0"},
+	};
+
+	return stomp_connect(s, "127.0.0.1", broker_service(st->b), 3, hdrs);
+}
+
+static int subscribe(stomp_session_t *s, const char *ack)
+{
+	struct stomp_hdr hdrs[] = {
+		{"destination", "/queue/test"},
+		{"ack", ack},
+	};
+
+	return stomp_subscribe(s, 2, hdrs);
+}
+
+static void done(stomp_session_t *s, struct state *st)
+{
+	stomp_session_free(s);
+	broker_stop(st->b);
+}
+
+static struct stomp_hdr dest[] = {
+	{"destination", "/queue/test"},
+	{"x-hdr", "a:b\nc"},
+};
+
+START_TEST(test_connect)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	st.user_max = 1;
+	fail_unless(connect_to(s, &st, "1.1,1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.connected == 1, NULL);
+	fail_unless(!strcmp(st.version, "1.2"), NULL);
+	fail_unless(!strcmp(st.receipt, "bye"), NULL);
+	fail_unless(broker_count(st.b, "CONNECT") == 1, NULL);
+	fail_unless(broker_count(st.b, "DISCONNECT") == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_version)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	st.user_max = 1;
+	fail_unless(connect_to(s, &st, "1.1", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(!strcmp(st.version, "1.1"), NULL);
+
+	stomp_session_free(s);
+
+	/* nothing in common */
+	s = stomp_session_new(&st);
+	stomp_callback_set(s, SCB_ERROR, _error);
+	fail_unless(connect_to(s, &st, "2.0", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) != 1, NULL);
+	fail_unless(st.errors == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_pipeline)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_stats stats;
+
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(subscribe(s, "client") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+
+	/* before anything was read back */
+	fail_unless(stomp_stats_get(s, &stats) == 0, NULL);
+	fail_unless(stats.frames_out[SSC_CONNECT] == 1, NULL);
+	fail_unless(stats.frames_out[SSC_SUBSCRIBE] == 2, NULL);
+	fail_unless(stats.writes == 1, NULL);
+	fail_unless(broker_wait(st.b, "SUBSCRIBE", 2, 5000) == 0, NULL);
+
+	st.user_max = 1;
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(st.connected == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_pipeline_refused)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+
+	/* nothing in common, the broker answers CONNECT with ERROR */
+	fail_unless(connect_to(s, &st, "2.0", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == -1, NULL);
+	fail_unless(errno == ECONNREFUSED, NULL);
+	fail_unless(st.errors == 1, NULL);
+	fail_unless(st.connected == 0, NULL);
+
+	/* the subscription is still registered and goes out with the next CONNECT */
+	st.messages_max = 1;
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "again", 5) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.connected == 1, NULL);
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(!strcmp(st.body, "again"), NULL);
+	fail_unless(broker_connections(st.b) == 2, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_send)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	st.messages_max = 1;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "hello", 5) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(!strcmp(st.body, "hello"), NULL);
+	fail_unless(!strcmp(st.hdr, "a:b\nc"), NULL);
+	fail_unless(broker_count(st.b, "SEND") == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_send_len)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_hdr_len lens[] = {
+		{11, 11},
+		{5, 5},
+	};
+
+	st.messages_max = 1;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send_len(s, 2, dest, lens, "hello", 5) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(!strcmp(st.body, "hello"), NULL);
+	fail_unless(!strcmp(st.hdr, "a:b\nc"), NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_fanout)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_hdr other[] = {
+		{"destination", "/queue/other"},
+	};
+
+	st.messages_max = 2;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, other, "no", 2) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "yes", 3) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	/* one copy per subscription, nothing for the other queue */
+	fail_unless(st.messages == 2, NULL);
+	fail_unless(!strcmp(st.body, "yes"), NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+/* messages of one subscription, see test_subscribe_cb */
+struct routed {
+	const char *destination; /* the subscription's */
+	unsigned long messages; /* for it */
+	unsigned long foreign; /* for another destination */
+	unsigned long *total; /* of all subscriptions, disconnect at 3 */
+};
+
+static void _routed(stomp_session_t *s, void *ctx, void *sub_ctx)
+{
+	struct stomp_ctx_message *m = ctx;
+	struct routed *r = sub_ctx;
+
+	if (strcmp(get(m->hdrc, m->hdrs, "destination"), r->destination)) {
+		r->foreign++;
+	} else {
+		r->messages++;
+	}
+
+	if (++*r->total == 3) {
+		bye(s);
+	}
+}
+
+START_TEST(test_subscribe_cb)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	unsigned long total = 0;
+	struct routed a = {"/queue/a", 0, 0, &total};
+	struct routed b = {"/queue/b", 0, 0, &total};
+	struct stomp_hdr to_a[] = {
+		{"destination", "/queue/a"},
+	};
+	struct stomp_hdr to_b[] = {
+		{"destination", "/queue/b"},
+	};
+
+	fail_unless(stomp_subscribe_cb(s, 1, to_a, _routed, &a) > 0, NULL);
+	fail_unless(stomp_subscribe_cb(s, 1, to_b, _routed, &b) > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, to_a, "a1", 2) == 0, NULL);
+	fail_unless(stomp_send(s, 1, to_b, "b1", 2) == 0, NULL);
+	fail_unless(stomp_send(s, 1, to_a, "a2", 2) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	/* each callback saw its own messages only, SCB_MESSAGE none */
+	fail_unless(a.messages == 2 && a.foreign == 0, NULL);
+	fail_unless(b.messages == 1 && b.foreign == 0, NULL);
+	fail_unless(st.messages == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_receipt)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_hdr hdrs[] = {
+		{"destination", "/queue/test"},
+		{"receipt", "r-1"},
+	};
+
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, hdrs, "x", 1) == 0, NULL);
+	fail_unless(stomp_disconnect(s, 0, hdrs) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.receipts == 1, NULL);
+	fail_unless(!strcmp(st.receipt, "r-1"), NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_transaction)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_hdr t1[] = {
+		{"transaction", "t1"},
+	};
+	struct stomp_hdr t2[] = {
+		{"transaction", "t2"},
+	};
+	struct stomp_hdr send1[] = {
+		{"destination", "/queue/test"},
+		{"transaction", "t1"},
+	};
+	struct stomp_hdr send2[] = {
+		{"destination", "/queue/test"},
+		{"transaction", "t2"},
+	};
+
+	st.messages_max = 1;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_begin(s, 1, t1) == 0, NULL);
+	fail_unless(stomp_send(s, 2, send1, "aborted", 7) == 0, NULL);
+	fail_unless(stomp_begin(s, 1, t2) == 0, NULL);
+	fail_unless(stomp_send(s, 2, send2, "committed", 9) == 0, NULL);
+	fail_unless(stomp_abort(s, 1, t1) == 0, NULL);
+	fail_unless(stomp_commit(s, 1, t2) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(!strcmp(st.body, "committed"), NULL);
+	fail_unless(broker_count(st.b, "BEGIN") == 2, NULL);
+	fail_unless(broker_count(st.b, "COMMIT") == 1, NULL);
+	fail_unless(broker_count(st.b, "ABORT") == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+static void _ack(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+	struct stomp_hdr hdrs[1] = {
+		{"id", NULL},
+	};
+
+	_message(s, ctx, session_ctx);
+
+	hdrs[0].val = st->ack;
+	fail_unless(stomp_ack(s, 1, hdrs) == 0, NULL);
+	fail_unless(stomp_nack(s, 1, hdrs) == 0, NULL);
+	bye(s);
+}
+
+START_TEST(test_ack)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	stomp_callback_set(s, SCB_MESSAGE, _ack);
+	fail_unless(subscribe(s, "client-individual") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "x", 1) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(st.ack[0] != '\0', NULL);
+	fail_unless(broker_count(st.b, "ACK") == 1, NULL);
+	fail_unless(broker_count(st.b, "NACK") == 1, NULL);
+	fail_unless(st.errors == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_error)
+{
+	struct state st;
+	struct broker_opts o = {
+		.error_after = 1,
+	};
+	stomp_session_t *s = session(&st, &o);
+	struct stomp_hdr hdrs[] = {
+		{"destination", "/queue/test"},
+		{"receipt", "r-1"},
+	};
+
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, hdrs, "x", 1) == 0, NULL);
+	fail_unless(stomp_run(s) != 1, NULL);
+
+	fail_unless(st.errors == 1, NULL);
+	fail_unless(st.receipts == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+static unsigned long ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long until;
+
+static void _user_until(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+
+	st->user++;
+	if (until && ms() >= until) {
+		until = 0;
+		bye(s);
+	}
+}
+
+START_TEST(test_heartbeat)
+{
+	struct state st;
+	struct broker_opts o = {
+		.hb_send = 50,
+		.hb_recv = 50,
+	};
+	stomp_session_t *s = session(&st, &o);
+
+	/* the broker drops clients which stay silent for two periods */
+	until = ms() + 300;
+	stomp_callback_set(s, SCB_USER, _user_until);
+	fail_unless(connect_to(s, &st, "1.2", "50,50") == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	/* both sides kept the connection alive meanwhile */
+	fail_unless(st.connected == 1, NULL);
+	fail_unless(!strcmp(st.receipt, "bye"), NULL);
+	fail_unless(broker_count(st.b, "HEART-BEAT") >= 4, NULL);
+	fail_unless(st.user >= 6, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+static void _send_async(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+	int i;
+
+	_connected(s, ctx, session_ctx);
+
+	for (i = 0; i < 10; i++) {
+		fail_unless(stomp_send_async(s, 1, dest, "x", 1, NULL) == 0, NULL);
+	}
+	fail_unless(stomp_send_async(s, 1, dest, "x", 1, NULL) == -1, NULL);
+	fail_unless(errno == EAGAIN, NULL);
+	fail_unless(st->confirms == 0, NULL);
+}
+
+static void _send_async_user(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+
+	if (st->confirms == 10 && !st->user_max) {
+		st->user_max = st->user + 1;
+	}
+
+	_user(s, ctx, session_ctx);
+}
+
+START_TEST(test_send_async)
+{
+	struct state st;
+	struct broker_opts o = {
+		.latency = 5,
+	};
+	stomp_session_t *s = session(&st, &o);
+
+	stomp_callback_set(s, SCB_CONNECTED, _send_async);
+	stomp_callback_set(s, SCB_USER, _send_async_user);
+	fail_unless(stomp_send_window_set(s, 10, 0) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.confirms == 10, NULL);
+	fail_unless(st.status == 0, NULL);
+	fail_unless(st.receipts == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_send_async_lost)
+{
+	struct state st;
+	struct broker_opts o = {
+		.no_receipts = 1,
+	};
+	stomp_session_t *s = session(&st, &o);
+
+	st.user_max = 1;
+	fail_unless(stomp_send_window_set(s, 10, 1) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send_async(s, 1, dest, "x", 1, NULL) == 0, NULL);
+	fail_unless(stomp_run(s) != 1, NULL);
+
+	fail_unless(st.confirms == 1, NULL);
+	fail_unless(st.status == ETIMEDOUT || st.status == ECONNRESET, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_batch)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	int i;
+
+	st.messages_max = 5;
+	fail_unless(stomp_batch_set(s, 3, 0, 0) == 0, NULL);
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	for (i = 0; i < 5; i++) {
+		fail_unless(stomp_send(s, 2, dest, "x", 1) == 0, NULL);
+	}
+	fail_unless(stomp_batch_flush(s) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 5, NULL);
+	fail_unless(st.batches == 2, NULL);
+	fail_unless(st.status == 0, NULL);
+	fail_unless(broker_count(st.b, "BEGIN") == 2, NULL);
+	fail_unless(broker_count(st.b, "COMMIT") == 2, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_batch_other)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_hdr sub[] = {
+		{"destination", "/queue/b"},
+		{"receipt", "subscribed"},
+	};
+
+	/* without a timeout the batch would stay open for ever */
+	fail_unless(stomp_batch_set(s, 100, 0, 0) == 0, NULL);
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "x", 1) == 0, NULL);
+
+	/* commits the batch, then goes out */
+	st.messages_max = 1;
+	fail_unless(stomp_subscribe(s, 2, sub) > 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(st.batches == 1, NULL);
+	fail_unless(st.status == 0, NULL);
+	fail_unless(broker_count(st.b, "COMMIT") == 1, NULL);
+	fail_unless(broker_count(st.b, "SUBSCRIBE") == 2, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_window)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	size_t credit;
+	int id;
+	int i;
+
+	id = subscribe(s, "client");
+	fail_unless(id > 0, NULL);
+	fail_unless(stomp_subscription_window_set(s, id, NULL, 2, 0) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	for (i = 0; i < 3; i++) {
+		fail_unless(stomp_send(s, 2, dest, "x", 1) == 0, NULL);
+	}
+
+	/* drive the session by hand until it stops reading */
+	while (!stomp_session_throttled(s)) {
+		struct pollfd pfd = {stomp_session_fd(s), POLLIN, 0};
+
+		fail_unless(poll(&pfd, 1, 1000) >= 0, NULL);
+		fail_unless(stomp_session_step(s, pfd.revents != 0) == 1, NULL);
+	}
+
+	fail_unless(st.messages == 2, NULL);
+	fail_unless(stomp_subscription_credit_get(s, id, NULL, &credit, NULL) == 0, NULL);
+	fail_unless(credit == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+static void _reconnect(stomp_session_t *s, void *ctx, void *session_ctx)
+{
+	struct state *st = session_ctx;
+
+	_connected(s, ctx, session_ctx);
+
+	if (st->connected == 1) {
+		broker_drop(st->b);
+	} else {
+		fail_unless(stomp_send(s, 2, dest, "again", 5) == 0, NULL);
+	}
+}
+
+START_TEST(test_reconnect)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+
+	st.messages_max = 1;
+	stomp_callback_set(s, SCB_CONNECTED, _reconnect);
+	fail_unless(stomp_reconnect_set(s, 10, 50, 5) == 0, NULL);
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	/* the subscription was made again on the new connection */
+	fail_unless(st.connected == 2, NULL);
+	fail_unless(broker_connections(st.b) == 2, NULL);
+	fail_unless(broker_count(st.b, "SUBSCRIBE") == 2, NULL);
+	fail_unless(!strcmp(st.body, "again"), NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+/* in-memory connections, a new pair for every connect, the test being the broker */
+struct reconnecting {
+	stomp_mem_t *ends[2];
+	unsigned long connects;
+};
+
+static int rc_connect(void *ctx, const char *host, const char *service, unsigned long timeout)
+{
+	struct reconnecting *rc = ctx;
+
+	stomp_mem_free(rc->ends[0]);
+	stomp_mem_free(rc->ends[1]);
+	rc->connects++;
+
+	return stomp_mem_pair(rc->ends);
+}
+
+static ssize_t rc_readv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	return stomp_mem_transport()->readv(((struct reconnecting *)ctx)->ends[0], iov, iovcnt);
+}
+
+static ssize_t rc_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	return stomp_mem_transport()->writev(((struct reconnecting *)ctx)->ends[0], iov, iovcnt);
+}
+
+static size_t rc_pending(void *ctx)
+{
+	return stomp_mem_transport()->pending(((struct reconnecting *)ctx)->ends[0]);
+}
+
+static int rc_fd(void *ctx)
+{
+	return stomp_mem_transport()->fd(((struct reconnecting *)ctx)->ends[0]);
+}
+
+static void rc_close(void *ctx)
+{
+	stomp_mem_close(((struct reconnecting *)ctx)->ends[0]);
+}
+
+static const struct stomp_transport rc_transport = {
+	.connect = rc_connect,
+	.readv = rc_readv,
+	.writev = rc_writev,
+	.pending = rc_pending,
+	.fd = rc_fd,
+	.close = rc_close,
+};
+
+/* read everything the session wrote to the broker end */
+static size_t rc_drain(struct reconnecting *rc, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size && (n = stomp_mem_read(rc->ends[1], buf + len, size - len)) > 0) {
+		len += n;
+	}
+
+	return len;
+}
+
+START_TEST(test_reconnect_order)
+{
+	const char connected[] = "CONNECTED\nversion:1.2\n\n";
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct reconnecting rc = {{NULL, NULL}, 0};
+	struct state st;
+	stomp_session_t *s;
+	char buf[4096];
+	const char *one, *two, *three;
+	size_t len;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	s = stomp_session_new(&st);
+	fail_if(s == NULL, NULL);
+	stomp_callback_set(s, SCB_CONNECTED, _connected);
+	fail_unless(stomp_reconnect_set(s, 1, 1, 0) == 0, NULL);
+	fail_unless(stomp_transport_set(s, &rc_transport, &rc) == 0, NULL);
+	fail_unless(stomp_connect(s, "mem", NULL, 1, hdrs) == 0, NULL);
+
+	fail_unless(stomp_mem_write(rc.ends[1], connected, sizeof(connected)) == sizeof(connected), NULL);
+	fail_unless(stomp_session_step(s, 1) == 1, NULL);
+	fail_unless(st.connected == 1, NULL);
+
+	/* the broker goes away, the messages wait for the next connection */
+	stomp_mem_close(rc.ends[1]);
+	fail_unless(stomp_session_step(s, 1) == 1, NULL);
+	fail_unless(stomp_send(s, 2, dest, "one", 3) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "two", 3) == 0, NULL);
+
+	for (i = 0; i < 100 && rc.connects < 2; i++) {
+		usleep(2000);
+		fail_unless(stomp_session_step(s, 0) == 1, NULL);
+	}
+	fail_unless(rc.connects == 2, NULL);
+
+	/* reconnected but not CONNECTED yet, this one must not overtake them */
+	fail_unless(stomp_send(s, 2, dest, "three", 5) == 0, NULL);
+	len = rc_drain(&rc, buf, sizeof(buf) - 1);
+	buf[len] = '\0';
+	fail_unless(!strncmp(buf, "CONNECT\n", 8), NULL);
+	for (i = 0; (size_t)i < len; i += strlen(buf + i) + 1) {
+		fail_if(!strncmp(buf + i, "SEND\n", 5), NULL);
+	}
+
+	fail_unless(stomp_mem_write(rc.ends[1], connected, sizeof(connected)) == sizeof(connected), NULL);
+	fail_unless(stomp_session_step(s, 1) == 1, NULL);
+	fail_unless(st.connected == 2, NULL);
+
+	len = rc_drain(&rc, buf, sizeof(buf) - 1);
+	fail_unless(len > 0, NULL);
+	buf[len] = '\0';
+	/* frames end with a NUL, look at them one at a time */
+	one = two = three = NULL;
+	for (i = 0; (size_t)i < len; i += strlen(buf + i) + 1) {
+		const char *body = strstr(buf + i, "\n\n");
+		if (!body) {
+			continue;
+		}
+		body += 2;
+		if (!strcmp(body, "one")) {
+			one = body;
+		} else if (!strcmp(body, "two")) {
+			two = body;
+		} else if (!strcmp(body, "three")) {
+			three = body;
+		}
+	}
+	fail_unless(one && two && three, NULL);
+	fail_unless(one < two && two < three, NULL);
+
+	stomp_session_free(s);
+	stomp_mem_free(rc.ends[0]);
+	stomp_mem_free(rc.ends[1]);
+}
+END_TEST
+
+START_TEST(test_dropped)
+{
+	struct state st;
+	struct broker_opts o = {
+		.drop_after = 1,
+	};
+	stomp_session_t *s = session(&st, &o);
+
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, dest, "x", 1) == 0, NULL);
+	fail_unless(stomp_run(s) == -1, NULL);
+	fail_unless(st.connected == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_bandwidth)
+{
+	struct state st;
+	struct broker_opts o = {
+		.bandwidth = 100000,
+	};
+	stomp_session_t *s = session(&st, &o);
+	unsigned long start;
+	char body[20000];
+
+	memset(body, 'x', sizeof(body));
+	start = ms();
+
+	st.messages_max = 1;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, dest, body, sizeof(body)) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	/* 20k at 100k/s */
+	fail_unless(st.messages == 1, NULL);
+	fail_unless(ms() - start >= 190, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_stats)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_stats stats;
+
+	fail_unless(stomp_stats_get(s, &stats) == 0, NULL);
+	fail_unless(stats.frames_out[SSC_CONNECT] == 0, NULL);
+
+	st.messages_max = 2;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "hello", 5) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "world", 5) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+
+	fail_unless(stomp_stats_get(s, &stats) == 0, NULL);
+	fail_unless(stats.frames_out[SSC_CONNECT] == 1, NULL);
+	fail_unless(stats.frames_out[SSC_SUBSCRIBE] == 1, NULL);
+	fail_unless(stats.frames_out[SSC_SEND] == 2, NULL);
+	fail_unless(stats.frames_out[SSC_DISCONNECT] == 1, NULL);
+	fail_unless(stats.frames_in[SSC_CONNECTED] == 1, NULL);
+	fail_unless(stats.frames_in[SSC_MESSAGE] == 2, NULL);
+	fail_unless(stats.frames_in[SSC_RECEIPT] == 1, NULL);
+	fail_unless(stats.bytes_in[SSC_MESSAGE] > 10, NULL);
+	fail_unless(stats.bytes_out[SSC_SEND] > 10, NULL);
+	fail_unless(stats.reads >= stats.bytes_in[SSC_MESSAGE] / 4096, NULL);
+	fail_unless(stats.writes >= 3, NULL);
+	fail_unless(stats.callbacks >= 4, NULL);
+	fail_unless(stats.hb_missed == 0, NULL);
+	fail_unless(stats.queue == 0 && stats.inflight == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+/* allocation hooks which count what is still allocated with them */
+static void *counting_malloc(void *ctx, size_t size)
+{
+	(*(long *)ctx)++;
+	return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+	(*(long *)ctx)--;
+	free(ptr);
+}
+
+START_TEST(test_allocator)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	long live = 0;
+	struct stomp_allocator a = {
+		.malloc_fn = counting_malloc,
+		.realloc_fn = counting_realloc,
+		.free_fn = counting_free,
+		.ctx = &live,
+	};
+	struct stomp_allocator partial = a;
+	int id;
+
+	partial.free_fn = NULL;
+	fail_unless(stomp_set_allocator(s, &partial) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+
+	fail_unless(stomp_set_allocator(s, &a) == 0, NULL);
+	fail_unless(live > 0, NULL);
+
+	st.messages_max = 1;
+	id = subscribe(s, "auto");
+	fail_unless(id > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 2, dest, "hello", 5) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(st.messages == 1, NULL);
+
+	/* a subscription would have to move */
+	fail_unless(stomp_set_allocator(s, NULL) == -1, NULL);
+	fail_unless(errno == EBUSY, NULL);
+
+	/* offline this only forgets the subscription */
+	fail_unless(stomp_unsubscribe(s, id, 1, dest) == 0, NULL);
+
+	/* frames, the write buffer and the registries all move back */
+	fail_unless(stomp_set_allocator(s, NULL) == 0, NULL);
+	fail_unless(live == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_limits)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_limits l = {
+		.frame = 256,
+		.keep = 4096,
+	};
+	char body[512];
+
+	fail_unless(stomp_limits_set(s, NULL) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+	fail_unless(stomp_limits_set(s, &l) == 0, NULL);
+
+	memset(body, 'x', sizeof(body));
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, dest, body, sizeof(body)) == 0, NULL);
+	fail_unless(stomp_run(s) == -1, NULL);
+	fail_unless(errno == EMSGSIZE, NULL);
+	fail_unless(st.messages == 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_session_memory)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	struct stomp_limits l = {
+		.keep = 1024,
+	};
+	struct stomp_memory m;
+	char body[16384];
+	int i;
+
+	stomp_session_memory(s, &m);
+	fail_unless(m.peak == 0 && m.trims == 0, NULL);
+
+	fail_unless(stomp_limits_set(s, &l) == 0, NULL);
+
+	/* one large message followed by more than a window of small ones */
+	memset(body, 'x', sizeof(body));
+	st.messages_max = 151;
+	fail_unless(subscribe(s, "auto") > 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_send(s, 1, dest, body, sizeof(body)) == 0, NULL);
+	for (i = 0; i < 150; i++) {
+		fail_unless(stomp_send(s, 1, dest, "x", 1) == 0, NULL);
+	}
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(st.messages == 151, NULL);
+
+	stomp_session_memory(s, &m);
+	fail_unless(m.peak > sizeof(body), NULL);
+	fail_unless(m.trims >= 1, NULL);
+	fail_unless(m.frames > 0, NULL);
+	/* held on to after the large frame was trimmed */
+	fail_unless(m.frames < sizeof(body), NULL);
+	/* CONNECT and SUBSCRIBE were batched into one write */
+	fail_unless(m.cork > 0, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_latency)
+{
+	struct state st;
+	struct broker_opts o = {
+		.latency = 2,
+	};
+	stomp_session_t *s = session(&st, &o);
+	struct stomp_latency l;
+	int i;
+
+	stomp_callback_set(s, SCB_USER, _send_async_user);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	for (i = 0; i < 10; i++) {
+		fail_unless(stomp_send_async(s, 1, dest, "x", 1, NULL) == 0, NULL);
+	}
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(st.confirms == 10, NULL);
+
+#ifdef STOMP_HISTOGRAMS
+	fail_unless(stomp_latency_get(s, SLT_RECEIPT, &l, 0) == 0, NULL);
+	fail_unless(l.count == 10, NULL);
+	/* the broker takes 2ms per frame */
+	fail_unless(l.min >= 2000000, NULL);
+	fail_unless(l.min <= l.p50 && l.p50 <= l.p90 && l.p90 <= l.p99 && l.p99 <= l.p999, NULL);
+	fail_unless(l.p999 <= l.max && l.mean <= l.max, NULL);
+
+	fail_unless(stomp_latency_get(s, SLT_CONNECT, &l, 0) == 0, NULL);
+	fail_unless(l.count == 1 && l.min >= 2000000, NULL);
+
+	fail_unless(stomp_latency_get(s, SLT_DISPATCH, &l, 0) == 0, NULL);
+	fail_unless(l.count == 12, NULL);
+
+	fail_unless(stomp_latency_get(s, SLT_CALLBACK, &l, 1) == 0, NULL);
+	fail_unless(l.count > 12, NULL);
+	fail_unless(stomp_latency_get(s, SLT_CALLBACK, &l, 0) == 0, NULL);
+	fail_unless(l.count == 0 && l.max == 0, NULL);
+
+	fail_unless(stomp_latency_get(s, SLT_MAX, &l, 0) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+#else
+	fail_unless(stomp_latency_get(s, SLT_RECEIPT, &l, 0) == -1, NULL);
+	fail_unless(errno == ENOSYS, NULL);
+#endif
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_unix)
+{
+	struct state st;
+	struct broker_opts o = {
+		.hb_send = 50,
+		.hb_recv = 50,
+	};
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+		{"heart-beat", "50,50"},
+	};
+	stomp_session_t *s;
+	char path[64];
+	char host[80];
+	int on;
+	socklen_t len;
+	int i;
+
+	/* a socket file, then the same in the abstract namespace */
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/check_stomp-%d.sock", i ? "@" : "/tmp", (int)getpid());
+		snprintf(host, sizeof(host), "unix:%s", path);
+		o.path = path;
+		s = session(&st, &o);
+
+		fail_unless(stomp_passcred_set(s, i) == 0, NULL);
+		fail_unless(subscribe(s, "auto") > 0, NULL);
+		fail_unless(stomp_connect(s, host, NULL, 2, hdrs) == 0, NULL);
+
+		on = -1;
+		len = sizeof(on);
+		fail_unless(getsockopt(stomp_session_fd(s), SOL_SOCKET, SO_PASSCRED, &on, &len) == 0, NULL);
+		fail_unless(on == i, NULL);
+
+		/* heart-beats keep the connection alive as they do over TCP */
+		until = ms() + 200;
+		stomp_callback_set(s, SCB_USER, _user_until);
+		fail_unless(stomp_send(s, 2, dest, "hello", 5) == 0, NULL);
+		fail_unless(stomp_run(s) == 0, NULL);
+
+		fail_unless(st.messages == 1, NULL);
+		fail_unless(!strcmp(st.body, "hello"), NULL);
+		fail_unless(!strcmp(st.receipt, "bye"), NULL);
+		fail_unless(broker_count(st.b, "HEART-BEAT") >= 2, NULL);
+
+		done(s, &st);
+	}
+
+	/* nobody listens there any more */
+	s = stomp_session_new(NULL);
+	fail_unless(stomp_connect(s, host, NULL, 2, hdrs) == -1, NULL);
+	fail_unless(errno == ECONNREFUSED, NULL);
+	snprintf(host, sizeof(host), "unix:/tmp/check_stomp-%d.sock", (int)getpid());
+	fail_unless(stomp_connect(s, host, NULL, 2, hdrs) == -1, NULL);
+	fail_unless(errno == ENOENT, NULL);
+	stomp_session_free(s);
+}
+END_TEST
+
+START_TEST(test_mem)
+{
+	const char frames[] =
+		"CONNECTED\nversion:1.2\n\n\0"
+		"MESSAGE\nsubscription:1\nmessage-id:1\ndestination:/queue/a\n\nhello\0"
+		"MESSAGE\nsubscription:1\nmessage-id:2\ndestination:/queue/a\nx-hdr:x\n\nworld\0";
+	struct stomp_hdr hdrs[] = {
+		{"accept-version", "1.2"},
+	};
+	struct stomp_transport t = *stomp_mem_transport();
+	struct state st;
+	stomp_session_t *s;
+	stomp_mem_t *ends[2];
+	char buf[256];
+	ssize_t n;
+	int chunk;
+
+	s = stomp_session_new(NULL);
+	t.fd = NULL;
+	fail_unless(stomp_transport_set(s, &t, NULL) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+	stomp_session_free(s);
+
+	/* all at once, then one byte per read */
+	for (chunk = 0; chunk < 2; chunk++) {
+		memset(&st, 0, sizeof(st));
+		s = stomp_session_new(&st);
+		fail_if(s == NULL, NULL);
+		stomp_callback_set(s, SCB_CONNECTED, _connected);
+		stomp_callback_set(s, SCB_MESSAGE, _message);
+
+		fail_unless(stomp_mem_pair(ends) == 0, NULL);
+		fail_unless(stomp_mem_chunk_set(ends[0], chunk) == 0, NULL);
+		fail_unless(stomp_mem_read(ends[1], buf, sizeof(buf)) == -1, NULL);
+		fail_unless(errno == EAGAIN, NULL);
+		fail_unless(stomp_mem_write(ends[1], frames, sizeof(frames) - 1) == sizeof(frames) - 1, NULL);
+
+		fail_unless(stomp_transport_set(s, stomp_mem_transport(), ends[0]) == 0, NULL);
+		fail_unless(stomp_connect(s, "mem", NULL, 1, hdrs) == 0, NULL);
+		fail_unless(stomp_session_fd(s) == stomp_mem_transport()->fd(ends[0]), NULL);
+
+		n = stomp_mem_read(ends[1], buf, sizeof(buf) - 1);
+		fail_unless(n > 0, NULL);
+		buf[n] = '\0';
+		fail_unless(!strncmp(buf, "CONNECT\n", 8), NULL);
+
+		/* the session reads everything queued before the EOF */
+		stomp_mem_close(ends[1]);
+		fail_unless(stomp_run(s) == -1, NULL);
+		fail_unless(st.connected == 1, NULL);
+		fail_unless(!strcmp(st.version, "1.2"), NULL);
+		fail_unless(st.messages == 2, NULL);
+		fail_unless(!strcmp(st.body, "world"), NULL);
+		fail_unless(!strcmp(st.hdr, "x"), NULL);
+
+		/* a closed pair cannot be connected again */
+		fail_unless(stomp_connect(s, "mem", NULL, 1, hdrs) == -1, NULL);
+		fail_unless(errno == ECONNREFUSED, NULL);
+		fail_unless(stomp_mem_write(ends[0], "x", 1) == -1, NULL);
+		fail_unless(errno == EBADF, NULL);
+
+		stomp_session_free(s);
+		stomp_mem_free(ends[0]);
+		stomp_mem_free(ends[1]);
+	}
+}
+END_TEST
+
+#ifdef STOMP_TLS
+START_TEST(test_tls)
+{
+	struct state st;
+	struct broker_opts o = {
+		.tls = 1,
+	};
+	stomp_session_t *s = session(&st, &o);
+	struct stomp_tls tls = {
+		.ca_file = broker_tls_ca(st.b),
+	};
+	static char big[100000];
+	int i, j;
+
+	memset(big, 'x', sizeof(big));
+
+	/* with and without kTLS, which the kernel may not support */
+	for (i = 0; i < 2; i++) {
+		tls.no_ktls = i;
+		fail_unless(stomp_tls_set(s, &tls) == 0, NULL);
+
+		st.messages = 0;
+		st.messages_max = 101;
+		fail_unless(subscribe(s, "auto") > 0, NULL);
+		fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+		fail_unless(stomp_send(s, 1, dest, big, sizeof(big)) == 0, NULL);
+		for (j = 0; j < 100; j++) {
+			fail_unless(stomp_send(s, 1, dest, "small", 5) == 0, NULL);
+		}
+		/* the small ones arrive many to a TLS record, which
+		 * poll() alone would not wake up for */
+		fail_unless(stomp_run(s) == 0, NULL);
+
+		fail_unless(st.messages == 101, NULL);
+		fail_unless(!strcmp(st.body, "small"), NULL);
+		fail_unless(st.tls == STLS_KERNEL || st.tls == STLS_USER, NULL);
+		if (tls.no_ktls) {
+			fail_unless(st.tls == STLS_USER, NULL);
+		}
+		fail_unless(stomp_session_tls(s) == STLS_NONE, NULL);
+
+		stomp_session_free(s);
+		s = stomp_session_new(&st);
+		stomp_callback_set(s, SCB_CONNECTED, _connected);
+		stomp_callback_set(s, SCB_MESSAGE, _message);
+		stomp_callback_set(s, SCB_RECEIPT, _receipt);
+	}
+
+	fail_unless(broker_count(st.b, "SEND") == 202, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_tls_verify)
+{
+	struct state st;
+	struct broker_opts o = {
+		.tls = 1,
+	};
+	stomp_session_t *s = session(&st, &o);
+	struct stomp_tls tls = {
+		.ca_file = broker_tls_ca(st.b),
+		.server_name = "broker.example",
+	};
+	struct stomp_tls insecure = {
+		.insecure = 1,
+	};
+	struct stomp_tls missing = {
+		.ca_file = "/nonexistent.pem",
+	};
+
+	/* not signed by a system CA */
+	fail_unless(stomp_tls_set(s, &(struct stomp_tls){0}) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == -1, NULL);
+	fail_unless(errno == EPROTO, NULL);
+
+	/* not issued to that name */
+	fail_unless(stomp_tls_set(s, &tls) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == -1, NULL);
+	fail_unless(errno == EPROTO, NULL);
+
+	fail_unless(stomp_tls_set(s, &missing) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+
+	st.user_max = 1;
+	fail_unless(stomp_tls_set(s, &insecure) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_session_tls(s) != STLS_NONE, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(st.connected == 1, NULL);
+
+	/* back to plain TCP, which the broker does not speak */
+	fail_unless(stomp_tls_set(s, NULL) == 0, NULL);
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_session_tls(s) == STLS_NONE, NULL);
+	fail_unless(stomp_run(s) == -1, NULL);
+	fail_unless(st.connected == 1, NULL);
+
+	done(s, &st);
+}
+END_TEST
+#else
+START_TEST(test_tls)
+{
+	struct stomp_tls tls = {
+		.insecure = 1,
+	};
+	stomp_session_t *s = stomp_session_new(NULL);
+
+	fail_unless(stomp_tls_set(s, &tls) == -1, NULL);
+	fail_unless(errno == ENOSYS, NULL);
+	fail_unless(stomp_tls_set(s, NULL) == 0, NULL);
+	fail_unless(stomp_session_tls(s) == STLS_NONE, NULL);
+
+	stomp_session_free(s);
+}
+END_TEST
+#endif
+
+START_TEST(test_dns_cache)
+{
+	struct state st;
+	stomp_session_t *s = session(&st, NULL);
+	unsigned long n;
+
+	fail_unless(stomp_connect_timeout_set(s, 5000, 60000) == 0, NULL);
+
+	n = resolved;
+	st.user_max = 1;
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(resolved == n + 1, NULL);
+
+	/* within dns_ttl the addresses are reused */
+	st.user = 0;
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(resolved == n + 1, NULL);
+
+	/* without caching every connect resolves */
+	fail_unless(stomp_connect_timeout_set(s, 5000, 0) == 0, NULL);
+	st.user = 0;
+	fail_unless(connect_to(s, &st, "1.2", NULL) == 0, NULL);
+	fail_unless(stomp_run(s) == 0, NULL);
+	fail_unless(resolved == n + 2, NULL);
+
+	fail_unless(st.connected == 3, NULL);
+	fail_unless(broker_connections(st.b) == 3, NULL);
+
+	done(s, &st);
+}
+END_TEST
+
+START_TEST(test_reactor)
+{
+	struct state st[4];
+	stomp_session_t *s[4];
+	stomp_reactor_t *r;
+	stomp_reactor_t *other;
+	broker_t *b;
+	char queue[4][32];
+	struct stomp_hdr hdrs[4][1];
+	int i;
+	int j;
+
+	r = stomp_reactor_new(2, NULL);
+	fail_if(r == NULL, NULL);
+	other = stomp_reactor_new(1, NULL);
+	fail_if(other == NULL, NULL);
+
+	/* one broker for all of them */
+	s[0] = session(&st[0], NULL);
+	b = st[0].b;
+
+	for (i = 0; i < 4; i++) {
+		if (i) {
+			memset(&st[i], 0, sizeof(st[i]));
+			st[i].b = b;
+			s[i] = stomp_session_new(&st[i]);
+			fail_if(s[i] == NULL, NULL);
+			stomp_callback_set(s[i], SCB_MESSAGE, _message);
+			stomp_callback_set(s[i], SCB_RECEIPT, _receipt);
+		}
+
+		/* each one has a queue of its own and leaves after 10 messages */
+		snprintf(queue[i], sizeof(queue[i]), "/queue/reactor-%d", i);
+		hdrs[i][0].key = "destination";
+		hdrs[i][0].val = queue[i];
+		st[i].messages_max = 10;
+		fail_unless(stomp_subscribe(s[i], 1, hdrs[i]) > 0, NULL);
+
+		/* not connected yet */
+		fail_unless(stomp_reactor_add(r, s[i], -1) == -1, NULL);
+		fail_unless(errno == EINVAL, NULL);
+
+		fail_unless(connect_to(s[i], &st[i], "1.2", NULL) == 0, NULL);
+		fail_unless(stomp_reactor_add(r, s[i], i % 2) == i % 2, NULL);
+
+		/* owned already */
+		fail_unless(stomp_reactor_add(r, s[i], -1) == -1, NULL);
+		fail_unless(stomp_reactor_send(other, s[i], 1, hdrs[i], "x", 1) == -1, NULL);
+		fail_unless(errno == EINVAL, NULL);
+	}
+
+	for (j = 0; j < 10; j++) {
+		for (i = 0; i < 4; i++) {
+			fail_unless(stomp_reactor_send(r, s[i], 1, hdrs[i], "hello", 5) == 0, NULL);
+		}
+	}
+
+	/* returns once every session got its messages and disconnected */
+	fail_unless(stomp_reactor_join(r) == 0, NULL);
+
+	for (i = 0; i < 4; i++) {
+		fail_unless(st[i].messages == 10, NULL);
+		fail_unless(!strcmp(st[i].body, "hello"), NULL);
+		fail_unless(!strcmp(st[i].receipt, "bye"), NULL);
+
+		/* over, no longer owned by the reactor */
+		fail_unless(stomp_reactor_send(r, s[i], 1, hdrs[i], "x", 1) == -1, NULL);
+		fail_unless(errno == EINVAL, NULL);
+	}
+
+	fail_unless(broker_count(b, "SEND") == 40, NULL);
+	fail_unless(broker_count(b, "DISCONNECT") == 4, NULL);
+
+	/* joined reactors take no more sessions */
+	fail_unless(stomp_reactor_add(r, s[0], -1) == -1, NULL);
+
+	stomp_reactor_free(other);
+	stomp_reactor_free(r);
+	for (i = 1; i < 4; i++) {
+		stomp_session_free(s[i]);
+	}
+	done(s[0], &st[0]);
+}
+END_TEST
+
+Suite *stomp_suite()
+{
+	Suite *s = suite_create ("stomp");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_set_timeout(tc_core, 10);
+	tcase_add_test(tc_core, test_connect);
+	tcase_add_test(tc_core, test_version);
+	tcase_add_test(tc_core, test_pipeline);
+	tcase_add_test(tc_core, test_pipeline_refused);
+	tcase_add_test(tc_core, test_send);
+	tcase_add_test(tc_core, test_send_len);
+	tcase_add_test(tc_core, test_fanout);
+	tcase_add_test(tc_core, test_subscribe_cb);
+	tcase_add_test(tc_core, test_receipt);
+	tcase_add_test(tc_core, test_transaction);
+	tcase_add_test(tc_core, test_ack);
+	tcase_add_test(tc_core, test_error);
+	tcase_add_test(tc_core, test_heartbeat);
+	tcase_add_test(tc_core, test_send_async);
+	tcase_add_test(tc_core, test_send_async_lost);
+	tcase_add_test(tc_core, test_batch);
+	tcase_add_test(tc_core, test_batch_other);
+	tcase_add_test(tc_core, test_window);
+	tcase_add_test(tc_core, test_reconnect);
+	tcase_add_test(tc_core, test_reconnect_order);
+	tcase_add_test(tc_core, test_dropped);
+	tcase_add_test(tc_core, test_bandwidth);
+	tcase_add_test(tc_core, test_stats);
+	tcase_add_test(tc_core, test_allocator);
+	tcase_add_test(tc_core, test_limits);
+	tcase_add_test(tc_core, test_session_memory);
+	tcase_add_test(tc_core, test_latency);
+	tcase_add_test(tc_core, test_unix);
+	tcase_add_test(tc_core, test_mem);
+	tcase_add_test(tc_core, test_dns_cache);
+	tcase_add_test(tc_core, test_reactor);
+	tcase_add_test(tc_core, test_tls);
+#ifdef STOMP_TLS
+	tcase_add_test(tc_core, test_tls_verify);
+#endif
+	suite_add_tcase (s, tc_core);
+
+	return s;
+}
 
 int main(int argc, const char *argv[])
 {
-	return 0;
+	int number_failed;
+
+	Suite *s = stomp_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
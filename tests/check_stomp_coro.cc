@@ -0,0 +1,198 @@
+#include <check.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "../src/stomp_coro.hpp"
+#include "broker.h"
+
+static stomp::coro::task<int> answer()
+{
+	co_return 42;
+}
+
+static stomp::coro::task<> await_answer(int &out)
+{
+	out = co_await answer();
+}
+
+static stomp::coro::task<> fail()
+{
+	throw std::runtime_error("fail");
+	co_return;
+}
+
+static stomp::coro::task<> connect_refused(stomp::coro::session &s, int &err)
+{
+	try {
+		/* nothing listens on the tcpmux port */
+		co_await s.connect("127.0.0.1", "1", stomp::headers(stomp::hdr("accept-version", "1.2")));
+	} catch (const std::system_error &e) {
+		err = e.code().value();
+	}
+}
+
+static const auto queue = stomp::headers(stomp::hdr("destination", "/queue/test"));
+
+static stomp::coro::task<> connect(stomp::coro::session &s, broker_t *b)
+{
+	co_await s.connect("127.0.0.1", broker_service(b), stomp::headers(stomp::hdr("accept-version", "1.2")));
+}
+
+static stomp::coro::task<> roundtrip(stomp::coro::session &s, stomp::coro::subscription &sub, broker_t *b, std::string &out)
+{
+	co_await connect(s, b);
+	co_await s.send_with_receipt(queue, "hello");
+	auto m = co_await sub.next();
+	out = stomp::as_string(m.body());
+	co_await s.disconnect();
+}
+
+static stomp::coro::task<> subscribe_after_connect(stomp::coro::session &s, broker_t *b, std::string &out)
+{
+	co_await connect(s, b);
+	auto sub = s.subscribe({{"destination", "/queue/test"}, {"ack", "auto"}});
+	/* queued while nobody awaits next() */
+	s.send(queue, "one");
+	co_await s.send_with_receipt(queue, "two");
+	out = stomp::as_string((co_await sub.next()).body());
+	out += stomp::as_string((co_await sub.next()).body());
+	co_await s.disconnect();
+}
+
+START_TEST(test_task)
+{
+	stomp::coro::executor ex;
+	int out = 0;
+
+	ex.spawn(await_answer(out));
+	ex.run();
+
+	fail_unless(out == 42, NULL);
+}
+END_TEST
+
+START_TEST(test_task_exception)
+{
+	stomp::coro::executor ex;
+	int thrown = 0;
+
+	ex.spawn(fail());
+	try {
+		ex.run();
+	} catch (const std::runtime_error &) {
+		thrown = 1;
+	}
+
+	fail_unless(thrown, NULL);
+}
+END_TEST
+
+START_TEST(test_connect_refused)
+{
+	stomp::coro::executor ex;
+	stomp::coro::session s(ex);
+	int err = 0;
+
+	ex.spawn(connect_refused(s, err));
+	ex.run();
+
+	fail_unless(err != 0, NULL);
+	fail_if(s.connected(), NULL);
+}
+END_TEST
+
+START_TEST(test_subscribe)
+{
+	broker_t *b = broker_start(NULL);
+	std::string out;
+
+	fail_if(b == NULL, NULL);
+	{
+		stomp::coro::executor ex;
+		stomp::coro::session s(ex);
+
+		ex.spawn(subscribe_after_connect(s, b, out));
+		ex.run();
+	}
+
+	fail_unless(out == "onetwo", NULL);
+	fail_unless(broker_count(b, "SUBSCRIBE") == 1, NULL);
+	broker_stop(b);
+}
+END_TEST
+
+START_TEST(test_subscribe_before_connect)
+{
+	broker_t *b = broker_start(NULL);
+	std::string out;
+
+	fail_if(b == NULL, NULL);
+	{
+		stomp::coro::executor ex;
+		stomp::coro::session s(ex);
+		auto sub = s.subscribe({{"destination", "/queue/test"}, {"ack", "auto"}});
+
+		ex.spawn(roundtrip(s, sub, b, out));
+		ex.run();
+	}
+
+	/* sent along with CONNECT */
+	fail_unless(out == "hello", NULL);
+	fail_unless(broker_count(b, "SUBSCRIBE") == 1, NULL);
+	broker_stop(b);
+}
+END_TEST
+
+START_TEST(test_subscription_destroyed)
+{
+	broker_t *b = broker_start(NULL);
+	std::string out;
+
+	fail_if(b == NULL, NULL);
+	{
+		stomp::coro::executor ex;
+		stomp::coro::session s(ex);
+		{
+			auto gone = s.subscribe({{"destination", "/queue/test"}, {"ack", "auto"}});
+		}
+		auto sub = s.subscribe({{"destination", "/queue/test"}, {"ack", "auto"}});
+
+		ex.spawn(roundtrip(s, sub, b, out));
+		ex.run();
+	}
+
+	/* the destroyed one was neither subscribed nor called back */
+	fail_unless(out == "hello", NULL);
+	fail_unless(broker_count(b, "SUBSCRIBE") == 1, NULL);
+	fail_unless(broker_count(b, "UNSUBSCRIBE") == 0, NULL);
+	broker_stop(b);
+}
+END_TEST
+
+Suite *stomp_coro_suite()
+{
+	Suite *s = suite_create ("stomp_coro");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_test(tc_core, test_task);
+	tcase_add_test(tc_core, test_task_exception);
+	tcase_add_test(tc_core, test_connect_refused);
+	tcase_add_test(tc_core, test_subscribe);
+	tcase_add_test(tc_core, test_subscribe_before_connect);
+	tcase_add_test(tc_core, test_subscription_destroyed);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = stomp_coro_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iterator>
+#include <stdexcept>
+
+#include "../src/stomp.hpp"
+
+START_TEST(test_hdr_literals)
+{
+	constexpr auto h = stomp::hdr("destination", "/queue/a");
+	static_assert(h.key_len == 11, "key length");
+	static_assert(h.val_len == 8, "value length");
+
+	constexpr auto hdrs = stomp::headers(h, stomp::hdr("ack", "client"));
+	static_assert(hdrs.size() == 2, "header count");
+	static_assert(hdrs.lens[1].key_len == 3 && hdrs.lens[1].val_len == 6, "lengths");
+
+	/* a runtime value has no length to pass on */
+	const char *dyn = "/queue/b";
+	auto mixed = stomp::headers(h, stomp::hdr("reply-to", dyn));
+	static_assert(std::is_same_v<decltype(mixed), std::array<struct stomp_hdr, 2>>, "mixed headers");
+	fail_if(strcmp(mixed[1].val, "/queue/b"), NULL);
+
+	fail_if(strcmp(hdrs[0].key, "destination"), NULL);
+	fail_if(strcmp(hdrs[1].val, "client"), NULL);
+}
+END_TEST
+
+START_TEST(test_headers_view)
+{
+	const struct stomp_hdr hdrs[] = {
+		{"destination", "/queue/a"},
+		{"message-id", "42"},
+	};
+	stomp::headers_view v(hdrs, sizeof(hdrs)/sizeof(struct stomp_hdr));
+	size_t n = 0;
+
+	fail_unless(v.size() == 2, NULL);
+	fail_unless(v.find("message-id") == std::string_view("42"), NULL);
+	fail_if(v.find("subscription").has_value(), NULL);
+
+	for (auto kv : v) {
+		fail_unless(kv.first.data() == hdrs[n].key, NULL);
+		fail_unless(kv.second.size() == strlen(hdrs[n].val), NULL);
+		n++;
+	}
+	fail_unless(n == 2, NULL);
+
+	auto it = v.begin();
+	std::advance(it, 1);
+	fail_unless((*it).first == "message-id", NULL);
+	fail_unless(std::distance(v.begin(), v.end()) == 2, NULL);
+}
+END_TEST
+
+START_TEST(test_message_retain)
+{
+	char key[] = "message-id";
+	char val[] = "42";
+	char body[] = "hello";
+	const struct stomp_hdr hdrs[] = {
+		{key, val},
+	};
+	stomp::message_view v(stomp::headers_view(hdrs, 1), 
+			stomp::bytes(reinterpret_cast<const std::byte *>(body), 5));
+
+	stomp::message m = v.retain();
+	memset(key, 0, sizeof(key));
+	memset(val, 0, sizeof(val));
+	memset(body, 0, sizeof(body));
+
+	fail_unless(m.header("message-id") == std::string_view("42"), NULL);
+	fail_unless(stomp::as_string(m.body()) == "hello", NULL);
+
+	stomp::message m2 = std::move(m);
+	fail_if(static_cast<bool>(m), NULL);
+	fail_unless(stomp::as_string(m2.body()) == "hello", NULL);
+}
+END_TEST
+
+START_TEST(test_session)
+{
+	stomp::session s;
+	int called = 0;
+
+	fail_if(s.native_handle() == NULL, NULL);
+	fail_unless(s.fd() == -1, NULL);
+
+	s.on_user([&called](stomp::session &) { called++; });
+
+	stomp::session s2 = std::move(s);
+	fail_if(s2.native_handle() == NULL, NULL);
+
+	try {
+		s2.subscribe({{"ack", "auto"}});
+		fail_if(1, NULL);
+	} catch (const std::system_error &e) {
+		fail_unless(e.code().value() == EINVAL, NULL);
+	}
+}
+END_TEST
+
+START_TEST(test_callback_throws)
+{
+	stomp::session s;
+	int called = 0;
+
+	s.on_user([&called](stomp::session &) { called++; throw std::runtime_error("user"); });
+
+	try {
+		s.run();
+		fail_if(1, NULL);
+	} catch (const std::runtime_error &e) {
+		fail_if(strcmp(e.what(), "user"), NULL);
+	}
+	fail_unless(called == 1, NULL);
+
+	/* the exception was taken, the next step runs the callback again */
+	try {
+		s.step(false);
+		fail_if(1, NULL);
+	} catch (const std::runtime_error &e) {
+		fail_if(strcmp(e.what(), "user"), NULL);
+	}
+	fail_unless(called == 2, NULL);
+}
+END_TEST
+
+Suite *stomp_hpp_suite()
+{
+	Suite *s = suite_create ("stomp_hpp");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_test(tc_core, test_hdr_literals);
+	tcase_add_test(tc_core, test_headers_view);
+	tcase_add_test(tc_core, test_message_retain);
+	tcase_add_test(tc_core, test_session);
+	tcase_add_test(tc_core, test_callback_throws);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = stomp_hpp_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,318 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "../src/sub.h"
+#include "../src/alloc.h"
+
+static subs_t *subs = NULL;
+
+void setup()
+{
+	struct stomp_allocator a;
+
+	alloc_global_get(&a);
+	subs = subs_new(&a);
+}
+
+void teardown()
+{
+	subs_free(subs);
+	subs = NULL;
+}
+
+START_TEST(test_new)
+{
+	fail_if(subs == NULL, NULL);
+	fail_unless(subs_len(subs) == 0, NULL);
+	fail_unless(subs_get(subs, "1") == NULL, NULL);
+	fail_unless(subs_get(subs, NULL) == NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_add_generated)
+{
+	struct sub *sub;
+
+	sub = subs_add(subs, "3", 3, "/queue/a");
+	fail_if(sub == NULL, NULL);
+
+	fail_unless(subs_get(subs, "3") == sub, NULL);
+	fail_unless(subs_get_client_id(subs, 3) == sub, NULL);
+	fail_unless(subs_get_destination(subs, "/queue/a") == sub, NULL);
+	fail_unless(subs_get(subs, "03") == NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_add_user)
+{
+	struct sub *sub;
+
+	sub = subs_add(subs, "orders", 0, "/queue/orders");
+	fail_if(sub == NULL, NULL);
+	fail_unless(subs_get(subs, "orders") == sub, NULL);
+	fail_unless(subs_get_client_id(subs, 0) == NULL, NULL);
+
+	/* user supplied, but numeric */
+	sub = subs_add(subs, "7", 0, "/queue/seven");
+	fail_if(sub == NULL, NULL);
+	fail_unless(subs_get(subs, "7") == sub, NULL);
+	fail_unless(subs_get_client_id(subs, 7) == NULL, NULL);
+}
+END_TEST
+
+START_TEST(test_add_duplicate)
+{
+	fail_if(subs_add(subs, "7", 0, "/queue/a") == NULL, NULL);
+
+	errno = 0;
+	fail_unless(subs_add(subs, "7", 7, "/queue/b") == NULL, NULL);
+	fail_unless(errno == EEXIST, NULL);
+
+	errno = 0;
+	fail_unless(subs_add(subs, "7", 0, "/queue/b") == NULL, NULL);
+	fail_unless(errno == EEXIST, NULL);
+
+	fail_unless(subs_len(subs) == 1, NULL);
+}
+END_TEST
+
+START_TEST(test_del)
+{
+	char id[16];
+	struct sub *sub;
+	int i;
+
+	for (i = 1; i <= 100; i++) {
+		snprintf(id, sizeof(id), "u%d", i);
+		fail_if(subs_add(subs, id, 0, "/queue/u") == NULL, NULL);
+		snprintf(id, sizeof(id), "%d", i);
+		fail_if(subs_add(subs, id, i, "/queue/g") == NULL, NULL);
+	}
+	fail_unless(subs_len(subs) == 200, NULL);
+
+	for (i = 1; i <= 100; i += 2) {
+		snprintf(id, sizeof(id), "u%d", i);
+		sub = subs_get(subs, id);
+		fail_if(sub == NULL, NULL);
+		subs_del(subs, sub);
+		subs_del(subs, subs_get_client_id(subs, i));
+	}
+	fail_unless(subs_len(subs) == 100, NULL);
+
+	for (i = 1; i <= 100; i++) {
+		snprintf(id, sizeof(id), "u%d", i);
+		fail_unless((subs_get(subs, id) == NULL) == (i % 2), NULL);
+		fail_unless((subs_get_client_id(subs, i) == NULL) == (i % 2), NULL);
+	}
+}
+END_TEST
+
+START_TEST(test_client_id_reuse)
+{
+	char id[16];
+	struct sub *sub;
+	int last = 0;
+	int max = 0;
+	int i;
+
+	/* taken by the user */
+	fail_if(subs_add(subs, "2", 0, "/queue/u") == NULL, NULL);
+
+	/* one subscription at a time, ids must not grow for ever */
+	for (i = 0; i < 10000; i++) {
+		last = subs_client_id_next(subs, last);
+		fail_unless(last > 0, NULL);
+		fail_unless(last != 2, NULL);
+		if (last > max) {
+			max = last;
+		}
+
+		snprintf(id, sizeof(id), "%d", last);
+		sub = subs_add(subs, id, last, "/queue/g");
+		fail_if(sub == NULL, NULL);
+		subs_del(subs, sub);
+	}
+	fail_unless(max < 64, NULL);
+
+	/* a freed id is not the next one given out */
+	fail_if(subs_add(subs, "1", 1, "/queue/g") == NULL, NULL);
+	subs_del(subs, subs_get_client_id(subs, 1));
+	fail_unless(subs_client_id_next(subs, 1) == 3, NULL);
+}
+END_TEST
+
+START_TEST(test_window_auto)
+{
+	struct sub *sub;
+
+	sub = subs_add(subs, "1", 1, "/queue/a");
+	fail_if(sub == NULL, NULL);
+
+	/* no window, nothing is tracked */
+	fail_unless(subs_consume(subs, sub, NULL, 10) == 0, NULL);
+	fail_unless(sub->msgs == 0, NULL);
+
+	subs_window_set(subs, sub, 2, 0);
+	fail_unless(subs_consume(subs, sub, NULL, 10) == 0, NULL);
+	fail_unless(subs_exhausted(subs) == 0, NULL);
+	fail_unless(subs_consume(subs, sub, NULL, 10) == 0, NULL);
+	fail_unless(subs_exhausted(subs) == 1, NULL);
+
+	subs_release(subs, sub, NULL, 10);
+	fail_unless(subs_exhausted(subs) == 0, NULL);
+	fail_unless(sub->msgs == 1, NULL);
+	fail_unless(sub->bytes == 10, NULL);
+
+	subs_window_set(subs, sub, 0, 10);
+	fail_unless(subs_exhausted(subs) == 1, NULL);
+
+	subs_del(subs, sub);
+	fail_unless(subs_exhausted(subs) == 0, NULL);
+}
+END_TEST
+
+START_TEST(test_window_client)
+{
+	struct sub *sub;
+
+	sub = subs_add(subs, "1", 1, "/queue/a");
+	fail_if(sub == NULL, NULL);
+	sub->ack_mode = SUB_ACK_CLIENT;
+	subs_window_set(subs, sub, 3, 0);
+
+	fail_unless(subs_consume(subs, sub, NULL, 1) == -1, NULL);
+	fail_unless(errno == EINVAL, NULL);
+
+	fail_unless(subs_consume(subs, sub, "m1", 1) == 0, NULL);
+	fail_unless(subs_consume(subs, sub, "m2", 2) == 0, NULL);
+	fail_unless(subs_consume(subs, sub, "m3", 3) == 0, NULL);
+	fail_unless(subs_exhausted(subs) == 1, NULL);
+	fail_unless(subs_get_pending(subs, "m2") == sub, NULL);
+	fail_unless(subs_get_pending(subs, "m4") == NULL, NULL);
+
+	/* cumulative */
+	subs_release(subs, sub, "m2", 0);
+	fail_unless(subs_exhausted(subs) == 0, NULL);
+	fail_unless(sub->msgs == 1, NULL);
+	fail_unless(sub->bytes == 3, NULL);
+	fail_unless(subs_get_pending(subs, "m1") == NULL, NULL);
+
+	/* unknown or already released acks are ignored */
+	subs_release(subs, sub, "m1", 0);
+	fail_unless(sub->msgs == 1, NULL);
+}
+END_TEST
+
+START_TEST(test_window_client_individual)
+{
+	struct sub *sub;
+
+	sub = subs_add(subs, "a", 0, "/queue/a");
+	fail_if(sub == NULL, NULL);
+	sub->ack_mode = SUB_ACK_CLIENT_INDIVIDUAL;
+	subs_window_set(subs, sub, 0, 5);
+
+	fail_unless(subs_consume(subs, sub, "m1", 1) == 0, NULL);
+	fail_unless(subs_consume(subs, sub, "m2", 2) == 0, NULL);
+	fail_unless(subs_consume(subs, sub, "m3", 3) == 0, NULL);
+	fail_unless(subs_exhausted(subs) == 1, NULL);
+
+	subs_release(subs, sub, "m2", 0);
+	fail_unless(subs_exhausted(subs) == 0, NULL);
+	fail_unless(sub->msgs == 2, NULL);
+	fail_unless(sub->bytes == 4, NULL);
+	fail_unless(subs_get_pending(subs, "m1") == sub, NULL);
+	fail_unless(subs_get_pending(subs, "m3") == sub, NULL);
+}
+END_TEST
+
+START_TEST(test_pending_lookup)
+{
+	struct sub *a;
+	struct sub *b;
+	char ack[32];
+	int i;
+
+	a = subs_add(subs, "a", 0, "/queue/a");
+	b = subs_add(subs, "2", 2, "/queue/b");
+	fail_if(a == NULL || b == NULL, NULL);
+	a->ack_mode = SUB_ACK_CLIENT;
+	b->ack_mode = SUB_ACK_CLIENT_INDIVIDUAL;
+	subs_window_set(subs, a, 1000, 0);
+	subs_window_set(subs, b, 1000, 0);
+
+	for (i = 0; i < 200; i++) {
+		snprintf(ack, sizeof(ack), "a-%d", i);
+		fail_unless(subs_consume(subs, a, ack, 1) == 0, NULL);
+		snprintf(ack, sizeof(ack), "b-%d", i);
+		fail_unless(subs_consume(subs, b, ack, 1) == 0, NULL);
+	}
+
+	fail_unless(subs_get_pending(subs, "a-17") == a, NULL);
+	fail_unless(subs_get_pending(subs, "b-199") == b, NULL);
+	fail_unless(subs_get_pending(subs, "b-200") == NULL, NULL);
+	fail_unless(subs_get_pending(subs, "a-1") == a, NULL);
+
+	/* a value that is a prefix of others is matched exactly */
+	subs_release(subs, a, "a-1", 0);
+	fail_unless(a->msgs == 198, NULL);
+	fail_unless(subs_get_pending(subs, "a-1") == NULL, NULL);
+	fail_unless(subs_get_pending(subs, "a-10") == a, NULL);
+
+	for (i = 0; i < 200; i += 2) {
+		snprintf(ack, sizeof(ack), "b-%d", i);
+		subs_release(subs, b, ack, 0);
+	}
+	fail_unless(b->msgs == 100, NULL);
+	fail_unless(subs_get_pending(subs, "b-100") == NULL, NULL);
+	fail_unless(subs_get_pending(subs, "b-101") == b, NULL);
+
+	/* the values left behind still match after the others were cut out */
+	subs_release(subs, b, "b-199", 0);
+	fail_unless(b->msgs == 99, NULL);
+	fail_unless(subs_get_pending(subs, "b-197") == b, NULL);
+
+	subs_del(subs, a);
+	fail_unless(subs_get_pending(subs, "a-10") == NULL, NULL);
+
+	subs_credit_reset(subs);
+	fail_unless(subs_get_pending(subs, "b-101") == NULL, NULL);
+	fail_unless(subs_consume(subs, b, "b-101", 1) == 0, NULL);
+	fail_unless(subs_get_pending(subs, "b-101") == b, NULL);
+}
+END_TEST
+
+Suite *sub_suite()
+{
+	Suite *s = suite_create ("sub");
+
+	TCase *tc_core = tcase_create ("core");
+	tcase_add_checked_fixture (tc_core, setup, teardown);
+	tcase_add_test(tc_core, test_new);
+	tcase_add_test(tc_core, test_add_generated);
+	tcase_add_test(tc_core, test_add_user);
+	tcase_add_test(tc_core, test_add_duplicate);
+	tcase_add_test(tc_core, test_del);
+	tcase_add_test(tc_core, test_client_id_reuse);
+	tcase_add_test(tc_core, test_window_auto);
+	tcase_add_test(tc_core, test_window_client);
+	tcase_add_test(tc_core, test_window_client_individual);
+	tcase_add_test(tc_core, test_pending_lookup);
+	suite_add_tcase (s, tc_core);
+	
+	return s;
+}
+
+int main(int argc, const char *argv[])
+{
+	int number_failed;
+
+	Suite *s = sub_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all (sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed (sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}